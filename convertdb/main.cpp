@@ -64,6 +64,21 @@ static int downgradeDatabase(const QString &downgradeFile)
     return Error::None;
 }
 
+static int indexDatabase(const QString &indexFile)
+{
+    QString errMsg;
+    QSqlDatabase db = Database::open(indexFile, &errMsg);
+    if (!db.isValid()) {
+	fprintf(stderr, "Index error: %s\n", qPrintable(errMsg));
+	return Error::Open;
+    }
+    if (!Database::createIndexes(db, &errMsg)) {
+	fprintf(stderr, "Index error: %s\n", qPrintable(errMsg));
+	return Error::Conversion;
+    }
+    return Error::None;
+}
+
 int main(int argc, char **argv)
 {
     QCoreApplication a(argc, argv);
@@ -73,10 +88,12 @@ int main(int argc, char **argv)
     QCommandLineOption acceptDataLoss("accept-data-loss", "Accept possible data loss that might occur on downgrades");
     QCommandLineOption upgradeFile("upgrade", "Upgrade to current version", "database");
     QCommandLineOption downgradeFile("downgrade", "Downgrade to current version", "database");
+    QCommandLineOption indexFile("index", "Create missing indexes, e.g. after a bulk load with deferred indexes", "database");
     opt.setApplicationDescription("Converts trace databases between different versions");
     opt.addOption(acceptDataLoss);
     opt.addOption(upgradeFile);
     opt.addOption(downgradeFile);
+    opt.addOption(indexFile);
     opt.addHelpOption();
     opt.addVersionOption();
     opt.process(a);
@@ -97,6 +114,8 @@ int main(int argc, char **argv)
             return Error::CommandLineArgs;
 	}
     return downgradeDatabase(opt.value(downgradeFile));
+    } else if (opt.isSet(indexFile)) {
+    return indexDatabase(opt.value(indexFile));
     } else {
         fprintf(stderr, "Missing command line argument.\n");
         opt.showHelp(Error::CommandLineArgs);
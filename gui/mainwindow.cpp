@@ -274,6 +274,8 @@ bool MainWindow::setDatabase(const QString &databaseFileName, QString *errMsg)
     }
     if (!m_db.isValid())
         return false;
+    if (!Database::attachSegments(m_db, errMsg))
+        return false;
 
     QStringList traceKeysNames = Database::seenGroupIds(m_db);
     tracePointsSearchWidget->setTraceKeys(traceKeysNames);
@@ -784,6 +786,13 @@ void MainWindow::clearTracePoints()
 void MainWindow::databaseWasNuked()
 {
     m_entryItemModel->clear();
+
+    // The server may have started or removed trace segments
+    QString errMsg;
+    if ( !Database::attachSegments( m_db, &errMsg ) ) {
+        qWarning() << "Failed to attach trace segments:" << errMsg;
+    }
+
     m_watchTree->reApplyFilter();
     tracePointsSearchWidget->setTraceKeys( QStringList() );
     m_filterForm->setTraceKeys( QStringList() );
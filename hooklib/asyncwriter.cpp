@@ -0,0 +1,387 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "asyncwriter.h"
+#include "log.h"
+#include "timehelper.h" // for now
+
+#include <algorithm>
+
+using namespace std;
+
+TRACELIB_NAMESPACE_BEGIN
+
+static const unsigned int MaximumIdleTime = 16; // milliseconds
+static const unsigned int DropReportInterval = 1000; // milliseconds
+static const unsigned int BlockTimeout = 1000; // milliseconds
+
+namespace {
+
+/* Keeps the value of a variable at the time the trace point was visited;
+ * the original variable only references the traced object, which may be
+ * gone by the time the entry gets serialized.
+ */
+class FrozenVariable : public AbstractVariable
+{
+public:
+    explicit FrozenVariable( const AbstractVariable &v )
+        : m_name( v.name() ),
+        m_value( v.value() )
+    {
+    }
+
+    virtual const char *name() const { return m_name.c_str(); }
+    virtual VariableValue value() const { return m_value; }
+
+private:
+    const string m_name;
+    const VariableValue m_value;
+};
+
+struct EarlierTimeStamp
+{
+    bool operator()( const QueuedEntry *a, const QueuedEntry *b ) const {
+        return a->entry.timeStamp < b->entry.timeStamp;
+    }
+};
+
+}
+
+QueuedEntry::QueuedEntry( TraceEntry &source )
+    : messageData( source.message ? source.message : "" ),
+    deferredMessageData( source.deferredMessage ? *source.deferredMessage : DeferredMessage() ),
+    entry( source.tracePoint,
+           source.message ? messageData.c_str() : 0,
+           source.threadId,
+           source.timeStamp,
+           source.stackPosition )
+{
+    entry.backtrace = source.backtrace;
+    source.backtrace = 0;
+
+    if ( source.deferredMessage ) {
+        entry.deferredMessage = &deferredMessageData;
+    }
+
+    if ( source.variables ) {
+        for ( size_t i = 0; i < source.variables->size(); ++i ) {
+            variableData.addCopy( FrozenVariable( *( *source.variables )[i] ) );
+        }
+        entry.variables = &variableData;
+    }
+}
+
+static unsigned long roundUpToPowerOfTwo( unsigned int v )
+{
+    unsigned long result = 1;
+    while ( result < v ) {
+        result <<= 1;
+    }
+    return result;
+}
+
+EntryRingBuffer::EntryRingBuffer( unsigned int capacity )
+    : m_slots( 0 ),
+    m_capacity( roundUpToPowerOfTwo( capacity ) ),
+    m_head( 0 ),
+    m_tail( 0 ),
+    m_abandoned( 0 )
+{
+    m_slots = new QueuedEntry *[m_capacity];
+}
+
+EntryRingBuffer::~EntryRingBuffer()
+{
+    while ( QueuedEntry *entry = popOldest() ) {
+        delete entry;
+    }
+    delete [] m_slots;
+}
+
+/* Indices only ever grow and are compared using unsigned arithmetic, so
+ * that wrapping around is harmless. Only the owning thread calls this.
+ */
+bool EntryRingBuffer::push( QueuedEntry *entry )
+{
+    const unsigned long head = atomicLoadRelaxed( &m_head );
+    const unsigned long tail = atomicLoad( &m_tail );
+    if ( head - tail >= m_capacity ) {
+        return false;
+    }
+    atomicStorePointer( &m_slots[head & ( m_capacity - 1 )], entry );
+    atomicStore( &m_head, static_cast<AtomicWord>( head + 1 ) );
+    return true;
+}
+
+/* The slot is read before claiming it; if claiming fails, somebody else
+ * (either a consumer or the producer discarding the oldest entry) took over
+ * the ownership of the entry and the value read is never dereferenced.
+ */
+QueuedEntry *EntryRingBuffer::popOldest()
+{
+    while ( true ) {
+        const unsigned long tail = atomicLoad( &m_tail );
+        const unsigned long head = atomicLoad( &m_head );
+        if ( tail == head ) {
+            return 0;
+        }
+        QueuedEntry *entry = atomicLoadPointer( &m_slots[tail & ( m_capacity - 1 )] );
+        if ( atomicCompareAndSwap( &m_tail, static_cast<AtomicWord>( tail ),
+                                   static_cast<AtomicWord>( tail + 1 ) ) ) {
+            return entry;
+        }
+    }
+}
+
+bool EntryRingBuffer::isEmpty() const
+{
+    return atomicLoad( &m_tail ) == atomicLoad( &m_head );
+}
+
+bool EntryRingBuffer::isFull() const
+{
+    const unsigned long head = atomicLoadRelaxed( &m_head );
+    const unsigned long tail = atomicLoad( &m_tail );
+    return head - tail >= m_capacity;
+}
+
+void EntryRingBuffer::abandon()
+{
+    atomicStore( &m_abandoned, 1 );
+}
+
+bool EntryRingBuffer::isAbandoned() const
+{
+    return atomicLoad( &m_abandoned ) != 0;
+}
+
+static void ringOwnerExited( void *ring )
+{
+    static_cast<EntryRingBuffer *>( ring )->abandon();
+}
+
+AsynchronousWriter::AsynchronousWriter( Trace *trace, Log *log )
+    : m_trace( trace ),
+    m_log( log ),
+    m_ringSlot( new ThreadLocalSlot( ringOwnerExited ) ),
+    m_bufferSize( WriterConfiguration::DefaultBufferSize ),
+    m_overflowPolicy( WriterConfiguration::DropEntry ),
+    m_droppedEntries( 0 ),
+    m_stopRequested( 0 ),
+    m_lastDropReport( 0 )
+{
+}
+
+AsynchronousWriter::~AsynchronousWriter()
+{
+    atomicStore( &m_stopRequested, 1 );
+    wait();
+
+    /* Destroy the slot before the buffers so that no thread exiting from
+     * now on touches a buffer which is about to be deleted.
+     */
+    delete m_ringSlot;
+    m_ringSlot = 0;
+
+    MutexLocker drainLocker( m_drainMutex );
+    drain();
+
+    MutexLocker ringsLocker( m_ringsMutex );
+    vector<EntryRingBuffer *>::iterator it, end = m_rings.end();
+    for ( it = m_rings.begin(); it != end; ++it ) {
+        delete *it;
+    }
+}
+
+/* The buffer size only affects buffers of threads which visit their first
+ * trace point after the configuration changed.
+ */
+void AsynchronousWriter::setConfiguration( const WriterConfiguration &cfg )
+{
+    atomicStore( &m_bufferSize, cfg.bufferSize );
+    atomicStore( &m_overflowPolicy, cfg.overflowPolicy );
+}
+
+EntryRingBuffer *AsynchronousWriter::ringForCurrentThread()
+{
+    EntryRingBuffer *ring = static_cast<EntryRingBuffer *>( m_ringSlot->value() );
+    if ( !ring ) {
+        ring = new EntryRingBuffer( atomicLoadRelaxed( &m_bufferSize ) );
+        {
+            MutexLocker ringsLocker( m_ringsMutex );
+            m_rings.push_back( ring );
+        }
+        m_ringSlot->setValue( ring );
+    }
+    return ring;
+}
+
+/* With the BlockThread policy, the thread waits (backing off from yielding
+ * to sleeping) for the writer thread to make room, but for no longer than
+ * the block timeout; the entry is dropped if the writer stops meanwhile.
+ */
+void AsynchronousWriter::enqueue( TraceEntry &entry )
+{
+    EntryRingBuffer *ring = ringForCurrentThread();
+
+    AtomicWord policy = atomicLoadRelaxed( &m_overflowPolicy );
+    if ( policy == WriterConfiguration::BlockThread && atomicLoad( &m_stopRequested ) ) {
+        // Nobody is going to make room anymore
+        policy = WriterConfiguration::DropEntry;
+    }
+
+    // Don't bother copying the entry if it would be dropped anyway
+    if ( policy == WriterConfiguration::DropEntry && ring->isFull() ) {
+        atomicFetchAdd( &m_droppedEntries, 1 );
+        return;
+    }
+
+    QueuedEntry *queuedEntry = new QueuedEntry( entry );
+    uint64_t deadline = 0;
+    unsigned int waitTime = 0;
+    while ( !ring->push( queuedEntry ) ) {
+        switch ( policy ) {
+            case WriterConfiguration::DropEntry:
+                delete queuedEntry;
+                atomicFetchAdd( &m_droppedEntries, 1 );
+                return;
+            case WriterConfiguration::OverwriteOldest:
+                if ( QueuedEntry *oldest = ring->popOldest() ) {
+                    delete oldest;
+                    atomicFetchAdd( &m_droppedEntries, 1 );
+                }
+                break;
+            case WriterConfiguration::BlockThread:
+                if ( deadline == 0 ) {
+                    deadline = now() + BlockTimeout;
+                } else if ( now() >= deadline ) {
+                    // The writer thread doesn't make progress; give up
+                    delete queuedEntry;
+                    atomicFetchAdd( &m_droppedEntries, 1 );
+                    return;
+                }
+                if ( waitTime == 0 ) {
+                    Thread::yield();
+                } else {
+                    Thread::sleep( waitTime );
+                }
+                waitTime = waitTime == 0 ? 1 : min( waitTime * 2, MaximumIdleTime );
+                break;
+        }
+
+        // The configuration may have changed or the writer may be stopping
+        policy = atomicLoadRelaxed( &m_overflowPolicy );
+        if ( policy == WriterConfiguration::BlockThread && atomicLoad( &m_stopRequested ) ) {
+            policy = WriterConfiguration::DropEntry;
+        }
+    }
+}
+
+void AsynchronousWriter::flush()
+{
+    MutexLocker drainLocker( m_drainMutex );
+    drain();
+}
+
+/* Used from the crash handler, where waiting for the writer thread (which
+ * may be the thread which crashed) is not an option.
+ */
+bool AsynchronousWriter::tryFlush()
+{
+    if ( !m_drainMutex.tryLock() ) {
+        return false;
+    }
+    drain();
+    m_drainMutex.unlock();
+    return true;
+}
+
+void AsynchronousWriter::run()
+{
+    unsigned int idleTime = 0;
+    while ( !atomicLoad( &m_stopRequested ) ) {
+        size_t entriesWritten;
+        {
+            MutexLocker drainLocker( m_drainMutex );
+            entriesWritten = drain();
+        }
+
+        if ( entriesWritten > 0 ) {
+            idleTime = 0;
+            continue;
+        }
+
+        idleTime = idleTime == 0 ? 1 : min( idleTime * 2, MaximumIdleTime );
+        Thread::sleep( idleTime );
+    }
+}
+
+// Expects m_drainMutex to be locked
+size_t AsynchronousWriter::drain()
+{
+    vector<EntryRingBuffer *> rings;
+    {
+        MutexLocker ringsLocker( m_ringsMutex );
+        rings = m_rings;
+    }
+
+    vector<QueuedEntry *> entries;
+    vector<EntryRingBuffer *>::const_iterator ringIt, ringEnd = rings.end();
+    for ( ringIt = rings.begin(); ringIt != ringEnd; ++ringIt ) {
+        while ( QueuedEntry *entry = ( *ringIt )->popOldest() ) {
+            entries.push_back( entry );
+        }
+    }
+
+    /* Each buffer is in chronological order already, merge them so that the
+     * entries of different threads appear in the order they were created.
+     */
+    stable_sort( entries.begin(), entries.end(), EarlierTimeStamp() );
+
+    vector<QueuedEntry *>::const_iterator entryIt, entryEnd = entries.end();
+    for ( entryIt = entries.begin(); entryIt != entryEnd; ++entryIt ) {
+        m_trace->addEntry( ( *entryIt )->entry );
+        delete *entryIt;
+    }
+
+    for ( ringIt = rings.begin(); ringIt != ringEnd; ++ringIt ) {
+        // The owner is gone, so once the buffer is empty it stays empty
+        if ( ( *ringIt )->isAbandoned() && ( *ringIt )->isEmpty() ) {
+            {
+                MutexLocker ringsLocker( m_ringsMutex );
+                m_rings.erase( find( m_rings.begin(), m_rings.end(), *ringIt ) );
+            }
+            delete *ringIt;
+        }
+    }
+
+    const uint64_t currentTime = now();
+    if ( currentTime - m_lastDropReport >= DropReportInterval ) {
+        const AtomicWord droppedEntries = atomicExchange( &m_droppedEntries, 0 );
+        if ( droppedEntries > 0 ) {
+            m_log->writeError( "AsynchronousWriter: dropped %ld trace entries since the writer buffer was full", droppedEntries );
+        }
+        m_lastDropReport = currentTime;
+    }
+
+    return entries.size();
+}
+
+TRACELIB_NAMESPACE_END
+
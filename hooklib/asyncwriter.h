@@ -0,0 +1,127 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACELIB_ASYNCWRITER_H
+#define TRACELIB_ASYNCWRITER_H
+
+#include "tracelib_config.h"
+#include "atomic.h"
+#include "configuration.h" // for WriterConfiguration
+#include "mutex.h"
+#include "thread.h"
+#include "trace.h" // for TraceEntry
+
+#include <string>
+#include <vector>
+
+TRACELIB_NAMESPACE_BEGIN
+
+class Log;
+
+/* A trace entry which owns copies of all the data it references, so that
+ * it can be serialized after the trace point visit returned. Deferred
+ * messages are copied as they are and get formatted by the writer thread.
+ */
+struct QueuedEntry
+{
+    explicit QueuedEntry( TraceEntry &source );
+
+    const std::string messageData;
+    const DeferredMessage deferredMessageData;
+    VariableSnapshot variableData;
+    TraceEntry entry;
+
+private:
+    QueuedEntry( const QueuedEntry &other ); // disabled
+    void operator=( const QueuedEntry &rhs ); // disabled
+};
+
+/* A bounded ring of queued entries with a single producer (the thread
+ * owning the buffer) and any number of consumers: besides the writer thread
+ * and threads flushing the writer, the producer itself claims (and discards)
+ * the oldest entry when the buffer is full. Consumers claim entries using
+ * compare-and-swap on the ever-growing tail index, so each entry is handed
+ * to exactly one of them.
+ */
+class EntryRingBuffer
+{
+public:
+    explicit EntryRingBuffer( unsigned int capacity );
+    ~EntryRingBuffer();
+
+    bool push( QueuedEntry *entry );
+    QueuedEntry *popOldest();
+
+    bool isEmpty() const;
+    bool isFull() const;
+
+    void abandon();
+    bool isAbandoned() const;
+
+private:
+    EntryRingBuffer( const EntryRingBuffer &other ); // disabled
+    void operator=( const EntryRingBuffer &rhs ); // disabled
+
+    QueuedEntry * volatile *m_slots;
+    const unsigned long m_capacity;
+    volatile AtomicWord m_head;
+    volatile AtomicWord m_tail;
+    volatile AtomicWord m_abandoned;
+};
+
+class AsynchronousWriter : public Thread
+{
+public:
+    AsynchronousWriter( Trace *trace, Log *log );
+    virtual ~AsynchronousWriter();
+
+    void setConfiguration( const WriterConfiguration &cfg );
+
+    void enqueue( TraceEntry &entry );
+
+    void flush();
+    bool tryFlush();
+
+protected:
+    virtual void run();
+
+private:
+    AsynchronousWriter( const AsynchronousWriter &other ); // disabled
+    void operator=( const AsynchronousWriter &rhs ); // disabled
+
+    EntryRingBuffer *ringForCurrentThread();
+    size_t drain();
+
+    Trace *m_trace;
+    Log *m_log;
+    ThreadLocalSlot *m_ringSlot;
+    Mutex m_ringsMutex;
+    std::vector<EntryRingBuffer *> m_rings;
+    Mutex m_drainMutex;
+    volatile AtomicWord m_bufferSize;
+    volatile AtomicWord m_overflowPolicy;
+    volatile AtomicWord m_droppedEntries;
+    volatile AtomicWord m_stopRequested;
+    uint64_t m_lastDropReport;
+};
+
+TRACELIB_NAMESPACE_END
+
+#endif // !defined(TRACELIB_ASYNCWRITER_H)
+
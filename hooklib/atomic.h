@@ -0,0 +1,173 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACELIB_ATOMIC_H
+#define TRACELIB_ATOMIC_H
+
+#include "tracelib_config.h"
+
+#ifdef _WIN32
+#  include <windows.h>
+#endif
+
+TRACELIB_NAMESPACE_BEGIN
+
+/* A minimal set of atomic operations on machine words and pointers. These
+ * are inline since they are used on the hot path of visiting trace points;
+ * loads have acquire semantics and stores have release semantics unless
+ * the function name says otherwise. All read-modify-write operations are
+ * full barriers. atomicSignalFence() only keeps the compiler from
+ * reordering memory accesses across it, which is sufficient for data which
+ * is only inspected by the same thread or after the process died.
+ */
+
+typedef long AtomicWord;
+
+#ifdef _WIN32
+
+inline AtomicWord atomicLoadRelaxed( const volatile AtomicWord *v )
+{
+    return *v;
+}
+
+inline AtomicWord atomicLoad( const volatile AtomicWord *v )
+{
+    // volatile reads have acquire semantics with MSVC
+    return *v;
+}
+
+inline void atomicStore( volatile AtomicWord *v, AtomicWord value )
+{
+    // volatile writes have release semantics with MSVC
+    *v = value;
+}
+
+inline AtomicWord atomicFetchAdd( volatile AtomicWord *v, AtomicWord delta )
+{
+    return ::InterlockedExchangeAdd( v, delta );
+}
+
+inline AtomicWord atomicExchange( volatile AtomicWord *v, AtomicWord value )
+{
+    return ::InterlockedExchange( v, value );
+}
+
+inline bool atomicCompareAndSwap( volatile AtomicWord *v, AtomicWord expected, AtomicWord desired )
+{
+    return ::InterlockedCompareExchange( v, desired, expected ) == expected;
+}
+
+template <typename T>
+inline T *atomicLoadPointer( T * const volatile *p )
+{
+    return *p;
+}
+
+template <typename T>
+inline void atomicStorePointer( T * volatile *p, T *value )
+{
+    *p = value;
+}
+
+template <typename T>
+inline T *atomicExchangePointer( T * volatile *p, T *value )
+{
+    return static_cast<T *>( ::InterlockedExchangePointer( reinterpret_cast<PVOID volatile *>( p ), value ) );
+}
+
+template <typename T>
+inline bool atomicCompareAndSwapPointer( T * volatile *p, T *expected, T *desired )
+{
+    return ::InterlockedCompareExchangePointer( reinterpret_cast<PVOID volatile *>( p ), desired, expected ) == expected;
+}
+
+inline void atomicSignalFence()
+{
+    _ReadWriteBarrier();
+}
+
+#else
+
+inline AtomicWord atomicLoadRelaxed( const volatile AtomicWord *v )
+{
+    return __atomic_load_n( v, __ATOMIC_RELAXED );
+}
+
+inline AtomicWord atomicLoad( const volatile AtomicWord *v )
+{
+    return __atomic_load_n( v, __ATOMIC_ACQUIRE );
+}
+
+inline void atomicStore( volatile AtomicWord *v, AtomicWord value )
+{
+    __atomic_store_n( v, value, __ATOMIC_RELEASE );
+}
+
+inline AtomicWord atomicFetchAdd( volatile AtomicWord *v, AtomicWord delta )
+{
+    return __atomic_fetch_add( v, delta, __ATOMIC_SEQ_CST );
+}
+
+inline AtomicWord atomicExchange( volatile AtomicWord *v, AtomicWord value )
+{
+    return __atomic_exchange_n( v, value, __ATOMIC_SEQ_CST );
+}
+
+inline bool atomicCompareAndSwap( volatile AtomicWord *v, AtomicWord expected, AtomicWord desired )
+{
+    return __atomic_compare_exchange_n( v, &expected, desired, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+}
+
+template <typename T>
+inline T *atomicLoadPointer( T * const volatile *p )
+{
+    return __atomic_load_n( p, __ATOMIC_ACQUIRE );
+}
+
+template <typename T>
+inline void atomicStorePointer( T * volatile *p, T *value )
+{
+    __atomic_store_n( p, value, __ATOMIC_RELEASE );
+}
+
+template <typename T>
+inline T *atomicExchangePointer( T * volatile *p, T *value )
+{
+    return __atomic_exchange_n( p, value, __ATOMIC_SEQ_CST );
+}
+
+template <typename T>
+inline bool atomicCompareAndSwapPointer( T * volatile *p, T *expected, T *desired )
+{
+    return __atomic_compare_exchange_n( p, &expected, desired, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+}
+
+inline void atomicSignalFence()
+{
+    __atomic_signal_fence( __ATOMIC_SEQ_CST );
+}
+
+#endif
+
+TRACELIB_NAMESPACE_END
+
+#endif // !defined(TRACELIB_ATOMIC_H)
+
@@ -26,17 +26,34 @@ using namespace std;
 TRACELIB_NAMESPACE_BEGIN
 
 Backtrace::Backtrace( const vector<StackFrame> &frames )
-    : m_frames( frames )
+    : m_frames( frames ),
+    m_resolved( true )
 {
 }
 
+Backtrace::Backtrace( const vector<void *> &addresses )
+    : m_addresses( addresses ),
+    m_resolved( false )
+{
+}
+
+void Backtrace::resolve() const
+{
+    if ( !m_resolved ) {
+        BacktraceGenerator::symbolize( m_addresses, m_frames );
+        m_resolved = true;
+    }
+}
+
 size_t Backtrace::depth() const
 {
+    resolve();
     return m_frames.size();
 }
 
 const StackFrame &Backtrace::frame( size_t depth ) const
 {
+    resolve();
     assert( depth < m_frames.size() );
     return m_frames[depth];
 }
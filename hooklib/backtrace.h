@@ -29,28 +29,53 @@ TRACELIB_NAMESPACE_BEGIN
 
 struct StackFrame
 {
-    StackFrame() : functionOffset( 0 ), lineNumber( 0 ) { }
+    StackFrame() : functionOffset( 0 ), lineNumber( 0 ), address( 0 ), moduleBase( 0 ) { }
     std::string module;
     std::string function;
     size_t functionOffset;
     std::string sourceFile;
     size_t lineNumber;
+    size_t address;
+    size_t moduleBase; // the address the module was loaded at, if known
+};
+
+/* A module (an executable or a shared library) of the process; addresses
+ * within the module minus its base are what the debug information of the
+ * module refers to.
+ */
+struct ModuleInfo
+{
+    ModuleInfo() : base( 0 ) { }
+    std::string fileName;
+    std::string buildId; // hexadecimal, empty if unknown
+    size_t base;
 };
 
 class BacktraceGenerator;
 
+/* A backtrace either holds resolved stack frames or just the return
+ * addresses, which are resolved to stack frames when the frames are
+ * accessed for the first time.
+ */
 class Backtrace
 {
     friend class BacktraceGenerator;
 
 public:
     explicit Backtrace( const std::vector<StackFrame> &frames );
+    explicit Backtrace( const std::vector<void *> &addresses );
+
+    bool isResolved() const { return m_resolved; }
+    void resolve() const;
+    const std::vector<void *> &addresses() const { return m_addresses; }
 
     size_t depth() const;
     const StackFrame &frame( size_t depth ) const;
 
 private:
-    std::vector<StackFrame> m_frames;
+    mutable std::vector<StackFrame> m_frames;
+    std::vector<void *> m_addresses;
+    mutable bool m_resolved;
 };
 
 class BacktraceGenerator
@@ -60,6 +85,14 @@ public:
     ~BacktraceGenerator();
 
     Backtrace generate( size_t skipInnermostFrames );
+    Backtrace capture( size_t skipInnermostFrames );
+
+    static void symbolize( const std::vector<void *> &addresses, std::vector<StackFrame> &frames );
+
+    /* Yields the module for each of the addresses (or null if unknown); the
+     * modules stay valid as long as any BacktraceGenerator exists.
+     */
+    static void findModules( const std::vector<void *> &addresses, std::vector<const ModuleInfo *> &modules );
 
 private:
     BacktraceGenerator( const BacktraceGenerator &other );
@@ -18,12 +18,15 @@
  */
 
 #include "backtrace.h"
+#include "atomic.h"
 
 #include <config.h>
 
+#include <algorithm>
 #include <cassert>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #if defined(__GNUC__) && defined(HAVE_EXECINFO_H)
 # include <execinfo.h>
@@ -35,47 +38,258 @@
 # include <dlfcn.h>
 #endif
 #include <dlfcn.h>
+#ifdef HAVE_LINK_H
+# include <link.h>
+#endif
 #if HAVE_BFD_H && HAVE_DEMANGLE_H
 # include <bfd.h>
 # include <demangle.h>
 #endif
 
+#ifdef __GNUC__
+# define TRACELIB_NOINLINE __attribute__((noinline))
+#else
+# define TRACELIB_NOINLINE
+#endif
+
 using namespace std;
 
 TRACELIB_NAMESPACE_BEGIN
 
 static int trace_ref_count;
 
-static pthread_mutex_t trace_mutex;
+// Serializes resolving addresses; neither bfd nor the symbol buffer may be used concurrently
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static char *symbol_buffer;
 static size_t symbol_buffer_length;
 
+extern string processFullName();
+
+/* The executable or a shared library mapped into the process. The symbol
+ * table of each module is read when an address in it is resolved for the
+ * first time.
+ */
+struct Module : public ModuleInfo
+{
+    Module()
+        : start( 0 ),
+        end( 0 )
 #if HAVE_BFD_H && HAVE_DEMANGLE_H
-static bfd *self_bfd;
-static asymbol **self_symbols;
+        , abfd( NULL ),
+        symbols( NULL ),
+        symbolTableRead( false )
 #endif
+    {
+    }
 
-extern string processFullName();
+    uintptr_t start;
+    uintptr_t end;
+#if HAVE_BFD_H && HAVE_DEMANGLE_H
+    bfd *abfd;
+    asymbol **symbols;
+    bool symbolTableRead;
+#endif
+};
 
-#if !defined(__GNUC__) && defined(__sun)
-static int buildBackTrace( uintptr_t p, int, void *user) {
-    std::vector<StackFrame> *trace = (std::vector<StackFrame> *)user;
+// Only accessed with trace_mutex locked; modules loaded last come last
+static vector<Module *> modules;
+
+/* Maps return addresses to the stack frames they were resolved to. Lookups
+ * take no locks; entries are added by whoever resolved the address (with
+ * trace_mutex locked anyway) and are only removed when the last
+ * BacktraceGenerator goes away. Once the probed slots are taken, further
+ * addresses are not cached.
+ */
+struct CachedFrame
+{
+    void *address;
     StackFrame frame;
+};
+
+static const size_t FrameCacheSize = 4096; // a power of two
+static const size_t FrameCacheProbes = 8;
+static CachedFrame * volatile frame_cache[FrameCacheSize];
+
+static size_t frameCacheSlot( const void *address )
+{
+    const uintptr_t a = reinterpret_cast<uintptr_t>( address );
+    return static_cast<size_t>( ( a >> 2 ) * 2654435761UL ) & ( FrameCacheSize - 1 );
+}
+
+static const CachedFrame *lookupFrame( const void *address )
+{
+    const size_t slot = frameCacheSlot( address );
+    for ( size_t i = 0; i < FrameCacheProbes; ++i ) {
+        const CachedFrame *cached = atomicLoadPointer( &frame_cache[( slot + i ) & ( FrameCacheSize - 1 )] );
+        if ( !cached ) {
+            return 0;
+        }
+        if ( cached->address == address ) {
+            return cached;
+        }
+    }
+    return 0;
+}
+
+// Expects trace_mutex to be locked
+static void insertFrame( void *address, const StackFrame &frame )
+{
+    const size_t slot = frameCacheSlot( address );
+    for ( size_t i = 0; i < FrameCacheProbes; ++i ) {
+        CachedFrame * volatile *entry = &frame_cache[( slot + i ) & ( FrameCacheSize - 1 )];
+        if ( !*entry ) {
+            CachedFrame *cached = new CachedFrame;
+            cached->address = address;
+            cached->frame = frame;
+            atomicStorePointer( entry, cached );
+            return;
+        }
+    }
+}
+
+// Expects trace_mutex to be locked
+static void clearFrameCache()
+{
+    for ( size_t i = 0; i < FrameCacheSize; ++i ) {
+        delete atomicExchangePointer( &frame_cache[i], static_cast<CachedFrame *>( 0 ) );
+    }
+}
+
+#ifdef HAVE_LINK_H
+// Reads the GNU build id from a PT_NOTE segment of a loaded module
+static string readBuildId( uintptr_t base, const ElfW(Phdr) &segment )
+{
+#ifdef NT_GNU_BUILD_ID
+    static const char hexDigits[] = "0123456789abcdef";
+
+    const char *p = reinterpret_cast<const char *>( base + segment.p_vaddr );
+    const char *end = p + segment.p_filesz;
+    while ( p + sizeof( ElfW(Nhdr) ) <= end ) {
+        const ElfW(Nhdr) *note = reinterpret_cast<const ElfW(Nhdr) *>( p );
+        const char *name = p + sizeof( ElfW(Nhdr) );
+        const unsigned char *desc = reinterpret_cast<const unsigned char *>( name + ( ( note->n_namesz + 3 ) & ~3u ) );
+        p = reinterpret_cast<const char *>( desc ) + ( ( note->n_descsz + 3 ) & ~3u );
+        if ( p > end ) {
+            break;
+        }
+        if ( note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp( name, "GNU", 4 ) == 0 ) {
+            string buildId;
+            for ( ElfW(Word) i = 0; i < note->n_descsz; ++i ) {
+                buildId += hexDigits[desc[i] >> 4];
+                buildId += hexDigits[desc[i] & 0xf];
+            }
+            return buildId;
+        }
+    }
+#endif
+    return string();
+}
+
+static int collectModule( struct dl_phdr_info *info, size_t, void *data )
+{
+    Module *module = new Module;
+    module->fileName = info->dlpi_name && *info->dlpi_name ? info->dlpi_name : processFullName();
+    module->base = info->dlpi_addr;
+    bool haveSegment = false;
+    for ( ElfW(Half) i = 0; i < info->dlpi_phnum; ++i ) {
+        const ElfW(Phdr) &segment = info->dlpi_phdr[i];
+        if ( segment.p_type == PT_NOTE && module->buildId.empty() ) {
+            module->buildId = readBuildId( info->dlpi_addr, segment );
+        }
+        if ( segment.p_type != PT_LOAD ) {
+            continue;
+        }
+        const uintptr_t start = info->dlpi_addr + segment.p_vaddr;
+        const uintptr_t end = start + segment.p_memsz;
+        if ( !haveSegment || start < module->start ) {
+            module->start = start;
+        }
+        if ( !haveSegment || end > module->end ) {
+            module->end = end;
+        }
+        haveSegment = true;
+    }
+
+    if ( haveSegment ) {
+        static_cast<vector<Module *> *>( data )->push_back( module );
+    } else {
+        delete module;
+    }
+    return 0;
+}
+#endif
+
+/* Adds the modules which were loaded since the last call. Modules which
+ * were unloaded are kept, but modules loaded later take precedence when
+ * looking up addresses. Expects trace_mutex to be locked.
+ */
+static void updateModules()
+{
+    vector<Module *> loadedModules;
+#ifdef HAVE_LINK_H
+    dl_iterate_phdr( collectModule, &loadedModules );
+#else
+    // Without knowing the modules, only the executable can be examined
+    Module *executable = new Module;
+    executable->fileName = processFullName();
+    executable->end = ~static_cast<uintptr_t>( 0 );
+    loadedModules.push_back( executable );
+#endif
+
+    vector<Module *>::const_iterator it, end = loadedModules.end();
+    for ( it = loadedModules.begin(); it != end; ++it ) {
+        bool known = false;
+        vector<Module *>::const_iterator knownIt, knownEnd = modules.end();
+        for ( knownIt = modules.begin(); knownIt != knownEnd; ++knownIt ) {
+            if ( ( *knownIt )->base == ( *it )->base && ( *knownIt )->start == ( *it )->start &&
+                 ( *knownIt )->fileName == ( *it )->fileName ) {
+                known = true;
+                break;
+            }
+        }
+        if ( known ) {
+            delete *it;
+        } else {
+            modules.push_back( *it );
+        }
+    }
+}
+
+// Expects trace_mutex to be locked
+static Module *findModule( uintptr_t address )
+{
+    for ( int attempt = 0; attempt < 2; ++attempt ) {
+        vector<Module *>::const_reverse_iterator it, end = modules.rend();
+        for ( it = modules.rbegin(); it != end; ++it ) {
+            if ( address >= ( *it )->start && address < ( *it )->end ) {
+                return *it;
+            }
+        }
+        // The module might have been loaded since the modules were looked at
+        updateModules();
+    }
+    return 0;
+}
+
+#if defined(__sun)
+static int collectAddress( uintptr_t p, int, void *user )
+{
+    static_cast<vector<void *> *>( user )->push_back( (void *)p );
+    return 0;
+}
+#endif
+
+#if !defined(__GNUC__) && defined(__sun)
+static void dladdrAddressInfo( void *addr, StackFrame *frame )
+{
     Dl_info info;
-    string line;
-    if (dladdr((void *)p, &info)) {
-        if (!cplus_demangle( info.dli_sname, symbol_buffer, symbol_buffer_length))
-            line = symbol_buffer;
-        else
-            line = info.dli_sname;
-        frame.function = info.dli_fname;
+    if (dladdr(addr, &info)) {
+        frame->function = info.dli_fname;
         /*TODO extract fields for SUN */
     } else {
-        frame.function = "??";
+        frame->function = "??";
     }
-    trace->push_back( frame );
-    return 0;
 }
 #endif
 
@@ -83,6 +297,7 @@ static int buildBackTrace( uintptr_t p, int, void *user) {
 
 struct BfdSymbol {
     bfd_vma pc;
+    asymbol **symbols;
     bool found;
     const char *filename;
     unsigned int linenr;
@@ -110,19 +325,20 @@ static void findAddressInSection( bfd *abfd, asection *section, void *data )
 
     bfd_sym->offset = bfd_sym->pc - vma;
     bfd_sym->found = bfd_find_nearest_line( abfd,
-            section, self_symbols,  bfd_sym->pc - vma,
+            section, bfd_sym->symbols,  bfd_sym->pc - vma,
             &bfd_sym->filename, &bfd_sym->functionname, &bfd_sym->linenr );
 }
 
-static bool bfdAddressInfo( bfd_vma addr, StackFrame *frame )
+static bool bfdAddressInfo( const Module *module, bfd_vma addr, StackFrame *frame )
 {
     BfdSymbol bfd_sym;
-    bfd_sym.pc = addr; //bfd_scan_vma( addr, NULL, 16 );
+    bfd_sym.pc = addr - module->base;
+    bfd_sym.symbols = module->symbols;
     bfd_sym.found = false;
-    bfd_map_over_sections( self_bfd, findAddressInSection, &bfd_sym );
+    bfd_map_over_sections( module->abfd, findAddressInSection, &bfd_sym );
     if ( bfd_sym.found ) {
         if ( bfd_sym.functionname ) {
-            char *demangle = bfd_demangle( self_bfd,
+            char *demangle = bfd_demangle( module->abfd,
                    bfd_sym.functionname, DMGL_ANSI | DMGL_PARAMS);
             if ( demangle ) {
                 frame->function = demangle;
@@ -156,6 +372,45 @@ static bool bfdAddressInfo( bfd_vma addr, StackFrame *frame )
 
     return true;
 }
+
+static void readSymbolTable( Module *module )
+{
+    bool success = false;
+    char **matching;
+    module->abfd = bfd_openr( module->fileName.c_str(), NULL );
+    if ( module->abfd && !bfd_check_format( module->abfd, bfd_archive) &&
+            bfd_check_format_matches( module->abfd, bfd_object, &matching ) ) {
+
+        if ( bfd_get_file_flags( module->abfd ) & HAS_SYMS ) {
+            bfd_boolean dynamic = false;
+
+            long storage = bfd_get_symtab_upper_bound( module->abfd );
+            if ( !storage ) {
+                storage = bfd_get_dynamic_symtab_upper_bound( module->abfd );
+                dynamic = true;
+            }
+            if ( storage >= 0 ) {
+                long symcnt;
+                module->symbols = (asymbol **)malloc( storage );
+                if (dynamic)
+                    symcnt = bfd_canonicalize_dynamic_symtab( module->abfd, module->symbols );
+                else
+                    symcnt = bfd_canonicalize_symtab( module->abfd, module->symbols );
+                if ( symcnt >= 0 ) {
+                    success = true;
+                } else {
+                    free( module->symbols );
+                    module->symbols = NULL;
+                }
+            }
+        }
+    }
+    if ( !success && module->abfd ) {
+        bfd_close( module->abfd );
+        module->abfd = NULL;
+        fprintf( stderr, "bfd setup failure for %s\n", module->fileName.c_str() );
+    }
+}
 #endif
 
 #if defined(__GNUC__) && defined(HAVE_EXECINFO_H)
@@ -172,12 +427,13 @@ static bool parseLine( const string line, StackFrame *frame )
 
             string sym = line.substr( pb+1, (pp == string::npos ? pe : pp)-pb-1 );
             int stat;
-            abi::__cxa_demangle( sym.c_str(),
+            char *demangled = abi::__cxa_demangle( sym.c_str(),
                     symbol_buffer,
                     &symbol_buffer_length, &stat );
-            if ( stat == 0 )
+            if ( stat == 0 ) {
+                symbol_buffer = demangled; // may have been reallocated
                 frame->function = symbol_buffer;
-            else
+            } else
                 frame->function = sym;
 
             if ( pp != string::npos ) {
@@ -198,133 +454,165 @@ static bool parseLine( const string line, StackFrame *frame )
 }
 #endif
 
-static void readBacktrace( std::vector<StackFrame> &trace, size_t skip
-#ifdef __sun
-        ,ucontext_t *context
-#endif
-)
+/* Collects the return addresses of the calling thread, omitting this
+ * function and the given number of innermost frames. This is never
+ * inlined so that the number of frames to skip is reliable.
+ */
+static TRACELIB_NOINLINE void readBacktrace( vector<void *> &addresses, size_t skip )
 {
 #if defined(__GNUC__) && defined(HAVE_EXECINFO_H)
     void *array[50];
     size_t size = backtrace(array, sizeof(array)/sizeof(void*));
-    if ( size > 0 && size < sizeof ( array ) / sizeof ( void* ) ) {
-#if HAVE_BFD_H && HAVE_DEMANGLE_H
-        if ( self_symbols ) {
-            for (size_t i = skip; i < size; ++i) {
-                StackFrame frame;
-                if ( !bfdAddressInfo( (bfd_vma)array[i], &frame ) ) {
-                    fprintf( stderr, "err (%d) %p\n", i, array[i] );
-                    frame.function = "??";
-                }
-                trace.push_back( frame );
-            }
-        } else {
-#endif
-            char **strs = backtrace_symbols(array, size);
-            if (strs) {
-                for (size_t i = skip; i < size; ++i) {
-                    StackFrame frame;
-                    if ( !parseLine( strs[i], &frame ) ) {
-                        fprintf( stderr, "err (%d) %s\n", int(i), strs[i] );
-                        frame.function = "??";
-                    }
-                    trace.push_back( frame );
-                }
-                free(strs);
-            }
-#if HAVE_BFD_H && HAVE_DEMANGLE_H
-        }
-#endif
+    if ( size > 0 && size < sizeof ( array ) / sizeof ( void* ) && skip + 1 < size ) {
+        addresses.assign( array + skip + 1, array + size );
     }
 #elif defined(__sun)
-    walkcontext( context, buildBackTrace, (void*)&trace );
+    ucontext_t context;
+    if ( getcontext( &context ) == 0 ) {
+        walkcontext( &context, collectAddress, (void*)&addresses );
+        addresses.erase( addresses.begin(), addresses.begin() + min( skip + 1, addresses.size() ) );
+    }
 #endif
 }
 
-static void setupSymbolTable()
+// Expects trace_mutex to be locked
+static void resolveAddress( void *address, StackFrame *frame )
 {
-#if HAVE_BFD_H && HAVE_DEMANGLE_H
-    bool success = false;
-    char **matching;
-    self_bfd = bfd_openr( processFullName().c_str(), NULL );
-    if ( !bfd_check_format( self_bfd, bfd_archive) &&
-            bfd_check_format_matches( self_bfd, bfd_object, &matching ) ) {
+    frame->address = reinterpret_cast<size_t>( address );
 
-        if ( bfd_get_file_flags( self_bfd ) & HAS_SYMS ) {
-            bfd_boolean dynamic = false;
+    Module *module = findModule( reinterpret_cast<uintptr_t>( address ) );
+    if ( module ) {
+        frame->moduleBase = module->base;
+    }
 
-            long storage = bfd_get_symtab_upper_bound( self_bfd );
-            if ( !storage ) {
-                storage = bfd_get_dynamic_symtab_upper_bound( self_bfd );
-                dynamic = true;
-            }
-            if ( storage >= 0 ) {
-                long symcnt;
-                self_symbols = (asymbol **)malloc( storage );
-                if (dynamic)
-                    symcnt = bfd_canonicalize_dynamic_symtab( self_bfd, self_symbols );
-                else
-                    symcnt = bfd_canonicalize_symtab( self_bfd, self_symbols );
-                if ( symcnt >= 0 ) {
-                    success = true;
-                } else {
-                    free( self_symbols );
-                    self_symbols = NULL;
-                }
-            }
-        }
+#if HAVE_BFD_H && HAVE_DEMANGLE_H
+    if ( module && !module->symbolTableRead ) {
+        readSymbolTable( module );
+        module->symbolTableRead = true;
     }
-    if ( !success && self_bfd ) {
-        bfd_close( self_bfd );
-        self_bfd = NULL;
-        fprintf( stderr, "bfd setup failure\n" );
+    if ( module && module->symbols ) {
+        bfdAddressInfo( module, (bfd_vma)address, frame );
+        return;
+    }
+#endif
+
+#if defined(__GNUC__) && defined(HAVE_EXECINFO_H)
+    char **strs = backtrace_symbols( &address, 1 );
+    if ( strs ) {
+        if ( !parseLine( strs[0], frame ) ) {
+            fprintf( stderr, "err %s\n", strs[0] );
+            frame->function = "??";
+        }
+        free( strs );
+        return;
     }
+#elif !defined(__GNUC__) && defined(__sun)
+    dladdrAddressInfo( address, frame );
+    return;
 #endif
+
+    char buf[32];
+    snprintf( buf, sizeof ( buf ), "[%p]", address );
+    frame->function = buf;
 }
 
-static void cleanupSymbolTable()
+// Expects trace_mutex to be locked
+static void cleanupModules()
 {
+    vector<Module *>::const_iterator it, end = modules.end();
+    for ( it = modules.begin(); it != end; ++it ) {
 #if HAVE_BFD_H && HAVE_DEMANGLE_H
-    if ( self_bfd ) {
-        bfd_close( self_bfd );
-        self_bfd = NULL;
-        if ( self_symbols ) {
-            free( self_symbols );
-            self_symbols = NULL;
+        if ( ( *it )->abfd ) {
+            bfd_close( ( *it )->abfd );
         }
-    }
+        free( ( *it )->symbols );
 #endif
+        delete *it;
+    }
+    modules.clear();
 }
 
 BacktraceGenerator::BacktraceGenerator()
 {
     if ( !trace_ref_count++ ) {
-        pthread_mutex_init( &trace_mutex, NULL );
+        pthread_mutex_lock( &trace_mutex );
         symbol_buffer = (char *)malloc( 4096 );
         symbol_buffer_length = 4096;
-        setupSymbolTable();
+        updateModules();
+        pthread_mutex_unlock( &trace_mutex );
     }
 }
 
 BacktraceGenerator::~BacktraceGenerator()
 {
     if ( ! --trace_ref_count ) {
-        pthread_mutex_destroy( &trace_mutex );
+        pthread_mutex_lock( &trace_mutex );
         free( symbol_buffer );
         symbol_buffer = NULL;
-        cleanupSymbolTable();
+        symbol_buffer_length = 0;
+        clearFrameCache();
+        cleanupModules();
+        pthread_mutex_unlock( &trace_mutex );
     }
 }
 
 Backtrace BacktraceGenerator::generate( size_t skipInnermostFrames )
 {
-    std::vector<StackFrame> trace;
+    vector<void *> addresses;
+    readBacktrace( addresses, skipInnermostFrames + 1 );
+
+    vector<StackFrame> frames;
+    symbolize( addresses, frames );
+    return Backtrace( frames );
+}
+
+/* Only records the return addresses; they are resolved when the frames of
+ * the backtrace are accessed.
+ */
+Backtrace BacktraceGenerator::capture( size_t skipInnermostFrames )
+{
+    vector<void *> addresses;
+    readBacktrace( addresses, skipInnermostFrames + 1 );
+    return Backtrace( addresses );
+}
+
+void BacktraceGenerator::symbolize( const vector<void *> &addresses, vector<StackFrame> &frames )
+{
+    frames.reserve( frames.size() + addresses.size() );
+
+    vector<void *>::const_iterator it, end = addresses.end();
+    for ( it = addresses.begin(); it != end; ++it ) {
+        const CachedFrame *cached = lookupFrame( *it );
+        if ( cached ) {
+            frames.push_back( cached->frame );
+            continue;
+        }
+
+        StackFrame frame;
+        pthread_mutex_lock( &trace_mutex );
+        // Another thread might have resolved the address meanwhile
+        cached = lookupFrame( *it );
+        if ( cached ) {
+            frame = cached->frame;
+        } else {
+            resolveAddress( *it, &frame );
+            insertFrame( *it, frame );
+        }
+        pthread_mutex_unlock( &trace_mutex );
+        frames.push_back( frame );
+    }
+}
+
+void BacktraceGenerator::findModules( const vector<void *> &addresses, vector<const ModuleInfo *> &result )
+{
+    result.reserve( result.size() + addresses.size() );
 
     pthread_mutex_lock( &trace_mutex );
-    readBacktrace( trace, skipInnermostFrames + 2 );
+    vector<void *>::const_iterator it, end = addresses.end();
+    for ( it = addresses.begin(); it != end; ++it ) {
+        result.push_back( findModule( reinterpret_cast<uintptr_t>( *it ) ) );
+    }
     pthread_mutex_unlock( &trace_mutex );
-
-    return Backtrace( trace );
 }
 
 TRACELIB_NAMESPACE_END
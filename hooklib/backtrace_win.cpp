@@ -23,6 +23,7 @@
 #include "3rdparty/stackwalker/StackWalker.h"
 #endif
 #include <windows.h>
+#include <stdio.h>
 
 using namespace std;
 
@@ -115,5 +116,29 @@ Backtrace BacktraceGenerator::generate( size_t skipInnermostFrames )
     return bt;
 }
 
+// Symbols are always resolved right away on Windows
+Backtrace BacktraceGenerator::capture( size_t skipInnermostFrames )
+{
+    return generate( skipInnermostFrames + 1 );
+}
+
+void BacktraceGenerator::symbolize( const vector<void *> &addresses, vector<StackFrame> &frames )
+{
+    vector<void *>::const_iterator it, end = addresses.end();
+    for ( it = addresses.begin(); it != end; ++it ) {
+        char buf[32];
+        _snprintf( buf, sizeof( buf ), "[%p]", *it );
+        StackFrame frame;
+        frame.function = buf;
+        frame.address = reinterpret_cast<size_t>( *it );
+        frames.push_back( frame );
+    }
+}
+
+void BacktraceGenerator::findModules( const vector<void *> &addresses, vector<const ModuleInfo *> &modules )
+{
+    modules.resize( modules.size() + addresses.size(), 0 );
+}
+
 TRACELIB_NAMESPACE_END
 
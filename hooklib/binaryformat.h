@@ -0,0 +1,97 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACELIB_BINARYFORMAT_H
+#define TRACELIB_BINARYFORMAT_H
+
+#include "tracelib_config.h"
+
+TRACELIB_NAMESPACE_BEGIN
+
+/* Constants describing the stream generated by the BinarySerializer, shared
+ * with the decoder in the traced daemon.
+ *
+ * A stream starts with a header consisting of the four Magic bytes and the
+ * format version (16 bit). The header is followed by any number of records,
+ * each starting with the length (32 bit, not including the length field
+ * itself) and the record type (8 bit). All integers are little endian,
+ * strings are written as their length (32 bit) followed by the UTF-8 encoded
+ * characters without a terminating null byte.
+ *
+ * ProcessRecord:
+ *   pid (64), start time (64), process name (string), number of trace
+ *   keys (32) followed by enabled (8) and name (string) per key, maximum
+ *   trace size (64), shrink percentage (16), archive directory (string)
+ * TracePointRecord:
+ *   id (32), type (8), line number (32), source file (string),
+ *   function (string), has group (8), group (string; only if has group)
+ * TraceEntryRecord:
+ *   trace point id (32), thread id (64), time stamp (64),
+ *   stack position (64), flags (8), then depending on the flags the
+ *   message (string), the variables and the backtrace.
+ *   Variables are the number of variables (32) followed by name (string),
+ *   type (8) and the value per variable; the value is a string for String
+ *   variables, a signedness flag (8) and the number (64) for Number
+ *   variables, an IEEE 754 double (64) for Float variables and 8 bit for
+ *   Boolean variables.
+ *   The backtrace is the number of frames (32) followed by module (string),
+ *   function (string), function offset (64), source file (string) and line
+ *   number (32) per frame.
+ *   An address backtrace (which is left to the receiver to resolve) is the
+ *   number of frames (32) followed by the module id (32) and the address
+ *   relative to the load address of the module (64) per frame. Addresses
+ *   outside of any known module have module id 0 and are absolute.
+ * ShutdownRecord:
+ *   pid (64), start time (64), shutdown time (64), process name (string)
+ * ModuleRecord:
+ *   id (32), load address (64), file name (string), build id (string;
+ *   hexadecimal, empty if unknown)
+ *
+ * Trace point and module ids are only valid within a stream; trace point,
+ * module and process records always precede the entries referring to them.
+ * Decoders skip records of unknown types, so records added later need no
+ * new format version.
+ */
+namespace BinaryFormat
+{
+    static const char Magic[4] = { '\x89', 'T', 'L', 'B' };
+    static const unsigned int MagicSize = sizeof( Magic );
+    static const unsigned int HeaderSize = MagicSize + 2;
+    static const unsigned short Version = 1;
+
+    enum RecordType {
+        ProcessRecord = 1,
+        TracePointRecord = 2,
+        TraceEntryRecord = 3,
+        ShutdownRecord = 4,
+        ModuleRecord = 5
+    };
+
+    enum TraceEntryFlags {
+        HasMessage = 0x01,
+        HasVariables = 0x02,
+        HasBacktrace = 0x04,
+        HasAddressBacktrace = 0x08
+    };
+}
+
+TRACELIB_NAMESPACE_END
+
+#endif // !defined(TRACELIB_BINARYFORMAT_H)
+
@@ -198,11 +198,87 @@ bool Configuration::readProcessElement( TiXmlElement *processElement )
             continue;
         }
 
+        if ( e->ValueStr() == "writer" ) {
+            if ( !readWriterElement( e ) ) {
+                return false;
+            }
+            continue;
+        }
+
         m_log->writeError( "Tracelib Configuration: while reading %s: unexpected child element '%s' found inside <process>.", m_fileName.c_str(), processElement->Value() );
     }
     return true;
 }
 
+bool Configuration::readWriterElement( TiXmlElement *writerElement )
+{
+    string writerType;
+    if ( writerElement->QueryValueAttribute( "type", &writerType ) != TIXML_SUCCESS ) {
+        m_log->writeError( "Tracelib Configuration: while reading %s: Failed to read type property of <writer> element.", m_fileName.c_str() );
+        return false;
+    }
+
+    if ( writerType == "synchronous" ) {
+        m_writerConfiguration.mode = WriterConfiguration::Synchronous;
+    } else if ( writerType == "asynchronous" ) {
+        m_writerConfiguration.mode = WriterConfiguration::Asynchronous;
+    } else if ( writerType == "flightrecorder" ) {
+        m_writerConfiguration.mode = WriterConfiguration::FlightRecorder;
+    } else {
+        m_log->writeError( "Tracelib Configuration: while reading %s: <writer> element with unknown type '%s' found.", m_fileName.c_str(), writerType.c_str() );
+        return false;
+    }
+
+    for ( TiXmlElement *optionElement = writerElement->FirstChildElement(); optionElement; optionElement = optionElement->NextSiblingElement() ) {
+        if ( optionElement->ValueStr() != "option" ) {
+            m_log->writeError( "Tracelib Configuration: while reading %s: Unexpected element '%s' in <writer> element found.", m_fileName.c_str(), optionElement->Value() );
+            return false;
+        }
+
+        string optionName;
+        if ( optionElement->QueryValueAttribute( "name", &optionName ) != TIXML_SUCCESS ) {
+            m_log->writeError( "Tracelib Configuration: while reading %s: Failed to read name property of <option> element; ignoring this.", m_fileName.c_str() );
+            continue;
+        }
+
+        if ( optionName == "bufferSize" ) {
+            istringstream str( getText( optionElement ) );
+            unsigned int bufferSize = 0;
+            if ( !( str >> bufferSize ) || bufferSize == 0 ) {
+                m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for 'bufferSize' option of <writer> element; ignoring this.", m_fileName.c_str(), getText( optionElement ).c_str() );
+                continue;
+            }
+            m_writerConfiguration.bufferSize = bufferSize;
+        } else if ( optionName == "overflowPolicy" ) {
+            const string policy = getText( optionElement );
+            if ( policy == "drop" ) {
+                m_writerConfiguration.overflowPolicy = WriterConfiguration::DropEntry;
+            } else if ( policy == "block" ) {
+                m_writerConfiguration.overflowPolicy = WriterConfiguration::BlockThread;
+            } else if ( policy == "overwrite" ) {
+                m_writerConfiguration.overflowPolicy = WriterConfiguration::OverwriteOldest;
+            } else {
+                m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for 'overflowPolicy' option of <writer> element; ignoring this.", m_fileName.c_str(), policy.c_str() );
+                continue;
+            }
+        } else if ( optionName == "maximumMessageLength" ) {
+            istringstream str( getText( optionElement ) );
+            unsigned int maximumMessageLength = 0;
+            if ( !( str >> maximumMessageLength ) ) {
+                m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for 'maximumMessageLength' option of <writer> element; ignoring this.", m_fileName.c_str(), getText( optionElement ).c_str() );
+                continue;
+            }
+            m_writerConfiguration.maximumMessageLength = maximumMessageLength;
+        } else {
+            m_log->writeError( "Tracelib Configuration: while reading %s: Unknown <option> element with name '%s' found in <writer> element; ignoring this.", m_fileName.c_str(), optionName.c_str() );
+            continue;
+        }
+    }
+
+    m_log->writeStatus( "Tracelib Configuration: using %s writer", writerType.c_str() );
+    return true;
+}
+
 bool Configuration::readTraceKeysElement( TiXmlElement *traceKeysElem )
 {
     for ( TiXmlElement *e = traceKeysElem->FirstChildElement(); e; e = e->NextSiblingElement() ) {
@@ -229,6 +305,11 @@ const StorageConfiguration &Configuration::storageConfiguration() const
     return m_storageConfiguration;
 }
 
+const WriterConfiguration &Configuration::writerConfiguration() const
+{
+    return m_writerConfiguration;
+}
+
 const vector<TracePointSet *> &Configuration::configuredTracePointSets() const
 {
     return m_configuredTracePointSets;
@@ -418,6 +499,38 @@ Serializer *Configuration::createSerializerFromElement( TiXmlElement *e )
         return serializer;
     }
 
+    if ( serializerType == "binary" ) {
+        bool writeBacktraceAddresses = false;
+        for ( TiXmlElement *optionElement = e->FirstChildElement(); optionElement; optionElement = optionElement->NextSiblingElement() ) {
+            if ( optionElement->ValueStr() != "option" ) {
+                m_log->writeError( "Tracelib Configuration: while reading %s: Unexpected element '%s' in <serializer> element of type binary found.", m_fileName.c_str(), optionElement->Value() );
+                return 0;
+            }
+
+            string optionName;
+            if ( optionElement->QueryValueAttribute( "name", &optionName ) != TIXML_SUCCESS ) {
+                m_log->writeError( "Tracelib Configuration: while reading %s: Failed to read name property of <option> element; ignoring this.", m_fileName.c_str() );
+                continue;
+            }
+
+            if ( optionName == "backtraces" ) {
+                const string value = getText( optionElement );
+                if ( value == "addresses" ) {
+                    writeBacktraceAddresses = true;
+                } else if ( value != "symbols" ) {
+                    m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for 'backtraces' option of binary serializer; ignoring this.", m_fileName.c_str(), value.c_str() );
+                }
+            } else {
+                m_log->writeError( "Tracelib Configuration: while reading %s: Unknown <option> element with name '%s' found in binary serializer; ignoring this.", m_fileName.c_str(), optionName.c_str() );
+                continue;
+            }
+        }
+        BinarySerializer *serializer = new BinarySerializer;
+        serializer->setWriteBacktraceAddresses( writeBacktraceAddresses );
+        m_log->writeStatus( "Tracelib Configuration: using binary serializer (backtrace addresses=%d)", writeBacktraceAddresses );
+        return serializer;
+    }
+
     m_log->writeError( "Tracelib Configuration: while reading %s: <serializer> element with unknown type '%s' found.", m_fileName.c_str(), serializerType.c_str() );
     return 0;
 }
@@ -426,7 +539,7 @@ TracePointSet *Configuration::createTracePointSetFromElement( TiXmlElement *e )
 {
     string backtracesAttr = "no";
     e->QueryValueAttribute( "backtraces", &backtracesAttr );
-    if ( backtracesAttr != "yes" && backtracesAttr != "no" ) {
+    if ( backtracesAttr != "yes" && backtracesAttr != "no" && backtracesAttr != "deferred" ) {
         m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for backtraces= attribute of <tracepointset> element", m_fileName.c_str(), backtracesAttr.c_str() );
         return 0;
     }
@@ -438,6 +551,47 @@ TracePointSet *Configuration::createTracePointSetFromElement( TiXmlElement *e )
         return 0;
     }
 
+    EntryLimits limits;
+    string sampleEveryAttr;
+    if ( e->QueryValueAttribute( "sampleEvery", &sampleEveryAttr ) == TIXML_SUCCESS ) {
+        istringstream str( sampleEveryAttr );
+        if ( !( str >> limits.sampleEvery ) || !str.eof() || limits.sampleEvery == 0 ) {
+            m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for sampleEvery= attribute of <tracepointset> element", m_fileName.c_str(), sampleEveryAttr.c_str() );
+            return 0;
+        }
+    }
+
+    string sampleProbabilityAttr;
+    if ( e->QueryValueAttribute( "sampleProbability", &sampleProbabilityAttr ) == TIXML_SUCCESS ) {
+        istringstream str( sampleProbabilityAttr );
+        if ( !( str >> limits.sampleProbability ) || !str.eof() ||
+             !( limits.sampleProbability > 0.0 && limits.sampleProbability <= 1.0 ) ) {
+            m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for sampleProbability= attribute of <tracepointset> element", m_fileName.c_str(), sampleProbabilityAttr.c_str() );
+            return 0;
+        }
+    }
+
+    string maximumRateAttr;
+    if ( e->QueryValueAttribute( "maximumRate", &maximumRateAttr ) == TIXML_SUCCESS ) {
+        istringstream str( maximumRateAttr );
+        if ( !( str >> limits.maximumRate ) || !str.eof() ||
+             limits.maximumRate == 0 || limits.maximumRate > EntryLimits::MaximumRate ) {
+            m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for maximumRate= attribute of <tracepointset> element", m_fileName.c_str(), maximumRateAttr.c_str() );
+            return 0;
+        }
+    }
+
+    string limitPerAttr = "tracepoint";
+    e->QueryValueAttribute( "limitPer", &limitPerAttr );
+    if ( limitPerAttr == "tracepoint" ) {
+        limits.scope = EntryLimits::PerTracePoint;
+    } else if ( limitPerAttr == "key" ) {
+        limits.scope = EntryLimits::PerTraceKey;
+    } else {
+        m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for limitPer= attribute of <tracepointset> element", m_fileName.c_str(), limitPerAttr.c_str() );
+        return 0;
+    }
+
     TiXmlElement *filterElement = e->FirstChildElement();
     if ( !filterElement ) {
         m_log->writeError( "Tracelib Configuration: while reading %s: No filter element specified for <tracepointset> element", m_fileName.c_str() );
@@ -458,12 +612,14 @@ TracePointSet *Configuration::createTracePointSetFromElement( TiXmlElement *e )
     int actions = TracePointSet::LogTracePoint;
     if ( backtracesAttr == "yes" ) {
         actions |= TracePointSet::YieldBacktrace;
+    } else if ( backtracesAttr == "deferred" ) {
+        actions |= TracePointSet::DeferSymbolization;
     }
     if ( variablesAttr == "yes" ) {
         actions |= TracePointSet::YieldVariables;
     }
 
-    return new TracePointSet( filter, actions );
+    return new TracePointSet( filter, actions, limits );
 }
 
 Output *Configuration::createOutputFromElement( TiXmlElement *e )
@@ -483,6 +639,12 @@ Output *Configuration::createOutputFromElement( TiXmlElement *e )
         std::string filename;
         bool overwriteExistingFile = true;
         bool relativePathIsRelativeToUserHome = false;
+        unsigned int bufferSize = 0;
+        unsigned int flushInterval = FileOutput::DefaultFlushInterval;
+        uint64_t maximumSize = 0;
+        unsigned int maximumAge = 0;
+        unsigned int keptFiles = FileOutput::DefaultKeptFiles;
+        bool compressRotatedFiles = false;
         for ( TiXmlElement *optionElement = e->FirstChildElement(); optionElement; optionElement = optionElement->NextSiblingElement() ) {
             if ( optionElement->ValueStr() != "option" ) {
                 m_log->writeError( "Tracelib Configuration: while reading %s: Unexpected element '%s' in <output> element of type file found.", m_fileName.c_str(), optionElement->Value() );
@@ -501,6 +663,49 @@ Output *Configuration::createOutputFromElement( TiXmlElement *e )
                 overwriteExistingFile = getText( optionElement ) == "true";
             } else if ( optionName == "relativeToUserHome" ) {
                 relativePathIsRelativeToUserHome = getText( optionElement ) == "true";
+            } else if ( optionName == "bufferSize" ) {
+                istringstream str( getText( optionElement ) );
+                if ( !( str >> bufferSize ) ) {
+                    m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for 'bufferSize' option of file output; ignoring this.", m_fileName.c_str(), getText( optionElement ).c_str() );
+                    bufferSize = 0;
+                    continue;
+                }
+            } else if ( optionName == "flushInterval" ) {
+                istringstream str( getText( optionElement ) );
+                if ( !( str >> flushInterval ) ) {
+                    m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for 'flushInterval' option of file output; ignoring this.", m_fileName.c_str(), getText( optionElement ).c_str() );
+                    flushInterval = FileOutput::DefaultFlushInterval;
+                    continue;
+                }
+            } else if ( optionName == "maximumSize" ) {
+                istringstream str( getText( optionElement ) );
+                if ( !( str >> maximumSize ) ) {
+                    m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for 'maximumSize' option of file output; ignoring this.", m_fileName.c_str(), getText( optionElement ).c_str() );
+                    maximumSize = 0;
+                    continue;
+                }
+            } else if ( optionName == "maximumAge" ) {
+                istringstream str( getText( optionElement ) );
+                if ( !( str >> maximumAge ) ) {
+                    m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for 'maximumAge' option of file output; ignoring this.", m_fileName.c_str(), getText( optionElement ).c_str() );
+                    maximumAge = 0;
+                    continue;
+                }
+            } else if ( optionName == "keptFiles" ) {
+                istringstream str( getText( optionElement ) );
+                if ( !( str >> keptFiles ) || keptFiles == 0 ) {
+                    m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for 'keptFiles' option of file output; ignoring this.", m_fileName.c_str(), getText( optionElement ).c_str() );
+                    keptFiles = FileOutput::DefaultKeptFiles;
+                    continue;
+                }
+            } else if ( optionName == "compressRotatedFiles" ) {
+                compressRotatedFiles = getText( optionElement ) == "true";
+#if !HAVE_ZLIB
+                if ( compressRotatedFiles ) {
+                    m_log->writeError( "Tracelib Configuration: while reading %s: This build does not support compressing rotated files; ignoring 'compressRotatedFiles' option of file output.", m_fileName.c_str() );
+                    compressRotatedFiles = false;
+                }
+#endif
             } else {
                 m_log->writeError( "Tracelib Configuration: while reading %s: Unknown <option> element with name '%s' found in file output; ignoring this.", m_fileName.c_str(), optionName.c_str() );
                 continue;
@@ -526,16 +731,21 @@ Output *Configuration::createOutputFromElement( TiXmlElement *e )
                 filename = sstr.str();
             }
         }
-        m_log->writeStatus( "Tracelib Configuration: using file output to %s", filename.c_str() );
-        return new FileOutput( m_log, filename );
+        m_log->writeStatus( "Tracelib Configuration: using file output to %s (buffer size=%u, flush interval=%u)", filename.c_str(), bufferSize, flushInterval );
+        FileOutput *output = new FileOutput( m_log, filename );
+        output->setBufferSize( bufferSize );
+        output->setFlushInterval( flushInterval );
+        output->setRotation( maximumSize, maximumAge, keptFiles, compressRotatedFiles );
+        return output;
     }
 
-    if ( outputType == "tcp" ) {
-        string hostname;
-        unsigned short port = TRACELIB_DEFAULT_PORT;
+    if ( outputType == "mmap" ) {
+        string filename;
+        bool relativePathIsRelativeToUserHome = false;
+        uint64_t size = MappedFileOutput::DefaultSize;
         for ( TiXmlElement *optionElement = e->FirstChildElement(); optionElement; optionElement = optionElement->NextSiblingElement() ) {
             if ( optionElement->ValueStr() != "option" ) {
-                m_log->writeError( "Tracelib Configuration: while reading %s: Unexpected element '%s' in <output> element of type tcp found.", m_fileName.c_str(), optionElement->Value() );
+                m_log->writeError( "Tracelib Configuration: while reading %s: Unexpected element '%s' in <output> element of type mmap found.", m_fileName.c_str(), optionElement->Value() );
                 return 0;
             }
 
@@ -545,29 +755,190 @@ Output *Configuration::createOutputFromElement( TiXmlElement *e )
                 continue;
             }
 
-            if ( optionName == "host" ) {
-                hostname = getText( optionElement ); // XXX Consider encoding issues
-            } else if ( optionName == "port" ) {
+            if ( optionName == "filename" ) {
+                filename = getText( optionElement ); // XXX Consider encoding issues
+            } else if ( optionName == "relativeToUserHome" ) {
+                relativePathIsRelativeToUserHome = getText( optionElement ) == "true";
+            } else if ( optionName == "size" ) {
                 istringstream str( getText( optionElement ) );
-                str >> port; // XXX Error handling for non-numeric port numbers
+                if ( !( str >> size ) || size < MappedFileOutput::MinimumSize ) {
+                    m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for 'size' option of mmap output; ignoring this.", m_fileName.c_str(), getText( optionElement ).c_str() );
+                    size = MappedFileOutput::DefaultSize;
+                    continue;
+                }
             } else {
-                m_log->writeError( "Tracelib Configuration: while reading %s: Unknown <option> element with name '%s' found in tcp output; ignoring this.", m_fileName.c_str(), optionName.c_str() );
+                m_log->writeError( "Tracelib Configuration: while reading %s: Unknown <option> element with name '%s' found in mmap output; ignoring this.", m_fileName.c_str(), optionName.c_str() );
                 continue;
             }
         }
 
-        if ( hostname.empty() ) {
-            m_log->writeError( "Tracelib Configuration: while reading %s: No 'host' option specified for <output> element of type tcp.", m_fileName.c_str() );
+        if ( filename.empty() ) {
+            m_log->writeError( "Tracelib Configuration: while reading %s: No 'filename' option specified for <output> element of type mmap.", m_fileName.c_str() );
             return 0;
         }
+        if( !isAbsolute( filename ) && relativePathIsRelativeToUserHome ) {
+            filename = userHome() + pathSeparator() + filename;
+        }
+        m_log->writeStatus( "Tracelib Configuration: using memory mapped file output to %s (size=%lu)", filename.c_str(), static_cast<unsigned long>( size ) );
+        return new MappedFileOutput( m_log, filename, size );
+    }
+
+    if ( outputType == "shm" ) {
+#ifdef _WIN32
+        m_log->writeError( "Tracelib Configuration: while reading %s: <output> elements of type shm are not supported on this platform", m_fileName.c_str() );
+        return 0;
+#else
+        string name;
+        for ( TiXmlElement *optionElement = e->FirstChildElement(); optionElement; optionElement = optionElement->NextSiblingElement() ) {
+            if ( optionElement->ValueStr() != "option" ) {
+                m_log->writeError( "Tracelib Configuration: while reading %s: Unexpected element '%s' in <output> element of type shm found.", m_fileName.c_str(), optionElement->Value() );
+                return 0;
+            }
 
-        if ( port == 0 ) {
-            m_log->writeError( "Tracelib Configuration: while reading %s: No 'port' option specified for <output> element of type tcp.", m_fileName.c_str() );
+            string optionName;
+            if ( optionElement->QueryValueAttribute( "name", &optionName ) != TIXML_SUCCESS ) {
+                m_log->writeError( "Tracelib Configuration: while reading %s: Failed to read name property of <option> element; ignoring this.", m_fileName.c_str() );
+                continue;
+            }
+
+            if ( optionName == "name" ) {
+                name = getText( optionElement );
+            } else {
+                m_log->writeError( "Tracelib Configuration: while reading %s: Unknown <option> element with name '%s' found in shm output; ignoring this.", m_fileName.c_str(), optionName.c_str() );
+                continue;
+            }
+        }
+
+        if ( name.empty() ) {
+            m_log->writeError( "Tracelib Configuration: while reading %s: No 'name' option specified for <output> element of type shm.", m_fileName.c_str() );
             return 0;
         }
 
-        m_log->writeStatus( "Tracelib Configuration: using TCP/IP output, remote = %s:%d", hostname.c_str(), port );
-        return new NetworkOutput( m_log, hostname.c_str(), port );
+        if ( !SharedMemoryOutput::isValidName( name ) ) {
+            m_log->writeError( "Tracelib Configuration: while reading %s: Invalid segment name '%s' specified for <output> element of type shm.", m_fileName.c_str(), name.c_str() );
+            return 0;
+        }
+
+        m_log->writeStatus( "Tracelib Configuration: using shared memory output, segment = %s", name.c_str() );
+        return new SharedMemoryOutput( m_log, name );
+#endif
+    }
+
+#ifdef _WIN32
+    if ( outputType == "unix" ) {
+        m_log->writeError( "Tracelib Configuration: while reading %s: <output> elements of type unix are not supported on this platform", m_fileName.c_str() );
+        return 0;
+    }
+#endif
+
+    if ( outputType == "tcp" || outputType == "unix" ) {
+        string hostname;
+        string socketPath;
+        unsigned short port = TRACELIB_DEFAULT_PORT;
+        size_t maximumQueueSize = NetworkOutput::DefaultMaximumQueueSize;
+        NetworkOutput::OverflowPolicy overflowPolicy = NetworkOutput::DropEntry;
+        unsigned int blockTimeout = NetworkOutput::DefaultBlockTimeout;
+        unsigned int reconnectDelay = NetworkOutput::DefaultReconnectDelay;
+        unsigned int maximumReconnectDelay = NetworkOutput::DefaultMaximumReconnectDelay;
+        for ( TiXmlElement *optionElement = e->FirstChildElement(); optionElement; optionElement = optionElement->NextSiblingElement() ) {
+            if ( optionElement->ValueStr() != "option" ) {
+                m_log->writeError( "Tracelib Configuration: while reading %s: Unexpected element '%s' in <output> element of type %s found.", m_fileName.c_str(), optionElement->Value(), outputType.c_str() );
+                return 0;
+            }
+
+            string optionName;
+            if ( optionElement->QueryValueAttribute( "name", &optionName ) != TIXML_SUCCESS ) {
+                m_log->writeError( "Tracelib Configuration: while reading %s: Failed to read name property of <option> element; ignoring this.", m_fileName.c_str() );
+                continue;
+            }
+
+            if ( optionName == "host" && outputType == "tcp" ) {
+                hostname = getText( optionElement ); // XXX Consider encoding issues
+            } else if ( optionName == "port" && outputType == "tcp" ) {
+                istringstream str( getText( optionElement ) );
+                str >> port; // XXX Error handling for non-numeric port numbers
+            } else if ( optionName == "path" && outputType == "unix" ) {
+                socketPath = getText( optionElement ); // XXX Consider encoding issues
+            } else if ( optionName == "maximumQueueSize" ) {
+                istringstream str( getText( optionElement ) );
+                if ( !( str >> maximumQueueSize ) ) {
+                    m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for 'maximumQueueSize' option of %s output; ignoring this.", m_fileName.c_str(), getText( optionElement ).c_str(), outputType.c_str() );
+                    maximumQueueSize = NetworkOutput::DefaultMaximumQueueSize;
+                    continue;
+                }
+            } else if ( optionName == "overflowPolicy" ) {
+                const string policy = getText( optionElement );
+                if ( policy == "drop" ) {
+                    overflowPolicy = NetworkOutput::DropEntry;
+                } else if ( policy == "overwrite" ) {
+                    overflowPolicy = NetworkOutput::OverwriteOldest;
+                } else if ( policy == "block" ) {
+                    overflowPolicy = NetworkOutput::BlockThread;
+                } else {
+                    m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for 'overflowPolicy' option of %s output; ignoring this.", m_fileName.c_str(), policy.c_str(), outputType.c_str() );
+                    continue;
+                }
+            } else if ( optionName == "blockTimeout" ) {
+                istringstream str( getText( optionElement ) );
+                if ( !( str >> blockTimeout ) ) {
+                    m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for 'blockTimeout' option of %s output; ignoring this.", m_fileName.c_str(), getText( optionElement ).c_str(), outputType.c_str() );
+                    blockTimeout = NetworkOutput::DefaultBlockTimeout;
+                    continue;
+                }
+            } else if ( optionName == "reconnectDelay" ) {
+                istringstream str( getText( optionElement ) );
+                if ( !( str >> reconnectDelay ) ) {
+                    m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for 'reconnectDelay' option of %s output; ignoring this.", m_fileName.c_str(), getText( optionElement ).c_str(), outputType.c_str() );
+                    reconnectDelay = NetworkOutput::DefaultReconnectDelay;
+                    continue;
+                }
+            } else if ( optionName == "maximumReconnectDelay" ) {
+                istringstream str( getText( optionElement ) );
+                if ( !( str >> maximumReconnectDelay ) ) {
+                    m_log->writeError( "Tracelib Configuration: while reading %s: Invalid value '%s' for 'maximumReconnectDelay' option of %s output; ignoring this.", m_fileName.c_str(), getText( optionElement ).c_str(), outputType.c_str() );
+                    maximumReconnectDelay = NetworkOutput::DefaultMaximumReconnectDelay;
+                    continue;
+                }
+            } else {
+                m_log->writeError( "Tracelib Configuration: while reading %s: Unknown <option> element with name '%s' found in %s output; ignoring this.", m_fileName.c_str(), optionName.c_str(), outputType.c_str() );
+                continue;
+            }
+        }
+
+        NetworkOutput *output;
+#ifndef _WIN32
+        if ( outputType == "unix" ) {
+            if ( socketPath.empty() ) {
+                m_log->writeError( "Tracelib Configuration: while reading %s: No 'path' option specified for <output> element of type unix.", m_fileName.c_str() );
+                return 0;
+            }
+
+            if ( !NetworkOutput::isValidSocketPath( socketPath ) ) {
+                m_log->writeError( "Tracelib Configuration: while reading %s: Socket path '%s' specified for <output> element of type unix is too long.", m_fileName.c_str(), socketPath.c_str() );
+                return 0;
+            }
+
+            m_log->writeStatus( "Tracelib Configuration: using Unix domain socket output, path = %s", socketPath.c_str() );
+            output = new NetworkOutput( m_log, socketPath );
+        } else
+#endif
+        {
+            if ( hostname.empty() ) {
+                m_log->writeError( "Tracelib Configuration: while reading %s: No 'host' option specified for <output> element of type tcp.", m_fileName.c_str() );
+                return 0;
+            }
+
+            if ( port == 0 ) {
+                m_log->writeError( "Tracelib Configuration: while reading %s: No 'port' option specified for <output> element of type tcp.", m_fileName.c_str() );
+                return 0;
+            }
+
+            m_log->writeStatus( "Tracelib Configuration: using TCP/IP output, remote = %s:%d", hostname.c_str(), port );
+            output = new NetworkOutput( m_log, hostname.c_str(), port );
+        }
+        output->setQueueLimit( maximumQueueSize, overflowPolicy, blockTimeout );
+        output->setReconnectDelay( reconnectDelay, maximumReconnectDelay );
+        return output;
     }
 
     m_log->writeError( "Tracelib Configuration: while reading %s: Unknown type '%s' specified for <output> element", m_fileName.c_str(), outputType.c_str() );
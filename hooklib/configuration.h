@@ -49,6 +49,35 @@ struct StorageConfiguration {
     std::string archiveDirectoryName;
 };
 
+struct WriterConfiguration {
+    enum Mode {
+        Synchronous,
+        Asynchronous,
+        FlightRecorder
+    };
+
+    enum OverflowPolicy {
+        DropEntry,
+        BlockThread,
+        OverwriteOldest
+    };
+
+    static const unsigned int DefaultBufferSize = 1024;
+    static const unsigned int DefaultMaximumMessageLength = 256;
+
+    WriterConfiguration()
+        : mode( Synchronous ),
+          bufferSize( DefaultBufferSize ),
+          overflowPolicy( DropEntry ),
+          maximumMessageLength( DefaultMaximumMessageLength )
+    { }
+
+    Mode mode;
+    unsigned int bufferSize;
+    OverflowPolicy overflowPolicy;
+    unsigned int maximumMessageLength; // only used by the flight recorder
+};
+
 struct TraceKey
 {
     TraceKey() : enabled( true ) { }
@@ -70,6 +99,7 @@ public:
     static Configuration *fromMarkup( const std::string &markup, Log *log );
 
     const StorageConfiguration &storageConfiguration() const;
+    const WriterConfiguration &writerConfiguration() const;
     const std::vector<TracePointSet *> &configuredTracePointSets() const;
     Serializer *configuredSerializer();
     Output *configuredOutput();
@@ -89,6 +119,7 @@ private:
     bool readProcessElement( TiXmlElement *e );
     bool readTraceKeysElement( TiXmlElement *e );
     bool readStorageElement( TiXmlElement *e );
+    bool readWriterElement( TiXmlElement *e );
 
     std::string m_fileName;
     std::vector<TracePointSet *> m_configuredTracePointSets;
@@ -97,6 +128,7 @@ private:
     Log *m_log;
     std::vector<TraceKey> m_configuredTraceKeys;
     StorageConfiguration m_storageConfiguration;
+    WriterConfiguration m_writerConfiguration;
 };
 
 TRACELIB_NAMESPACE_END
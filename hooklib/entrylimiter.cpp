@@ -0,0 +1,140 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "entrylimiter.h"
+#include "timehelper.h"
+
+#include <algorithm>
+
+using namespace std;
+
+TRACELIB_NAMESPACE_BEGIN
+
+static unsigned long sampleThreshold( double probability )
+{
+    if ( probability >= 1.0 ) {
+        return 0xffffffffUL;
+    }
+    return static_cast<unsigned long>( probability * 4294967295.0 );
+}
+
+// Scrambles the bits of a counter (the finalizer of MurmurHash3)
+static unsigned long mix( unsigned long v )
+{
+    v &= 0xffffffffUL;
+    v ^= v >> 16;
+    v = ( v * 0x85ebca6bUL ) & 0xffffffffUL;
+    v ^= v >> 13;
+    v = ( v * 0xc2b2ae35UL ) & 0xffffffffUL;
+    v ^= v >> 16;
+    return v;
+}
+
+EntryLimiter::EntryLimiter( const EntryLimits &limits )
+    : m_sampleEvery( max( limits.sampleEvery, 1u ) ),
+    m_sampleThreshold( sampleThreshold( limits.sampleProbability ) ),
+    m_maximumRate( limits.maximumRate < EntryLimits::MaximumRate ? limits.maximumRate : EntryLimits::MaximumRate ),
+    m_startTime( now() ),
+    m_visits( 0 ),
+    m_tokens( m_maximumRate ),
+    m_lastRefill( 0 ),
+    m_suppressedCount( 0 ),
+    m_lastSuppressedTracePoint( 0 )
+{
+}
+
+AtomicWord EntryLimiter::takeSuppressedCount()
+{
+    return atomicExchange( &m_suppressedCount, 0 );
+}
+
+const TracePoint *EntryLimiter::lastSuppressedTracePoint() const
+{
+    return atomicLoadPointer( &m_lastSuppressedTracePoint );
+}
+
+/* The visits are numbered; every n-th one is kept, and the probability is
+ * applied by comparing a scrambled visit number against a threshold.
+ */
+bool EntryLimiter::sample()
+{
+    const unsigned long visit = static_cast<unsigned long>( atomicFetchAdd( &m_visits, 1 ) );
+    if ( visit % m_sampleEvery != 0 ) {
+        return false;
+    }
+    return m_sampleThreshold == NoSampling ||
+           mix( visit * 0x9e3779b9UL + reinterpret_cast<size_t>( this ) ) < m_sampleThreshold;
+}
+
+bool EntryLimiter::takeToken()
+{
+    do {
+        AtomicWord tokens = atomicLoadRelaxed( &m_tokens );
+        while ( tokens > 0 ) {
+            if ( atomicCompareAndSwap( &m_tokens, tokens, tokens - 1 ) ) {
+                return true;
+            }
+            tokens = atomicLoadRelaxed( &m_tokens );
+        }
+    } while ( refill() );
+    return false;
+}
+
+/* Credits the tokens which accumulated since the last refill. The time of
+ * the refill only advances by the time it takes to accumulate the credited
+ * tokens, so no fraction of a token gets lost. Returns false if no tokens
+ * could be added (yet).
+ */
+bool EntryLimiter::refill()
+{
+    const AtomicWord elapsed = static_cast<AtomicWord>( now() - m_startTime );
+    const AtomicWord lastRefill = atomicLoadRelaxed( &m_lastRefill );
+    const AtomicWord milliseconds = static_cast<AtomicWord>( static_cast<unsigned long>( elapsed ) -
+                                                             static_cast<unsigned long>( lastRefill ) );
+    if ( milliseconds <= 0 ) {
+        return false;
+    }
+
+    AtomicWord credit;
+    AtomicWord refillTime;
+    if ( milliseconds >= 1000 ) {
+        credit = m_maximumRate;
+        refillTime = elapsed;
+    } else {
+        credit = milliseconds * m_maximumRate / 1000;
+        if ( credit == 0 ) {
+            return false;
+        }
+        refillTime = static_cast<AtomicWord>( static_cast<unsigned long>( lastRefill ) +
+                                              ( credit * 1000 + m_maximumRate - 1 ) / m_maximumRate );
+    }
+
+    // Whoever fails here lost against another thread which is refilling
+    if ( !atomicCompareAndSwap( &m_lastRefill, lastRefill, refillTime ) ) {
+        return true;
+    }
+
+    AtomicWord tokens = atomicLoadRelaxed( &m_tokens );
+    while ( !atomicCompareAndSwap( &m_tokens, tokens, min( tokens + credit, m_maximumRate ) ) ) {
+        tokens = atomicLoadRelaxed( &m_tokens );
+    }
+    return true;
+}
+
+TRACELIB_NAMESPACE_END
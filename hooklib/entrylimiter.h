@@ -0,0 +1,117 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACELIB_ENTRYLIMITER_H
+#define TRACELIB_ENTRYLIMITER_H
+
+#include "tracelib_config.h"
+#include "atomic.h"
+#include "config.h" // for uint64_t
+
+TRACELIB_NAMESPACE_BEGIN
+
+struct TracePoint;
+
+/* The sampling and rate limiting configured for a <tracepointset>. */
+struct EntryLimits
+{
+    enum Scope {
+        PerTracePoint,
+        PerTraceKey
+    };
+
+    static const unsigned int MaximumRate = 1000000; // entries per second
+
+    EntryLimits()
+        : sampleEvery( 1 ),
+        sampleProbability( 1.0 ),
+        maximumRate( 0 ),
+        scope( PerTracePoint )
+    {
+    }
+
+    bool isLimited() const {
+        return sampleEvery > 1 || sampleProbability < 1.0 || maximumRate > 0;
+    }
+
+    unsigned int sampleEvery;
+    double sampleProbability;
+    unsigned int maximumRate; // entries per second, 0 meaning unlimited
+    Scope scope;
+};
+
+/* Decides which visits of the trace points it is responsible for yield a
+ * trace entry. Visits are sampled first (keeping every n-th visit and/or
+ * each visit with some probability); the remaining ones are subject to a
+ * token bucket which holds up to one second worth of entries and is
+ * refilled lazily once it ran empty. Everything works without locks since
+ * admit() is called on the hot path.
+ *
+ * The number of suppressed entries is counted so that it can be reported
+ * in the trace.
+ */
+class EntryLimiter
+{
+public:
+    explicit EntryLimiter( const EntryLimits &limits );
+
+    bool admit( const TracePoint *tracePoint ) {
+        if ( ( m_sampleEvery > 1 || m_sampleThreshold != NoSampling ) && !sample() ) {
+            suppress( tracePoint );
+            return false;
+        }
+        if ( m_maximumRate > 0 && !takeToken() ) {
+            suppress( tracePoint );
+            return false;
+        }
+        return true;
+    }
+
+    AtomicWord takeSuppressedCount();
+    const TracePoint *lastSuppressedTracePoint() const;
+
+private:
+    EntryLimiter( const EntryLimiter &other ); // disabled
+    void operator=( const EntryLimiter &rhs ); // disabled
+
+    static const unsigned long NoSampling = 0xffffffffUL;
+
+    void suppress( const TracePoint *tracePoint ) {
+        atomicFetchAdd( &m_suppressedCount, 1 );
+        atomicStorePointer( &m_lastSuppressedTracePoint, tracePoint );
+    }
+
+    bool sample();
+    bool takeToken();
+    bool refill();
+
+    const unsigned long m_sampleEvery;
+    const unsigned long m_sampleThreshold;
+    const AtomicWord m_maximumRate;
+    const uint64_t m_startTime;
+    volatile AtomicWord m_visits;
+    volatile AtomicWord m_tokens;
+    volatile AtomicWord m_lastRefill; // milliseconds since m_startTime
+    volatile AtomicWord m_suppressedCount;
+    const TracePoint * volatile m_lastSuppressedTracePoint;
+};
+
+TRACELIB_NAMESPACE_END
+
+#endif // !defined(TRACELIB_ENTRYLIMITER_H)
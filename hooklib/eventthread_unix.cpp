@@ -168,13 +168,8 @@ addToTimeOut( TimeOutMap &map, const timeval &now, EventObserver *obs, int ms )
 {
     timeval next;
     timeval add;
-    if ( ms >= 1000 ) {
-        add.tv_sec = ms / 1000;
-        ms %= 1000;
-    } else {
-        add.tv_sec = 0;
-    }
-    add.tv_usec = ms * 1000;
+    add.tv_sec = ms / 1000;
+    add.tv_usec = ( ms % 1000 ) * 1000;
     timeradd( &now, &add, &next );
 
     TimeOutMap::iterator it = map.find( next );
@@ -201,45 +196,39 @@ static void removeFromTimeOut( TimeOutMap &map, const EventObserver *observer )
         {
             if ( ti->observer == observer ) {
                 ti = it->second.erase( ti );
-                if ( it->second.size() == 0 )
-                    map.erase( it );
                 //return; not yet guaranteed that an observer is add only once
             } else {
                 ++ti;
             }
         }
+        if ( it->second.empty() )
+            map.erase( it );
 
         it = next;
     }
 }
 
+/* Observers may add or remove timeouts while handling one, so the map is
+ * looked up anew for each expired timeout.
+ */
 static void handleTimeout( EventContext *ctx, const timeval &now )
 {
-    const TimeOutMap::iterator e = ctx->m_timeout_map.end();
-    for ( TimeOutMap::iterator i = ctx->m_timeout_map.begin(); i != e; ) {
-        TimeOutMap::iterator succ = i;
-        ++succ;
-
-        if ( now < i->first )
-            break;
-
-        const TimeOutList::iterator te = i->second.end();
-        for ( TimeOutList::iterator ti = i->second.begin(); ti != te; )
-        {
-            TimeOut timeout = *ti;
-            ti = i->second.erase( ti );
-
-            if ( timeout.timeout > 0 ) {
-                addToTimeOut( ctx->m_timeout_map, now,
-                        timeout.observer, timeout.timeout );
-            }
+    TimeOutMap::iterator i;
+    while ( ( i = ctx->m_timeout_map.begin() ) != ctx->m_timeout_map.end() &&
+            !( now < i->first ) ) {
+        TimeOut timeout = i->second.front();
+        i->second.pop_front();
+        if ( i->second.empty() ) {
+            ctx->m_timeout_map.erase( i );
+        }
 
-            TimerEvent event;
-            timeout.observer->handleEvent( ctx, &event );
+        if ( timeout.timeout > 0 ) {
+            addToTimeOut( ctx->m_timeout_map, now,
+                    timeout.observer, timeout.timeout );
         }
 
-        ctx->m_timeout_map.erase( i );
-        i = succ;
+        TimerEvent event;
+        timeout.observer->handleEvent( ctx, &event );
     }
 }
 
@@ -252,6 +241,8 @@ static int processFds( EventContext *data, int nds, fd_set *rfds, fd_set *wfds )
         timeval now;
         gettimeofday( &now, NULL );
         handleTimeout( data, now );
+        // Observers handling a timeout may have started watching other files
+        nds = data->getFDSets( rfds, wfds );
 
         it = data->m_timeout_map.begin();
         if ( it != data->m_timeout_map.end() ) {
@@ -436,13 +427,29 @@ EventThreadUnix::EventThreadUnix() : d( new EventContext )
 EventThreadUnix::~EventThreadUnix()
 {
     stop();
-    m_self = NULL;
+    atomicCompareAndSwapPointer( &m_self, this, static_cast<EventThreadUnix *>( 0 ) );
     delete d;
 }
 
+/* Several threads may need the event thread at the same time; only one of
+ * the event threads they start is kept.
+ */
+EventThreadUnix *EventThreadUnix::create()
+{
+    EventThreadUnix *thread = new EventThreadUnix();
+    if ( thread->d->command_pipe[1] == -1 ) {
+        delete thread;
+        return atomicLoadPointer( &m_self );
+    }
+    if ( !atomicCompareAndSwapPointer( &m_self, static_cast<EventThreadUnix *>( 0 ), thread ) ) {
+        delete thread;
+    }
+    return atomicLoadPointer( &m_self );
+}
+
 void EventThreadUnix::postTask( Task *task )
 {
-    if ( running() ) {
+    if ( d->command_pipe[1] > -1 ) {
         MutexLocker locker( d->pipe_mutex );
         write( d->command_pipe[1], &PostTask, sizeof ( PostTask ) );
         write( d->command_pipe[1], &task, sizeof ( task ) );
@@ -451,7 +458,7 @@ void EventThreadUnix::postTask( Task *task )
 
 void *EventThreadUnix::sendTask( Task *task )
 {
-    if ( running() ) {
+    if ( d->command_pipe[1] > -1 ) {
         MutexLocker locker( d->pipe_mutex );
 
         write( d->command_pipe[1], &SendTask, sizeof ( SendTask ) );
@@ -467,7 +474,7 @@ void *EventThreadUnix::sendTask( Task *task )
 
 void EventThreadUnix::commandChannels( int *in, int *out )
 {
-    if ( running() ) {
+    if ( d->command_pipe[1] > -1 ) {
         *in = d->confirm_pipe[0];
         *out = d->confirm_pipe[1];
     } else {
@@ -510,7 +517,7 @@ int EventThreadUnix::processEvents( EventContext *ctx )
     return processFds( ctx, nds, &rfds, &wfds );
 }
 
-EventThreadUnix *EventThreadUnix::m_self;
+EventThreadUnix * volatile EventThreadUnix::m_self;
 
 TRACELIB_NAMESPACE_END
 
@@ -22,6 +22,7 @@
 
 #include "tracelib_config.h"
 #include "getcurrentthreadid.h"
+#include "atomic.h"
 
 TRACELIB_NAMESPACE_BEGIN
 
@@ -142,13 +143,10 @@ public:
 
     static EventThreadUnix *self()
     {
-        if ( !m_self )
-            m_self = new EventThreadUnix();
-        if ( !m_self->running() ) {
-            delete m_self;
-            m_self = (EventThreadUnix *)0;
-        }
-        return m_self;
+        EventThreadUnix *thread = atomicLoadPointer( &m_self );
+        if ( !thread )
+            thread = create();
+        return thread;
     }
 
     static bool running();
@@ -166,11 +164,13 @@ public:
 private:
     EventThreadUnix();
 
+    static EventThreadUnix *create();
+
     void stop();
 
     EventContext *d;
 
-    static EventThreadUnix *m_self;
+    static EventThreadUnix * volatile m_self;
 };
 
 TRACELIB_NAMESPACE_END
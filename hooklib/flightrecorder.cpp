@@ -0,0 +1,234 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flightrecorder.h"
+#include "getcurrentthreadid.h"
+#include "log.h"
+#include "timehelper.h" // for now
+#include "trace.h"
+#include "variabledumping.h"
+
+#include <algorithm>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+TRACELIB_NAMESPACE_BEGIN
+
+static const size_t CacheLineSize = 64;
+static const unsigned int NoMessage = ~0u;
+
+/* The message is stored right behind the slot; slots are padded to whole
+ * cache lines so that threads recording at the same time don't compete for
+ * the same cache line.
+ */
+struct FlightRecorder::Slot
+{
+    volatile AtomicWord sequence;
+    unsigned long ticket;
+    const TracePoint *tracePoint;
+    ThreadId threadId;
+    uint64_t timeStamp;
+    size_t stackPosition;
+    unsigned int messageLength;
+
+    char *message() { return reinterpret_cast<char *>( this + 1 ); }
+};
+
+namespace {
+
+struct RecordedEntry
+{
+    unsigned long age;
+    const TracePoint *tracePoint;
+    ThreadId threadId;
+    uint64_t timeStamp;
+    size_t stackPosition;
+    bool hasMessage;
+    string message;
+};
+
+struct OlderEntry
+{
+    bool operator()( const RecordedEntry &a, const RecordedEntry &b ) const {
+        return a.age > b.age;
+    }
+};
+
+}
+
+static unsigned long roundUpToPowerOfTwo( unsigned int v )
+{
+    unsigned long result = 1;
+    while ( result < v ) {
+        result <<= 1;
+    }
+    return result;
+}
+
+FlightRecorder::FlightRecorder( Trace *trace, Log *log, unsigned int capacity,
+                                unsigned int maximumMessageLength )
+    : m_trace( trace ),
+    m_log( log ),
+    m_capacity( roundUpToPowerOfTwo( capacity ) ),
+    m_maximumMessageLength( maximumMessageLength ),
+    m_slotSize( ( sizeof( Slot ) + maximumMessageLength + CacheLineSize - 1 ) / CacheLineSize * CacheLineSize ),
+    m_slots( 0 ),
+    m_nextTicket( 0 ),
+    m_skippedEntries( 0 ),
+    m_dumpedTicket( 0 )
+{
+    // Zero sequence numbers mark slots which were never written
+    m_slots = new char[m_capacity * m_slotSize];
+    for ( unsigned long i = 0; i < m_capacity; ++i ) {
+        slot( i )->sequence = 0;
+    }
+}
+
+FlightRecorder::~FlightRecorder()
+{
+    delete [] m_slots;
+}
+
+bool FlightRecorder::hasSize( unsigned int capacity, unsigned int maximumMessageLength ) const
+{
+    return m_capacity == roundUpToPowerOfTwo( capacity ) &&
+           m_maximumMessageLength == maximumMessageLength;
+}
+
+FlightRecorder::Slot *FlightRecorder::slot( unsigned long ticket ) const
+{
+    return reinterpret_cast<Slot *>( m_slots + ( ticket & ( m_capacity - 1 ) ) * m_slotSize );
+}
+
+/* Claiming the slot only fails if the ring wrapped around completely while
+ * another thread was still writing the slot; the entry is skipped then.
+ */
+void FlightRecorder::record( const TracePoint *tracePoint, const char *msg,
+                             const DeferredMessage *deferredMessage )
+{
+    const unsigned long ticket = atomicFetchAdd( &m_nextTicket, 1 );
+    Slot *s = slot( ticket );
+
+    const AtomicWord sequence = atomicLoadRelaxed( &s->sequence );
+    if ( ( sequence & 1 ) || !atomicCompareAndSwap( &s->sequence, sequence, sequence + 1 ) ) {
+        atomicFetchAdd( &m_skippedEntries, 1 );
+        return;
+    }
+
+    s->ticket = ticket;
+    s->tracePoint = tracePoint;
+    s->threadId = getCurrentThreadId();
+    s->timeStamp = now();
+    s->stackPosition = reinterpret_cast<size_t>( &sequence );
+    if ( deferredMessage ) {
+        const size_t length = deferredMessage->formatInto( s->message(), m_maximumMessageLength );
+        s->messageLength = static_cast<unsigned int>( length );
+    } else if ( msg ) {
+        const size_t length = min( strlen( msg ), static_cast<size_t>( m_maximumMessageLength ) );
+        memcpy( s->message(), msg, length );
+        s->messageLength = static_cast<unsigned int>( length );
+    } else {
+        s->messageLength = NoMessage;
+    }
+
+    atomicStore( &s->sequence, sequence + 2 );
+}
+
+void FlightRecorder::dump()
+{
+    MutexLocker dumpLocker( m_dumpMutex );
+    dumpEntries();
+}
+
+/* Used from the crash handler, where waiting for another dump (which may
+ * have been interrupted by the crash) is not an option.
+ */
+bool FlightRecorder::tryDump()
+{
+    if ( !m_dumpMutex.tryLock() ) {
+        return false;
+    }
+    dumpEntries();
+    m_dumpMutex.unlock();
+    return true;
+}
+
+/* Writes all entries which were recorded since the last dump and are still
+ * in the ring, oldest first. Expects m_dumpMutex to be locked.
+ */
+void FlightRecorder::dumpEntries()
+{
+    const unsigned long endTicket = atomicLoad( &m_nextTicket );
+    const unsigned long newEntries = endTicket - m_dumpedTicket;
+
+    vector<RecordedEntry> entries;
+    for ( unsigned long i = 0; i < m_capacity; ++i ) {
+        Slot *s = slot( i );
+        const AtomicWord sequence = atomicLoad( &s->sequence );
+        if ( sequence == 0 || ( sequence & 1 ) ) {
+            continue;
+        }
+
+        RecordedEntry entry;
+        entry.age = endTicket - s->ticket;
+        entry.tracePoint = s->tracePoint;
+        entry.threadId = s->threadId;
+        entry.timeStamp = s->timeStamp;
+        entry.stackPosition = s->stackPosition;
+        const unsigned int messageLength = s->messageLength;
+        entry.hasMessage = messageLength != NoMessage;
+        if ( entry.hasMessage ) {
+            entry.message.assign( s->message(), min( messageLength, m_maximumMessageLength ) );
+        }
+
+        // A full barrier, so the slot is read completely before checking that it didn't change
+        if ( atomicFetchAdd( &s->sequence, 0 ) != sequence ) {
+            continue;
+        }
+        // Skip entries dumped before and entries recorded after the dump started
+        if ( entry.age == 0 || entry.age > newEntries ) {
+            continue;
+        }
+        entries.push_back( entry );
+    }
+    m_dumpedTicket = endTicket;
+
+    sort( entries.begin(), entries.end(), OlderEntry() );
+
+    vector<RecordedEntry>::const_iterator it, end = entries.end();
+    for ( it = entries.begin(); it != end; ++it ) {
+        TraceEntry entry( it->tracePoint,
+                          it->hasMessage ? it->message.c_str() : 0,
+                          it->threadId,
+                          it->timeStamp,
+                          it->stackPosition );
+        m_trace->addEntry( entry );
+    }
+
+    const AtomicWord skippedEntries = atomicExchange( &m_skippedEntries, 0 );
+    if ( skippedEntries > 0 ) {
+        m_log->writeError( "FlightRecorder: skipped %ld trace entries since their slot was still being written", skippedEntries );
+    }
+}
+
+TRACELIB_NAMESPACE_END
+
@@ -0,0 +1,84 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACELIB_FLIGHTRECORDER_H
+#define TRACELIB_FLIGHTRECORDER_H
+
+#include "tracelib_config.h"
+#include "atomic.h"
+#include "mutex.h"
+
+#include <stddef.h>
+
+TRACELIB_NAMESPACE_BEGIN
+
+class DeferredMessage;
+class Log;
+class Trace;
+struct TracePoint;
+
+/* Keeps the most recent trace entries in a ring of fixed size without
+ * serializing them; only the trace point, the thread, the time stamp and
+ * the (possibly truncated) message are recorded. The entries are serialized
+ * and written to the output of the trace only when the recorder is dumped.
+ *
+ * All threads share the ring. Each slot has a sequence number which is odd
+ * while the slot is written, so that dumping (which may happen at any time)
+ * skips slots which are being modified.
+ */
+class FlightRecorder
+{
+public:
+    FlightRecorder( Trace *trace, Log *log, unsigned int capacity,
+                    unsigned int maximumMessageLength );
+    ~FlightRecorder();
+
+    bool hasSize( unsigned int capacity, unsigned int maximumMessageLength ) const;
+
+    void record( const TracePoint *tracePoint, const char *msg,
+                 const DeferredMessage *deferredMessage = 0 );
+
+    void dump();
+    bool tryDump();
+
+private:
+    FlightRecorder( const FlightRecorder &other ); // disabled
+    void operator=( const FlightRecorder &rhs ); // disabled
+
+    struct Slot;
+
+    Slot *slot( unsigned long ticket ) const;
+    void dumpEntries();
+
+    Trace *m_trace;
+    Log *m_log;
+    const unsigned long m_capacity;
+    const unsigned int m_maximumMessageLength;
+    const size_t m_slotSize;
+    char *m_slots;
+    volatile AtomicWord m_nextTicket;
+    volatile AtomicWord m_skippedEntries;
+    Mutex m_dumpMutex;
+    unsigned long m_dumpedTicket;
+};
+
+TRACELIB_NAMESPACE_END
+
+#endif // !defined(TRACELIB_FLIGHTRECORDER_H)
+
@@ -49,11 +49,13 @@ Log::Log( LogOutput* statusOutput, LogOutput *errorOutput )
 
 void Log::writeStatus( const string &msg )
 {
+    MutexLocker locker( m_mutex );
     m_statusOutput->write( msg );
 }
 
 void Log::writeError( const string &msg )
 {
+    MutexLocker locker( m_mutex );
     m_errorOutput->write( msg );
 }
 
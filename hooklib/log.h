@@ -22,6 +22,7 @@
 
 #include "tracelib_config.h"
 
+#include "mutex.h"
 #include "timehelper.h"
 
 #include <stdarg.h>
@@ -85,6 +86,7 @@ private:
     void operator=( const Log &other );
     LogOutput* m_statusOutput;
     LogOutput* m_errorOutput;
+    Mutex m_mutex; // trace points may get (re)configured by many threads at once
 };
 
 #ifdef _WIN32
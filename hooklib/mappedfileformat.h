@@ -0,0 +1,79 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACELIB_MAPPEDFILEFORMAT_H
+#define TRACELIB_MAPPEDFILEFORMAT_H
+
+#include "tracelib_config.h"
+#include "config.h" // for uint64_t
+
+TRACELIB_NAMESPACE_BEGIN
+
+/* Layout of the files written by the MappedFileOutput, shared with the
+ * recovertrace tool.
+ *
+ * A file consists of a Header followed by the data area, which is used as a
+ * ring buffer. All integers are stored in the byte order of the machine
+ * which wrote the file. Positions count the bytes written since the file was
+ * created; byte n is stored at offset HeaderSize + n % capacity.
+ *
+ * Each trace entry is stored as a record consisting of the length of the
+ * data (32 bit), the data itself and the length again, so that the records
+ * can be read backwards starting at the write position.
+ *
+ * Before a record is copied into the data area, reservedPosition is set to
+ * the position after the record; writePosition is only set to the same
+ * value once the record is complete. Hence, all records ending at or before
+ * writePosition and starting at or after reservedPosition - capacity are
+ * intact, even if the process died while writing a record. When such a
+ * file is continued, the incomplete record is turned into a padding record,
+ * which has the PaddingRecord bit set in both length fields and is skipped
+ * by readers.
+ */
+namespace MappedFileFormat
+{
+    static const char Magic[4] = { '\x89', 'T', 'L', 'M' };
+    static const unsigned short Version = 1;
+
+    enum Flags {
+        BinaryData = 0x0001 // records are not text (see Output::setBinaryData)
+    };
+
+    struct Header {
+        char magic[4];
+        unsigned short version;
+        unsigned short flags;
+        unsigned int headerSize;
+        unsigned int reserved;
+        uint64_t capacity;
+        volatile uint64_t reservedPosition;
+        volatile uint64_t writePosition;
+        char padding[24];
+    };
+
+    static const unsigned int HeaderSize = sizeof( Header );
+    static const unsigned int RecordOverhead = 2 * sizeof( unsigned int );
+    static const unsigned int PaddingRecord = 0x80000000;
+    static const unsigned int MaximumRecordLength = PaddingRecord - 1;
+}
+
+TRACELIB_NAMESPACE_END
+
+#endif // !defined(TRACELIB_MAPPEDFILEFORMAT_H)
+
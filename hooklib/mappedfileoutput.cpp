@@ -0,0 +1,250 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "output.h"
+#include "atomic.h"
+#include "log.h"
+#include "mappedfileformat.h"
+
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+using namespace std;
+
+TRACELIB_NAMESPACE_BEGIN
+
+using namespace MappedFileFormat;
+
+static bool isValidHeader( const Header *header, uint64_t capacity )
+{
+    return memcmp( header->magic, Magic, sizeof( Magic ) ) == 0 &&
+           header->version == Version &&
+           header->headerSize == HeaderSize &&
+           header->capacity == capacity &&
+           header->writePosition <= header->reservedPosition &&
+           header->reservedPosition - header->writePosition <= capacity;
+}
+
+MappedFileOutput::MappedFileOutput( Log *log, const string &filename, uint64_t size )
+    : m_filename( filename ),
+    m_log( log ),
+    m_capacity( size > HeaderSize + RecordOverhead ? size - HeaderSize : RecordOverhead ),
+    m_mapping( 0 ),
+    m_data( 0 ),
+    m_writePosition( 0 ),
+    m_lastWriteFailed( false ),
+#ifdef _WIN32
+    m_fileHandle( INVALID_HANDLE_VALUE ),
+    m_mappingHandle( 0 )
+#else
+    m_fd( -1 )
+#endif
+{
+}
+
+MappedFileOutput::~MappedFileOutput()
+{
+    close();
+}
+
+bool MappedFileOutput::canWrite() const
+{
+    return m_mapping != 0;
+}
+
+bool MappedFileOutput::open()
+{
+    if ( m_mapping ) {
+        return true;
+    }
+
+    const uint64_t fileSize = HeaderSize + m_capacity;
+#ifdef _WIN32
+    m_fileHandle = ::CreateFileA( m_filename.c_str(), GENERIC_READ | GENERIC_WRITE,
+                                  FILE_SHARE_READ, NULL, OPEN_ALWAYS,
+                                  FILE_ATTRIBUTE_NORMAL, NULL );
+    if ( m_fileHandle == INVALID_HANDLE_VALUE ) {
+        m_log->writeError( "MappedFileOutput: failed to open %s: error %lu", m_filename.c_str(), ::GetLastError() );
+        return false;
+    }
+
+    // Creating the mapping makes the file as large as the mapping
+    m_mappingHandle = ::CreateFileMappingA( m_fileHandle, NULL, PAGE_READWRITE,
+                                            static_cast<DWORD>( fileSize >> 32 ),
+                                            static_cast<DWORD>( fileSize ), NULL );
+    if ( m_mappingHandle ) {
+        m_mapping = static_cast<char *>( ::MapViewOfFile( m_mappingHandle, FILE_MAP_WRITE, 0, 0,
+                                                          static_cast<SIZE_T>( fileSize ) ) );
+    }
+    if ( !m_mapping ) {
+        m_log->writeError( "MappedFileOutput: failed to map %s: error %lu", m_filename.c_str(), ::GetLastError() );
+        close();
+        return false;
+    }
+#else
+    m_fd = ::open( m_filename.c_str(), O_RDWR | O_CREAT, 0666 );
+    if ( m_fd == -1 ) {
+        m_log->writeError( "MappedFileOutput: failed to open %s: %s", m_filename.c_str(), strerror( errno ) );
+        return false;
+    }
+
+    struct stat st;
+    if ( fstat( m_fd, &st ) != 0 || static_cast<uint64_t>( st.st_size ) != fileSize ) {
+        /* Allocate the blocks right away; running out of disk space while
+         * writing to a sparse mapping would kill the process with SIGBUS.
+         */
+        int result = ftruncate( m_fd, static_cast<off_t>( fileSize ) );
+#ifdef __linux__
+        if ( result == 0 ) {
+            result = posix_fallocate( m_fd, 0, static_cast<off_t>( fileSize ) );
+            errno = result;
+        }
+#endif
+        if ( result != 0 ) {
+            m_log->writeError( "MappedFileOutput: failed to resize %s: %s", m_filename.c_str(), strerror( errno ) );
+            close();
+            return false;
+        }
+    }
+
+    void *mapping = mmap( 0, static_cast<size_t>( fileSize ), PROT_READ | PROT_WRITE,
+                          MAP_SHARED, m_fd, 0 );
+    if ( mapping == MAP_FAILED ) {
+        m_log->writeError( "MappedFileOutput: failed to map %s: %s", m_filename.c_str(), strerror( errno ) );
+        close();
+        return false;
+    }
+    m_mapping = static_cast<char *>( mapping );
+#endif
+    m_data = m_mapping + HeaderSize;
+
+    Header *header = reinterpret_cast<Header *>( m_mapping );
+    if ( !isValidHeader( header, m_capacity ) ) {
+        memset( header, 0, HeaderSize );
+        memcpy( header->magic, Magic, sizeof( Magic ) );
+        header->version = Version;
+        header->headerSize = HeaderSize;
+        header->capacity = m_capacity;
+    } else if ( header->reservedPosition != header->writePosition ) {
+        // The previous process died while writing a record
+        const unsigned int length = static_cast<unsigned int>(
+            header->reservedPosition - header->writePosition - RecordOverhead ) | PaddingRecord;
+        copyToData( header->writePosition, reinterpret_cast<const char *>( &length ), sizeof( length ) );
+        copyToData( header->reservedPosition - sizeof( length ), reinterpret_cast<const char *>( &length ), sizeof( length ) );
+        atomicSignalFence();
+        header->writePosition = header->reservedPosition;
+    }
+    header->flags = m_binaryData ? BinaryData : 0;
+    m_writePosition = header->writePosition;
+    return true;
+}
+
+void MappedFileOutput::close()
+{
+#ifdef _WIN32
+    if ( m_mapping ) {
+        ::UnmapViewOfFile( m_mapping );
+    }
+    if ( m_mappingHandle ) {
+        ::CloseHandle( m_mappingHandle );
+        m_mappingHandle = 0;
+    }
+    if ( m_fileHandle != INVALID_HANDLE_VALUE ) {
+        ::CloseHandle( m_fileHandle );
+        m_fileHandle = INVALID_HANDLE_VALUE;
+    }
+#else
+    if ( m_mapping ) {
+        munmap( m_mapping, static_cast<size_t>( HeaderSize + m_capacity ) );
+    }
+    if ( m_fd != -1 ) {
+        ::close( m_fd );
+        m_fd = -1;
+    }
+#endif
+    m_mapping = 0;
+    m_data = 0;
+}
+
+void MappedFileOutput::setBinaryData( bool binaryData )
+{
+    Output::setBinaryData( binaryData );
+    if ( m_mapping ) {
+        reinterpret_cast<Header *>( m_mapping )->flags = binaryData ? BinaryData : 0;
+    }
+}
+
+void MappedFileOutput::copyToData( uint64_t position, const char *data, size_t size )
+{
+    const size_t offset = static_cast<size_t>( position % m_capacity );
+    const size_t firstPart = offset + size <= m_capacity ? size : static_cast<size_t>( m_capacity - offset );
+    memcpy( m_data + offset, data, firstPart );
+    if ( firstPart < size ) {
+        memcpy( m_data, data + firstPart, size - firstPart );
+    }
+}
+
+/* The positions in the header are only updated after the data they cover
+ * was copied; the kernel keeps the contents of the mapping if the process
+ * dies, so all the compiler needs to preserve is the order of the writes.
+ */
+void MappedFileOutput::write( const vector<char> &data )
+{
+    if ( !m_mapping ) {
+        return;
+    }
+
+    const uint64_t recordSize = data.size() + RecordOverhead;
+    if ( data.size() > MaximumRecordLength || recordSize > m_capacity ) {
+        if ( !m_lastWriteFailed ) {
+            m_log->writeError( "MappedFileOutput: dropping trace entry of %lu bytes which does not fit into %s", static_cast<unsigned long>( data.size() ), m_filename.c_str() );
+            m_lastWriteFailed = true;
+        }
+        return;
+    }
+    m_lastWriteFailed = false;
+
+    Header *header = reinterpret_cast<Header *>( m_mapping );
+    const uint64_t endPosition = m_writePosition + recordSize;
+    const unsigned int length = static_cast<unsigned int>( data.size() );
+
+    header->reservedPosition = endPosition;
+    atomicSignalFence();
+    copyToData( m_writePosition, reinterpret_cast<const char *>( &length ), sizeof( length ) );
+    if ( !data.empty() ) {
+        copyToData( m_writePosition + sizeof( length ), &data[0], data.size() );
+    }
+    copyToData( endPosition - sizeof( length ), reinterpret_cast<const char *>( &length ), sizeof( length ) );
+    atomicSignalFence();
+    header->writePosition = endPosition;
+
+    m_writePosition = endPosition;
+}
+
+TRACELIB_NAMESPACE_END
+
@@ -33,6 +33,7 @@ public:
     ~Mutex();
 
     void lock();
+    bool tryLock();
     void unlock();
 
 private:
@@ -43,6 +43,11 @@ void Mutex::lock()
     pthread_mutex_lock( &m_handle->mutex );
 }
 
+bool Mutex::tryLock()
+{
+    return pthread_mutex_trylock( &m_handle->mutex ) == 0;
+}
+
 void Mutex::unlock()
 {
     pthread_mutex_unlock( &m_handle->mutex );
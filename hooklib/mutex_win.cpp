@@ -43,6 +43,11 @@ void Mutex::lock()
     ::EnterCriticalSection( &m_handle->section );
 }
 
+bool Mutex::tryLock()
+{
+    return ::TryEnterCriticalSection( &m_handle->section ) != FALSE;
+}
+
 void Mutex::unlock()
 {
     ::LeaveCriticalSection( &m_handle->section );
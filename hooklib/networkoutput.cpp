@@ -28,12 +28,16 @@
 
 #include "output.h"
 #include "log.h"
+#include "timehelper.h"
 
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <sys/types.h>
 
+#include <algorithm>
+
 #ifdef _WIN32
 #  include <windows.h>
 #  include <winsock2.h>
@@ -94,7 +98,19 @@ static size_t writeTo( int fd, const char *data, const int length, Log *log )
 
 NetworkOutput::NetworkOutput( Log *log, const string &host, unsigned short port )
     : m_host( host ), m_port( port ), m_socket( -1 ), m_log( log ),
-    m_lastConnectionAttemptFailed( false ), d( 0 )
+    d( 0 ),
+    m_maximumQueueSize( DefaultMaximumQueueSize ),
+    m_overflowPolicy( DropEntry ),
+    m_blockTimeout( DefaultBlockTimeout ),
+    m_droppedData( false ),
+    m_droppedEntries( 0 ),
+    m_streamStart( true ),
+    m_restartStream( false ),
+    m_resumeStream( false ),
+    m_minimumReconnectDelay( DefaultReconnectDelay ),
+    m_maximumReconnectDelay( DefaultMaximumReconnectDelay ),
+    m_reconnectDelay( DefaultReconnectDelay ),
+    m_nextConnectionAttempt( 0 )
 {
 #ifdef _WIN32
     WSADATA wsaData;
@@ -119,12 +135,18 @@ NetworkOutput::~NetworkOutput()
 #endif
 }
 
+/* Connects synchronously; after a failed attempt, the next one is made once
+ * the (randomized, growing) reconnect delay passed.
+ */
 bool NetworkOutput::open()
 {
-    if ( m_socket == -1 && !m_lastConnectionAttemptFailed ) {
+    if ( m_socket == -1 && now() >= m_nextConnectionAttempt ) {
         m_socket = connectTo( m_host, m_port, m_log );
         if ( m_socket == -1 ) {
-            m_lastConnectionAttemptFailed = true;
+            m_nextConnectionAttempt = now() + m_reconnectDelay / 2 + rand() % ( m_reconnectDelay / 2 + 1 );
+            m_reconnectDelay = min( m_reconnectDelay * 2, m_maximumReconnectDelay );
+        } else {
+            m_reconnectDelay = m_minimumReconnectDelay;
         }
     }
     return m_socket != -1;
@@ -144,6 +166,40 @@ void NetworkOutput::write( const vector<char> &data )
     }
 }
 
+void NetworkOutput::setReconnectDelay( unsigned int minimumDelay, unsigned int maximumDelay )
+{
+    m_minimumReconnectDelay = minimumDelay;
+    m_maximumReconnectDelay = max( minimumDelay, maximumDelay );
+    m_reconnectDelay = minimumDelay;
+}
+
+// Data is written synchronously, so there is no queue to limit
+void NetworkOutput::setQueueLimit( size_t maximumSize, OverflowPolicy policy, unsigned int blockTimeout )
+{
+    m_maximumQueueSize = maximumSize;
+    m_overflowPolicy = policy;
+    m_blockTimeout = blockTimeout;
+}
+
+bool NetworkOutput::droppedData()
+{
+    return false;
+}
+
+unsigned long NetworkOutput::takeDroppedEntryCount()
+{
+    return 0;
+}
+
+bool NetworkOutput::keepsQueuedData() const
+{
+    return false;
+}
+
+void NetworkOutput::prependData( const vector<char> &data )
+{
+}
+
 void NetworkOutput::close()
 {
 #ifdef _WIN32
@@ -152,7 +208,6 @@ void NetworkOutput::close()
     ::close( m_socket );
 #endif
     m_socket = -1;
-    m_lastConnectionAttemptFailed = false;
 }
 
 TRACELIB_NAMESPACE_END
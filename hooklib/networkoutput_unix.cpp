@@ -19,7 +19,11 @@
 
 #include "output.h"
 #include "log.h"
+#include "atomic.h"
 #include "eventthread_unix.h"
+#include "sendbuffer.h"
+#include "thread.h"
+#include "timehelper.h"
 
 #include <arpa/inet.h>
 #include <string.h>
@@ -28,35 +32,61 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <netdb.h>
 
-#include <list>
-
 using namespace std;
 
 TRACELIB_NAMESPACE_BEGIN
 
+#ifdef MSG_NOSIGNAL
+static const int SendFlags = MSG_NOSIGNAL;
+#else
+static const int SendFlags = 0;
+#endif
+
+// Upper limit for the number of chunks written with a single sendmsg call
+static const size_t MaximumWriteRegions = 64;
+
 class NetworkOutputPrivate : public FileEventObserver {
 public:
-    typedef std::list< std::vector<char> * > BufferList;
-
-    // Only used in event thread
-    BufferList buffers;
-    string host;
+    /* Filled by the NetworkOutput calling thread(s), emptied by the event
+     * thread.
+     */
+    SendBuffer sendBuffer;
+    /* Set by the event thread once a connection broke after data was sent
+     * over it; the queued data then belongs to a stream the receiver never
+     * sees the end of. Reset by the NetworkOutput calling thread once it
+     * discarded that data, the event thread doesn't write until then.
+     */
+    volatile AtomicWord failed;
+    // Set by the event thread while the connection is established
+    volatile AtomicWord connected;
+
+    // Only used in event thread (set before the connection is started)
+    string host; // or the path of a Unix domain socket
     unsigned short port;
+    bool localSocket;
     bool notify_on_close;
+    int closed_pipe[2]; // signals the end of closing to a waiting thread
     bool dummy;
     int m_socket;
     Log *log;
-    ssize_t buf_pos;
     int watching;
+    unsigned int minimumReconnectDelay;
+    unsigned int maximumReconnectDelay;
+    unsigned int reconnectDelay;
+    unsigned int randomSeed;
+    bool sentData; // over the current connection
 
     enum ObserverState {
         NotConnected,
         Connecting, Connected,
         Closing,
-        Error
+        Waiting // for the next connection attempt
     };
     ObserverState state;
 
@@ -64,8 +94,7 @@ public:
     enum NetworkOutputState {
         Idle,
         Opened,
-        Closed,
-        Failure
+        Closed
     };
     NetworkOutputState network_state;
 
@@ -73,25 +102,40 @@ public:
     ~NetworkOutputPrivate();
 
     // Only used in NetworkOutput calling thread
-    void connect();
     void close();
 
     // Only used in event thread
     void clear();
+    void connect( EventContext *ctx );
+    void connectTo( EventContext *ctx, const sockaddr *address, socklen_t length );
     void addObserver( EventContext *ctx, int watch );
     void removeObserver( EventContext *ctx, int watch );
     void endClosing( EventContext *ctx );
-    bool write( EventContext *ctx, std::vector<char>* buffer );
+    void connectionLost( EventContext *ctx );
+    void scheduleReconnect( EventContext *ctx );
+    void startWriting( EventContext *ctx );
+    bool writeBuffer( int fd, bool *empty );
     void handleEvent( EventContext*, Event *event );
 };
 
-class WriteDataTask : public Task
+class ConnectTask : public Task
 {
     NetworkOutputPrivate *observer;
-    vector<char> *data;
 public:
-    WriteDataTask( NetworkOutputPrivate *obs, vector<char> *d )
-        : observer( obs ), data( d )
+    ConnectTask( NetworkOutputPrivate *obs ) : observer( obs )
+    {}
+
+    void *exec( EventContext* );
+};
+
+/* Posted whenever data is appended to the empty send buffer; data appended
+ * to a non-empty buffer is written along with the data already in there.
+ */
+class StartWritingTask : public Task
+{
+    NetworkOutputPrivate *observer;
+public:
+    StartWritingTask( NetworkOutputPrivate *obs ) : observer( obs )
     {}
 
     void *exec( EventContext* );
@@ -109,53 +153,102 @@ public:
 
 
 NetworkOutputPrivate::NetworkOutputPrivate( const string h, unsigned short p, Log *_log )
- : host( h ),
+ : failed( 0 ),
+   connected( 0 ),
+   host( h ),
    port( p ),
+   localSocket( false ),
    notify_on_close( true ),
    m_socket( -1 ),
    log( _log ),
-   buf_pos( 0),
    watching( FileEvent::Error ),
+   minimumReconnectDelay( NetworkOutput::DefaultReconnectDelay ),
+   maximumReconnectDelay( NetworkOutput::DefaultMaximumReconnectDelay ),
+   reconnectDelay( NetworkOutput::DefaultReconnectDelay ),
+   randomSeed( static_cast<unsigned int>( getpid() ^ now() ) ),
+   sentData( false ),
    state( NotConnected ),
    network_state( Idle )
-{}
+{
+    closed_pipe[0] = closed_pipe[1] = -1;
+}
 
 NetworkOutputPrivate::~NetworkOutputPrivate()
 {
     close();
 }
 
-void NetworkOutputPrivate::connect()
+/* Abstract socket names are not null terminated, the address size tells
+ * their length.
+ */
+static socklen_t localSocketAddress( const string &path, struct sockaddr_un *address )
+{
+    memset( address, 0, sizeof( *address ) );
+    address->sun_family = AF_UNIX;
+    memcpy( address->sun_path, path.data(), path.size() );
+#ifdef __linux__
+    if ( path[0] == '@' ) {
+        address->sun_path[0] = '\0';
+        return offsetof( struct sockaddr_un, sun_path ) + path.size();
+    }
+#endif
+    return offsetof( struct sockaddr_un, sun_path ) + path.size() + 1;
+}
+
+/* Resolving the host name may take a while, but it only holds up the event
+ * thread; threads writing trace entries just keep queueing them.
+ */
+void NetworkOutputPrivate::connect( EventContext *ctx )
 {
-    // NetworkOutput calling thread, no event thread calls at this point
-    state = Error;
-    network_state = Opened;
+    if ( localSocket ) {
+        struct sockaddr_un address;
+        const socklen_t length = localSocketAddress( host, &address );
+        connectTo( ctx, (const sockaddr *)&address, length );
+        return;
+    }
 
-    struct hostent *he = gethostbyname( host.c_str() );
-    if ( !he ) {
-        log->writeError( "connect: host '%s' not found\n", host.c_str() );
+    char service[8];
+    snprintf( service, sizeof( service ), "%u", port );
+
+    struct addrinfo hints;
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *addresses = 0;
+    const int err = getaddrinfo( host.c_str(), service, &hints, &addresses );
+    if ( err != 0 ) {
+        log->writeError( "connect: host '%s' not found: %s", host.c_str(), gai_strerror( err ) );
+        scheduleReconnect( ctx );
         return;
     }
 
-    struct sockaddr_in server;
-    m_socket = ::socket( AF_INET, SOCK_STREAM, 0 );
-    server.sin_family = AF_INET;
-    memcpy( &server.sin_addr.s_addr, he->h_addr, he->h_length );
-    server.sin_port = htons( port );
+    connectTo( ctx, addresses->ai_addr, addresses->ai_addrlen );
+    freeaddrinfo( addresses );
+}
 
+void NetworkOutputPrivate::connectTo( EventContext *ctx, const sockaddr *address, socklen_t length )
+{
+    m_socket = ::socket( address->sa_family, SOCK_STREAM, 0 );
+    if ( m_socket == -1 ) {
+        log->writeError( "connect to %s: %s", host.c_str(), strerror( errno ) );
+        scheduleReconnect( ctx );
+        return;
+    }
     fcntl( m_socket, F_SETFL, fcntl( m_socket , F_GETFL ) | O_NONBLOCK );
 
-    if ( ::connect( m_socket, (const sockaddr *)&server, sizeof ( server ) ) == -1 &&
-            errno == EINPROGRESS ) {
-        watching = FileEvent::FileReadWrite;
-        EventThreadUnix::self()->postTask(
-                new AddIOObserverTask( m_socket, this, watching ) );
+    const int result = ::connect( m_socket, address, length );
+    const int connectError = errno;
 
+    if ( result == 0 || connectError == EINPROGRESS ) {
+        // Writability tells that the connection is established
         state = Connecting;
+        addObserver( ctx, FileEvent::FileReadWrite );
     } else {
-        log->writeError( "connect to %s: %s", host.c_str(), strerror( errno ) );
+        log->writeError( "connect to %s: %s", host.c_str(), strerror( connectError ) );
         ::close( m_socket );
         m_socket = -1;
+        scheduleReconnect( ctx );
     }
 }
 
@@ -177,34 +270,29 @@ void NetworkOutputPrivate::handleEvent( EventContext *ctx, Event *event )
         FileEvent *fe = (FileEvent *)event;
         if ( FileEvent::FileWrite == fe->watch ) {
             if ( Connecting == state ) {
+                int error = 0;
+                socklen_t length = sizeof( error );
+                if ( getsockopt( fe->fd, SOL_SOCKET, SO_ERROR, &error, &length ) == -1 ) {
+                    error = errno;
+                }
+                if ( error != 0 ) {
+                    log->writeError( "connect to %s: %s", host.c_str(), strerror( error ) );
+                    connectionLost( ctx );
+                    return;
+                }
                 state = Connected;
                 removeObserver( ctx, FileEvent::FileRead );
+                reconnectDelay = minimumReconnectDelay;
+                sentData = false;
+                atomicStore( &connected, 1 );
             }
-            if ( buffers.size() ) {
-                int total_written = 0;
-                BufferList::iterator e = buffers.end();
-                for ( BufferList::iterator it = buffers.begin(); it != e; ) {
-                    vector<char> *buf = *it;
-
-                    int nr = ::write( fe->fd, &(*buf)[0] + buf_pos, buf->size() - buf_pos );
-                    if ( nr <= 0 )
-                        break;
-
-                    total_written += nr;
-                    buf_pos += nr;
-                    if ( buf_pos != (ssize_t)buf->size() )
-                        break;
-
-                    delete buf;
-                    it = buffers.erase( it );
-                    buf_pos = 0;
-                }
-                if ( !total_written ) {
-                    clear(); // clears buffers, FileWrite observer below removed
-                    state = Error;
-                }
+            bool empty = true;
+            if ( !atomicLoad( &failed ) && !writeBuffer( fe->fd, &empty ) ) {
+                log->writeError( "write to %s: %s", host.c_str(), strerror( errno ) );
+                connectionLost( ctx );
+                return;
             }
-            if ( buffers.size() == 0 ) {
+            if ( empty ) {
                 removeObserver( ctx, FileEvent::FileWrite );
                 if ( Closing == state ) {
                     endClosing( ctx );
@@ -213,37 +301,108 @@ void NetworkOutputPrivate::handleEvent( EventContext *ctx, Event *event )
         } else if ( FileEvent::FileRead == fe->watch ) {
             log->writeError( "Connect error to %s %d %d",
                     host.c_str(), fe->fd, m_socket );
-            removeObserver( ctx, FileEvent::FileReadWrite );
-            clear();
-            state = Error;
+            connectionLost( ctx );
         } else if ( FileEvent::Error == fe->watch ) {
             log->writeError( "Network error to %s: %s %d",
                     host.c_str(), strerror( fe->err ), fe->fd );
-            if ( Connecting == state )
-                removeObserver( ctx, FileEvent::FileWrite );
-            clear();
-            state = Error;
-            watching = FileEvent::Error;
+            connectionLost( ctx );
         }
     } else { //TimerEventType
         if ( Closing == state ) {
             endClosing( ctx );
+        } else if ( Waiting == state ) {
+            TimerTask( this ).exec( ctx );
+            connect( ctx );
         }
     }
 }
 
-bool NetworkOutputPrivate::write( EventContext *ctx, std::vector<char>* buffer )
+void NetworkOutputPrivate::startWriting( EventContext *ctx )
 {
-    if ( state > NotConnected && state < Closing ) {
-        buffers.push_back( buffer );
+    // Otherwise the data is written once connected (or the data discarded)
+    if ( Connected == state && !atomicLoad( &failed ) ) {
         if ( !(watching & FileEvent::FileWrite ) ) {
-            buf_pos = 0;
             addObserver( ctx, FileEvent::FileWrite );
         }
-        return true;
     }
-    delete buffer;
-    return false;
+}
+
+/* Writes as much of the buffered data as the socket accepts, passing many
+ * chunks to each sendmsg call. Returns false if writing failed; otherwise
+ * empty tells whether all data was written.
+ */
+bool NetworkOutputPrivate::writeBuffer( int fd, bool *empty )
+{
+    SendBuffer::Region regions[MaximumWriteRegions];
+    struct iovec iov[MaximumWriteRegions];
+
+    *empty = sendBuffer.isEmpty();
+    while ( !*empty ) {
+        const size_t numRegions = sendBuffer.peek( regions, MaximumWriteRegions );
+        size_t size = 0;
+        for ( size_t i = 0; i < numRegions; ++i ) {
+            iov[i].iov_base = const_cast<char *>( regions[i].data );
+            iov[i].iov_len = regions[i].size;
+            size += regions[i].size;
+        }
+
+        struct msghdr msg;
+        memset( &msg, 0, sizeof( msg ) );
+        msg.msg_iov = iov;
+        msg.msg_iovlen = numRegions;
+        const ssize_t nr = ::sendmsg( fd, &msg, SendFlags );
+        if ( nr < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            sendBuffer.consume( 0 );
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        sentData = true;
+        *empty = sendBuffer.consume( nr );
+        if ( static_cast<size_t>( nr ) < size ) {
+            break; // the socket buffer is full
+        }
+    }
+    return true;
+}
+
+/* The queued data is kept for the next connection; only if some data was
+ * sent already, the NetworkOutput calling thread has to start a new stream.
+ */
+void NetworkOutputPrivate::connectionLost( EventContext *ctx )
+{
+    if ( watching != FileEvent::Error ) {
+        removeObserver( ctx, watching );
+    }
+    if ( m_socket > -1 ) {
+        ::close( m_socket );
+        m_socket = -1;
+    }
+    atomicStore( &connected, 0 );
+    if ( sentData ) {
+        atomicStore( &failed, 1 );
+        sentData = false;
+    }
+
+    if ( Closing == state ) {
+        endClosing( ctx );
+    } else {
+        scheduleReconnect( ctx );
+    }
+}
+
+/* The delay is randomized between half and all of the current reconnect
+ * delay, so that the processes tracing to a restarted server don't all
+ * reconnect at the same time.
+ */
+void NetworkOutputPrivate::scheduleReconnect( EventContext *ctx )
+{
+    state = Waiting;
+    const unsigned int delay = reconnectDelay / 2 + rand_r( &randomSeed ) % ( reconnectDelay / 2 + 1 );
+    reconnectDelay = min( reconnectDelay * 2, maximumReconnectDelay );
+    TimerTask( max( delay, 1u ), this ).exec( ctx );
 }
 
 void NetworkOutputPrivate::close()
@@ -257,33 +416,53 @@ void NetworkOutputPrivate::close()
             EventThreadUnix::processEvents( ctx );
         notify_on_close = old_notify_on_close;
     } else {
+        /* Several outputs may be closed at the same time (e.g. by threads
+         * creating a trace concurrently), so each waits on a pipe of its
+         * own rather than on the shared confirmation channel.
+         */
+        int in, out;
+        if ( pipe( closed_pipe ) == 0 ) {
+            in = closed_pipe[0];
+        } else {
+            closed_pipe[0] = closed_pipe[1] = -1;
+            EventThreadUnix::self()->commandChannels( &in, &out );
+        }
+
         EventThreadUnix::self()->postTask( new SocketClosingTask( this ) );
 
-        int in, out;
         void *response;
-        EventThreadUnix::self()->commandChannels( &in, &out );
-
-        read( in, &response, sizeof ( response ) );
+        while ( read( in, &response, sizeof ( response ) ) < 0 && errno == EINTR )
+            ;
 
+        if ( closed_pipe[0] > -1 ) {
+            ::close( closed_pipe[0] );
+            ::close( closed_pipe[1] );
+            closed_pipe[0] = closed_pipe[1] = -1;
+        }
         clear();
     }
 }
 
 void NetworkOutputPrivate::endClosing( EventContext *ctx )
 {
-    if ( watching != Error ) {
+    // Stops the closing timeout or a pending connection attempt
+    TimerTask( this ).exec( ctx );
+    if ( watching != FileEvent::Error ) {
         removeObserver( ctx, watching );
-        clear();
     }
+    clear();
+    atomicStore( &connected, 0 );
     state = NotConnected;
 
     if ( notify_on_close ) {
         int in, out;
         void *response = 0;
-        EventThreadUnix::self()->commandChannels( &in, &out );
+        if ( closed_pipe[1] > -1 ) {
+            out = closed_pipe[1];
+        } else {
+            EventThreadUnix::self()->commandChannels( &in, &out );
+        }
         ::write( out, &response, sizeof ( response ) );
-
-        TimerTask( this ).exec( ctx );
     }
 }
 
@@ -294,25 +473,31 @@ void NetworkOutputPrivate::clear()
         m_socket = -1;
         state = NotConnected;
     }
-    BufferList::iterator e = buffers.end();
-    for ( BufferList::iterator it = buffers.begin(); it != e; ) {
-        delete *it;
-        it = buffers.erase( it );
+    sendBuffer.clear();
+}
+
+
+void *ConnectTask::exec( EventContext *ctx )
+{
+    if ( NetworkOutputPrivate::NotConnected == observer->state ) {
+        observer->connect( ctx );
     }
+    return NULL;
 }
 
 
-void *WriteDataTask::exec( EventContext *ctx )
+void *StartWritingTask::exec( EventContext *ctx )
 {
-    return observer->write( ctx, data )
-        ? (void*)(long)NetworkOutputPrivate::Opened
-        : (void*)(long)NetworkOutputPrivate::Failure;
+    observer->startWriting( ctx );
+    return NULL;
 }
 
 
 void *SocketClosingTask::exec( EventContext *ctx )
 {
-    if ( observer->buffers.size() > 0 ) {
+    const bool connecting = NetworkOutputPrivate::Connecting == observer->state ||
+                            NetworkOutputPrivate::Connected == observer->state;
+    if ( connecting && !observer->sendBuffer.isEmpty() && !atomicLoad( &observer->failed ) ) {
         // try for 10s to flush remaining buffers
         observer->state = NetworkOutputPrivate::Closing;
         TimerTask( 10000, observer ).exec( ctx );
@@ -323,41 +508,238 @@ void *SocketClosingTask::exec( EventContext *ctx )
 }
 
 
+
 NetworkOutput::NetworkOutput( Log *log, const string &host, unsigned short port )
     : m_host( host ), m_port( port ), m_socket( -1 ), m_log( log ),
-    d( new NetworkOutputPrivate( host, port, log ) )
+    d( new NetworkOutputPrivate( host, port, log ) ),
+    m_maximumQueueSize( DefaultMaximumQueueSize ),
+    m_overflowPolicy( DropEntry ),
+    m_blockTimeout( DefaultBlockTimeout ),
+    m_droppedData( false ),
+    m_droppedEntries( 0 ),
+    m_streamStart( true ),
+    m_restartStream( false ),
+    m_resumeStream( false ),
+    m_minimumReconnectDelay( DefaultReconnectDelay ),
+    m_maximumReconnectDelay( DefaultMaximumReconnectDelay ),
+    m_reconnectDelay( DefaultReconnectDelay ),
+    m_nextConnectionAttempt( 0 )
 {
 }
 
+NetworkOutput::NetworkOutput( Log *log, const string &socketPath )
+    : m_host( socketPath ), m_port( 0 ), m_socket( -1 ), m_log( log ),
+    d( new NetworkOutputPrivate( socketPath, 0, log ) ),
+    m_maximumQueueSize( DefaultMaximumQueueSize ),
+    m_overflowPolicy( DropEntry ),
+    m_blockTimeout( DefaultBlockTimeout ),
+    m_droppedData( false ),
+    m_droppedEntries( 0 ),
+    m_streamStart( true ),
+    m_restartStream( false ),
+    m_resumeStream( false ),
+    m_minimumReconnectDelay( DefaultReconnectDelay ),
+    m_maximumReconnectDelay( DefaultMaximumReconnectDelay ),
+    m_reconnectDelay( DefaultReconnectDelay ),
+    m_nextConnectionAttempt( 0 )
+{
+    d->localSocket = true;
+}
+
+bool NetworkOutput::isValidSocketPath( const string &socketPath )
+{
+    return !socketPath.empty() && socketPath.size() < sizeof( ( ( struct sockaddr_un *)0 )->sun_path );
+}
+
 NetworkOutput::~NetworkOutput()
 {
     delete d;
 }
 
+/* Connecting is left to the event thread; until the connection is
+ * established, written data is just queued.
+ */
 bool NetworkOutput::open()
 {
-    if ( d->network_state == NetworkOutputPrivate::Idle )
-        d->connect();
-
-    return NetworkOutputPrivate::Opened == d->network_state;
+    if ( d->network_state == NetworkOutputPrivate::Idle ) {
+        d->minimumReconnectDelay = m_minimumReconnectDelay;
+        d->maximumReconnectDelay = m_maximumReconnectDelay;
+        d->reconnectDelay = m_minimumReconnectDelay;
+        d->network_state = NetworkOutputPrivate::Opened;
+        EventThreadUnix::self()->postTask( new ConnectTask( d ) );
+    } else if ( d->network_state == NetworkOutputPrivate::Opened && atomicLoad( &d->failed ) && !m_resumeStream ) {
+        discardBrokenStream();
+    }
+    if ( m_restartStream ) {
+        m_restartStream = false;
+        m_streamStart = true;
+    }
+    return m_resumeStream || canWrite();
 }
 
+/* Fails after losing a connection or the start of a binary stream, so that
+ * the serializer restarts its stream.
+ */
 bool NetworkOutput::canWrite() const
 {
-    return NetworkOutputPrivate::Opened == d->network_state;
-    //return d->m_socket != -1;
+    return NetworkOutputPrivate::Opened == d->network_state && !atomicLoad( &d->failed ) && !m_restartStream;
 }
 
 void NetworkOutput::write( const vector<char> &data )
 {
     if ( NetworkOutputPrivate::Opened == d->network_state ) {
-        vector<char> *buf = new vector<char>( data );
-        //buf->swap( data );
-        WriteDataTask task( d, buf );
-        d->network_state =
-            (NetworkOutputPrivate::NetworkOutputState)(long)
-            EventThreadUnix::self()->sendTask( &task );
+        if ( !makeRoom( data.size() ) ) {
+            dropEntry();
+            return;
+        }
+        if ( d->sendBuffer.append( &data[0], data.size() ) ) {
+            EventThreadUnix::self()->postTask( new StartWritingTask( d ) );
+        }
+        m_streamStart = false;
+    }
+}
+
+/* The receiver cannot decode a binary stream without its header, so the
+ * stream is restarted if the record which would have started it is lost.
+ * Otherwise, the serializer repeats its definitions with new ids (see
+ * Serializer::dataDropped()), so the binary entries queued so far don't
+ * fit the definitions it would repeat for resuming a broken stream anymore.
+ */
+void NetworkOutput::dropEntry()
+{
+    m_droppedData = true;
+    ++m_droppedEntries;
+    if ( m_binaryData ) {
+        if ( m_streamStart ) {
+            m_restartStream = true;
+        } else {
+            d->sendBuffer.markEntries();
+        }
+    }
+}
+
+void NetworkOutput::setReconnectDelay( unsigned int minimumDelay, unsigned int maximumDelay )
+{
+    m_minimumReconnectDelay = minimumDelay;
+    m_maximumReconnectDelay = max( minimumDelay, maximumDelay );
+}
+
+/* The receiver gets a new stream over the next connection, so what is left
+ * of a partially sent entry is dropped; text entries stand on their own, so
+ * the others are just sent over the new connection. Binary entries refer to
+ * what the serializer defined earlier, so those queued before it repeated
+ * its definitions with new ids (see dropEntry()) are dropped as well; the
+ * others are kept until the serializer provided what has to precede them
+ * (see prependData()). The event thread doesn't touch the queue meanwhile.
+ */
+void NetworkOutput::discardBrokenStream()
+{
+    m_droppedEntries += d->sendBuffer.dropStartedEntry();
+    if ( m_binaryData ) {
+        m_droppedEntries += d->sendBuffer.dropMarkedEntries();
+        if ( !d->sendBuffer.isEmpty() ) {
+            m_resumeStream = true;
+            return;
+        }
+    }
+
+    atomicStore( &d->failed, 0 );
+    m_streamStart = true;
+    if ( !d->sendBuffer.isEmpty() ) {
+        EventThreadUnix::self()->postTask( new StartWritingTask( d ) );
+    }
+}
+
+bool NetworkOutput::keepsQueuedData() const
+{
+    return m_resumeStream;
+}
+
+void NetworkOutput::prependData( const vector<char> &data )
+{
+    if ( !m_resumeStream ) {
+        return;
+    }
+    if ( !data.empty() ) {
+        d->sendBuffer.prepend( &data[0], data.size() );
+    }
+    m_resumeStream = false;
+    m_streamStart = false;
+
+    atomicStore( &d->failed, 0 );
+    EventThreadUnix::self()->postTask( new StartWritingTask( d ) );
+}
+
+void NetworkOutput::setQueueLimit( size_t maximumSize, OverflowPolicy policy, unsigned int blockTimeout )
+{
+    m_maximumQueueSize = maximumSize;
+    m_overflowPolicy = policy;
+    m_blockTimeout = blockTimeout;
+}
+
+/* Applies the overflow policy if queueing the given number of bytes would
+ * exceed the maximum queue size; returns false if the data has to be
+ * dropped. Only the event thread takes data off the queue, so its size
+ * cannot grow between checking and appending.
+ */
+bool NetworkOutput::makeRoom( size_t bytes )
+{
+    if ( m_maximumQueueSize == 0 || d->sendBuffer.size() + bytes <= m_maximumQueueSize ) {
+        return true;
+    }
+    if ( bytes > m_maximumQueueSize ) {
+        return false;
+    }
+
+    switch ( m_overflowPolicy ) {
+        case DropEntry:
+            break;
+        case OverwriteOldest:
+            if ( !m_binaryData ) {
+                const size_t excess = d->sendBuffer.size() + bytes - m_maximumQueueSize;
+                const size_t droppedEntries = d->sendBuffer.dropOldest( excess );
+                if ( droppedEntries > 0 ) {
+                    m_droppedData = true;
+                    m_droppedEntries += droppedEntries;
+                    return true;
+                }
+            }
+            break;
+        case BlockThread: {
+            const uint64_t deadline = now() + m_blockTimeout;
+            while ( d->sendBuffer.size() + bytes > m_maximumQueueSize ) {
+                if ( !atomicLoad( &d->connected ) || now() >= deadline ) {
+                    return false;
+                }
+                Thread::sleep( 1 );
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+bool NetworkOutput::droppedData()
+{
+    const bool dropped = m_droppedData;
+    m_droppedData = false;
+    return dropped;
+}
+
+/* Dropped entries are reported once the queue drained to half its maximum
+ * size again, so that the report itself doesn't get dropped right away.
+ */
+unsigned long NetworkOutput::takeDroppedEntryCount()
+{
+    if ( m_droppedEntries == 0 || !atomicLoad( &d->connected ) ) {
+        return 0;
+    }
+    if ( m_maximumQueueSize > 0 && d->sendBuffer.size() > m_maximumQueueSize / 2 ) {
+        return 0;
     }
+    const unsigned long count = m_droppedEntries;
+    m_droppedEntries = 0;
+    return count;
 }
 
 void NetworkOutput::close()
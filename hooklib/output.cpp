@@ -18,17 +18,250 @@
  */
 
 #include "output.h"
+#include "atomic.h"
 #include "log.h"
+#include "mutex.h"
+#include "thread.h"
+#include "timehelper.h" // for now
 
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+
+#ifdef _WIN32
+#  include <io.h>
+#  include <sys/stat.h>
+#else
+#  include <sys/uio.h>
+#  include <unistd.h>
+#endif
+
+#if HAVE_ZLIB
+#  include <zlib.h>
+#endif
+
+#include <sstream>
 
 using namespace std;
 
 TRACELIB_NAMESPACE_BEGIN
 
+static const char EntrySeparator = '\n';
+
+static void closeFile( int fd )
+{
+#ifdef _WIN32
+    _close( fd );
+#else
+    ::close( fd );
+#endif
+}
+
+/* Takes care of trace files which were rotated away: closes them, shifts
+ * the names of the files kept so far (<name>.1 being the most recent one),
+ * removes the oldest one and optionally compresses the new <name>.1.
+ */
+class FileRotator : public Thread
+{
+public:
+    FileRotator( Log *log, const string &fileName, unsigned int keptFiles,
+                 bool compressFiles );
+    virtual ~FileRotator();
+
+    // fd is -1 if the file was closed already
+    void rotate( int fd, const string &rotatedFileName );
+
+protected:
+    virtual void run();
+
+private:
+    struct Job {
+        int fd;
+        string fileName;
+    };
+
+    string keptFileName( unsigned int n ) const;
+    void process( const Job &job );
+    bool compress( const string &fileName );
+
+    Log *m_log;
+    const string m_fileName;
+    const unsigned int m_keptFiles;
+    const bool m_compressFiles;
+    Mutex m_jobsMutex;
+    vector<Job> m_jobs;
+    volatile AtomicWord m_stopRequested;
+};
+
+FileRotator::FileRotator( Log *log, const string &fileName, unsigned int keptFiles,
+                          bool compressFiles )
+    : m_log( log ),
+    m_fileName( fileName ),
+    m_keptFiles( keptFiles ),
+    m_compressFiles( compressFiles ),
+    m_stopRequested( 0 )
+{
+}
+
+// Finishes all pending rotations
+FileRotator::~FileRotator()
+{
+    atomicStore( &m_stopRequested, 1 );
+    wait();
+}
+
+void FileRotator::rotate( int fd, const string &rotatedFileName )
+{
+    Job job;
+    job.fd = fd;
+    job.fileName = rotatedFileName;
+
+    MutexLocker jobsLocker( m_jobsMutex );
+    m_jobs.push_back( job );
+}
+
+void FileRotator::run()
+{
+    while ( true ) {
+        const bool stopRequested = atomicLoad( &m_stopRequested ) != 0;
+
+        vector<Job> jobs;
+        {
+            MutexLocker jobsLocker( m_jobsMutex );
+            jobs.swap( m_jobs );
+        }
+
+        if ( jobs.empty() ) {
+            if ( stopRequested ) {
+                return;
+            }
+            Thread::sleep( 100 );
+            continue;
+        }
+
+        vector<Job>::const_iterator it, end = jobs.end();
+        for ( it = jobs.begin(); it != end; ++it ) {
+            process( *it );
+        }
+    }
+}
+
+string FileRotator::keptFileName( unsigned int n ) const
+{
+    ostringstream str;
+    str << m_fileName << "." << n;
+    return str.str();
+}
+
+void FileRotator::process( const Job &job )
+{
+    if ( job.fd != -1 ) {
+        closeFile( job.fd );
+    }
+
+    static const char * const suffixes[] = { "", ".gz" };
+    for ( size_t s = 0; s < sizeof( suffixes ) / sizeof( suffixes[0] ); ++s ) {
+        remove( ( keptFileName( m_keptFiles ) + suffixes[s] ).c_str() );
+        for ( unsigned int n = m_keptFiles - 1; n >= 1; --n ) {
+            rename( ( keptFileName( n ) + suffixes[s] ).c_str(),
+                    ( keptFileName( n + 1 ) + suffixes[s] ).c_str() );
+        }
+    }
+
+    const string newestFileName = keptFileName( 1 );
+    if ( rename( job.fileName.c_str(), newestFileName.c_str() ) != 0 ) {
+        m_log->writeError( "FileRotator: failed to rename %s to %s: %s", job.fileName.c_str(), newestFileName.c_str(), strerror( errno ) );
+        return;
+    }
+
+    if ( m_compressFiles && compress( newestFileName ) ) {
+        remove( newestFileName.c_str() );
+    }
+}
+
+// Writes <fileName>.gz, leaving the original file alone
+bool FileRotator::compress( const string &fileName )
+{
+#if HAVE_ZLIB
+    FILE *in = fopen( fileName.c_str(), "rb" );
+    if ( !in ) {
+        m_log->writeError( "FileRotator: failed to open %s for compression: %s", fileName.c_str(), strerror( errno ) );
+        return false;
+    }
+
+    const string compressedFileName = fileName + ".gz";
+    gzFile out = gzopen( compressedFileName.c_str(), "wb" );
+    if ( !out ) {
+        m_log->writeError( "FileRotator: failed to create %s", compressedFileName.c_str() );
+        fclose( in );
+        return false;
+    }
+
+    bool success = true;
+    vector<char> buf( 65536 );
+    size_t n;
+    while ( ( n = fread( &buf[0], 1, buf.size(), in ) ) > 0 ) {
+        if ( gzwrite( out, &buf[0], static_cast<unsigned int>( n ) ) != static_cast<int>( n ) ) {
+            success = false;
+            break;
+        }
+    }
+    success = gzclose( out ) == Z_OK && success && !ferror( in );
+    fclose( in );
+
+    if ( !success ) {
+        m_log->writeError( "FileRotator: failed to compress %s", fileName.c_str() );
+        remove( compressedFileName.c_str() );
+    }
+    return success;
+#else
+    return false;
+#endif
+}
+
+/* Writes the buffer of a file output once the flush interval elapsed and
+ * rotates the file once it reached the maximum age, even if the process
+ * doesn't write any trace entries meanwhile.
+ */
+class FileOutputTimer : public Thread
+{
+public:
+    explicit FileOutputTimer( FileOutput *output );
+    virtual ~FileOutputTimer();
+
+protected:
+    virtual void run();
+
+private:
+    static const unsigned int Interval = 100; // milliseconds
+
+    FileOutput *m_output;
+    volatile AtomicWord m_stopRequested;
+};
+
+FileOutputTimer::FileOutputTimer( FileOutput *output )
+    : m_output( output ),
+    m_stopRequested( 0 )
+{
+}
+
+FileOutputTimer::~FileOutputTimer()
+{
+    atomicStore( &m_stopRequested, 1 );
+    wait();
+}
+
+void FileOutputTimer::run()
+{
+    while ( atomicLoad( &m_stopRequested ) == 0 ) {
+        Thread::sleep( Interval );
+        m_output->handleTimeout();
+    }
+}
+
 Output::Output()
+    : m_binaryData( false )
 {
 }
 
@@ -38,49 +271,308 @@ Output::~Output()
 
 void StdoutOutput::write( const vector<char> &data )
 {
-    vector<char> nullTerminatedData = data;
-    nullTerminatedData.push_back( '\0' );
-    fprintf(stdout, "%s\n", &nullTerminatedData[0]);
+    if ( !data.empty() ) {
+        fwrite( &data[0], 1, data.size(), stdout );
+    }
+    if ( !m_binaryData ) {
+        fputc( EntrySeparator, stdout );
+    }
     fflush(stdout);
 }
 
 FileOutput::FileOutput( Log *log, const string& filename )
-    : m_filename( filename ), m_file( 0 ), m_log( log )
+    : m_filename( filename ), m_fd( -1 ), m_log( log ),
+    m_bufferSize( 0 ),
+    m_flushInterval( DefaultFlushInterval ),
+    m_lastFlush( 0 ),
+    m_lastWriteFailed( false ),
+    m_maximumFileSize( 0 ),
+    m_maximumFileAge( 0 ),
+    m_fileSize( 0 ),
+    m_fileOpenTime( 0 ),
+    m_rotator( 0 ),
+    m_rotationCount( 0 ),
+    m_timer( 0 ),
+    m_droppedEntries( 0 )
 {
 }
 
 FileOutput::~FileOutput()
 {
-    if( m_file ) {
-        fclose(m_file);
+    delete m_timer;
+    m_timer = 0;
+    flush();
+    if( m_fd != -1 ) {
+        closeFile( m_fd );
     }
-    m_file = 0;
+    m_fd = -1;
+    delete m_rotator;
+    m_rotator = 0;
     m_filename = "";
     m_log = 0;
 }
 
+void FileOutput::setBufferSize( size_t bytes )
+{
+    {
+        MutexLocker locker( m_mutex );
+        flushBuffer();
+        m_bufferSize = bytes;
+        m_buffer.reserve( bytes );
+    }
+    updateTimer();
+}
+
+void FileOutput::setFlushInterval( unsigned int milliseconds )
+{
+    MutexLocker locker( m_mutex );
+    m_flushInterval = milliseconds;
+}
+
+// A maximum size or age of 0 disables the respective limit
+void FileOutput::setRotation( uint64_t maximumSize, unsigned int maximumAgeInMinutes,
+                              unsigned int keptFiles, bool compressRotatedFiles )
+{
+    {
+        MutexLocker locker( m_mutex );
+        delete m_rotator;
+        m_rotator = 0;
+
+        m_maximumFileSize = maximumSize;
+        m_maximumFileAge = uint64_t( maximumAgeInMinutes ) * 60 * 1000;
+        if ( m_maximumFileSize > 0 || m_maximumFileAge > 0 ) {
+            m_rotator = new FileRotator( m_log, m_filename, keptFiles > 0 ? keptFiles : 1,
+                                         compressRotatedFiles );
+            if ( !m_rotator->start() ) {
+                m_log->writeError( "FileOutput: failed to start rotation thread, not rotating %s", m_filename.c_str() );
+                delete m_rotator;
+                m_rotator = 0;
+            }
+        }
+    }
+    updateTimer();
+}
+
+/* The timer only runs while there is something to check; it is deleted
+ * without holding the mutex since it may be waiting for it.
+ */
+void FileOutput::updateTimer()
+{
+    const bool needed = m_bufferSize > 0 || ( m_rotator && m_maximumFileAge > 0 );
+    if ( needed && !m_timer ) {
+        m_timer = new FileOutputTimer( this );
+        if ( !m_timer->start() ) {
+            m_log->writeError( "FileOutput: failed to start timer thread, buffered data of %s is only written with the next entry", m_filename.c_str() );
+            delete m_timer;
+            m_timer = 0;
+        }
+    } else if ( !needed && m_timer ) {
+        delete m_timer;
+        m_timer = 0;
+    }
+}
+
 bool FileOutput::canWrite() const
 {
-    return m_file != 0;
+    MutexLocker locker( m_mutex );
+    return m_fd != -1;
 }
 
 bool FileOutput::open()
 {
-    m_file = fopen( m_filename.c_str(), "w" );
-    if( !m_file ) {
+    MutexLocker locker( m_mutex );
+#ifdef _WIN32
+    m_fd = _open( m_filename.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE );
+#else
+    m_fd = ::open( m_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+#endif
+    if( m_fd == -1 ) {
         m_log->writeError( "Failed to open file!: %s", strerror( errno ) );
         return false;
     }
+    m_lastFlush = now();
+    m_fileOpenTime = m_lastFlush;
+    m_fileSize = 0;
     return true;
 }
 
 void FileOutput::write( const vector<char> &data )
 {
-    if( m_file ) {
-        vector<char> nullTerminatedData = data;
-        nullTerminatedData.push_back( '\0' );
-        fprintf( m_file, "%s\n", &nullTerminatedData[0] );
-        fflush( m_file );
+    MutexLocker locker( m_mutex );
+    if( m_fd == -1 ) {
+        // The timer rotated the file since the trace called canWrite()
+        ++m_droppedEntries;
+        return;
+    }
+
+    const char * const dataBegin = data.empty() ? 0 : &data[0];
+    const size_t separatorSize = m_binaryData ? 0 : 1;
+    if ( m_buffer.size() + data.size() + separatorSize <= m_bufferSize ) {
+        m_buffer.insert( m_buffer.end(), data.begin(), data.end() );
+        if ( separatorSize > 0 ) {
+            m_buffer.push_back( EntrySeparator );
+        }
+        if ( !m_timer && now() - m_lastFlush >= m_flushInterval ) {
+            flushBuffer();
+        }
+    } else {
+        // The data doesn't fit, so write it right after whatever is buffered
+        writeChunks( m_buffer.empty() ? 0 : &m_buffer[0], m_buffer.size(),
+                     dataBegin, data.size(), separatorSize );
+        m_buffer.clear();
+        m_lastFlush = now();
+    }
+
+    if ( rotationDue() ) {
+        rotate();
+    }
+}
+
+// The timer checks the maximum age unless it failed to start
+bool FileOutput::rotationDue() const
+{
+    if ( !m_rotator ) {
+        return false;
+    }
+    if ( m_maximumFileSize > 0 && m_fileSize + m_buffer.size() >= m_maximumFileSize ) {
+        return true;
+    }
+    return !m_timer && m_maximumFileAge > 0 && now() - m_fileOpenTime >= m_maximumFileAge;
+}
+
+/* Only renames the file so that the calling thread doesn't wait for the
+ * file to be closed or compressed. The new file is opened once the next
+ * entry is written; closing the output here makes the trace restart the
+ * serializer stream, so that the new file is complete on its own.
+ */
+void FileOutput::rotate()
+{
+    flushBuffer();
+
+    ostringstream str;
+    str << m_filename << ".rotating" << m_rotationCount++;
+    const string rotatedFileName = str.str();
+
+#ifdef _WIN32
+    // Open files cannot be renamed on Windows
+    closeFile( m_fd );
+    m_fd = -1;
+#endif
+    if ( rename( m_filename.c_str(), rotatedFileName.c_str() ) != 0 ) {
+        m_log->writeError( "FileOutput: failed to rotate %s: %s", m_filename.c_str(), strerror( errno ) );
+#ifdef _WIN32
+        m_fd = _open( m_filename.c_str(), _O_WRONLY | _O_APPEND | _O_BINARY );
+#endif
+        // Try again once the limit is exceeded again
+        m_fileSize = 0;
+        m_fileOpenTime = now();
+        return;
+    }
+
+    m_rotator->rotate( m_fd, rotatedFileName );
+    m_fd = -1;
+}
+
+void FileOutput::handleTimeout()
+{
+    MutexLocker locker( m_mutex );
+    if ( m_fd == -1 ) {
+        return;
+    }
+    const uint64_t t = now();
+    if ( !m_buffer.empty() && t - m_lastFlush >= m_flushInterval ) {
+        flushBuffer();
+    }
+    if ( m_rotator && m_maximumFileAge > 0 && t - m_fileOpenTime >= m_maximumFileAge ) {
+        rotate();
+    }
+}
+
+unsigned long FileOutput::takeDroppedEntryCount()
+{
+    MutexLocker locker( m_mutex );
+    const unsigned long count = m_droppedEntries;
+    m_droppedEntries = 0;
+    return count;
+}
+
+void FileOutput::flush()
+{
+    MutexLocker locker( m_mutex );
+    flushBuffer();
+}
+
+void FileOutput::flushBuffer()
+{
+    if ( m_fd == -1 || m_buffer.empty() ) {
+        return;
+    }
+    writeChunks( &m_buffer[0], m_buffer.size(), 0, 0, 0 );
+    m_buffer.clear();
+    m_lastFlush = now();
+}
+
+/* Writes the buffered data followed by the given data and, if separatorSize
+ * is not zero, the entry separator with as few system calls as possible.
+ * Partial writes are continued; data which could not be written is dropped.
+ */
+void FileOutput::writeChunks( const char *buffered, size_t bufferedSize,
+                              const char *data, size_t dataSize,
+                              size_t separatorSize )
+{
+    struct Chunk {
+        const char *data;
+        size_t size;
+    } chunks[] = {
+        { buffered, bufferedSize },
+        { data, dataSize },
+        { &EntrySeparator, separatorSize }
+    };
+    const size_t numChunks = sizeof( chunks ) / sizeof( chunks[0] );
+
+    size_t first = 0;
+    while ( first < numChunks ) {
+        if ( chunks[first].size == 0 ) {
+            ++first;
+            continue;
+        }
+
+#ifdef _WIN32
+        const int written = _write( m_fd, chunks[first].data, static_cast<unsigned int>( chunks[first].size ) );
+#else
+        iovec iov[numChunks];
+        int iovCount = 0;
+        for ( size_t i = first; i < numChunks; ++i ) {
+            if ( chunks[i].size > 0 ) {
+                iov[iovCount].iov_base = const_cast<char *>( chunks[i].data );
+                iov[iovCount].iov_len = chunks[i].size;
+                ++iovCount;
+            }
+        }
+        const ssize_t written = ::writev( m_fd, iov, iovCount );
+#endif
+        if ( written < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            if ( !m_lastWriteFailed ) {
+                m_log->writeError( "FileOutput: failed to write to %s: %s", m_filename.c_str(), strerror( errno ) );
+                m_lastWriteFailed = true;
+            }
+            return;
+        }
+        m_lastWriteFailed = false;
+        m_fileSize += written;
+
+        size_t remaining = static_cast<size_t>( written );
+        while ( first < numChunks && remaining >= chunks[first].size ) {
+            remaining -= chunks[first].size;
+            ++first;
+        }
+        if ( first < numChunks ) {
+            chunks[first].data += remaining;
+            chunks[first].size -= remaining;
+        }
     }
 }
 
@@ -97,6 +589,46 @@ void MultiplexingOutput::write( const vector<char> &data )
     }
 }
 
+void MultiplexingOutput::flush()
+{
+    vector<Output *>::const_iterator it, end = m_outputs.end();
+    for ( it = m_outputs.begin(); it != end; ++it ) {
+        ( *it )->flush();
+    }
+}
+
+void MultiplexingOutput::setBinaryData( bool binaryData )
+{
+    Output::setBinaryData( binaryData );
+    vector<Output *>::const_iterator it, end = m_outputs.end();
+    for ( it = m_outputs.begin(); it != end; ++it ) {
+        ( *it )->setBinaryData( binaryData );
+    }
+}
+
+// Asks every output so that none keeps its flag for the next call
+bool MultiplexingOutput::droppedData()
+{
+    bool dropped = false;
+    vector<Output *>::const_iterator it, end = m_outputs.end();
+    for ( it = m_outputs.begin(); it != end; ++it ) {
+        if ( ( *it )->droppedData() ) {
+            dropped = true;
+        }
+    }
+    return dropped;
+}
+
+unsigned long MultiplexingOutput::takeDroppedEntryCount()
+{
+    unsigned long count = 0;
+    vector<Output *>::const_iterator it, end = m_outputs.end();
+    for ( it = m_outputs.begin(); it != end; ++it ) {
+        count += ( *it )->takeDroppedEntryCount();
+    }
+    return count;
+}
+
 MultiplexingOutput::~MultiplexingOutput()
 {
     vector<Output *>::const_iterator it, end = m_outputs.end();
@@ -21,6 +21,8 @@
 #define TRACELIB_OUTPUT_H
 
 #include "tracelib_config.h"
+#include "config.h" // for uint64_t
+#include "mutex.h"
 
 #include <stdio.h>
 #include <string>
@@ -28,6 +30,8 @@
 
 TRACELIB_NAMESPACE_BEGIN
 
+class FileOutputTimer;
+class FileRotator;
 class Log;
 class NetworkOutputPrivate;
 
@@ -40,9 +44,37 @@ public:
     virtual bool canWrite() const { return true; }
     virtual void write( const std::vector<char> &data ) = 0;
 
+    // Writes any data which the output might have buffered
+    virtual void flush() { }
+
+    /* Outputs which are meant to be read by humans put each (textual) trace
+     * entry on a line of its own; binary data is written as it is.
+     */
+    virtual void setBinaryData( bool binaryData ) { m_binaryData = binaryData; }
+
+    /* Outputs which may drop data instead of writing it (e.g. because the
+     * receiver doesn't keep up) tell whether they did so since the last
+     * call, so that serializers can repeat what the dropped data defined.
+     */
+    virtual bool droppedData() { return false; }
+
+    /* Returns the number of trace entries dropped since the last report
+     * once the output is able to deliver a report about them.
+     */
+    virtual unsigned long takeDroppedEntryCount() { return 0; }
+
+    /* Outputs which keep the data queued for a stream which broke tell so
+     * after being opened again; that data is then sent over the new stream,
+     * preceded by the given data (see Serializer::resumeStream()).
+     */
+    virtual bool keepsQueuedData() const { return false; }
+    virtual void prependData( const std::vector<char> &data ) { }
+
 protected:
     Output();
 
+    bool m_binaryData;
+
 private:
     Output( const Output &rhs );
     void operator=( const Output &other );
@@ -54,18 +86,158 @@ public:
     virtual void write( const std::vector<char> &data );
 };
 
+/* Trace entries are collected in a buffer of the given size (if any) which
+ * is written once it is full, once the flush interval elapsed, and whenever
+ * the trace explicitly flushes the output (e.g. for Error entries and
+ * crashes).
+ *
+ * If rotation is enabled, the file is renamed once it exceeds the maximum
+ * size or age and a new one is started with the next entry. Closing,
+ * renaming and compressing the old files happens in a background thread.
+ *
+ * The flush interval and the maximum age are checked by a timer thread, so
+ * that they apply while no entries are written as well; the mutex protects
+ * the buffer and the file against it.
+ */
 class FileOutput : public Output
 {
+    friend class FileOutputTimer;
+
+    mutable Mutex m_mutex;
     std::string m_filename;
-    FILE* m_file;
+    int m_fd;
     Log *m_log;
+    std::vector<char> m_buffer;
+    size_t m_bufferSize;
+    unsigned int m_flushInterval;
+    uint64_t m_lastFlush;
+    bool m_lastWriteFailed;
+    uint64_t m_maximumFileSize;
+    uint64_t m_maximumFileAge;
+    uint64_t m_fileSize;
+    uint64_t m_fileOpenTime;
+    FileRotator *m_rotator;
+    unsigned int m_rotationCount;
+    FileOutputTimer *m_timer;
+    unsigned long m_droppedEntries;
+
+    void writeChunks( const char *buffered, size_t bufferedSize,
+                      const char *data, size_t dataSize,
+                      size_t separatorSize );
+    void flushBuffer();
+    bool rotationDue() const;
+    void rotate();
+    void updateTimer();
+    void handleTimeout();
+
 public:
+    static const unsigned int DefaultFlushInterval = 1000; // milliseconds
+    static const unsigned int DefaultKeptFiles = 5;
+
     FileOutput( Log *erroLog, const std::string& filename );
     virtual ~FileOutput();
+    void setBufferSize( size_t bytes );
+    void setFlushInterval( unsigned int milliseconds );
+    void setRotation( uint64_t maximumSize, unsigned int maximumAgeInMinutes,
+                      unsigned int keptFiles, bool compressRotatedFiles );
+    virtual void write( const std::vector<char> &data );
+    virtual void flush();
+    virtual bool open();
+    virtual bool canWrite() const;
+    virtual unsigned long takeDroppedEntryCount();
+};
+
+/* Writes trace entries into a file of fixed size which is mapped into
+ * memory and used as a ring buffer (see mappedfileformat.h), so writing an
+ * entry is just a copy. Since the kernel owns the mapped pages, the most
+ * recent entries survive a crash of the process and can be extracted using
+ * the recovertrace tool. An existing file of the same size is continued.
+ */
+class MappedFileOutput : public Output
+{
+    std::string m_filename;
+    Log *m_log;
+    uint64_t m_capacity;
+    char *m_mapping;
+    char *m_data;
+    uint64_t m_writePosition;
+    bool m_lastWriteFailed;
+#ifdef _WIN32
+    void *m_fileHandle;
+    void *m_mappingHandle;
+#else
+    int m_fd;
+#endif
+
+    void copyToData( uint64_t position, const char *data, size_t size );
+    void close();
+
+public:
+    static const uint64_t DefaultSize = 4 * 1024 * 1024; // bytes
+    static const uint64_t MinimumSize = 4096;
+
+    MappedFileOutput( Log *log, const std::string &filename, uint64_t size );
+    virtual ~MappedFileOutput();
+
+    virtual bool open();
+    virtual bool canWrite() const;
     virtual void write( const std::vector<char> &data );
+    virtual void setBinaryData( bool binaryData );
+};
+
+#ifndef _WIN32
+/* Passes trace entries to a trace server on the same machine through a POSIX
+ * shared memory segment created by the server (see sharedmemoryformat.h).
+ * Writing an entry copies it into a ring buffer of which this process is the
+ * only writer; the server is only woken up (using a futex on Linux) if it
+ * is waiting for data. Entries are dropped if the ring buffer is full or no
+ * server has created the segment yet; in the latter case, opening the segment
+ * is retried after the reconnect delay. If the server is restarted, it
+ * continues reading the segment and the stream is restarted.
+ */
+class SharedMemoryOutput : public Output
+{
+    std::string m_name;
+    Log *m_log;
+    char *m_mapping;
+    uint64_t m_mappingSize;
+    unsigned int m_slot;
+    unsigned int m_slotGeneration;
+    uint64_t m_slotSize;
+    char *m_data;
+    uint64_t m_writePosition;
+    unsigned int m_serverPid;
+    unsigned int m_serverGeneration;
+    unsigned int m_pid;
+    bool m_streamStart;
+    bool m_restartStream;
+    bool m_droppedData;
+    unsigned long m_droppedEntries;
+    bool m_lastOpenFailed;
+    bool m_lastWriteFailed;
+    uint64_t m_nextOpenAttempt;
+
+    bool mapSegment();
+    void close();
+    void copyToData( uint64_t position, const char *data, size_t size );
+    void wakeServer();
+    void dropEntry();
+
+public:
+    static const unsigned int DefaultReconnectDelay = 1000; // milliseconds
+
+    SharedMemoryOutput( Log *log, const std::string &name );
+    virtual ~SharedMemoryOutput();
+
+    static bool isValidName( const std::string &name );
+
     virtual bool open();
     virtual bool canWrite() const;
+    virtual void write( const std::vector<char> &data );
+    virtual bool droppedData();
+    virtual unsigned long takeDroppedEntryCount();
 };
+#endif
 
 class MultiplexingOutput : public Output
 {
@@ -75,29 +247,94 @@ public:
     void addOutput( Output *output );
 
     virtual void write( const std::vector<char> &data );
+    virtual void flush();
+    virtual void setBinaryData( bool binaryData );
+    virtual bool droppedData();
+    virtual unsigned long takeDroppedEntryCount();
 
 private:
     std::vector<Output *> m_outputs;
 };
 
+/* On Unix, data is queued and sent by the event thread. The queue is limited
+ * to a maximum size (if any); once that is reached, the overflow policy
+ * decides whether the new entry is dropped, the oldest queued entries are
+ * dropped (which falls back to dropping the new entry for binary data since
+ * later entries may refer to what earlier ones defined) or the writing
+ * thread waits for the queue to drain for up to the block timeout.
+ *
+ * Failed connections are retried; the delay between two attempts starts at
+ * the minimum reconnect delay and doubles (up to the maximum) with every
+ * failed attempt. On Unix, the event thread resolves the host name and
+ * connects, so writing never waits for the network; entries written in the
+ * meantime stay queued and are sent once the connection is up again. If a
+ * connection breaks after data was sent over it, the queued entries go to
+ * the next connection as well (binary ones preceded by whatever they refer
+ * to); only the entry which was partially sent is lost.
+ *
+ * On Unix, the output may also connect to a local trace server using a Unix
+ * domain socket, which saves the overhead of TCP over the loopback device.
+ */
 class NetworkOutput : public Output
 {
+public:
+    enum OverflowPolicy {
+        DropEntry,
+        OverwriteOldest,
+        BlockThread
+    };
+
+private:
     std::string m_host;
     unsigned short m_port;
     int m_socket;
     Log *m_log;
     NetworkOutputPrivate *d;
-    bool m_lastConnectionAttemptFailed;
+    size_t m_maximumQueueSize;
+    OverflowPolicy m_overflowPolicy;
+    unsigned int m_blockTimeout;
+    bool m_droppedData;
+    unsigned long m_droppedEntries;
+    bool m_streamStart;
+    bool m_restartStream;
+    bool m_resumeStream;
+    unsigned int m_minimumReconnectDelay;
+    unsigned int m_maximumReconnectDelay;
+    unsigned int m_reconnectDelay;
+    uint64_t m_nextConnectionAttempt;
 
     void close();
+    bool makeRoom( size_t bytes );
+    void dropEntry();
+    void discardBrokenStream();
 
 public:
+    static const size_t DefaultMaximumQueueSize = 16 * 1024 * 1024; // bytes
+    static const unsigned int DefaultBlockTimeout = 1000; // milliseconds
+    static const unsigned int DefaultReconnectDelay = 500; // milliseconds
+    static const unsigned int DefaultMaximumReconnectDelay = 30000; // milliseconds
+
     NetworkOutput( Log *log, const std::string &remoteHost, unsigned short remotePort );
+#ifndef _WIN32
+    /* Connects to the Unix domain socket with the given path; on Linux, a
+     * path starting with '@' names a socket in the abstract namespace.
+     */
+    NetworkOutput( Log *log, const std::string &socketPath );
+
+    static bool isValidSocketPath( const std::string &socketPath );
+#endif
     virtual ~NetworkOutput();
 
+    void setQueueLimit( size_t maximumSize, OverflowPolicy policy, unsigned int blockTimeout );
+    void setReconnectDelay( unsigned int minimumDelay, unsigned int maximumDelay );
+
     virtual bool open();
     virtual bool canWrite() const;
     virtual void write( const std::vector<char> &data );
+    virtual bool droppedData();
+    virtual unsigned long takeDroppedEntryCount();
+    virtual bool keepsQueuedData() const;
+    virtual void prependData( const std::vector<char> &data );
 };
 
 TRACELIB_NAMESPACE_END
@@ -0,0 +1,314 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sendbuffer.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include <algorithm>
+
+using namespace std;
+
+TRACELIB_NAMESPACE_BEGIN
+
+SendBuffer::SendBuffer()
+    : m_spareChunk( 0 ),
+    m_size( 0 ),
+    m_markedEntries( 0 ),
+    m_frontEntryStarted( false ),
+    m_inFlight( 0 )
+{
+}
+
+SendBuffer::~SendBuffer()
+{
+    clear();
+    if ( m_spareChunk ) {
+        delete [] m_spareChunk->data;
+        delete m_spareChunk;
+    }
+}
+
+// Reuses the last released chunk, so a steady stream of data needs no allocations
+SendBuffer::Chunk *SendBuffer::newChunk( size_t minimumCapacity )
+{
+    Chunk *chunk;
+    if ( m_spareChunk && m_spareChunk->capacity >= minimumCapacity ) {
+        chunk = m_spareChunk;
+        m_spareChunk = 0;
+    } else {
+        chunk = new Chunk;
+        chunk->capacity = minimumCapacity > ChunkSize ? minimumCapacity : ChunkSize;
+        chunk->data = new char[chunk->capacity];
+    }
+    chunk->readPos = 0;
+    chunk->writePos = 0;
+    return chunk;
+}
+
+void SendBuffer::releaseChunk( Chunk *chunk )
+{
+    if ( !m_spareChunk && chunk->capacity == ChunkSize ) {
+        m_spareChunk = chunk;
+        return;
+    }
+    delete [] chunk->data;
+    delete chunk;
+}
+
+bool SendBuffer::append( const char *data, size_t size )
+{
+    MutexLocker locker( m_mutex );
+    const bool wasEmpty = m_size == 0;
+    m_size += size;
+    m_entrySizes.push_back( size );
+
+    if ( !m_chunks.empty() ) {
+        Chunk *last = m_chunks.back();
+        const size_t n = min( size, last->capacity - last->writePos );
+        memcpy( last->data + last->writePos, data, n );
+        last->writePos += n;
+        data += n;
+        size -= n;
+    }
+
+    if ( size > 0 ) {
+        Chunk *chunk = newChunk( size );
+        memcpy( chunk->data, data, size );
+        chunk->writePos = size;
+        m_chunks.push_back( chunk );
+    }
+    return wasEmpty;
+}
+
+bool SendBuffer::isEmpty() const
+{
+    MutexLocker locker( m_mutex );
+    return m_size == 0;
+}
+
+size_t SendBuffer::size() const
+{
+    MutexLocker locker( m_mutex );
+    return m_size;
+}
+
+size_t SendBuffer::peek( Region *regions, size_t maxRegions ) const
+{
+    MutexLocker locker( m_mutex );
+    size_t n = 0;
+    m_inFlight = 0;
+    deque<Chunk *>::const_iterator it, end = m_chunks.end();
+    for ( it = m_chunks.begin(); it != end && n < maxRegions; ++it ) {
+        if ( ( *it )->writePos > ( *it )->readPos ) {
+            regions[n].data = ( *it )->data + ( *it )->readPos;
+            regions[n].size = ( *it )->writePos - ( *it )->readPos;
+            m_inFlight += regions[n].size;
+            ++n;
+        }
+    }
+    return n;
+}
+
+/* Also ends writing the regions which were peeked at, so the consumer calls
+ * this even if it couldn't write anything.
+ */
+bool SendBuffer::consume( size_t bytes )
+{
+    MutexLocker locker( m_mutex );
+    assert( bytes <= m_size );
+    m_inFlight = 0;
+    discard( bytes );
+
+    while ( bytes > 0 ) {
+        if ( bytes < m_entrySizes.front() ) {
+            m_entrySizes.front() -= bytes;
+            m_frontEntryStarted = true;
+            break;
+        }
+        bytes -= m_entrySizes.front();
+        m_entrySizes.pop_front();
+        m_frontEntryStarted = false;
+        if ( m_markedEntries > 0 ) {
+            --m_markedEntries;
+        }
+    }
+    return m_size == 0;
+}
+
+// Expects the mutex to be locked
+void SendBuffer::discard( size_t bytes )
+{
+    m_size -= bytes;
+    while ( bytes > 0 ) {
+        Chunk *chunk = m_chunks.front();
+        const size_t n = min( bytes, chunk->writePos - chunk->readPos );
+        chunk->readPos += n;
+        bytes -= n;
+        if ( chunk->readPos == chunk->writePos && ( chunk->writePos == chunk->capacity || m_size == 0 ) ) {
+            m_chunks.pop_front();
+            releaseChunk( chunk );
+        }
+    }
+}
+
+/* Copies bytes within the buffer; the offsets are relative to the first
+ * byte not sent yet. Expects the mutex to be locked.
+ */
+void SendBuffer::copyBytes( size_t from, size_t to, size_t length )
+{
+    size_t fromChunk = 0;
+    size_t toChunk = 0;
+    from += m_chunks[0]->readPos;
+    to += m_chunks[0]->readPos;
+    while ( from >= m_chunks[fromChunk]->writePos ) {
+        from -= m_chunks[fromChunk++]->writePos;
+    }
+    while ( to >= m_chunks[toChunk]->writePos ) {
+        to -= m_chunks[toChunk++]->writePos;
+    }
+
+    while ( length > 0 ) {
+        const size_t n = min( length, min( m_chunks[fromChunk]->writePos - from,
+                                           m_chunks[toChunk]->writePos - to ) );
+        memcpy( m_chunks[toChunk]->data + to, m_chunks[fromChunk]->data + from, n );
+        length -= n;
+        from += n;
+        to += n;
+        if ( from == m_chunks[fromChunk]->writePos ) {
+            ++fromChunk;
+            from = 0;
+        }
+        if ( to == m_chunks[toChunk]->writePos ) {
+            ++toChunk;
+            to = 0;
+        }
+    }
+}
+
+/* If the first entry was sent partially, its remaining bytes are moved to
+ * the end of the dropped entries, which are then discarded from the front.
+ */
+size_t SendBuffer::dropOldest( size_t bytes )
+{
+    MutexLocker locker( m_mutex );
+    if ( m_inFlight > 0 ) {
+        return 0;
+    }
+
+    const size_t first = m_frontEntryStarted ? 1 : 0;
+    const size_t kept = m_frontEntryStarted ? m_entrySizes.front() : 0;
+    size_t freed = 0;
+    size_t count = 0;
+    while ( ( freed < bytes || freed < kept ) && first + count < m_entrySizes.size() ) {
+        freed += m_entrySizes[first + count];
+        ++count;
+    }
+    if ( freed < bytes || freed < kept ) {
+        return 0;
+    }
+
+    if ( kept > 0 ) {
+        copyBytes( 0, freed, kept );
+    }
+    discard( freed );
+    m_entrySizes.erase( m_entrySizes.begin() + first, m_entrySizes.begin() + first + count );
+    if ( m_markedEntries > first ) {
+        m_markedEntries -= min( m_markedEntries - first, count );
+    }
+    return count;
+}
+
+size_t SendBuffer::dropStartedEntry()
+{
+    MutexLocker locker( m_mutex );
+    if ( !m_frontEntryStarted ) {
+        return 0;
+    }
+    discard( m_entrySizes.front() );
+    m_entrySizes.pop_front();
+    m_frontEntryStarted = false;
+    if ( m_markedEntries > 0 ) {
+        --m_markedEntries;
+    }
+    return 1;
+}
+
+void SendBuffer::markEntries()
+{
+    MutexLocker locker( m_mutex );
+    m_markedEntries = m_entrySizes.size();
+}
+
+size_t SendBuffer::dropMarkedEntries()
+{
+    MutexLocker locker( m_mutex );
+    const size_t count = m_markedEntries;
+    if ( count == 0 ) {
+        return 0;
+    }
+    size_t bytes = 0;
+    for ( size_t i = 0; i < count; ++i ) {
+        bytes += m_entrySizes[i];
+    }
+    discard( bytes );
+    m_entrySizes.erase( m_entrySizes.begin(), m_entrySizes.begin() + count );
+    m_markedEntries = 0;
+    m_frontEntryStarted = false;
+    return count;
+}
+
+/* The chunk is used for the given data only; it counts as full, so that
+ * appended data doesn't end up in front of the data queued before.
+ */
+void SendBuffer::prepend( const char *data, size_t size )
+{
+    MutexLocker locker( m_mutex );
+    assert( !m_frontEntryStarted && m_inFlight == 0 );
+    Chunk *chunk = newChunk( size );
+    memcpy( chunk->data, data, size );
+    chunk->writePos = size;
+    chunk->capacity = size;
+    m_chunks.push_front( chunk );
+    m_entrySizes.push_front( size );
+    m_size += size;
+}
+
+size_t SendBuffer::entryCount() const
+{
+    MutexLocker locker( m_mutex );
+    return m_entrySizes.size();
+}
+
+void SendBuffer::clear()
+{
+    MutexLocker locker( m_mutex );
+    while ( !m_chunks.empty() ) {
+        releaseChunk( m_chunks.front() );
+        m_chunks.pop_front();
+    }
+    m_size = 0;
+    m_entrySizes.clear();
+    m_markedEntries = 0;
+    m_frontEntryStarted = false;
+    m_inFlight = 0;
+}
+
+TRACELIB_NAMESPACE_END
@@ -0,0 +1,123 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACELIB_SENDBUFFER_H
+#define TRACELIB_SENDBUFFER_H
+
+#include "tracelib_config.h"
+#include "mutex.h"
+
+#include <stddef.h>
+#include <deque>
+
+TRACELIB_NAMESPACE_BEGIN
+
+/* A queue of bytes waiting to be sent, stored in chunks of ChunkSize bytes
+ * (larger pieces of data get a chunk of their own size). Any number of
+ * threads may append data; a single consumer thread takes the data off the
+ * front. Since chunks never move, the consumer can write the regions it
+ * peeked at without holding the lock while producers keep appending.
+ *
+ * Each appended piece of data is an entry; when the buffer grows too large,
+ * the oldest entries can be dropped without ever cutting one in two.
+ */
+class SendBuffer
+{
+public:
+    static const size_t ChunkSize = 64 * 1024;
+
+    struct Region
+    {
+        const char *data;
+        size_t size;
+    };
+
+    SendBuffer();
+    ~SendBuffer();
+
+    // Returns true if the buffer was empty before
+    bool append( const char *data, size_t size );
+
+    bool isEmpty() const;
+    size_t size() const;
+
+    /* Fills in the regions holding the first (up to maxRegions) chunks of
+     * data; returns the number of regions filled in.
+     */
+    size_t peek( Region *regions, size_t maxRegions ) const;
+
+    // Returns true if the buffer is empty after removing the bytes
+    bool consume( size_t bytes );
+
+    /* Drops the oldest entries which weren't (partially) sent yet such that
+     * at least the given number of bytes is freed; returns the number of
+     * entries dropped. Nothing is dropped (and zero is returned) if not
+     * enough bytes can be freed, or while the consumer is writing the
+     * regions it peeked at.
+     */
+    size_t dropOldest( size_t bytes );
+
+    // Drops what is left of the first entry if it was sent partially
+    size_t dropStartedEntry();
+
+    /* Marks the entries queued so far, so that dropMarkedEntries() can drop
+     * those of them which weren't sent completely by then.
+     */
+    void markEntries();
+    size_t dropMarkedEntries();
+
+    /* Puts the data in front of the queued data as an entry of its own;
+     * expects the consumer not to have started sending the first entry.
+     */
+    void prepend( const char *data, size_t size );
+
+    size_t entryCount() const;
+
+    void clear();
+
+private:
+    SendBuffer( const SendBuffer &other ); // disabled
+    void operator=( const SendBuffer &rhs ); // disabled
+
+    struct Chunk
+    {
+        char *data;
+        size_t capacity;
+        size_t readPos;
+        size_t writePos;
+    };
+
+    Chunk *newChunk( size_t minimumCapacity );
+    void releaseChunk( Chunk *chunk );
+    void discard( size_t bytes );
+    void copyBytes( size_t from, size_t to, size_t length );
+
+    mutable Mutex m_mutex;
+    std::deque<Chunk *> m_chunks;
+    Chunk *m_spareChunk;
+    size_t m_size;
+    std::deque<size_t> m_entrySizes; // not yet sent bytes per entry
+    size_t m_markedEntries; // at the front of m_entrySizes
+    bool m_frontEntryStarted;
+    mutable size_t m_inFlight; // bytes peeked at but not consumed yet
+};
+
+TRACELIB_NAMESPACE_END
+
+#endif // !defined(TRACELIB_SENDBUFFER_H)
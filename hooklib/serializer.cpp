@@ -18,12 +18,13 @@
  */
 
 #include "serializer.h"
+#include "binaryformat.h"
 #include "trace.h"
 #include "tracepoint.h"
 #include "configuration.h"
 #include "timehelper.h" // for timeToString
 
-#include <string.h> // for strlen
+#include <string.h> // for strlen, memcpy
 
 #include <sstream>
 
@@ -307,5 +308,353 @@ string XMLSerializer::convertVariable( const char *n, const VariableValue &v ) c
     return str.str();
 }
 
-TRACELIB_NAMESPACE_END
+namespace {
+
+/* Appends little endian encoded values to a buffer; records are started
+ * with beginRecord() and their length is filled in by endRecord().
+ */
+class RecordWriter
+{
+public:
+    explicit RecordWriter( vector<char> &buf ) : m_buf( buf ), m_recordStart( 0 ) { }
+
+    void beginRecord( BinaryFormat::RecordType type ) {
+        m_recordStart = m_buf.size();
+        writeUInt32( 0 );
+        writeUInt8( type );
+    }
+
+    void endRecord() {
+        const uint64_t length = m_buf.size() - m_recordStart - 4;
+        for ( int i = 0; i < 4; ++i ) {
+            m_buf[m_recordStart + i] = static_cast<char>( ( length >> ( 8 * i ) ) & 0xff );
+        }
+    }
+
+    void writeUInt8( unsigned int v ) {
+        m_buf.push_back( static_cast<char>( v & 0xff ) );
+    }
+
+    void writeUInt16( unsigned int v ) {
+        writeLittleEndian( v, 2 );
+    }
+
+    void writeUInt32( uint64_t v ) {
+        writeLittleEndian( v, 4 );
+    }
+
+    void writeUInt64( uint64_t v ) {
+        writeLittleEndian( v, 8 );
+    }
+
+    void writeDouble( double v ) {
+        uint64_t bits;
+        memcpy( &bits, &v, sizeof( bits ) );
+        writeUInt64( bits );
+    }
+
+    void writeString( const char *s, size_t len ) {
+        writeUInt32( len );
+        m_buf.insert( m_buf.end(), s, s + len );
+    }
+
+    void writeString( const char *s ) {
+        writeString( s, strlen( s ) );
+    }
+
+    void writeString( const string &s ) {
+        writeString( s.data(), s.size() );
+    }
+
+    void writeBytes( const char *data, size_t len ) {
+        m_buf.insert( m_buf.end(), data, data + len );
+    }
+
+private:
+    void writeLittleEndian( uint64_t v, int bytes ) {
+        for ( int i = 0; i < bytes; ++i ) {
+            m_buf.push_back( static_cast<char>( ( v >> ( 8 * i ) ) & 0xff ) );
+        }
+    }
+
+    vector<char> &m_buf;
+    size_t m_recordStart;
+};
+
+}
+
+static bool operator==( const TraceKey &a, const TraceKey &b )
+{
+    return a.enabled == b.enabled && a.name == b.name;
+}
+
+BinarySerializer::BinarySerializer()
+    : m_streamStarted( false ),
+    m_processRecordOutdated( true ),
+    m_writeBacktraceAddresses( false )
+{
+}
+
+void BinarySerializer::setStorageConfiguration( const StorageConfiguration &cfg )
+{
+    m_cfg = cfg;
+    m_processRecordOutdated = true;
+}
+
+void BinarySerializer::restartStream()
+{
+    m_streamStarted = false;
+    m_processRecordOutdated = true;
+    m_tracePointIds.clear();
+    m_moduleIds.clear();
+}
+
+/* Trace point and module ids are assigned anew; the receiver replaces its
+ * definitions for ids which it saw before.
+ */
+void BinarySerializer::dataDropped()
+{
+    m_processRecordOutdated = true;
+    m_tracePointIds.clear();
+    m_moduleIds.clear();
+}
+
+void BinarySerializer::writeStreamHeader( vector<char> &buf )
+{
+    RecordWriter writer( buf );
+    writer.writeBytes( BinaryFormat::Magic, BinaryFormat::MagicSize );
+    writer.writeUInt16( BinaryFormat::Version );
+    m_streamStarted = true;
+}
+
+void BinarySerializer::writeProcessRecord( vector<char> &buf )
+{
+    static const string myProcessName = Configuration::currentProcessName();
+
+    RecordWriter writer( buf );
+    writer.beginRecord( BinaryFormat::ProcessRecord );
+    writer.writeUInt64( TraceEntry::process.id );
+    writer.writeUInt64( TraceEntry::process.startTime );
+    writer.writeString( myProcessName );
+    m_writtenTraceKeys = TraceEntry::process.availableTraceKeys;
+    writer.writeUInt32( m_writtenTraceKeys.size() );
+    vector<TraceKey>::const_iterator it, end = m_writtenTraceKeys.end();
+    for ( it = m_writtenTraceKeys.begin(); it != end; ++it ) {
+        writer.writeUInt8( it->enabled ? 1 : 0 );
+        writer.writeString( it->name );
+    }
+    writer.writeUInt64( m_cfg.maximumTraceSize );
+    writer.writeUInt16( m_cfg.shrinkPercentage );
+    writer.writeString( m_cfg.archiveDirectoryName );
+    writer.endRecord();
+
+    m_processRecordOutdated = false;
+}
+
+/* The ids are assigned in ascending order and only reset all at once, so
+ * they can be repeated in the same order for resuming a stream.
+ */
+vector<char> BinarySerializer::resumeStream()
+{
+    vector<char> buf;
+    writeStreamHeader( buf );
+    writeProcessRecord( buf );
+
+    vector<const TracePoint *> tracePoints( m_tracePointIds.size() );
+    map<const TracePoint *, unsigned int>::const_iterator tpIt, tpEnd = m_tracePointIds.end();
+    for ( tpIt = m_tracePointIds.begin(); tpIt != tpEnd; ++tpIt ) {
+        tracePoints[tpIt->second - 1] = tpIt->first;
+    }
+    for ( size_t i = 0; i < tracePoints.size(); ++i ) {
+        writeTracePointRecord( buf, tracePoints[i], i + 1 );
+    }
 
+    vector<const ModuleInfo *> modules( m_moduleIds.size() );
+    map<const ModuleInfo *, unsigned int>::const_iterator moduleIt, moduleEnd = m_moduleIds.end();
+    for ( moduleIt = m_moduleIds.begin(); moduleIt != moduleEnd; ++moduleIt ) {
+        modules[moduleIt->second - 1] = moduleIt->first;
+    }
+    for ( size_t i = 0; i < modules.size(); ++i ) {
+        writeModuleRecord( buf, modules[i], i + 1 );
+    }
+
+    return buf;
+}
+
+void BinarySerializer::writeTracePointRecord( vector<char> &buf, const TracePoint *tracePoint, unsigned int id )
+{
+    RecordWriter writer( buf );
+    writer.beginRecord( BinaryFormat::TracePointRecord );
+    writer.writeUInt32( id );
+    writer.writeUInt8( tracePoint->type );
+    writer.writeUInt32( tracePoint->lineno );
+    writer.writeString( tracePoint->sourceFile );
+    writer.writeString( tracePoint->functionName );
+    writer.writeUInt8( tracePoint->groupName ? 1 : 0 );
+    if ( tracePoint->groupName ) {
+        writer.writeString( tracePoint->groupName );
+    }
+    writer.endRecord();
+}
+
+void BinarySerializer::writeModuleRecord( vector<char> &buf, const ModuleInfo *module, unsigned int id )
+{
+    RecordWriter writer( buf );
+    writer.beginRecord( BinaryFormat::ModuleRecord );
+    writer.writeUInt32( id );
+    writer.writeUInt64( module->base );
+    writer.writeString( module->fileName );
+    writer.writeString( module->buildId );
+    writer.endRecord();
+}
+
+// Writes a module record the first time a module is referred to
+unsigned int BinarySerializer::moduleId( vector<char> &buf, const ModuleInfo *module )
+{
+    if ( !module ) {
+        return 0;
+    }
+
+    const map<const ModuleInfo *, unsigned int>::const_iterator it = m_moduleIds.find( module );
+    if ( it != m_moduleIds.end() ) {
+        return it->second;
+    }
+
+    const unsigned int id = m_moduleIds.size() + 1;
+    m_moduleIds[module] = id;
+    writeModuleRecord( buf, module, id );
+    return id;
+}
+
+vector<char> BinarySerializer::serialize( const TraceEntry &entry )
+{
+    vector<char> buf;
+    buf.reserve( 128 );
+
+    if ( !m_streamStarted ) {
+        writeStreamHeader( buf );
+    }
+
+    if ( m_processRecordOutdated || !( entry.process.availableTraceKeys == m_writtenTraceKeys ) ) {
+        writeProcessRecord( buf );
+    }
+
+    unsigned int tracePointId;
+    const map<const TracePoint *, unsigned int>::const_iterator it = m_tracePointIds.find( entry.tracePoint );
+    if ( it != m_tracePointIds.end() ) {
+        tracePointId = it->second;
+    } else {
+        tracePointId = m_tracePointIds.size() + 1;
+        m_tracePointIds[entry.tracePoint] = tracePointId;
+        writeTracePointRecord( buf, entry.tracePoint, tracePointId );
+    }
+
+    unsigned int flags = 0;
+    if ( entry.message ) {
+        flags |= BinaryFormat::HasMessage;
+    }
+    if ( entry.variables ) {
+        flags |= BinaryFormat::HasVariables;
+    }
+    const bool writeAddresses = entry.backtrace && m_writeBacktraceAddresses && !entry.backtrace->isResolved();
+    if ( writeAddresses ) {
+        flags |= BinaryFormat::HasAddressBacktrace;
+    } else if ( entry.backtrace ) {
+        flags |= BinaryFormat::HasBacktrace;
+    }
+
+    // Module records have to precede the trace entry record
+    vector<unsigned int> frameModuleIds;
+    if ( writeAddresses ) {
+        m_frameModules.clear();
+        BacktraceGenerator::findModules( entry.backtrace->addresses(), m_frameModules );
+        frameModuleIds.reserve( m_frameModules.size() );
+        for ( size_t i = 0; i < m_frameModules.size(); ++i ) {
+            frameModuleIds.push_back( moduleId( buf, m_frameModules[i] ) );
+        }
+    }
+
+    RecordWriter writer( buf );
+    writer.beginRecord( BinaryFormat::TraceEntryRecord );
+    writer.writeUInt32( tracePointId );
+    writer.writeUInt64( entry.threadId );
+    writer.writeUInt64( entry.timeStamp );
+    writer.writeUInt64( entry.stackPosition );
+    writer.writeUInt8( flags );
+
+    if ( entry.message ) {
+        writer.writeString( entry.message );
+    }
+
+    if ( entry.variables ) {
+        writer.writeUInt32( entry.variables->size() );
+        for ( size_t i = 0; i < entry.variables->size(); ++i ) {
+            AbstractVariable *v = (*entry.variables)[i];
+            const VariableValue value = v->value();
+            writer.writeString( v->name() );
+            writer.writeUInt8( value.type() );
+            switch ( value.type() ) {
+                case VariableType::String:
+                    writer.writeString( value.asString() );
+                    break;
+                case VariableType::Number:
+                    writer.writeUInt8( value.isSignedNumber() ? 1 : 0 );
+                    writer.writeUInt64( value.asNumber() );
+                    break;
+                case VariableType::Float:
+                    writer.writeDouble( static_cast<double>( value.asFloat() ) );
+                    break;
+                case VariableType::Boolean:
+                    writer.writeUInt8( value.asBoolean() ? 1 : 0 );
+                    break;
+                default:
+                    assert( !"Unreachable" );
+            }
+        }
+    }
+
+    if ( writeAddresses ) {
+        const vector<void *> &addresses = entry.backtrace->addresses();
+        writer.writeUInt32( addresses.size() );
+        for ( size_t i = 0; i < addresses.size(); ++i ) {
+            const size_t address = reinterpret_cast<size_t>( addresses[i] );
+            writer.writeUInt32( frameModuleIds[i] );
+            writer.writeUInt64( m_frameModules[i] ? address - m_frameModules[i]->base : address );
+        }
+    } else if ( entry.backtrace ) {
+        writer.writeUInt32( entry.backtrace->depth() );
+        for ( size_t i = 0; i < entry.backtrace->depth(); ++i ) {
+            const StackFrame &frame = entry.backtrace->frame( i );
+            writer.writeString( frame.module );
+            writer.writeString( frame.function );
+            writer.writeUInt64( frame.functionOffset );
+            writer.writeString( frame.sourceFile );
+            writer.writeUInt32( frame.lineNumber );
+        }
+    }
+    writer.endRecord();
+
+    return buf;
+}
+
+vector<char> BinarySerializer::serialize( const ProcessShutdownEvent &ev )
+{
+    static const string myProcessName = Configuration::currentProcessName();
+
+    vector<char> buf;
+    if ( !m_streamStarted ) {
+        writeStreamHeader( buf );
+    }
+
+    RecordWriter writer( buf );
+    writer.beginRecord( BinaryFormat::ShutdownRecord );
+    writer.writeUInt64( ev.process->id );
+    writer.writeUInt64( ev.process->startTime );
+    writer.writeUInt64( ev.shutdownTime );
+    writer.writeString( myProcessName );
+    writer.endRecord();
+
+    return buf;
+}
+
+TRACELIB_NAMESPACE_END
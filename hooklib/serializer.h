@@ -22,6 +22,7 @@
 
 #include "tracelib_config.h"
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -29,7 +30,9 @@
 
 TRACELIB_NAMESPACE_BEGIN
 
+struct ModuleInfo;
 struct TraceEntry;
+struct TracePoint;
 struct ProcessShutdownEvent;
 class VariableValue;
 
@@ -43,6 +46,33 @@ public:
 
     virtual void setStorageConfiguration( const StorageConfiguration &cfg ) { }
 
+    /* Called whenever the output starts a new stream (e.g. after connecting
+     * to the server), so serializers which refer to data written earlier
+     * know that they need to repeat it.
+     */
+    virtual void restartStream() { }
+
+    /* Called whenever the output dropped data instead of writing it; unlike
+     * after restartStream(), the stream goes on, but whatever the dropped
+     * data defined has to be repeated.
+     */
+    virtual void dataDropped() { }
+
+    /* Called instead of restartStream() if the output keeps the data which
+     * it queued for a broken stream and sends it over a new one; returns
+     * what has to precede that data (e.g. a stream header and whatever the
+     * data may refer to). Unlike restartStream(), the state is kept.
+     */
+    virtual std::vector<char> resumeStream() { return std::vector<char>(); }
+
+    // Text formats get separated by newlines when written to files
+    virtual bool isBinary() const { return false; }
+
+    /* Serializers which write the return addresses of backtraces rather
+     * than stack frames don't need the backtraces resolved.
+     */
+    virtual bool writesBacktraceAddresses() const { return false; }
+
 protected:
     Serializer();
 
@@ -87,6 +117,44 @@ private:
     StorageConfiguration m_cfg;
 };
 
+class BinarySerializer : public Serializer
+{
+public:
+    BinarySerializer();
+
+    virtual std::vector<char> serialize( const TraceEntry &entry );
+    virtual std::vector<char> serialize( const ProcessShutdownEvent &ev );
+
+    virtual void setStorageConfiguration( const StorageConfiguration &cfg );
+    virtual void restartStream();
+    virtual void dataDropped();
+    virtual std::vector<char> resumeStream();
+    virtual bool isBinary() const { return true; }
+    virtual bool writesBacktraceAddresses() const { return m_writeBacktraceAddresses; }
+
+    /* Makes backtraces which were not resolved yet (see the 'deferred'
+     * backtraces of trace point sets) get written as addresses, leaving it
+     * to the server to resolve them.
+     */
+    void setWriteBacktraceAddresses( bool enabled ) { m_writeBacktraceAddresses = enabled; }
+
+private:
+    void writeStreamHeader( std::vector<char> &buf );
+    void writeProcessRecord( std::vector<char> &buf );
+    void writeTracePointRecord( std::vector<char> &buf, const TracePoint *tracePoint, unsigned int id );
+    void writeModuleRecord( std::vector<char> &buf, const ModuleInfo *module, unsigned int id );
+    unsigned int moduleId( std::vector<char> &buf, const ModuleInfo *module );
+
+    bool m_streamStarted;
+    bool m_processRecordOutdated;
+    bool m_writeBacktraceAddresses;
+    StorageConfiguration m_cfg;
+    std::vector<TraceKey> m_writtenTraceKeys;
+    std::map<const TracePoint *, unsigned int> m_tracePointIds;
+    std::map<const ModuleInfo *, unsigned int> m_moduleIds;
+    std::vector<const ModuleInfo *> m_frameModules;
+};
+
 TRACELIB_NAMESPACE_END
 
 #endif // !defined(TRACELIB_SERIALIZER_H)
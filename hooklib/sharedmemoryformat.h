@@ -0,0 +1,163 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACELIB_SHAREDMEMORYFORMAT_H
+#define TRACELIB_SHAREDMEMORYFORMAT_H
+
+#include "tracelib_config.h"
+#include "config.h" // for uint64_t
+
+TRACELIB_NAMESPACE_BEGIN
+
+/* Layout of the POSIX shared memory segment through which the
+ * SharedMemoryOutput passes trace entries to the trace server, which creates
+ * the segment.
+ *
+ * The segment consists of a Header, an array of slotCount SlotHeaders and
+ * the data areas of the slots, slotSize bytes each. A traced process claims
+ * a free slot by changing its ownerPid from 0 to its process id; the slot's
+ * data area is then used as a ring buffer with this process as the only
+ * writer and the server as the only reader. Positions count the bytes
+ * written since the slot was last freed; byte n is stored at offset
+ * n % slotSize of the data area.
+ *
+ * Each trace entry is stored as a record consisting of a RecordHeader and the
+ * data. A record is only published by advancing writePosition after it was
+ * copied completely, so a process dying while writing leaves no partial
+ * record behind. The server advances readPosition after consuming records.
+ *
+ * The first record written after claiming a slot or after the server
+ * changed (i.e. serverPid or serverGeneration changed) has the StreamStart
+ * flag set and begins a new stream, to be decoded on its own. Records which
+ * can be decoded without the preceding ones (text entries) have the
+ * SyncPoint flag set; a server taking over a segment skips the records up to
+ * the next one with either flag since it cannot decode binary data without
+ * the preceding definitions.
+ *
+ * A slot is freed by the server once its owner set the released flag or
+ * died: the remaining records are consumed, the positions and the flag are
+ * reset and finally ownerPid is set to 0.
+ *
+ * The server sets serverWaiting before waiting for wakeupSequence to change
+ * (a futex on Linux); processes only increment it and wake the server if
+ * serverWaiting is set, so writing a record does not need any system call
+ * while the server keeps up.
+ *
+ * All integers are stored in the byte order of the machine and accessed
+ * using the atomic helpers below.
+ */
+namespace SharedMemoryFormat
+{
+    static const char Magic[4] = { '\x89', 'T', 'L', 'S' };
+    static const unsigned short Version = 1;
+
+    enum Flags {
+        Closed = 0x0001 // segment was replaced by a new one, reopen it
+    };
+
+    struct Header {
+        char magic[4];
+        unsigned short version;
+        volatile unsigned short flags;
+        unsigned int headerSize;
+        unsigned int slotCount;
+        uint64_t slotSize;
+        volatile unsigned int serverPid;
+        volatile unsigned int serverGeneration;
+        volatile unsigned int serverWaiting;
+        volatile unsigned int wakeupSequence;
+        char padding[24];
+    };
+
+    struct SlotHeader {
+        volatile unsigned int ownerPid;
+        volatile unsigned int generation; // incremented whenever claimed
+        volatile uint64_t writePosition;
+        volatile uint64_t readPosition;
+        volatile unsigned int released; // set by the owner when it is done
+        char padding[36]; // keep slots in separate cache lines
+    };
+
+    enum RecordFlags {
+        StreamStart = 0x0001,
+        SyncPoint = 0x0002
+    };
+
+    struct RecordHeader {
+        unsigned int length;
+        unsigned int flags;
+    };
+
+    static const unsigned int HeaderSize = sizeof( Header );
+    static const unsigned int SlotHeaderSize = sizeof( SlotHeader );
+    static const unsigned int RecordHeaderSize = sizeof( RecordHeader );
+
+    inline uint64_t segmentSize( unsigned int slotCount, uint64_t slotSize )
+    {
+        return HeaderSize + ( SlotHeaderSize + slotSize ) * slotCount;
+    }
+
+    inline SlotHeader *slotHeader( char *segment, unsigned int slot )
+    {
+        return reinterpret_cast<SlotHeader *>( segment + HeaderSize ) + slot;
+    }
+
+    inline char *slotData( char *segment, unsigned int slotCount, uint64_t slotSize, unsigned int slot )
+    {
+        return segment + HeaderSize + SlotHeaderSize * slotCount + slotSize * slot;
+    }
+
+    /* The segment is shared between processes, so the fields above are
+     * accessed with explicit barriers; the same compiler builtins as in
+     * atomic.h, but usable on the fixed-size fields of the segment.
+     */
+    template <typename T>
+    inline T load( const volatile T *v )
+    {
+        return __atomic_load_n( v, __ATOMIC_ACQUIRE );
+    }
+
+    template <typename T>
+    inline void store( volatile T *v, T value )
+    {
+        __atomic_store_n( v, value, __ATOMIC_RELEASE );
+    }
+
+    template <typename T>
+    inline T fetchAdd( volatile T *v, T delta )
+    {
+        return __atomic_fetch_add( v, delta, __ATOMIC_SEQ_CST );
+    }
+
+    template <typename T>
+    inline bool compareAndSwap( volatile T *v, T expected, T desired )
+    {
+        return __atomic_compare_exchange_n( v, &expected, desired, false,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+    }
+
+    inline void fullFence()
+    {
+        __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    }
+}
+
+TRACELIB_NAMESPACE_END
+
+#endif // !defined(TRACELIB_SHAREDMEMORYFORMAT_H)
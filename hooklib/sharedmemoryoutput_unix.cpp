@@ -0,0 +1,336 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "output.h"
+#include "log.h"
+#include "sharedmemoryformat.h"
+#include "timehelper.h"
+
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+TRACELIB_NAMESPACE_BEGIN
+
+using namespace SharedMemoryFormat;
+
+static string segmentName( const string &name )
+{
+    return name[0] == '/' ? name : '/' + name;
+}
+
+static bool isValidHeader( const Header *header, uint64_t size )
+{
+    return memcmp( header->magic, Magic, sizeof( Magic ) ) == 0 &&
+           header->version == Version &&
+           header->headerSize == HeaderSize &&
+           header->slotCount > 0 &&
+           segmentSize( header->slotCount, header->slotSize ) == size;
+}
+
+SharedMemoryOutput::SharedMemoryOutput( Log *log, const string &name )
+    : m_name( segmentName( name ) ),
+    m_log( log ),
+    m_mapping( 0 ),
+    m_mappingSize( 0 ),
+    m_slot( 0 ),
+    m_slotGeneration( 0 ),
+    m_slotSize( 0 ),
+    m_data( 0 ),
+    m_writePosition( 0 ),
+    m_serverPid( 0 ),
+    m_serverGeneration( 0 ),
+    m_pid( static_cast<unsigned int>( getpid() ) ),
+    m_streamStart( true ),
+    m_restartStream( false ),
+    m_droppedData( false ),
+    m_droppedEntries( 0 ),
+    m_lastOpenFailed( false ),
+    m_lastWriteFailed( false ),
+    m_nextOpenAttempt( 0 )
+{
+}
+
+SharedMemoryOutput::~SharedMemoryOutput()
+{
+    close();
+}
+
+/* POSIX only guarantees portable behaviour for names consisting of a
+ * leading slash followed by characters other than slashes.
+ */
+bool SharedMemoryOutput::isValidName( const string &name )
+{
+    const string s = segmentName( name );
+    return s.size() > 1 && s.size() < NAME_MAX && s.find( '/', 1 ) == string::npos;
+}
+
+/* Writing stops as soon as the server marked the segment as replaced, freed
+ * the slot (i.e. considers this process dead), stopped or a new server took
+ * over the segment; in the latter two cases the stream is restarted in the
+ * same slot, so that the next server can decode everything from there on.
+ */
+bool SharedMemoryOutput::canWrite() const
+{
+    if ( !m_mapping || m_restartStream ) {
+        return false;
+    }
+    const Header *header = reinterpret_cast<const Header *>( m_mapping );
+    const SlotHeader *slot = slotHeader( m_mapping, m_slot );
+    return ( load( &header->flags ) & Closed ) == 0 &&
+           load( &slot->ownerPid ) == m_pid &&
+           load( &slot->generation ) == m_slotGeneration &&
+           load( &header->serverPid ) == m_serverPid &&
+           load( &header->serverGeneration ) == m_serverGeneration;
+}
+
+bool SharedMemoryOutput::open()
+{
+    if ( m_mapping ) {
+        const Header *header = reinterpret_cast<const Header *>( m_mapping );
+        const SlotHeader *slot = slotHeader( m_mapping, m_slot );
+        if ( ( load( &header->flags ) & Closed ) == 0 &&
+             load( &slot->ownerPid ) == m_pid &&
+             load( &slot->generation ) == m_slotGeneration ) {
+            m_serverPid = load( &header->serverPid );
+            m_serverGeneration = load( &header->serverGeneration );
+            m_restartStream = false;
+            m_streamStart = true;
+            return true;
+        }
+        close();
+    }
+
+    if ( now() < m_nextOpenAttempt ) {
+        return false;
+    }
+    if ( !mapSegment() ) {
+        m_nextOpenAttempt = now() + DefaultReconnectDelay;
+        m_lastOpenFailed = true;
+        return false;
+    }
+    m_lastOpenFailed = false;
+    m_restartStream = false;
+    m_streamStart = true;
+    return true;
+}
+
+bool SharedMemoryOutput::mapSegment()
+{
+    const int fd = shm_open( m_name.c_str(), O_RDWR, 0 );
+    if ( fd == -1 ) {
+        if ( !m_lastOpenFailed ) {
+            m_log->writeError( "SharedMemoryOutput: failed to open shared memory segment %s: %s", m_name.c_str(), strerror( errno ) );
+        }
+        return false;
+    }
+
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    if ( fstat( fd, &st ) == 0 && static_cast<uint64_t>( st.st_size ) >= HeaderSize ) {
+        mapping = mmap( 0, static_cast<size_t>( st.st_size ), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0 );
+    }
+    ::close( fd ); // the mapping stays valid
+    if ( mapping == MAP_FAILED ) {
+        if ( !m_lastOpenFailed ) {
+            m_log->writeError( "SharedMemoryOutput: failed to map shared memory segment %s: %s", m_name.c_str(), strerror( errno ) );
+        }
+        return false;
+    }
+    m_mapping = static_cast<char *>( mapping );
+    m_mappingSize = static_cast<uint64_t>( st.st_size );
+
+    Header *header = reinterpret_cast<Header *>( m_mapping );
+    if ( !isValidHeader( header, m_mappingSize ) || ( load( &header->flags ) & Closed ) != 0 ) {
+        if ( !m_lastOpenFailed ) {
+            m_log->writeError( "SharedMemoryOutput: %s is not a shared memory segment created by a compatible trace server", m_name.c_str() );
+        }
+        close();
+        return false;
+    }
+
+    unsigned int slot = 0;
+    while ( slot < header->slotCount && !compareAndSwap( &slotHeader( m_mapping, slot )->ownerPid, 0u, m_pid ) ) {
+        ++slot;
+    }
+    if ( slot == header->slotCount ) {
+        if ( !m_lastOpenFailed ) {
+            m_log->writeError( "SharedMemoryOutput: all %u slots of shared memory segment %s are in use", header->slotCount, m_name.c_str() );
+        }
+        close();
+        return false;
+    }
+
+    SlotHeader *slotHdr = slotHeader( m_mapping, slot );
+    m_slot = slot;
+    m_slotGeneration = fetchAdd( &slotHdr->generation, 1u ) + 1;
+    m_slotSize = header->slotSize;
+    m_data = slotData( m_mapping, header->slotCount, m_slotSize, slot );
+    m_writePosition = load( &slotHdr->writePosition );
+    m_serverPid = load( &header->serverPid );
+    m_serverGeneration = load( &header->serverGeneration );
+    m_log->writeStatus( "SharedMemoryOutput: writing to slot %u of shared memory segment %s", slot, m_name.c_str() );
+    return true;
+}
+
+/* The slot is handed back to the server, which consumes the remaining
+ * records before freeing it.
+ */
+void SharedMemoryOutput::close()
+{
+    if ( !m_mapping ) {
+        return;
+    }
+    if ( m_data ) {
+        SlotHeader *slot = slotHeader( m_mapping, m_slot );
+        if ( load( &slot->ownerPid ) == m_pid && load( &slot->generation ) == m_slotGeneration ) {
+            store( &slot->released, 1u );
+            wakeServer();
+        }
+    }
+    munmap( m_mapping, static_cast<size_t>( m_mappingSize ) );
+    m_mapping = 0;
+    m_mappingSize = 0;
+    m_data = 0;
+}
+
+void SharedMemoryOutput::copyToData( uint64_t position, const char *data, size_t size )
+{
+    const size_t offset = static_cast<size_t>( position % m_slotSize );
+    const size_t firstPart = offset + size <= m_slotSize ? size : static_cast<size_t>( m_slotSize - offset );
+    memcpy( m_data + offset, data, firstPart );
+    if ( firstPart < size ) {
+        memcpy( m_data, data + firstPart, size - firstPart );
+    }
+}
+
+/* The fence orders publishing the record before reading serverWaiting; the
+ * server does the opposite before it goes to sleep, so either it sees the
+ * new record or this process sees that it needs to be woken up.
+ */
+void SharedMemoryOutput::wakeServer()
+{
+    Header *header = reinterpret_cast<Header *>( m_mapping );
+    fullFence();
+    if ( load( &header->serverWaiting ) ) {
+        fetchAdd( &header->wakeupSequence, 1u );
+#ifdef __linux__
+        syscall( SYS_futex, &header->wakeupSequence, FUTEX_WAKE, INT_MAX, 0, 0, 0 );
+#endif
+    }
+}
+
+/* The server cannot decode a binary stream without its header, so the
+ * stream is restarted if the record which would have started it is lost.
+ */
+void SharedMemoryOutput::dropEntry()
+{
+    m_droppedData = true;
+    ++m_droppedEntries;
+    if ( m_streamStart && m_binaryData ) {
+        m_restartStream = true;
+    }
+}
+
+void SharedMemoryOutput::write( const vector<char> &data )
+{
+    if ( !m_data ) {
+        return;
+    }
+
+    const uint64_t recordSize = RecordHeaderSize + data.size();
+    if ( recordSize > m_slotSize ) {
+        if ( !m_lastWriteFailed ) {
+            m_log->writeError( "SharedMemoryOutput: dropping trace entry of %lu bytes which does not fit into a slot of %s", static_cast<unsigned long>( data.size() ), m_name.c_str() );
+            m_lastWriteFailed = true;
+        }
+        dropEntry();
+        return;
+    }
+
+    Header *header = reinterpret_cast<Header *>( m_mapping );
+    SlotHeader *slot = slotHeader( m_mapping, m_slot );
+    if ( m_writePosition + recordSize - load( &slot->readPosition ) > m_slotSize ) {
+        if ( !m_lastWriteFailed ) {
+            // The slot keeps the queued entries for the next server
+            const unsigned int serverPid = load( &header->serverPid );
+            if ( serverPid == 0 || ( kill( static_cast<pid_t>( serverPid ), 0 ) == -1 && errno == ESRCH ) ) {
+                m_log->writeError( "SharedMemoryOutput: no trace server is reading %s; dropping trace entries until one is started", m_name.c_str() );
+            } else {
+                m_log->writeError( "SharedMemoryOutput: trace server does not keep up with reading %s; dropping trace entries", m_name.c_str() );
+            }
+            m_lastWriteFailed = true;
+        }
+        dropEntry();
+        return;
+    }
+
+    RecordHeader record;
+    record.length = static_cast<unsigned int>( data.size() );
+    record.flags = ( m_streamStart ? StreamStart : 0 ) | ( m_binaryData ? 0 : SyncPoint );
+    copyToData( m_writePosition, reinterpret_cast<const char *>( &record ), RecordHeaderSize );
+    if ( !data.empty() ) {
+        copyToData( m_writePosition + RecordHeaderSize, &data[0], data.size() );
+    }
+    m_writePosition += recordSize;
+    store( &slot->writePosition, m_writePosition );
+    m_streamStart = false;
+
+    wakeServer();
+}
+
+bool SharedMemoryOutput::droppedData()
+{
+    const bool dropped = m_droppedData;
+    m_droppedData = false;
+    return dropped;
+}
+
+/* Dropped entries are reported once the slot drained to half its size
+ * again, so that the report itself doesn't get dropped right away.
+ */
+unsigned long SharedMemoryOutput::takeDroppedEntryCount()
+{
+    if ( m_droppedEntries == 0 || !m_data ) {
+        return 0;
+    }
+    const SlotHeader *slot = slotHeader( m_mapping, m_slot );
+    if ( m_writePosition - load( &slot->readPosition ) > m_slotSize / 2 ) {
+        return 0;
+    }
+    const unsigned long count = m_droppedEntries;
+    m_droppedEntries = 0;
+    m_lastWriteFailed = false;
+    return count;
+}
+
+TRACELIB_NAMESPACE_END
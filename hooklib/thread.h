@@ -0,0 +1,80 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACELIB_THREAD_H
+#define TRACELIB_THREAD_H
+
+#include "tracelib_config.h"
+
+TRACELIB_NAMESPACE_BEGIN
+
+struct ThreadHandle;
+struct ThreadLocalSlotHandle;
+
+class Thread
+{
+public:
+    virtual ~Thread();
+
+    bool start();
+    void wait();
+
+    static void sleep( unsigned int milliseconds );
+    static void yield();
+
+protected:
+    Thread();
+
+    virtual void run() = 0;
+
+private:
+    friend struct ThreadHandle;
+
+    Thread( const Thread &other ); // disabled
+    void operator=( const Thread &rhs ); // disabled
+
+    ThreadHandle *m_handle;
+};
+
+/* Stores one pointer per thread. If an exit handler is given, it is called
+ * with the stored pointer when a thread which set a non-null value
+ * terminates.
+ */
+class ThreadLocalSlot
+{
+public:
+    typedef void (*ExitHandler)( void *value );
+
+    explicit ThreadLocalSlot( ExitHandler exitHandler = 0 );
+    ~ThreadLocalSlot();
+
+    void *value() const;
+    void setValue( void *value );
+
+private:
+    ThreadLocalSlot( const ThreadLocalSlot &other ); // disabled
+    void operator=( const ThreadLocalSlot &rhs ); // disabled
+
+    ThreadLocalSlotHandle *m_handle;
+};
+
+TRACELIB_NAMESPACE_END
+
+#endif // !defined(TRACELIB_THREAD_H)
+
@@ -0,0 +1,121 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "thread.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+
+TRACELIB_NAMESPACE_BEGIN
+
+struct ThreadHandle {
+    ThreadHandle() : running( false ) { }
+
+    static void *entryPoint( void *arg );
+
+    pthread_t thread;
+    bool running;
+};
+
+struct ThreadLocalSlotHandle {
+    pthread_key_t key;
+};
+
+void *ThreadHandle::entryPoint( void *arg )
+{
+    /* Don't let our helper threads handle any signals; they should be
+     * delivered to the threads of the traced application.
+     */
+    sigset_t signals;
+    sigfillset( &signals );
+    pthread_sigmask( SIG_BLOCK, &signals, NULL );
+
+    static_cast<Thread *>( arg )->run();
+    return NULL;
+}
+
+Thread::Thread()
+    : m_handle( new ThreadHandle )
+{
+}
+
+Thread::~Thread()
+{
+    wait();
+    delete m_handle;
+}
+
+bool Thread::start()
+{
+    if ( m_handle->running ) {
+        return true;
+    }
+    m_handle->running = pthread_create( &m_handle->thread, NULL, ThreadHandle::entryPoint, this ) == 0;
+    return m_handle->running;
+}
+
+void Thread::wait()
+{
+    if ( m_handle->running ) {
+        pthread_join( m_handle->thread, NULL );
+        m_handle->running = false;
+    }
+}
+
+void Thread::sleep( unsigned int milliseconds )
+{
+    struct timespec ts;
+    ts.tv_sec = milliseconds / 1000;
+    ts.tv_nsec = ( milliseconds % 1000 ) * 1000000L;
+    while ( nanosleep( &ts, &ts ) == -1 && errno == EINTR )
+        ;
+}
+
+void Thread::yield()
+{
+    sched_yield();
+}
+
+ThreadLocalSlot::ThreadLocalSlot( ExitHandler exitHandler )
+    : m_handle( new ThreadLocalSlotHandle )
+{
+    pthread_key_create( &m_handle->key, exitHandler );
+}
+
+ThreadLocalSlot::~ThreadLocalSlot()
+{
+    pthread_key_delete( m_handle->key );
+    delete m_handle;
+}
+
+void *ThreadLocalSlot::value() const
+{
+    return pthread_getspecific( m_handle->key );
+}
+
+void ThreadLocalSlot::setValue( void *value )
+{
+    pthread_setspecific( m_handle->key, value );
+}
+
+TRACELIB_NAMESPACE_END
+
@@ -0,0 +1,109 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "thread.h"
+
+#include <windows.h>
+
+TRACELIB_NAMESPACE_BEGIN
+
+struct ThreadHandle {
+    ThreadHandle() : thread( NULL ) { }
+
+    static DWORD WINAPI entryPoint( LPVOID arg );
+
+    HANDLE thread;
+};
+
+struct ThreadLocalSlotHandle {
+    DWORD index;
+};
+
+DWORD WINAPI ThreadHandle::entryPoint( LPVOID arg )
+{
+    static_cast<Thread *>( arg )->run();
+    return 0;
+}
+
+Thread::Thread()
+    : m_handle( new ThreadHandle )
+{
+}
+
+Thread::~Thread()
+{
+    wait();
+    delete m_handle;
+}
+
+bool Thread::start()
+{
+    if ( m_handle->thread ) {
+        return true;
+    }
+    m_handle->thread = ::CreateThread( NULL, 0, ThreadHandle::entryPoint, this, 0, NULL );
+    return m_handle->thread != NULL;
+}
+
+void Thread::wait()
+{
+    if ( m_handle->thread ) {
+        ::WaitForSingleObject( m_handle->thread, INFINITE );
+        ::CloseHandle( m_handle->thread );
+        m_handle->thread = NULL;
+    }
+}
+
+void Thread::sleep( unsigned int milliseconds )
+{
+    ::Sleep( milliseconds );
+}
+
+void Thread::yield()
+{
+    ::SwitchToThread();
+}
+
+/* Fiber local storage is used instead of thread local storage since only
+ * the former supports a callback which is invoked when a thread exits.
+ */
+ThreadLocalSlot::ThreadLocalSlot( ExitHandler exitHandler )
+    : m_handle( new ThreadLocalSlotHandle )
+{
+    m_handle->index = ::FlsAlloc( reinterpret_cast<PFLS_CALLBACK_FUNCTION>( exitHandler ) );
+}
+
+ThreadLocalSlot::~ThreadLocalSlot()
+{
+    ::FlsFree( m_handle->index );
+    delete m_handle;
+}
+
+void *ThreadLocalSlot::value() const
+{
+    return ::FlsGetValue( m_handle->index );
+}
+
+void ThreadLocalSlot::setValue( void *value )
+{
+    ::FlsSetValue( m_handle->index, value );
+}
+
+TRACELIB_NAMESPACE_END
+
@@ -18,20 +18,28 @@
  */
 
 #include "trace.h"
+#include "asyncwriter.h"
 #include "configuration.h"
 #include "crashhandler.h"
 #include "filter.h"
+#include "flightrecorder.h"
 #include "output.h"
 #include "serializer.h"
 #include "tracepoint.h"
 #include "log.h"
+#include "thread.h" // for Thread::yield
 #include "tracelib.h" // for deleteRange
 #include "timehelper.h" // for now
 
+#include <cstdio>
 #include <cstdlib>
 #include <ctime>
 #include <iostream>
 
+#ifdef _WIN32
+#define snprintf _snprintf
+#endif
+
 using namespace std;
 
 TRACELIB_NAMESPACE_BEGIN
@@ -55,7 +63,11 @@ static void recordCrashInTrace()
                           functionName.c_str(), 0 );
     TraceEntry te( &tp, "The application crashed at this point!" );
     te.backtrace = bt;
-    getActiveTrace()->addEntry( te );
+
+    Trace *trace = getActiveTrace();
+    trace->flushQueuedEntries( false );
+    trace->dumpFlightRecorder( false );
+    trace->addEntry( te );
 
 }
 
@@ -63,9 +75,11 @@ const struct CrashHandlerInstaller {
     CrashHandlerInstaller() { installCrashHandler( recordCrashInTrace ); }
 } g_crashHandlerInstaller;
 
-TracePointSet::TracePointSet( Filter *filter, unsigned int actions )
+TracePointSet::TracePointSet( Filter *filter, unsigned int actions,
+                              const EntryLimits &limits )
     : m_filter( filter ),
-    m_actions( actions )
+    m_actions( actions ),
+    m_limits( limits )
 {
 }
 
@@ -101,10 +115,24 @@ TraceEntry::TraceEntry( const TracePoint *tracePoint_, const char *msg )
     variables( 0 ),
     backtrace( 0 ),
     message( msg ),
+    deferredMessage( 0 ),
     stackPosition( reinterpret_cast<size_t>( &stackPosition ) )
 {
 }
 
+TraceEntry::TraceEntry( const TracePoint *tracePoint_, const char *msg,
+                        ThreadId threadId_, uint64_t timeStamp_, size_t stackPosition_ )
+    : threadId( threadId_ ),
+    timeStamp( timeStamp_ ),
+    tracePoint( tracePoint_ ),
+    variables( 0 ),
+    backtrace( 0 ),
+    message( msg ),
+    deferredMessage( 0 ),
+    stackPosition( stackPosition_ )
+{
+}
+
 TraceEntry::~TraceEntry()
 {
     // variables are deleted on the caller side of the macros so the delete happens with the
@@ -112,6 +140,42 @@ TraceEntry::~TraceEntry()
     delete backtrace;
 }
 
+/* The configuration which is used to decide which trace points are active.
+ * It is never modified once published, so any number of threads can read it
+ * without holding a lock.
+ */
+struct Trace::PublishedConfiguration
+{
+    PublishedConfiguration( Configuration *configuration_,
+                            const vector<TracePointSet *> &tracePointSets_ )
+        : configuration( configuration_ ),
+        tracePointSets( tracePointSets_ )
+    {
+    }
+
+    ~PublishedConfiguration()
+    {
+        deleteRange( tracePointSets.begin(), tracePointSets.end() );
+        delete configuration;
+    }
+
+    Configuration * const configuration;
+    const vector<TracePointSet *> tracePointSets;
+
+private:
+    PublishedConfiguration( const PublishedConfiguration &other ); // disabled
+    void operator=( const PublishedConfiguration &rhs ); // disabled
+};
+
+/* Generations are unique within the process (and not just within a Trace)
+ * so that trace points configured by one Trace are reconfigured as soon as
+ * another one becomes active.
+ */
+static volatile AtomicWord g_lastConfigurationGeneration = 0;
+
+// Milliseconds between two reports about suppressed trace entries
+static const unsigned long SuppressionReportInterval = 1000;
+
 static LogOutput* checkForLogFileEnvVar( const char* envVar )
 {
     if ( getenv( envVar ) ) {
@@ -127,7 +191,17 @@ static LogOutput* checkForLogFileEnvVar( const char* envVar )
 Trace::Trace()
     : m_serializer( 0 ),
     m_output( 0 ),
-    m_configuration( 0 ),
+    m_hasSerializerAndOutput( 0 ),
+    m_serializerWritesBacktraceAddresses( 0 ),
+    m_publishedConfiguration( 0 ),
+    m_configurationGeneration( 0 ),
+    m_configurationReaders( 0 ),
+    m_hasLimiters( 0 ),
+    m_lastSuppressionReport( static_cast<AtomicWord>( now() ) ),
+    m_droppedEntries( 0 ),
+    m_asyncWriter( 0 ),
+    m_flightRecorder( 0 ),
+    m_writerMode( WriterConfiguration::Synchronous ),
     m_configFileMonitor( 0 ),
     m_log( 0 ),
     m_errorOutput( 0 ),
@@ -166,6 +240,12 @@ Trace::~Trace()
 {
     ShutdownNotifier::self().removeObserver( this );
 
+    // Stops the writer thread and writes all entries still queued
+    delete m_asyncWriter;
+
+    delete m_flightRecorder;
+    deleteRange( m_retiredFlightRecorders.begin(), m_retiredFlightRecorders.end() );
+
     {
         MutexLocker serializerLocker( m_serializerMutex );
         delete m_serializer;
@@ -176,11 +256,8 @@ Trace::~Trace()
         delete m_output;
     }
 
-    {
-        MutexLocker configurationLocker( m_configurationMutex );
-        deleteRange( m_tracePointSets.begin(), m_tracePointSets.end() );
-        delete m_configuration;
-    }
+    delete m_publishedConfiguration;
+    deleteRange( m_limiters.begin(), m_limiters.end() );
 
     delete m_configFileMonitor;
     delete m_log;
@@ -195,13 +272,6 @@ void Trace::reloadConfiguration( const string &fileName )
     if ( cfg ) {
         setSerializer( cfg->configuredSerializer() );
         setOutput( cfg->configuredOutput() );
-        {
-            MutexLocker configurationLocker( m_configurationMutex );
-            deleteRange( m_tracePointSets.begin(), m_tracePointSets.end() );
-            m_tracePointSets = cfg->configuredTracePointSets();
-            delete m_configuration;
-            m_configuration = cfg;
-        }
 
         {
             MutexLocker serializerLocker( m_serializerMutex );
@@ -210,15 +280,18 @@ void Trace::reloadConfiguration( const string &fileName )
             }
         }
 
+        applyWriterConfiguration( cfg->writerConfiguration() );
+
         /* If any trace keys are given in the XML file, they also implicitely
          * filter out all those trace entries which do not have any of the
          * specified keys. A feature requested by Siemens.
          */
+        const vector<TracePointSet *> tracePointSets = cfg->configuredTracePointSets();
         const vector<TraceKey> traceKeys = cfg->configuredTraceKeys();
         TraceEntry::process.availableTraceKeys = traceKeys;
         if ( !traceKeys.empty() ) {
-            vector<TracePointSet *>::iterator setIt, setEnd = m_tracePointSets.end();
-            for ( setIt = m_tracePointSets.begin(); setIt != setEnd; ++setIt ) {
+            vector<TracePointSet *>::const_iterator setIt, setEnd = tracePointSets.end();
+            for ( setIt = tracePointSets.begin(); setIt != setEnd; ++setIt ) {
                 bool haveEnabledTraceKey = false;
                 GroupFilter *groupFilter = new GroupFilter;
                 groupFilter->setMode( GroupFilter::Whitelist );
@@ -238,107 +311,401 @@ void Trace::reloadConfiguration( const string &fileName )
                 }
             }
         }
+
+        publishConfiguration( new PublishedConfiguration( cfg, tracePointSets ) );
+
+        m_log->writeStatus( "Trace::reloadConfiguration: configuration updated with serializer: %s and output: %s",
+                            (m_serializer ? "yes" : "no"),
+                            (m_output ? "yes" : "no") );
     } else {
+        applyWriterConfiguration( WriterConfiguration() );
         setSerializer( 0 );
         setOutput( 0 );
-        {
-            MutexLocker configurationLocker( m_configurationMutex );
-            deleteRange( m_tracePointSets.begin(), m_tracePointSets.end() );
-            m_tracePointSets.clear();
-            delete m_configuration;
-            m_configuration = 0;
-        }
+        publishConfiguration( 0 );
         TraceEntry::process.availableTraceKeys.clear();
     }
-    if( m_configuration ) {
-        m_log->writeStatus( "Trace::reloadConfiguration: configuration updated with serializer: %s and output: %s",
-                            (m_serializer ? "yes" : "no"),
-                            (m_output ? "yes" : "no") );
+}
+
+/* Replaces the configuration in an RCU fashion: new readers see the new
+ * configuration right away, the old one is deleted as soon as no reader
+ * can see it anymore. Advancing the generation makes all trace points
+ * reconfigure themselves on their next visit.
+ */
+void Trace::publishConfiguration( PublishedConfiguration *cfg )
+{
+    MutexLocker configurationLocker( m_configurationMutex );
+    PublishedConfiguration *previous = atomicExchangePointer( &m_publishedConfiguration, cfg );
+    atomicStore( &m_configurationGeneration, atomicFetchAdd( &g_lastConfigurationGeneration, 1 ) + 1 );
+
+    // Readers only ever take a short look at the trace point sets
+    while ( atomicLoad( &m_configurationReaders ) != 0 ) {
+        Thread::yield();
+    }
+
+    /* The limiters stay alive (trace points may still refer to them) but
+     * new trace point sets get new ones.
+     */
+    {
+        MutexLocker limiterLocker( m_limiterMutex );
+        m_tracePointLimiters.clear();
+        m_traceKeyLimiters.clear();
     }
+    delete previous;
 }
 
+/* The asynchronous writer and the flight recorder are never deleted while
+ * tracing is active since other threads might be about to use them;
+ * switching back to synchronous mode just makes them idle. Flight recorders
+ * of another size replace the current one, which is retired.
+ */
+void Trace::applyWriterConfiguration( const WriterConfiguration &cfg )
+{
+    if ( cfg.mode == WriterConfiguration::Asynchronous ) {
+        if ( !m_asyncWriter ) {
+            m_asyncWriter = new AsynchronousWriter( this, m_log );
+            if ( !m_asyncWriter->start() ) {
+                m_log->writeError( "Trace::applyWriterConfiguration: failed to start writer thread, writing trace entries synchronously" );
+                delete m_asyncWriter;
+                m_asyncWriter = 0;
+                atomicStore( &m_writerMode, WriterConfiguration::Synchronous );
+                return;
+            }
+        }
+        m_asyncWriter->setConfiguration( cfg );
+    } else if ( cfg.mode == WriterConfiguration::FlightRecorder ) {
+        if ( !m_flightRecorder || !m_flightRecorder->hasSize( cfg.bufferSize, cfg.maximumMessageLength ) ) {
+            FlightRecorder *recorder = new FlightRecorder( this, m_log, cfg.bufferSize, cfg.maximumMessageLength );
+            FlightRecorder *previous = atomicExchangePointer( &m_flightRecorder, recorder );
+            if ( previous ) {
+                m_retiredFlightRecorders.push_back( previous );
+            }
+        }
+    }
+    atomicStore( &m_writerMode, cfg.mode );
+}
+
+/* May run in any number of threads at once. If two threads configure the
+ * same trace point, the one which read the older generation might win; that
+ * just makes the trace point get reconfigured on its next visit.
+ */
 void Trace::configureTracePoint( TracePoint *tracePoint ) const
 {
-    MutexLocker configurationLocker( m_configurationMutex );
-    tracePoint->lastUsedConfiguration = m_configuration;
+    // The generation is advanced after publishing the configuration
+    const AtomicWord generation = atomicLoad( &m_configurationGeneration );
 
-    if ( m_tracePointSets.empty() ) {
-        tracePoint->active = true;
-        return;
+    EntryLimiter *limiter = 0;
+    atomicFetchAdd( &m_configurationReaders, 1 );
+    const long flags = stateForTracePoint( atomicLoadPointer( &m_publishedConfiguration ), tracePoint, &limiter );
+    atomicFetchAdd( &m_configurationReaders, -1 );
+
+    if ( limiter ) {
+        atomicStorePointer( &tracePoint->limiter, limiter );
     }
+    atomicStore( &tracePoint->state, ( generation << TracePoint::StateFlagBits ) | flags );
+}
 
-    tracePoint->active = false;
+long Trace::stateForTracePoint( const PublishedConfiguration *cfg, const TracePoint *tracePoint,
+                                EntryLimiter **limiter ) const
+{
+    if ( !cfg || cfg->tracePointSets.empty() ) {
+        return TracePoint::Active;
+    }
 
-    vector<TracePointSet *>::const_iterator it, end = m_tracePointSets.end();
-    for ( it = m_tracePointSets.begin(); it != end; ++it ) {
+    vector<TracePointSet *>::const_iterator it, end = cfg->tracePointSets.end();
+    for ( it = cfg->tracePointSets.begin(); it != end; ++it ) {
         const unsigned int action = ( *it )->actionForTracePoint( tracePoint );
         if ( action == TracePointSet::IgnoreTracePoint ) {
             continue;
         }
 
-        tracePoint->active = true;
-        tracePoint->backtracesEnabled = ( action & TracePointSet::YieldBacktrace ) == TracePointSet::YieldBacktrace;
-        tracePoint->variableSnapshotEnabled = ( action & TracePointSet::YieldVariables ) == TracePointSet::YieldVariables;
+        long state = TracePoint::Active;
+        if ( ( action & TracePointSet::YieldBacktrace ) == TracePointSet::YieldBacktrace ) {
+            state |= TracePoint::BacktracesEnabled;
+        }
+        if ( ( action & TracePointSet::DeferSymbolization ) == TracePointSet::DeferSymbolization ) {
+            state |= TracePoint::DeferredSymbolization;
+        }
+        if ( ( action & TracePointSet::YieldVariables ) == TracePointSet::YieldVariables ) {
+            state |= TracePoint::VariableSnapshotEnabled;
+        }
+        if ( ( *it )->limits().isLimited() ) {
+            state |= TracePoint::Limited;
+            *limiter = limiterForTracePoint( *it, tracePoint );
+        }
 
-        m_log->writeStatus( "Trace::configureTracePoint: activating trace point at %s:%d (backtraces=%d, variables=%d)", tracePoint->sourceFile, tracePoint->lineno, tracePoint->backtracesEnabled, tracePoint->variableSnapshotEnabled );
+        m_log->writeStatus( "Trace::configureTracePoint: activating trace point at %s:%d (backtraces=%d, variables=%d, limited=%d)", tracePoint->sourceFile, tracePoint->lineno, ( state & TracePoint::BacktracesEnabled ) != 0, ( state & TracePoint::VariableSnapshotEnabled ) != 0, ( state & TracePoint::Limited ) != 0 );
 
-        return;
+        return state;
     }
 
     m_log->writeStatus( "Trace::configureTracePoint: trace point at %s:%d is not active", tracePoint->sourceFile, tracePoint->lineno );
+    return 0;
+}
+
+/* Trace point sets limiting per trace point get a limiter for each trace
+ * point, those limiting per trace key share one limiter between all trace
+ * points of a key (trace points without a key share one, too). Limiters are
+ * only deleted together with the Trace.
+ */
+EntryLimiter *Trace::limiterForTracePoint( const TracePointSet *set, const TracePoint *tracePoint ) const
+{
+    MutexLocker limiterLocker( m_limiterMutex );
+
+    EntryLimiter **limiter;
+    if ( set->limits().scope == EntryLimits::PerTraceKey ) {
+        const string key = tracePoint->groupName ? tracePoint->groupName : "";
+        limiter = &m_traceKeyLimiters[make_pair( set, key )];
+    } else {
+        limiter = &m_tracePointLimiters[make_pair( set, tracePoint )];
+    }
+
+    if ( !*limiter ) {
+        *limiter = new EntryLimiter( set->limits() );
+        m_limiters.push_back( *limiter );
+        atomicStore( &m_hasLimiters, 1 );
+    }
+    return *limiter;
 }
 
 // configures the trace point if necessary and tells us if it's
-// supposed to be visited.
+// supposed to be visited. For trace points which are configured already,
+// this takes no locks.
 bool Trace::advanceVisit( TracePoint *tracePoint ) const
 {
-    if ( tracePoint->lastUsedConfiguration != m_configuration ) {
+    long state = atomicLoadRelaxed( &tracePoint->state );
+    if ( ( state >> TracePoint::StateFlagBits ) != atomicLoadRelaxed( &m_configurationGeneration ) ) {
         configureTracePoint( tracePoint );
+        state = atomicLoadRelaxed( &tracePoint->state );
+    }
+
+    if ( !( state & TracePoint::Active ) || !atomicLoadRelaxed( &m_hasSerializerAndOutput ) ) {
+        return false;
+    }
+    if ( state & TracePoint::Limited ) {
+        EntryLimiter *limiter = atomicLoadPointer( &tracePoint->limiter );
+        return !limiter || limiter->admit( tracePoint );
+    }
+    return true;
+}
+
+/* Writes a trace entry for every limiter which suppressed entries since the
+ * last report; the entry is attributed to the trace point which was
+ * suppressed last. Reports are written at most once per
+ * SuppressionReportInterval unless forced.
+ */
+void Trace::reportSuppressedEntries( bool force )
+{
+    const AtomicWord currentTime = static_cast<AtomicWord>( now() );
+    const AtomicWord lastReport = atomicLoadRelaxed( &m_lastSuppressionReport );
+    if ( !force && static_cast<unsigned long>( currentTime ) - static_cast<unsigned long>( lastReport ) < SuppressionReportInterval ) {
+        return;
+    }
+    if ( !atomicCompareAndSwap( &m_lastSuppressionReport, lastReport, currentTime ) && !force ) {
+        return;
+    }
+
+    vector<pair<const TracePoint *, AtomicWord> > reports;
+    {
+        MutexLocker limiterLocker( m_limiterMutex );
+        vector<EntryLimiter *>::const_iterator it, end = m_limiters.end();
+        for ( it = m_limiters.begin(); it != end; ++it ) {
+            const AtomicWord suppressedCount = ( *it )->takeSuppressedCount();
+            if ( suppressedCount > 0 ) {
+                reports.push_back( make_pair( ( *it )->lastSuppressedTracePoint(), suppressedCount ) );
+            }
+        }
     }
 
-    return tracePoint->active && m_serializer && m_output;
+    vector<pair<const TracePoint *, AtomicWord> >::const_iterator it, end = reports.end();
+    for ( it = reports.begin(); it != end; ++it ) {
+        char msg[96];
+        snprintf( msg, sizeof( msg ), "%ld trace entries suppressed by sampling or rate limiting", it->second );
+        visitTracePoint( it->first, msg );
+    }
+}
+
+/* Writes a trace entry about the entries which the output dropped; the
+ * entry is attributed to the trace point visited when the output recovered.
+ */
+void Trace::reportDroppedEntries( const TracePoint *tracePoint )
+{
+    const AtomicWord droppedEntries = atomicExchange( &m_droppedEntries, 0 );
+    if ( droppedEntries > 0 ) {
+        char msg[96];
+        snprintf( msg, sizeof( msg ), "%ld trace entries dropped since the output did not keep up", droppedEntries );
+        visitTracePoint( tracePoint, msg );
+    }
 }
 
 void Trace::visitTracePoint( const TracePoint *tracePoint,
                              const char *msg,
-                             VariableSnapshot *variables )
+                             VariableSnapshot *variables,
+                             const DeferredMessage *deferredMessage )
 {
+    if ( atomicLoadRelaxed( &m_hasLimiters ) ) {
+        reportSuppressedEntries( false );
+    }
+    if ( atomicLoadRelaxed( &m_droppedEntries ) ) {
+        reportDroppedEntries( tracePoint );
+    }
+
+    const long state = atomicLoadRelaxed( &tracePoint->state );
+    const AtomicWord writerMode = atomicLoad( &m_writerMode );
+
+    if ( writerMode == WriterConfiguration::FlightRecorder ) {
+        FlightRecorder *recorder = atomicLoadPointer( &m_flightRecorder );
+        if ( tracePoint->type != TracePointType::Error ) {
+            recorder->record( tracePoint, msg, deferredMessage );
+            return;
+        }
+
+        // Errors are written right away, following what led to them
+        recorder->dump();
+    } else if ( writerMode == WriterConfiguration::Asynchronous ) {
+        TraceEntry entry( tracePoint, msg );
+        entry.deferredMessage = deferredMessage;
+        if ( state & TracePoint::BacktracesEnabled ) {
+            entry.backtrace = new Backtrace( state & TracePoint::DeferredSymbolization
+                                             ? m_backtraceGenerator.capture( 1 /* omit this function in backtrace */ )
+                                             : m_backtraceGenerator.generate( 1 /* omit this function in backtrace */ ) );
+        }
+
+        if ( state & TracePoint::VariableSnapshotEnabled ) {
+            entry.variables = variables;
+        }
+
+        m_asyncWriter->enqueue( entry );
+        return;
+    }
+
     {
+        MutexLocker serializerLocker( m_serializerMutex );
+        if ( !m_serializer ) {
+            return;
+        }
         MutexLocker outputLocker( m_outputMutex );
-        if ( !m_output || ( !m_output->canWrite() && !m_output->open() ) ) {
+        if ( !openOutput() ) {
             return;
         }
     }
 
     TraceEntry entry( tracePoint, msg );
-    if ( tracePoint->backtracesEnabled ) {
-        entry.backtrace = new Backtrace( m_backtraceGenerator.generate( 1 /* omit this function in backtrace */ ) );
+    entry.deferredMessage = deferredMessage;
+    if ( state & TracePoint::BacktracesEnabled ) {
+        entry.backtrace = new Backtrace( state & TracePoint::DeferredSymbolization
+                                         ? m_backtraceGenerator.capture( 1 /* omit this function in backtrace */ )
+                                         : m_backtraceGenerator.generate( 1 /* omit this function in backtrace */ ) );
     }
 
-    if ( tracePoint->variableSnapshotEnabled ) {
+    if ( state & TracePoint::VariableSnapshotEnabled ) {
         entry.variables = variables;
     }
 
     addEntry( entry );
 }
 
+/* Both locks are held until the data is written since serializers may refer
+ * to data which they wrote earlier (see BinarySerializer), so the order in
+ * which the output receives the data must match the order of serialization.
+ */
 void Trace::addEntry( const TraceEntry &entry )
 {
-    vector<char> data;
-    {
-        MutexLocker serializerLocker( m_serializerMutex );
-        if ( !m_serializer ) {
-            return;
-        }
-        data = m_serializer->serialize( entry );
+    /* Backtraces and deferred messages are resolved before taking the locks
+     * (unless the serializer writes the addresses; should it change
+     * meanwhile, it resolves the backtrace when it needs it).
+     */
+    if ( entry.backtrace && !atomicLoadRelaxed( &m_serializerWritesBacktraceAddresses ) ) {
+        entry.backtrace->resolve();
+    }
+    if ( entry.deferredMessage ) {
+        const string message = entry.deferredMessage->format();
+        TraceEntry formattedEntry( entry.tracePoint, message.c_str(), entry.threadId,
+                                   entry.timeStamp, entry.stackPosition );
+        formattedEntry.variables = entry.variables;
+        formattedEntry.backtrace = entry.backtrace;
+        addEntry( formattedEntry );
+        formattedEntry.backtrace = 0; // still owned by the given entry
+        return;
+    }
+
+    MutexLocker serializerLocker( m_serializerMutex );
+    if ( !m_serializer ) {
+        return;
+    }
+
+    MutexLocker outputLocker( m_outputMutex );
+    if ( !openOutput() ) {
+        return;
     }
 
+    const vector<char> data = m_serializer->serialize( entry );
     if ( !data.empty() ) {
-        MutexLocker outputLocker( m_outputMutex );
-        if ( !m_output || ( !m_output->canWrite() && !m_output->open() ) ) {
-            return;
-        }
         m_output->write( data );
+        if ( m_output->droppedData() ) {
+            m_serializer->dataDropped();
+        }
+
+        // Errors (and crashes, see recordCrashInTrace) must not be lost
+        if ( entry.tracePoint->type == TracePointType::Error ) {
+            m_output->flush();
+        }
+
+        // Reported with the next trace entry since the locks are held here
+        const unsigned long droppedEntries = m_output->takeDroppedEntryCount();
+        if ( droppedEntries > 0 ) {
+            atomicFetchAdd( &m_droppedEntries, static_cast<AtomicWord>( droppedEntries ) );
+        }
+    }
+}
+
+// Expects both the serializer and the output mutex to be locked
+bool Trace::openOutput()
+{
+    if ( !m_output ) {
+        return false;
+    }
+    if ( !m_output->canWrite() ) {
+        if ( !m_output->open() ) {
+            return false;
+        }
+        if ( m_output->keepsQueuedData() ) {
+            m_output->prependData( m_serializer->resumeStream() );
+        } else {
+            m_serializer->restartStream();
+        }
+    }
+    return true;
+}
+
+void Trace::flushQueuedEntries( bool mayBlock )
+{
+    if ( !m_asyncWriter ) {
+        return;
+    }
+    if ( mayBlock ) {
+        m_asyncWriter->flush();
+    } else {
+        m_asyncWriter->tryFlush();
+    }
+}
+
+void Trace::dumpFlightRecorder( bool mayBlock )
+{
+    FlightRecorder *recorder = atomicLoadPointer( &m_flightRecorder );
+    if ( !recorder ) {
+        return;
+    }
+    if ( !mayBlock ) {
+        recorder->tryDump();
+        return;
+    }
+
+    recorder->dump();
+
+    // Dumps are requested because something went wrong, so don't buffer them
+    MutexLocker outputLocker( m_outputMutex );
+    if ( m_output ) {
+        m_output->flush();
     }
 }
 
@@ -347,13 +714,28 @@ void Trace::setSerializer( Serializer *serializer )
     MutexLocker serializerLocker( m_serializerMutex );
     delete m_serializer;
     m_serializer = serializer;
+
+    MutexLocker outputLocker( m_outputMutex );
+    serializerOrOutputChanged();
 }
 
 void Trace::setOutput( Output *output )
 {
+    MutexLocker serializerLocker( m_serializerMutex );
     MutexLocker outputLocker( m_outputMutex );
     delete m_output;
     m_output = output;
+    serializerOrOutputChanged();
+}
+
+// Expects both the serializer and the output mutex to be locked
+void Trace::serializerOrOutputChanged()
+{
+    atomicStore( &m_hasSerializerAndOutput, m_serializer && m_output ? 1 : 0 );
+    atomicStore( &m_serializerWritesBacktraceAddresses, m_serializer && m_serializer->writesBacktraceAddresses() ? 1 : 0 );
+    if ( m_serializer && m_output ) {
+        m_output->setBinaryData( m_serializer->isBinary() );
+    }
 }
 
 void Trace::handleFileModification( const std::string &fileName, NotificationReason reason )
@@ -365,22 +747,25 @@ void Trace::handleProcessShutdown()
 {
     m_log->writeStatus( "Trace::handleProcessShutdown: detected process shutdown" );
 
+    if ( atomicLoadRelaxed( &m_hasLimiters ) ) {
+        reportSuppressedEntries( true );
+    }
+    flushQueuedEntries();
+
     ProcessShutdownEvent ev;
 
-    vector<char> data;
-    {
-        MutexLocker serializerLocker( m_serializerMutex );
-        if ( !m_serializer ) {
-            return;
-        }
-        data = m_serializer->serialize( ev );
+    MutexLocker serializerLocker( m_serializerMutex );
+    if ( !m_serializer ) {
+        return;
+    }
+
+    MutexLocker outputLocker( m_outputMutex );
+    if ( !openOutput() ) {
+        return;
     }
 
+    const vector<char> data = m_serializer->serialize( ev );
     if ( !data.empty() ) {
-        MutexLocker outputLocker( m_outputMutex );
-        if ( !m_output || ( !m_output->canWrite() && !m_output->open() ) ) {
-            return;
-        }
         m_output->write( data );
 
         /* Delete the output object to make sure it flushes any data which
@@ -389,22 +774,32 @@ void Trace::handleProcessShutdown()
          */
         delete m_output;
         m_output = 0;
+        serializerOrOutputChanged();
     }
 }
 
-static Trace *g_activeTrace = 0;
+static Trace * volatile g_activeTrace = 0;
 
+/* Several threads may visit their first trace point at the same time; only
+ * one of the traces they create is kept.
+ */
 Trace *getActiveTrace()
 {
-    if ( !g_activeTrace ) {
-        g_activeTrace = new Trace;
+    Trace *trace = atomicLoadPointer( &g_activeTrace );
+    if ( !trace ) {
+        Trace *newTrace = new Trace;
+        if ( atomicCompareAndSwapPointer( &g_activeTrace, static_cast<Trace *>( 0 ), newTrace ) ) {
+            return newTrace;
+        }
+        delete newTrace;
+        trace = atomicLoadPointer( &g_activeTrace );
     }
-    return g_activeTrace;
+    return trace;
 }
 
 void setActiveTrace( Trace *trace )
 {
-    g_activeTrace = trace;
+    atomicStorePointer( &g_activeTrace, trace );
 }
 
 TRACELIB_NAMESPACE_END
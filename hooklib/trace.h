@@ -21,8 +21,10 @@
 #define TRACELIB_TRACE_H
 
 #include "tracelib_config.h"
+#include "atomic.h"
 #include "backtrace.h"
 #include "configuration.h" // for TraceKey
+#include "entrylimiter.h"
 #include "filemodificationmonitor.h"
 #include "getcurrentthreadid.h"
 #include "mutex.h"
@@ -30,11 +32,16 @@
 #include "variabledumping.h"
 #include "config.h" // for uint64_t
 
+#include <map>
+#include <string>
+#include <utility>
 #include <vector>
 
 TRACELIB_NAMESPACE_BEGIN
 
+class AsynchronousWriter;
 class Filter;
+class FlightRecorder;
 class Output;
 class Serializer;
 struct TracePoint;
@@ -48,14 +55,17 @@ public:
     static const unsigned int LogTracePoint = 0x0001;
     static const unsigned int YieldBacktrace = LogTracePoint | 0x0100;
     static const unsigned int YieldVariables = LogTracePoint | 0x0200;
+    static const unsigned int DeferSymbolization = YieldBacktrace | 0x0400;
 
-    TracePointSet( Filter *filter, unsigned int actions );
+    TracePointSet( Filter *filter, unsigned int actions,
+                   const EntryLimits &limits = EntryLimits() );
     ~TracePointSet();
 
     Filter *filter() { return m_filter; }
     void setFilter( Filter *filter ) { m_filter = filter; }
 
     unsigned int actionForTracePoint( const TracePoint *tracePoint );
+    const EntryLimits &limits() const { return m_limits; }
 
 private:
     TracePointSet( const TracePointSet &other );
@@ -63,6 +73,7 @@ private:
 
     Filter *m_filter;
     const unsigned int m_actions;
+    const EntryLimits m_limits;
 };
 
 struct TracedProcess
@@ -76,6 +87,8 @@ struct TracedProcess
 struct TraceEntry
 {
     TraceEntry( const TracePoint *tracePoint_, const char *msg = 0 );
+    TraceEntry( const TracePoint *tracePoint_, const char *msg,
+                ThreadId threadId_, uint64_t timeStamp_, size_t stackPosition_ );
     ~TraceEntry();
 
     static TracedProcess process;
@@ -85,6 +98,7 @@ struct TraceEntry
     VariableSnapshot *variables;
     Backtrace *backtrace;
     const char * const message;
+    const DeferredMessage *deferredMessage; // formatted when serializing, if set
     const size_t stackPosition;
 };
 
@@ -107,9 +121,12 @@ public:
     bool advanceVisit( TracePoint *tracePoint ) const;
     void visitTracePoint( const TracePoint *tracePoint,
                           const char *msg = 0,
-                          VariableSnapshot *variables = 0 );
+                          VariableSnapshot *variables = 0,
+                          const DeferredMessage *deferredMessage = 0 );
 
     void addEntry( const TraceEntry &e );
+    void flushQueuedEntries( bool mayBlock = true );
+    void dumpFlightRecorder( bool mayBlock = true );
 
     void setSerializer( Serializer *serializer );
     void setOutput( Output *output );
@@ -122,16 +139,41 @@ private:
     Trace( const Trace &trace );
     void operator=( const Trace &trace );
 
+    struct PublishedConfiguration;
+
     void reloadConfiguration( const std::string &fileName );
+    void publishConfiguration( PublishedConfiguration *cfg );
+    long stateForTracePoint( const PublishedConfiguration *cfg, const TracePoint *tracePoint,
+                             EntryLimiter **limiter ) const;
+    EntryLimiter *limiterForTracePoint( const TracePointSet *set, const TracePoint *tracePoint ) const;
+    void reportSuppressedEntries( bool force );
+    void reportDroppedEntries( const TracePoint *tracePoint );
+    void applyWriterConfiguration( const WriterConfiguration &cfg );
+    void serializerOrOutputChanged();
+    bool openOutput();
 
     Serializer *m_serializer;
     Mutex m_serializerMutex;
     Output *m_output;
     Mutex m_outputMutex;
-    std::vector<TracePointSet *> m_tracePointSets;
-    Configuration *m_configuration;
-    mutable Mutex m_configurationMutex;
+    volatile AtomicWord m_hasSerializerAndOutput;
+    volatile AtomicWord m_serializerWritesBacktraceAddresses;
+    PublishedConfiguration * volatile m_publishedConfiguration;
+    volatile AtomicWord m_configurationGeneration;
+    mutable volatile AtomicWord m_configurationReaders;
+    Mutex m_configurationMutex;
+    mutable Mutex m_limiterMutex;
+    mutable std::vector<EntryLimiter *> m_limiters;
+    mutable std::map<std::pair<const TracePointSet *, const TracePoint *>, EntryLimiter *> m_tracePointLimiters;
+    mutable std::map<std::pair<const TracePointSet *, std::string>, EntryLimiter *> m_traceKeyLimiters;
+    mutable volatile AtomicWord m_hasLimiters;
+    volatile AtomicWord m_lastSuppressionReport;
+    volatile AtomicWord m_droppedEntries;
     BacktraceGenerator m_backtraceGenerator;
+    AsynchronousWriter *m_asyncWriter;
+    FlightRecorder * volatile m_flightRecorder;
+    std::vector<FlightRecorder *> m_retiredFlightRecorders;
+    volatile AtomicWord m_writerMode;
     FileModificationMonitor *m_configFileMonitor;
     Log *m_log;
     LogOutput *m_errorOutput;
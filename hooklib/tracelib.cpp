@@ -15,5 +15,17 @@ void visitTracePoint( const TracePoint *tracePoint,
     getActiveTrace()->visitTracePoint( tracePoint, msg, variables );
 }
 
+void visitTracePoint( const TracePoint *tracePoint,
+                      const DeferredMessage &msg,
+                      VariableSnapshot *variables )
+{
+    getActiveTrace()->visitTracePoint( tracePoint, 0, variables, &msg );
+}
+
+void dumpFlightRecorder()
+{
+    getActiveTrace()->dumpFlightRecorder();
+}
+
 TRACELIB_NAMESPACE_END
 
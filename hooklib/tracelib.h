@@ -60,9 +60,9 @@
 #ifndef TRACELIB_DISABLE_TRACE_CODE
 // Helper macros to avoid duplicating the VISIT_TRACEPOINT* ones, depending on
 // wether there is an actual msg or not we need different code as some compilers
-// will not accept an anonymous StringBuilder object and require an actual variable
+// will not accept an anonymous DeferredMessage object and require an actual variable
 #  define TRACELIB_CREATE_MESSAGE_VAR(msg) \
-        TRACELIB_NAMESPACE_IDENT(StringBuilder) msgBuilder; \
+        TRACELIB_NAMESPACE_IDENT(DeferredMessage) msgBuilder; \
         msgBuilder << msg;
 #  define TRACELIB_CREATE_NULL_VAR \
         const char *msgBuilder = 0;
@@ -70,12 +70,10 @@
 { \
     static TRACELIB_NAMESPACE_IDENT(TracePoint) tracePoint(TRACELIB_NAMESPACE_IDENT(TracePointType)::Watch, TRACELIB_CURRENT_FILE_NAME, TRACELIB_CURRENT_LINE_NUMBER, TRACELIB_CURRENT_FUNCTION_NAME, key); \
     if ( TRACELIB_NAMESPACE_IDENT(advanceVisit)( &tracePoint ) ) { \
-        TRACELIB_NAMESPACE_IDENT(VariableSnapshot) *variableSnapshot = new TRACELIB_NAMESPACE_IDENT(VariableSnapshot); \
-        (*variableSnapshot) << vars; \
+        TRACELIB_NAMESPACE_IDENT(VariableSnapshot) variableSnapshot; \
+        variableSnapshot << vars; \
         msg \
-        TRACELIB_NAMESPACE_IDENT(visitTracePoint)( &tracePoint, msgBuilder, variableSnapshot ); \
-        for ( size_t i = 0; i < variableSnapshot->size(); ++i ) delete (*variableSnapshot)[i]; \
-        delete variableSnapshot; \
+        TRACELIB_NAMESPACE_IDENT(visitTracePoint)( &tracePoint, msgBuilder, &variableSnapshot ); \
     } \
 }
 #  define TRACELIB_VISIT_TRACEPOINT(type, key, msg) \
@@ -87,14 +85,14 @@
     } \
 }
 #  define TRACELIB_VISIT_TRACEPOINT_STREAM(VisitorType, type, key) \
-    static TRACELIB_NAMESPACE_IDENT(TracePoint) TRACELIB_TOKEN_GLUE(tracePoint, TRACELIB_CURRENT_LINE_NUMBER)( (type), TRACELIB_CURRENT_FILE_NAME, TRACELIB_CURRENT_LINE_NUMBER, TRACELIB_CURRENT_FUNCTION_NAME, (key) ); TRACELIB_NAMESPACE_IDENT(VisitorType) TRACELIB_TOKEN_GLUE(tracePointVisitor, TRACELIB_CURRENT_LINE_NUMBER)( &TRACELIB_TOKEN_GLUE(tracePoint, TRACELIB_CURRENT_LINE_NUMBER) ); if ( TRACELIB_NAMESPACE_IDENT(advanceVisit)( &TRACELIB_TOKEN_GLUE(tracePoint, TRACELIB_CURRENT_LINE_NUMBER) ) ) (TRACELIB_TOKEN_GLUE(tracePointVisitor, TRACELIB_CURRENT_LINE_NUMBER))
-#  define TRACELIB_VAR_IMPL(v) TRACELIB_NAMESPACE_IDENT(makeConverter)(#v, v)
+    static TRACELIB_NAMESPACE_IDENT(TracePoint) TRACELIB_TOKEN_GLUE(tracePoint, TRACELIB_CURRENT_LINE_NUMBER)( (type), TRACELIB_CURRENT_FILE_NAME, TRACELIB_CURRENT_LINE_NUMBER, TRACELIB_CURRENT_FUNCTION_NAME, (key) ); if ( TRACELIB_NAMESPACE_IDENT(advanceVisit)( &TRACELIB_TOKEN_GLUE(tracePoint, TRACELIB_CURRENT_LINE_NUMBER) ) ) TRACELIB_NAMESPACE_IDENT(VisitorType)( &TRACELIB_TOKEN_GLUE(tracePoint, TRACELIB_CURRENT_LINE_NUMBER) ).stream()
+#  define TRACELIB_VAR_IMPL(v) TRACELIB_NAMESPACE_IDENT(makeVariable)(#v, v)
 #else
 #  define TRACELIB_VISIT_TRACEPOINT_VARS(key, vars, msg) (void)0;
 #  define TRACELIB_VISIT_TRACEPOINT_VARS(key, vars) (void)0;
 #  define TRACELIB_VISIT_TRACEPOINT(type, key) (void)0;
 #  define TRACELIB_VISIT_TRACEPOINT(type, key, msg) (void)0;
-#  define TRACELIB_VISIT_TRACEPOINT_STREAM(VisitorType, type, key) if (false) (TRACELIB_NAMESPACE_IDENT(VisitorType)( NULL ))
+#  define TRACELIB_VISIT_TRACEPOINT_STREAM(VisitorType, type, key) if (false) TRACELIB_NAMESPACE_IDENT(VisitorType)( NULL ).stream()
 #  define TRACELIB_VAR_IMPL(v) NULL
 #endif
 
@@ -175,12 +173,81 @@ inline StringBuilder &operator<<( StringBuilder &lhs, const T &rhs ) {
     return lhs << convertVariable( rhs );
 }
 
+/* The message arguments passed to the trace macros are captured as they
+ * are; the message text is only built once the entry is serialized.
+ */
+inline DeferredMessage &operator<<( DeferredMessage &lhs, const VariableValue &rhs ) {
+    lhs.appendValue( rhs );
+    return lhs;
+}
+
+inline DeferredMessage &operator<<( DeferredMessage &lhs, const char *rhs ) {
+    lhs.appendString( rhs );
+    return lhs;
+}
+
+inline DeferredMessage &operator<<( DeferredMessage &lhs, char *rhs ) {
+    lhs.appendString( rhs );
+    return lhs;
+}
+
+inline DeferredMessage &operator<<( DeferredMessage &lhs, const std::string &rhs ) {
+    lhs.appendString( rhs.data(), rhs.size() );
+    return lhs;
+}
+
+#define TRACELIB_DEFERRED_CHARACTER(T) \
+inline DeferredMessage &operator<<( DeferredMessage &lhs, T rhs ) { \
+    const char c = static_cast<char>( rhs ); \
+    lhs.appendString( &c, 1 ); \
+    return lhs; \
+}
+TRACELIB_DEFERRED_CHARACTER(char)
+TRACELIB_DEFERRED_CHARACTER(signed char)
+TRACELIB_DEFERRED_CHARACTER(unsigned char)
+#undef TRACELIB_DEFERRED_CHARACTER
+
+#define TRACELIB_DEFERRED_ARGUMENT(T, appendFunction, U) \
+inline DeferredMessage &operator<<( DeferredMessage &lhs, T rhs ) { \
+    lhs.appendFunction( static_cast<U>( rhs ) ); \
+    return lhs; \
+}
+TRACELIB_DEFERRED_ARGUMENT(bool, appendBoolean, bool)
+TRACELIB_DEFERRED_ARGUMENT(short, appendNumber, vlonglong)
+TRACELIB_DEFERRED_ARGUMENT(unsigned short, appendNumber, vulonglong)
+TRACELIB_DEFERRED_ARGUMENT(int, appendNumber, vlonglong)
+TRACELIB_DEFERRED_ARGUMENT(unsigned int, appendNumber, vulonglong)
+TRACELIB_DEFERRED_ARGUMENT(long, appendNumber, vlonglong)
+TRACELIB_DEFERRED_ARGUMENT(unsigned long, appendNumber, vulonglong)
+TRACELIB_DEFERRED_ARGUMENT(vlonglong, appendNumber, vlonglong)
+TRACELIB_DEFERRED_ARGUMENT(vulonglong, appendNumber, vulonglong)
+TRACELIB_DEFERRED_ARGUMENT(float, appendFloat, long double)
+TRACELIB_DEFERRED_ARGUMENT(double, appendFloat, long double)
+TRACELIB_DEFERRED_ARGUMENT(long double, appendFloat, long double)
+#undef TRACELIB_DEFERRED_ARGUMENT
+
+// Everything else is converted using the convertVariable() specializations
+template <class T>
+inline DeferredMessage &operator<<( DeferredMessage &lhs, const T &rhs ) {
+    return lhs << convertVariable( rhs );
+}
+
 TRACELIB_EXPORT bool advanceVisit( TracePoint *tracePoint );
 
 TRACELIB_EXPORT void visitTracePoint( const TracePoint *tracePoint,
                       const char *msg = 0,
                       VariableSnapshot *variables = 0 );
 
+TRACELIB_EXPORT void visitTracePoint( const TracePoint *tracePoint,
+                      const DeferredMessage &msg,
+                      VariableSnapshot *variables = 0 );
+
+/* Writes the trace entries kept by the flight recorder writer (if it is
+ * configured) to the output, e.g. when the application detects a problem
+ * which is not reported by an Error trace point.
+ */
+TRACELIB_EXPORT void dumpFlightRecorder();
+
 struct StreamEnd {
 };
 
@@ -188,36 +255,46 @@ class TracePointVisitor {
 public:
     inline TracePointVisitor( TracePoint *tracePoint )
         : m_tracePoint( tracePoint )
-        , m_stream( 0 )
-        , m_variables( 0 )
     { }
     inline ~TracePointVisitor() {
-        if( m_variables ) {
-            for ( size_t i = 0; i < m_variables->size(); ++i ) delete (*m_variables)[i];
-            delete m_variables;
-        }
-        delete m_stream;
+        deleteRange( m_adoptedVariables.begin(), m_adoptedVariables.end() );
+    }
+
+    /* The stream macros only construct a (temporary) visitor once
+     * advanceVisit() returned true; this makes it usable with the
+     * operators below.
+     */
+    inline TracePointVisitor &stream() {
+        return *this;
     }
 
     inline TracePointVisitor &operator<<( const VariableValue &v ) {
-        if( !m_stream ) {
-            m_stream = new std::ostringstream();
-        }
-        (*m_stream) << variableValueAsString( v );
+        m_message.appendValue( v );
+        return *this;
+    }
+
+    template <class T>
+    inline TracePointVisitor &appendToMessage( const T &v ) {
+        m_message << v;
         return *this;
     }
 
+    // Takes ownership of the variable
     inline TracePointVisitor &addVariable( AbstractVariable *v ) {
-        if ( !m_variables )
-            m_variables = new VariableSnapshot;
-        (*m_variables) << v;
+        m_adoptedVariables.push_back( v );
+        m_variables << v;
         return *this;
     }
 
+    template <class T>
+    inline TracePointVisitor &addVariable( const Variable<T> &v ) {
+        m_variables << v;
+        return *this;
+    }
+
+    // Only reached if advanceVisit() returned true for the trace point
     void flush() {
-        if( m_tracePoint->active ) {
-            visitTracePoint( m_tracePoint, m_stream ? m_stream->str().c_str() : "", m_variables );
-        }
+        visitTracePoint( m_tracePoint, m_message, m_variables.size() > 0 ? &m_variables : 0 );
     }
 
 private:
@@ -225,8 +302,9 @@ private:
     void operator=( const TracePointVisitor &rhs );
 
     TracePoint *m_tracePoint;
-    std::ostringstream *m_stream;
-    VariableSnapshot *m_variables;
+    DeferredMessage m_message;
+    VariableSnapshot m_variables;
+    std::vector<AbstractVariable *> m_adoptedVariables;
 };
 
 // Keep these before the template functions below otherwise the compiler will try to put 'AbstractVariable *'
@@ -236,13 +314,18 @@ inline TracePointVisitor &operator<<( TracePointVisitor &lhs, AbstractVariable *
     return lhs.addVariable( rhs );
 }
 
+template <class T>
+inline TracePointVisitor &operator<<( TracePointVisitor &lhs, const Variable<T> &rhs ) {
+    return lhs.addVariable( rhs );
+}
+
 inline void operator<<( TracePointVisitor &lhs, const StreamEnd & ) {
     lhs.flush();
 }
 
 template <class T>
 inline TracePointVisitor &operator<<( TracePointVisitor &lhs, const T &rhs ) {
-    return lhs << convertVariable( rhs );
+    return lhs.appendToMessage( rhs );
 }
 
 TRACELIB_NAMESPACE_END
@@ -6,6 +6,8 @@
 
 TRACELIB_NAMESPACE_BEGIN
 
+class EntryLimiter;
+
 struct TracePointType {
     enum Value {
         None = 0
@@ -39,19 +41,27 @@ struct TracePointType {
     }
 };
 
-class Configuration;
-
 struct TracePoint {
+    /* Flags stored in the lower bits of the state; the remaining bits hold
+     * the generation of the configuration they were computed for.
+     */
+    enum StateFlags {
+        Active = 0x1,
+        BacktracesEnabled = 0x2,
+        VariableSnapshotEnabled = 0x4,
+        Limited = 0x8,
+        DeferredSymbolization = 0x10
+    };
+    static const int StateFlagBits = 5;
+
     TRACELIB_EXPORT TracePoint( TracePointType::Value type_, const char *sourceFile_, unsigned int lineno_, const char *functionName_, const char *groupName_ )
         : type( type_ ),
         sourceFile( sourceFile_ ),
         lineno( lineno_ ),
         functionName( functionName_ ),
         groupName( groupName_ ),
-        lastUsedConfiguration( 0 ),
-        active( false ),
-        backtracesEnabled( false ),
-        variableSnapshotEnabled( false )
+        state( 0 ),
+        limiter( 0 )
     {
     }
 
@@ -60,10 +70,10 @@ struct TracePoint {
     const unsigned int lineno;
     const char * const functionName;
     const char * const groupName;
-    const Configuration *lastUsedConfiguration;
-    bool active;
-    bool backtracesEnabled;
-    bool variableSnapshotEnabled;
+    // Only accessed using the functions in atomic.h (see Trace::advanceVisit)
+    volatile long state;
+    // Decides about the visits if the Limited flag is set
+    EntryLimiter * volatile limiter;
 };
 
 TRACELIB_NAMESPACE_END
@@ -21,8 +21,13 @@
 
 #include <cassert>
 #include <cstdlib> // for free
+#include <algorithm> // for min
 #include <cstring> // for strncpy, strdup
 
+#ifdef _WIN32
+#define snprintf _snprintf
+#endif
+
 using namespace std;
 
 TRACELIB_NAMESPACE_BEGIN
@@ -31,7 +36,13 @@ VariableValue VariableValue::stringValue( const char *s )
 {
     VariableValue var;
     var.m_type = VariableType::String;
-    var.m_primitiveValue.string = strdup( s );
+    const size_t length = strlen( s );
+    if ( length < ShortStringSize ) {
+        memcpy( var.m_shortString, s, length + 1 );
+        var.m_primitiveValue.string = var.m_shortString;
+    } else {
+        var.m_primitiveValue.string = strdup( s );
+    }
     return var;
 }
 
@@ -111,13 +122,18 @@ VariableValue::VariableValue( const VariableValue &other )
 	m_isSignedNumber( other.m_isSignedNumber )
 {
     if ( m_type == VariableType::String ) {
-        m_primitiveValue.string = strdup( other.asString() );
+        if ( other.m_primitiveValue.string == other.m_shortString ) {
+            memcpy( m_shortString, other.m_shortString, sizeof( m_shortString ) );
+            m_primitiveValue.string = m_shortString;
+        } else {
+            m_primitiveValue.string = strdup( other.asString() );
+        }
     }
 }
 
 VariableValue::~VariableValue()
 {
-    if ( m_type == VariableType::String ) {
+    if ( m_type == VariableType::String && m_primitiveValue.string != m_shortString ) {
         free( m_primitiveValue.string );
     }
 }
@@ -157,32 +173,247 @@ VariableValue::VariableValue()
 {
 }
 
+/* Storage for variables which didn't fit into the snapshot itself; the
+ * variables follow the (suitably padded) header.
+ */
+struct VariableSnapshot::Chunk
+{
+    Chunk *next;
+    char *end;
+
+    char *begin() {
+        return reinterpret_cast<char *>( this ) +
+               ( ( sizeof( Chunk ) + StorageAlignment - 1 ) & ~( StorageAlignment - 1 ) );
+    }
+};
+
 VariableSnapshot::VariableSnapshot()
-    : m_variables( new std::vector<AbstractVariable *> )
+    : m_variables( m_inlineVariables ),
+    m_size( 0 ),
+    m_capacity( InlineVariables ),
+    m_storagePos( m_inlineStorage.bytes ),
+    m_storageEnd( m_inlineStorage.bytes + InlineStorageSize ),
+    m_chunks( 0 )
 {
 }
 
 VariableSnapshot::~VariableSnapshot()
 {
-    delete m_variables;
+    for ( size_t i = 0; i < m_size; ++i ) {
+        if ( ownsVariable( m_variables[i] ) ) {
+            m_variables[i]->~AbstractVariable();
+        }
+    }
+    while ( m_chunks ) {
+        Chunk *next = m_chunks->next;
+        delete [] reinterpret_cast<char *>( m_chunks );
+        m_chunks = next;
+    }
+    if ( m_variables != m_inlineVariables ) {
+        delete [] m_variables;
+    }
+}
+
+// Chunks grow with the snapshot, so huge snapshots need few of them
+void VariableSnapshot::allocateChunk( size_t size )
+{
+    size_t capacity = m_chunks ? ( m_chunks->end - m_chunks->begin() ) * 2 : InlineStorageSize;
+    capacity = max( capacity, size );
+
+    const size_t headerSize = ( sizeof( Chunk ) + StorageAlignment - 1 ) & ~( StorageAlignment - 1 );
+    Chunk *chunk = reinterpret_cast<Chunk *>( new char[headerSize + capacity] );
+    chunk->next = m_chunks;
+    chunk->end = chunk->begin() + capacity;
+    m_chunks = chunk;
+    m_storagePos = chunk->begin();
+    m_storageEnd = chunk->end;
 }
 
+bool VariableSnapshot::ownsVariable( const AbstractVariable *v ) const
+{
+    const char *p = reinterpret_cast<const char *>( v );
+    if ( p >= m_inlineStorage.bytes && p < m_inlineStorage.bytes + InlineStorageSize ) {
+        return true;
+    }
+    for ( Chunk *c = m_chunks; c; c = c->next ) {
+        if ( p >= c->begin() && p < c->end ) {
+            return true;
+        }
+    }
+    return false;
+}
 
 VariableSnapshot &VariableSnapshot::operator<<( AbstractVariable *v )
 {
-    m_variables->push_back( v );
+    if ( m_size == m_capacity ) {
+        AbstractVariable **variables = new AbstractVariable *[m_capacity * 2];
+        memcpy( variables, m_variables, m_size * sizeof( AbstractVariable * ) );
+        if ( m_variables != m_inlineVariables ) {
+            delete [] m_variables;
+        }
+        m_variables = variables;
+        m_capacity *= 2;
+    }
+    m_variables[m_size++] = v;
     return *this;
 }
 
 size_t VariableSnapshot::size() const
 {
-    return m_variables->size();
+    return m_size;
 }
 
 
 AbstractVariable *&VariableSnapshot::operator[]( size_t idx )
 {
-    return (*m_variables)[idx];
+    return m_variables[idx];
+}
+
+DeferredMessage::DeferredMessage()
+    : m_data( m_inlineData ),
+    m_size( 0 ),
+    m_capacity( InlineCapacity )
+{
+}
+
+DeferredMessage::DeferredMessage( const DeferredMessage &other )
+    : m_data( m_inlineData ),
+    m_size( other.m_size ),
+    m_capacity( InlineCapacity )
+{
+    if ( m_size > m_capacity ) {
+        m_data = new char[m_size];
+        m_capacity = m_size;
+    }
+    memcpy( m_data, other.m_data, m_size );
+}
+
+DeferredMessage::~DeferredMessage()
+{
+    if ( m_data != m_inlineData ) {
+        delete [] m_data;
+    }
+}
+
+void DeferredMessage::grow( size_t size )
+{
+    size_t capacity = m_capacity * 2;
+    while ( capacity - m_size < size ) {
+        capacity *= 2;
+    }
+    char *data = new char[capacity];
+    memcpy( data, m_data, m_size );
+    if ( m_data != m_inlineData ) {
+        delete [] m_data;
+    }
+    m_data = data;
+    m_capacity = capacity;
+}
+
+void DeferredMessage::appendValue( const VariableValue &v )
+{
+    switch ( v.type() ) {
+        case VariableType::String:
+            appendString( v.asString() );
+            return;
+        case VariableType::Number:
+            if ( v.isSignedNumber() ) {
+                appendNumber( static_cast<vlonglong>( v.asNumber() ) );
+            } else {
+                appendNumber( v.asNumber() );
+            }
+            return;
+        case VariableType::Float:
+            appendFloat( v.asFloat() );
+            return;
+        case VariableType::Boolean:
+            appendBoolean( v.asBoolean() );
+            return;
+        case VariableType::Unknown:
+            assert( !"appendValue on Unknown VariableType" );
+    }
+}
+
+/* Numbers are converted by hand (and floats using snprintf) so that
+ * formatting doesn't need any memory; the output matches stringRep().
+ */
+const char *DeferredMessage::formatArgument( const char *pos, char *scratch, size_t scratchSize,
+                                             const char **text, size_t *length )
+{
+    const char type = *pos++;
+    switch ( type ) {
+        case StringArgument:
+            memcpy( length, pos, sizeof( *length ) );
+            pos += sizeof( *length );
+            *text = pos;
+            return pos + *length;
+        case SignedNumberArgument:
+        case UnsignedNumberArgument: {
+            vulonglong number;
+            memcpy( &number, pos, sizeof( number ) );
+            const bool negative = type == SignedNumberArgument && static_cast<vlonglong>( number ) < 0;
+            if ( negative ) {
+                number = 0 - number;
+            }
+            char *p = scratch + scratchSize;
+            do {
+                *--p = static_cast<char>( '0' + number % 10 );
+                number /= 10;
+            } while ( number != 0 );
+            if ( negative ) {
+                *--p = '-';
+            }
+            *text = p;
+            *length = scratch + scratchSize - p;
+            return pos + sizeof( number );
+        }
+        case FloatArgument: {
+            long double value;
+            memcpy( &value, pos, sizeof( value ) );
+            const int n = snprintf( scratch, scratchSize, "%Lg", value );
+            *text = scratch;
+            *length = n < 0 ? 0 : min( static_cast<size_t>( n ), scratchSize - 1 );
+            return pos + sizeof( value );
+        }
+        case BooleanArgument:
+            *text = *pos ? "true" : "false";
+            *length = *pos ? 4 : 5;
+            return pos + 1;
+    }
+    assert( !"Unreachable" );
+    *length = 0;
+    return pos;
+}
+
+string DeferredMessage::format() const
+{
+    string result;
+    result.reserve( m_size );
+    char scratch[64];
+    const char *pos = m_data, *end = m_data + m_size;
+    while ( pos != end ) {
+        const char *text;
+        size_t length;
+        pos = formatArgument( pos, scratch, sizeof( scratch ), &text, &length );
+        result.append( text, length );
+    }
+    return result;
+}
+
+size_t DeferredMessage::formatInto( char *buf, size_t bufsize ) const
+{
+    size_t written = 0;
+    char scratch[64];
+    const char *pos = m_data, *end = m_data + m_size;
+    while ( pos != end && written < bufsize ) {
+        const char *text;
+        size_t length;
+        pos = formatArgument( pos, scratch, sizeof( scratch ), &text, &length );
+        length = min( length, bufsize - written );
+        memcpy( buf + written, text, length );
+        written += length;
+    }
+    return written;
 }
 
 TRACELIB_NAMESPACE_END
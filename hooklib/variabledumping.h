@@ -26,7 +26,9 @@
 #include <stdio.h> // for snprintf
 
 #include <cstddef>
+#include <cstring> // for memcpy, strlen
 #include <memory>
+#include <new> // for placement new
 #include <sstream>
 #include <string>
 #include <vector>
@@ -96,6 +98,10 @@ public:
 
 private:
     VariableValue();
+    VariableValue &operator=( const VariableValue &rhs ); // disabled
+
+    // Strings shorter than this are stored in the value itself
+    static const size_t ShortStringSize = 24;
 
     VariableType::Value m_type;
     union {
@@ -105,6 +111,7 @@ private:
         char *string;
     } m_primitiveValue;
     bool m_isSignedNumber;
+    char m_shortString[ShortStringSize];
 };
 
 template <typename T>
@@ -151,26 +158,42 @@ TRACELIB_SPECIALIZE_CONVERSION_INTEGRAL(unsigned __int16, vulonglong)
 TRACELIB_SPECIALIZE_CONVERSION_INTEGRAL(unsigned __int32, vulonglong)
 #endif
 
-#define TRACELIB_SPECIALIZE_CONVERSION_USING_SSTREAM(T) \
+/* Characters and strings yield the same text as streaming them into a
+ * std::ostream would, without going through a stream; a null pointer yields
+ * an empty string.
+ */
+#define TRACELIB_SPECIALIZE_CONVERSION_CHARACTER(T) \
+template <> \
+inline VariableValue convertVariable( T val ) { \
+    const char s[] = { static_cast<char>( val ), '\0' }; \
+    return VariableValue::stringValue( s ); \
+}
+
+TRACELIB_SPECIALIZE_CONVERSION_CHARACTER(char)
+TRACELIB_SPECIALIZE_CONVERSION_CHARACTER(signed char)
+TRACELIB_SPECIALIZE_CONVERSION_CHARACTER(unsigned char)
+
+#undef TRACELIB_SPECIALIZE_CONVERSION_CHARACTER
+
+#define TRACELIB_SPECIALIZE_CONVERSION_CHARACTER_POINTER(T) \
 template <> \
 inline VariableValue convertVariable( T val ) { \
-    std::ostringstream str; \
-    str << val; \
-    return VariableValue::stringValue( str.str().c_str() ); \
+    return VariableValue::stringValue( val ? reinterpret_cast<const char *>( val ) : "" ); \
 }
 
-TRACELIB_SPECIALIZE_CONVERSION_USING_SSTREAM(char)
-TRACELIB_SPECIALIZE_CONVERSION_USING_SSTREAM(signed char)
-TRACELIB_SPECIALIZE_CONVERSION_USING_SSTREAM(unsigned char)
-TRACELIB_SPECIALIZE_CONVERSION_USING_SSTREAM(char *)
-TRACELIB_SPECIALIZE_CONVERSION_USING_SSTREAM(signed char *)
-TRACELIB_SPECIALIZE_CONVERSION_USING_SSTREAM(unsigned char *)
-TRACELIB_SPECIALIZE_CONVERSION_USING_SSTREAM(const char *)
-TRACELIB_SPECIALIZE_CONVERSION_USING_SSTREAM(const signed char *)
-TRACELIB_SPECIALIZE_CONVERSION_USING_SSTREAM(const unsigned char *)
-TRACELIB_SPECIALIZE_CONVERSION_USING_SSTREAM(std::string)
+TRACELIB_SPECIALIZE_CONVERSION_CHARACTER_POINTER(char *)
+TRACELIB_SPECIALIZE_CONVERSION_CHARACTER_POINTER(signed char *)
+TRACELIB_SPECIALIZE_CONVERSION_CHARACTER_POINTER(unsigned char *)
+TRACELIB_SPECIALIZE_CONVERSION_CHARACTER_POINTER(const char *)
+TRACELIB_SPECIALIZE_CONVERSION_CHARACTER_POINTER(const signed char *)
+TRACELIB_SPECIALIZE_CONVERSION_CHARACTER_POINTER(const unsigned char *)
+
+#undef TRACELIB_SPECIALIZE_CONVERSION_CHARACTER_POINTER
 
-#undef TRACELIB_SPECIALIZE_CONVERSION_USING_SSTREAM
+template <>
+inline VariableValue convertVariable( std::string val ) {
+    return VariableValue::stringValue( val.c_str() );
+}
 
 #if defined(_MSC_VER)
 #define snprintf _snprintf
@@ -178,15 +201,16 @@ TRACELIB_SPECIALIZE_CONVERSION_USING_SSTREAM(std::string)
 // msvc's stringstream does not prepend a 0x to pointers, so do that manually
 template <>
 inline VariableValue convertVariable( const void *val ) {
-    std::vector<char> buf( 11 );
+    char buf[11];
 #if defined(_MSC_VER)
 #  define TYPE_SPECIFIER_PTRDIFF_T "Ix"
 #else
 #  define TYPE_SPECIFIER_PTRDIFF_T "tx"
 #endif
-    snprintf( &buf[0], 11, "0x%08" TYPE_SPECIFIER_PTRDIFF_T, (ptrdiff_t)val );
+    snprintf( buf, sizeof( buf ), "0x%08" TYPE_SPECIFIER_PTRDIFF_T, (ptrdiff_t)val );
+    buf[sizeof( buf ) - 1] = '\0';
 #undef TYPE_SPECIFIED_PTRDIFF_T
-    return convertVariable( &buf[0] );
+    return VariableValue::stringValue( buf );
 }
 #if defined(_MSC_VER)
 #undef snprintf
@@ -226,6 +250,21 @@ AbstractVariable *makeConverter( const char *name, const T &o ) {
     return new Variable<T>( name, o );
 }
 
+// Used by TRACELIB_VAR; the variable is copied into the VariableSnapshot
+template <typename T>
+Variable<T> makeVariable( const char *name, const T &o ) {
+    return Variable<T>( name, o );
+}
+
+/* The variables of a trace entry. Copies of the variables added using
+ * addCopy() (or operator<< for Variable objects) are kept in storage which
+ * is part of the snapshot, so a snapshot of a handful of variables which
+ * lives on the stack doesn't allocate any memory. Further variables are
+ * put into chunks which are allocated as needed and released together with
+ * the snapshot.
+ *
+ * Variables added as pointers are not owned by the snapshot.
+ */
 class VariableSnapshot
 {
 public:
@@ -234,6 +273,17 @@ public:
 
     TRACELIB_EXPORT VariableSnapshot &operator<<( AbstractVariable *v );
 
+    template <typename T>
+    VariableSnapshot &operator<<( const Variable<T> &v ) {
+        return addCopy( v );
+    }
+
+    template <typename V>
+    VariableSnapshot &addCopy( const V &v ) {
+        AbstractVariable *copy = new ( allocate( sizeof( V ) ) ) V( v );
+        return *this << copy;
+    }
+
     TRACELIB_EXPORT size_t size() const;
     TRACELIB_EXPORT AbstractVariable *&operator[]( size_t idx );
 
@@ -246,7 +296,118 @@ private:
     VariableSnapshot& operator=( const VariableSnapshot& );
 #endif
 
-    std::vector<AbstractVariable *> *m_variables;
+    static const size_t InlineVariables = 8;
+    static const size_t InlineStorageSize = 256; // bytes
+    static const size_t StorageAlignment = 16;
+
+    struct Chunk;
+
+    void *allocate( size_t size ) {
+        size = ( size + StorageAlignment - 1 ) & ~( StorageAlignment - 1 );
+        if ( m_storageEnd - m_storagePos < static_cast<ptrdiff_t>( size ) ) {
+            allocateChunk( size );
+        }
+        void *p = m_storagePos;
+        m_storagePos += size;
+        return p;
+    }
+    TRACELIB_EXPORT void allocateChunk( size_t size );
+    bool ownsVariable( const AbstractVariable *v ) const;
+
+    AbstractVariable **m_variables;
+    size_t m_size;
+    size_t m_capacity;
+    char *m_storagePos;
+    char *m_storageEnd;
+    Chunk *m_chunks;
+    AbstractVariable *m_inlineVariables[InlineVariables];
+    union {
+        char bytes[InlineStorageSize];
+        long double alignLongDouble;
+        void *alignPointer;
+    } m_inlineStorage;
+};
+
+/* Collects the arguments of a trace message without converting them to
+ * text: strings are copied, numbers, floats and booleans are stored as they
+ * are. The text is built by format() (or formatInto()) only when the entry
+ * is actually serialized - which happens on the writer thread in case of an
+ * asynchronous writer, and never for entries which get dropped.
+ *
+ * Short messages fit into a buffer inside the object, so that capturing
+ * them doesn't allocate memory.
+ */
+class DeferredMessage
+{
+public:
+    TRACELIB_EXPORT DeferredMessage();
+    TRACELIB_EXPORT DeferredMessage( const DeferredMessage &other );
+    TRACELIB_EXPORT ~DeferredMessage();
+
+    bool isEmpty() const { return m_size == 0; }
+
+    void appendString( const char *s ) {
+        appendString( s, s ? strlen( s ) : 0 );
+    }
+    void appendString( const char *s, size_t length ) {
+        char *p = reserve( 1 + sizeof( length ) + length );
+        *p = StringArgument;
+        memcpy( p + 1, &length, sizeof( length ) );
+        if ( length > 0 ) {
+            memcpy( p + 1 + sizeof( length ), s, length );
+        }
+    }
+    void appendNumber( vlonglong v ) { appendArgument( SignedNumberArgument, &v, sizeof( v ) ); }
+    void appendNumber( vulonglong v ) { appendArgument( UnsignedNumberArgument, &v, sizeof( v ) ); }
+    void appendFloat( long double v ) { appendArgument( FloatArgument, &v, sizeof( v ) ); }
+    void appendBoolean( bool v ) {
+        const char c = v ? 1 : 0;
+        appendArgument( BooleanArgument, &c, sizeof( c ) );
+    }
+    TRACELIB_EXPORT void appendValue( const VariableValue &v );
+
+    /* Yields the same text as concatenating the stringRep() of all
+     * arguments. formatInto() writes at most bufsize characters (without
+     * a terminating null) and returns the number of characters written.
+     */
+    TRACELIB_EXPORT std::string format() const;
+    TRACELIB_EXPORT size_t formatInto( char *buf, size_t bufsize ) const;
+
+private:
+    DeferredMessage &operator=( const DeferredMessage &rhs ); // disabled
+
+    enum ArgumentType {
+        StringArgument,
+        SignedNumberArgument,
+        UnsignedNumberArgument,
+        FloatArgument,
+        BooleanArgument
+    };
+
+    static const size_t InlineCapacity = 128;
+
+    char *reserve( size_t size ) {
+        if ( m_capacity - m_size < size ) {
+            grow( size );
+        }
+        char *p = m_data + m_size;
+        m_size += size;
+        return p;
+    }
+    void appendArgument( ArgumentType type, const void *value, size_t size ) {
+        char *p = reserve( 1 + size );
+        *p = static_cast<char>( type );
+        memcpy( p + 1, value, size );
+    }
+    TRACELIB_EXPORT void grow( size_t size );
+
+    static const char *formatArgument( const char *pos, char *scratch, size_t scratchSize,
+                                       const char **text, size_t *length );
+
+    char *m_data;
+    size_t m_size;
+    size_t m_capacity;
+    char m_inlineData[InlineCapacity];
 };
 
 TRACELIB_NAMESPACE_END
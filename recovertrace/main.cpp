@@ -0,0 +1,200 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "../hooklib/mappedfileformat.h"
+#include "config.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QFile>
+
+using namespace TRACELIB_NAMESPACE_IDENT(MappedFileFormat);
+
+namespace Error
+{
+    const int None = 0;
+    const int CommandLineArgs = 1;
+    const int Open = 2;
+    const int File = 3;
+    const int Format = 4;
+}
+
+struct Record
+{
+    uint64_t position;
+    unsigned int length;
+};
+
+// Copies data out of the ring, which may wrap around at the end
+static void readData(const uchar *data, uint64_t capacity, uint64_t position,
+                     void *buf, size_t size)
+{
+    const size_t offset = static_cast<size_t>(position % capacity);
+    const size_t firstPart = offset + size <= capacity ? size : static_cast<size_t>(capacity - offset);
+    memcpy(buf, data + offset, firstPart);
+    if (firstPart < size) {
+        memcpy(static_cast<char *>(buf) + firstPart, data, size - firstPart);
+    }
+}
+
+/* Walks backwards from the write position until the given number of
+ * records (0 meaning all) was found or the next record was (possibly) overwritten.
+ * The records are returned most recent first.
+ */
+static bool findRecords(const uchar *file, qint64 fileSize, unsigned int count,
+                        std::vector<Record> *records, QString *errMsg)
+{
+    const Header *header = reinterpret_cast<const Header *>(file);
+    if (fileSize < static_cast<qint64>(HeaderSize) ||
+        memcmp(header->magic, Magic, sizeof(Magic)) != 0) {
+        *errMsg = "Not a memory mapped trace file";
+        return false;
+    }
+    if (header->version != Version || header->headerSize != HeaderSize) {
+        *errMsg = QString("Unsupported file format version %1").arg(header->version);
+        return false;
+    }
+
+    const uint64_t capacity = header->capacity;
+    const uint64_t writePosition = header->writePosition;
+    const uint64_t reservedPosition = header->reservedPosition;
+    if (capacity == 0 || static_cast<uint64_t>(fileSize) < HeaderSize + capacity ||
+        writePosition > reservedPosition || reservedPosition - writePosition > capacity) {
+        *errMsg = "Corrupt file header";
+        return false;
+    }
+
+    const uchar *data = file + HeaderSize;
+    const uint64_t oldestPosition = reservedPosition > capacity ? reservedPosition - capacity : 0;
+    uint64_t position = writePosition;
+    while (position - oldestPosition >= RecordOverhead &&
+           (count == 0 || records->size() < count)) {
+        unsigned int trailingLength;
+        readData(data, capacity, position - sizeof(trailingLength),
+                 &trailingLength, sizeof(trailingLength));
+        const unsigned int length = trailingLength & ~PaddingRecord;
+        if (length > position - oldestPosition - RecordOverhead) {
+            break;
+        }
+
+        const uint64_t recordPosition = position - length - RecordOverhead;
+        unsigned int leadingLength;
+        readData(data, capacity, recordPosition, &leadingLength, sizeof(leadingLength));
+        if (leadingLength != trailingLength) {
+            break;
+        }
+
+        if (!(trailingLength & PaddingRecord)) {
+            Record record;
+            record.position = recordPosition + sizeof(leadingLength);
+            record.length = length;
+            records->push_back(record);
+        }
+        position = recordPosition;
+    }
+    return true;
+}
+
+static void writeRecords(const uchar *file, const std::vector<Record> &records, FILE *output)
+{
+    const Header *header = reinterpret_cast<const Header *>(file);
+    const bool binaryData = header->flags & BinaryData;
+
+    std::vector<char> buf;
+    std::vector<Record>::const_reverse_iterator it, end = records.rend();
+    for (it = records.rbegin(); it != end; ++it) {
+        buf.resize(it->length);
+        if (!buf.empty()) {
+            readData(file + HeaderSize, header->capacity, it->position, &buf[0], buf.size());
+            fwrite(&buf[0], 1, buf.size(), output);
+        }
+        if (!binaryData) {
+            fputc('\n', output);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication a(argc, argv);
+    a.setApplicationVersion(QLatin1String(TRACELIB_VERSION_STR));
+
+    QCommandLineParser opt;
+    QCommandLineOption output(QStringList() << "o" << "output", "Output File to write the entries into, if not specified writes to stdout", "file");
+    QCommandLineOption entries(QStringList() << "n" << "entries", "Number of most recent entries to recover, all by default", "count");
+    opt.addHelpOption();
+    opt.addVersionOption();
+    opt.setApplicationDescription("Recovers the most recent trace entries from files written by the mmap output");
+    opt.addOption(output);
+    opt.addOption(entries);
+    opt.addPositionalArgument("mapped-file", "File written by the mmap output");
+    opt.process(a);
+
+    if( opt.positionalArguments().isEmpty() ) {
+        fprintf(stderr, "Missing command line argument.\n");
+        opt.showHelp(Error::CommandLineArgs);
+    }
+
+    unsigned int count = 0;
+    if (opt.isSet(entries)) {
+        bool ok;
+        count = opt.value(entries).toUInt(&ok);
+        if (!ok || count == 0) {
+            fprintf(stderr, "Invalid number of entries '%s'.\n", qPrintable(opt.value(entries)));
+            return Error::CommandLineArgs;
+        }
+    }
+
+    QFile mappedFile(opt.positionalArguments().at(0));
+    if (!mappedFile.open(QIODevice::ReadOnly)) {
+        fprintf(stderr, "Open error: %s\n", qPrintable(mappedFile.errorString()));
+        return Error::Open;
+    }
+    const uchar *file = mappedFile.map(0, mappedFile.size());
+    if (!file) {
+        fprintf(stderr, "Open error: %s\n", qPrintable(mappedFile.errorString()));
+        return Error::Open;
+    }
+
+    QString errMsg;
+    std::vector<Record> records;
+    if (!findRecords(file, mappedFile.size(), count, &records, &errMsg)) {
+        fprintf(stderr, "Format error: %s\n", qPrintable(errMsg));
+        return Error::Format;
+    }
+
+    FILE *outputStream;
+    if (!opt.isSet(output)) {
+        outputStream = stdout;
+    } else {
+        QString outputFile = opt.value(output);
+        outputStream = fopen(qPrintable(outputFile), "wb");
+        if (outputStream == NULL) {
+            fprintf(stderr, "File '%s' cannot be opened for writing.\n", qPrintable(outputFile));
+            return Error::File;
+        }
+    }
+
+    writeRecords(file, records, outputStream);
+    fclose(outputStream);
+    return Error::None;
+}
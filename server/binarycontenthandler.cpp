@@ -0,0 +1,389 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "binarycontenthandler.h"
+
+#include "../hooklib/binaryformat.h"
+
+#include <cstring>
+
+namespace BinaryFormat = TRACELIB_NAMESPACE_IDENT(BinaryFormat);
+
+// Larger records are assumed to be garbage rather than trace data
+static const quint32 MaximumRecordSize = 64 * 1024 * 1024;
+
+static quint64 readLittleEndian( const uchar *p, int size )
+{
+    quint64 v = 0;
+    for ( int i = size - 1; i >= 0; --i ) {
+        v = ( v << 8 ) | p[i];
+    }
+    return v;
+}
+
+/* Reads the fields of a single record; the data is owned by the caller and
+ * contains the complete record.
+ */
+class RecordReader
+{
+public:
+    RecordReader( const char *data, int size )
+        : m_data( reinterpret_cast<const uchar *>( data ) ),
+        m_size( size ),
+        m_pos( 0 )
+    {
+    }
+
+    quint8 readUInt8() {
+        require( 1 );
+        return m_data[m_pos++];
+    }
+
+    quint16 readUInt16() { return static_cast<quint16>( readNumber( 2 ) ); }
+    quint32 readUInt32() { return static_cast<quint32>( readNumber( 4 ) ); }
+    quint64 readUInt64() { return readNumber( 8 ); }
+
+    double readDouble() {
+        const quint64 bits = readUInt64();
+        double v;
+        memcpy( &v, &bits, sizeof( v ) );
+        return v;
+    }
+
+    QString readString() {
+        const quint32 len = readUInt32();
+        if ( len > static_cast<quint32>( m_size - m_pos ) ) {
+            throw BinaryParseException( QString::fromLatin1( "Truncated string in binary trace record" ) );
+        }
+        const QString s = QString::fromUtf8( reinterpret_cast<const char *>( m_data + m_pos ), len );
+        m_pos += len;
+        return s;
+    }
+
+private:
+    void require( int bytes ) const {
+        if ( m_size - m_pos < bytes ) {
+            throw BinaryParseException( QString::fromLatin1( "Truncated binary trace record" ) );
+        }
+    }
+
+    quint64 readNumber( int bytes ) {
+        require( bytes );
+        const quint64 v = readLittleEndian( m_data + m_pos, bytes );
+        m_pos += bytes;
+        return v;
+    }
+
+    const uchar *m_data;
+    const int m_size;
+    int m_pos;
+};
+
+BinaryContentHandler::BinaryContentHandler( XmlParseEventsHandler *handler, Symbolizer *symbolizer )
+    : m_handler( handler ),
+    m_symbolizer( symbolizer ),
+    m_bufferPos( 0 ),
+    m_readHeader( false ),
+    m_readProcessRecord( false ),
+    m_waitForSymbols( true ),
+    m_waitingForSymbols( false ),
+    m_pid( 0 )
+{
+}
+
+void BinaryContentHandler::addData( const QByteArray &data )
+{
+    m_buffer.append( data );
+}
+
+void BinaryContentHandler::stopWaitingForSymbols()
+{
+    m_waitForSymbols = false;
+}
+
+void BinaryContentHandler::continueParsing()
+{
+    m_waitingForSymbols = false;
+
+    if ( !m_readHeader ) {
+        if ( m_buffer.size() < static_cast<int>( BinaryFormat::HeaderSize ) ) {
+            return;
+        }
+        readHeader();
+    }
+
+    while ( m_buffer.size() - m_bufferPos >= 4 ) {
+        const uchar *p = reinterpret_cast<const uchar *>( m_buffer.constData() ) + m_bufferPos;
+        const quint32 recordSize = static_cast<quint32>( readLittleEndian( p, 4 ) );
+        if ( recordSize == 0 || recordSize > MaximumRecordSize ) {
+            throw BinaryParseException( QString::fromLatin1( "Invalid binary trace record size %1 at offset %2" )
+                                            .arg( recordSize )
+                                            .arg( m_bufferPos ) );
+        }
+        if ( static_cast<quint32>( m_buffer.size() - m_bufferPos - 4 ) < recordSize ) {
+            break;
+        }
+
+        RecordReader reader( m_buffer.constData() + m_bufferPos + 4, recordSize );
+        const unsigned char type = reader.readUInt8();
+        const int recordPos = m_bufferPos;
+        m_bufferPos += 4 + recordSize;
+        if ( !handleRecord( type, reader ) ) {
+            // Read again once the symbolizer resolved the backtrace
+            m_bufferPos = recordPos;
+            m_waitingForSymbols = true;
+            break;
+        }
+    }
+
+    // Drop the consumed data in one go instead of after every record
+    m_buffer.remove( 0, m_bufferPos );
+    m_bufferPos = 0;
+}
+
+void BinaryContentHandler::readHeader()
+{
+    if ( memcmp( m_buffer.constData(), BinaryFormat::Magic, BinaryFormat::MagicSize ) != 0 ) {
+        throw BinaryParseException( QString::fromLatin1( "Binary trace data lacks the stream header" ) );
+    }
+    RecordReader reader( m_buffer.constData() + BinaryFormat::MagicSize, 2 );
+    const quint16 version = reader.readUInt16();
+    if ( version > BinaryFormat::Version ) {
+        throw BinaryParseException( QString::fromLatin1( "Unsupported binary trace format version %1" ).arg( version ) );
+    }
+    m_bufferPos = BinaryFormat::HeaderSize;
+    m_readHeader = true;
+}
+
+// Returns false if the record has to be handled again later
+bool BinaryContentHandler::handleRecord( unsigned char type, RecordReader &reader )
+{
+    switch ( type ) {
+        case BinaryFormat::ProcessRecord:
+            handleProcessRecord( reader );
+            break;
+        case BinaryFormat::TracePointRecord:
+            handleTracePointRecord( reader );
+            break;
+        case BinaryFormat::TraceEntryRecord:
+            return handleTraceEntryRecord( reader );
+        case BinaryFormat::ShutdownRecord:
+            handleShutdownRecord( reader );
+            break;
+        case BinaryFormat::ModuleRecord:
+            handleModuleRecord( reader );
+            break;
+        default:
+            // Records added by later format versions are skipped
+            break;
+    }
+    return true;
+}
+
+void BinaryContentHandler::handleProcessRecord( RecordReader &reader )
+{
+    m_pid = static_cast<unsigned int>( reader.readUInt64() );
+    m_processStartTime = QDateTime::fromMSecsSinceEpoch( static_cast<qint64>( reader.readUInt64() ) );
+    m_processName = reader.readString();
+
+    m_traceKeys.clear();
+    const quint32 numKeys = reader.readUInt32();
+    for ( quint32 i = 0; i < numKeys; ++i ) {
+        TraceKey key;
+        key.enabled = reader.readUInt8() != 0;
+        key.name = reader.readString();
+        m_traceKeys.append( key );
+    }
+
+    StorageConfiguration cfg;
+    cfg.maximumSize = static_cast<unsigned long>( reader.readUInt64() );
+    cfg.shrinkBy = reader.readUInt16();
+    cfg.archiveDir = reader.readString();
+    m_readProcessRecord = true;
+
+    m_handler->applyStorageConfiguration( cfg );
+}
+
+void BinaryContentHandler::handleTracePointRecord( RecordReader &reader )
+{
+    const quint32 id = reader.readUInt32();
+    if ( id == 0 || id > static_cast<quint32>( m_tracePoints.size() ) + 1 ) {
+        throw BinaryParseException( QString::fromLatin1( "Unexpected trace point id %1 in binary trace data" ).arg( id ) );
+    }
+
+    TracePointDefinition def;
+    def.defined = true;
+    def.type = reader.readUInt8();
+    def.lineno = reader.readUInt32();
+    def.path = reader.readString();
+    def.function = reader.readString();
+    if ( reader.readUInt8() != 0 ) {
+        def.groupName = reader.readString();
+    }
+
+    if ( id > static_cast<quint32>( m_tracePoints.size() ) ) {
+        m_tracePoints.append( def );
+    } else {
+        m_tracePoints[id - 1] = def;
+    }
+}
+
+bool BinaryContentHandler::handleTraceEntryRecord( RecordReader &reader )
+{
+    const quint32 tracePointId = reader.readUInt32();
+    if ( tracePointId == 0 || tracePointId > static_cast<quint32>( m_tracePoints.size() ) ) {
+        throw BinaryParseException( QString::fromLatin1( "Trace entry refers to unknown trace point %1" ).arg( tracePointId ) );
+    }
+    if ( !m_readProcessRecord ) {
+        throw BinaryParseException( QString::fromLatin1( "Trace entry precedes process information in binary trace data" ) );
+    }
+    const TracePointDefinition &tracePoint = m_tracePoints[tracePointId - 1];
+
+    TraceEntry entry;
+    entry.pid = m_pid;
+    entry.processStartTime = m_processStartTime;
+    entry.processName = m_processName;
+    entry.traceKeys = m_traceKeys;
+    entry.type = tracePoint.type;
+    entry.path = tracePoint.path;
+    entry.lineno = tracePoint.lineno;
+    entry.function = tracePoint.function;
+    entry.groupName = tracePoint.groupName;
+
+    entry.tid = static_cast<unsigned int>( reader.readUInt64() );
+    entry.timestamp = QDateTime::fromMSecsSinceEpoch( static_cast<qint64>( reader.readUInt64() ) );
+    entry.stackPosition = static_cast<unsigned long>( reader.readUInt64() );
+    const quint8 flags = reader.readUInt8();
+
+    if ( flags & BinaryFormat::HasMessage ) {
+        entry.message = reader.readString();
+    }
+
+    if ( flags & BinaryFormat::HasVariables ) {
+        const quint32 numVariables = reader.readUInt32();
+        for ( quint32 i = 0; i < numVariables; ++i ) {
+            Variable var;
+            var.name = reader.readString();
+            var.type = static_cast<TRACELIB_NAMESPACE_IDENT(VariableType)::Value>( reader.readUInt8() );
+            // Format the values just like the XMLSerializer does
+            switch ( var.type ) {
+                case TRACELIB_NAMESPACE_IDENT(VariableType)::String:
+                    var.value = reader.readString();
+                    break;
+                case TRACELIB_NAMESPACE_IDENT(VariableType)::Number: {
+                    const bool isSigned = reader.readUInt8() != 0;
+                    const quint64 v = reader.readUInt64();
+                    var.value = isSigned ? QString::number( static_cast<qint64>( v ) )
+                                         : QString::number( v );
+                    break;
+                }
+                case TRACELIB_NAMESPACE_IDENT(VariableType)::Float:
+                    var.value = QString::number( reader.readDouble() );
+                    break;
+                case TRACELIB_NAMESPACE_IDENT(VariableType)::Boolean:
+                    var.value = QString::number( reader.readUInt8() != 0 ? 1 : 0 );
+                    break;
+                default:
+                    throw BinaryParseException( QString::fromLatin1( "Unknown variable type %1 in binary trace data" ).arg( var.type ) );
+            }
+            entry.variables.append( var );
+        }
+    }
+
+    if ( flags & BinaryFormat::HasBacktrace ) {
+        const quint32 depth = reader.readUInt32();
+        for ( quint32 i = 0; i < depth; ++i ) {
+            StackFrame frame;
+            frame.module = reader.readString();
+            frame.function = reader.readString();
+            frame.functionOffset = static_cast<size_t>( reader.readUInt64() );
+            frame.sourceFile = reader.readString();
+            frame.lineNumber = reader.readUInt32();
+            entry.backtrace.append( frame );
+        }
+    }
+
+    if ( ( flags & BinaryFormat::HasAddressBacktrace ) && !readAddressBacktrace( reader, entry ) ) {
+        return false;
+    }
+
+    m_handler->handleTraceEntry( entry );
+    return true;
+}
+
+void BinaryContentHandler::handleShutdownRecord( RecordReader &reader )
+{
+    ProcessShutdownEvent ev;
+    ev.pid = static_cast<unsigned int>( reader.readUInt64() );
+    ev.startTime = QDateTime::fromMSecsSinceEpoch( static_cast<qint64>( reader.readUInt64() ) );
+    ev.stopTime = QDateTime::fromMSecsSinceEpoch( static_cast<qint64>( reader.readUInt64() ) );
+    ev.name = reader.readString();
+    m_handler->handleShutdownEvent( ev );
+}
+
+void BinaryContentHandler::handleModuleRecord( RecordReader &reader )
+{
+    const quint32 id = reader.readUInt32();
+    if ( id == 0 || id > static_cast<quint32>( m_modules.size() ) + 1 ) {
+        throw BinaryParseException( QString::fromLatin1( "Unexpected module id %1 in binary trace data" ).arg( id ) );
+    }
+
+    ModuleDescription module;
+    module.base = reader.readUInt64();
+    module.fileName = reader.readString();
+    module.buildId = reader.readString();
+
+    if ( id > static_cast<quint32>( m_modules.size() ) ) {
+        m_modules.append( module );
+    } else {
+        m_modules[id - 1] = module;
+    }
+}
+
+bool BinaryContentHandler::readAddressBacktrace( RecordReader &reader, TraceEntry &entry )
+{
+    QList<Symbolizer::Address> addresses;
+    const quint32 depth = reader.readUInt32();
+    for ( quint32 i = 0; i < depth; ++i ) {
+        const quint32 moduleId = reader.readUInt32();
+        const quint64 offset = reader.readUInt64();
+        if ( moduleId > static_cast<quint32>( m_modules.size() ) ) {
+            throw BinaryParseException( QString::fromLatin1( "Backtrace refers to unknown module %1" ).arg( moduleId ) );
+        }
+        const ModuleDescription *module = moduleId > 0 ? &m_modules[moduleId - 1] : 0;
+        addresses.append( qMakePair( module, offset ) );
+    }
+
+    if ( m_symbolizer ) {
+        return m_symbolizer->resolve( addresses, &entry.backtrace ) || !m_waitForSymbols;
+    }
+
+    QList<Symbolizer::Address>::ConstIterator it, end = addresses.end();
+    for ( it = addresses.begin(); it != end; ++it ) {
+        StackFrame frame;
+        if ( it->first ) {
+            frame.module = it->first->fileName;
+        }
+        frame.function = QString::fromLatin1( "[0x%1]" ).arg( it->second, 0, 16 );
+        frame.functionOffset = 0;
+        frame.lineNumber = 0;
+        entry.backtrace.append( frame );
+    }
+    return true;
+}
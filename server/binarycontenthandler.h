@@ -0,0 +1,105 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACER_BINARYCONTENTHANDLER_H
+#define TRACER_BINARYCONTENTHANDLER_H
+
+#include "xmlcontenthandler.h"
+#include "symbolizer.h"
+
+#include <QByteArray>
+#include <QList>
+#include <QVector>
+
+class BinaryParseException : public std::runtime_error
+{
+public:
+    BinaryParseException( const QString &what )
+        : std::runtime_error( what.toUtf8().constData() )
+    {
+    }
+};
+
+class RecordReader;
+
+/* Decodes the stream written by the BinarySerializer of the hooklib (see
+ * hooklib/binaryformat.h). Process information and trace point definitions
+ * are sent just once per stream, so they are kept here and copied into each
+ * decoded trace entry.
+ */
+class BinaryContentHandler
+{
+public:
+    /* The symbolizer resolves backtraces which were sent as plain
+     * addresses; without one, such frames only show the addresses.
+     */
+    BinaryContentHandler( XmlParseEventsHandler *handler, Symbolizer *symbolizer = 0 );
+
+    void addData( const QByteArray &data );
+
+    /* Stops at a trace entry whose backtrace the symbolizer is still
+     * looking up, so that the entries are passed on in order; parsing
+     * continues with that entry once called again after the symbolizer
+     * emitted framesResolved().
+     */
+    void continueParsing();
+    bool isWaitingForSymbols() const { return m_waitingForSymbols; }
+
+    // Passes on the remaining entries without waiting for the symbolizer
+    void stopWaitingForSymbols();
+
+private:
+    struct TracePointDefinition
+    {
+        TracePointDefinition() : defined( false ), type( 0 ), lineno( 0 ) { }
+
+        bool defined;
+        unsigned int type;
+        unsigned long lineno;
+        QString path;
+        QString function;
+        QString groupName;
+    };
+
+    void readHeader();
+    bool handleRecord( unsigned char type, RecordReader &reader );
+    void handleProcessRecord( RecordReader &reader );
+    void handleTracePointRecord( RecordReader &reader );
+    bool handleTraceEntryRecord( RecordReader &reader );
+    void handleShutdownRecord( RecordReader &reader );
+    void handleModuleRecord( RecordReader &reader );
+    bool readAddressBacktrace( RecordReader &reader, TraceEntry &entry );
+
+    XmlParseEventsHandler *m_handler;
+    Symbolizer *m_symbolizer;
+    QByteArray m_buffer;
+    int m_bufferPos;
+    bool m_readHeader;
+    bool m_readProcessRecord;
+    bool m_waitForSymbols;
+    bool m_waitingForSymbols;
+    unsigned int m_pid;
+    QDateTime m_processStartTime;
+    QString m_processName;
+    QList<TraceKey> m_traceKeys;
+    QVector<TracePointDefinition> m_tracePoints;
+    QVector<ModuleDescription> m_modules;
+};
+
+#endif // TRACER_BINARYCONTENTHANDLER_H
@@ -23,6 +23,7 @@
 #include <stdexcept>
 #include <QDataStream>
 #include <QDebug>
+#include <QDir>
 #include <QFile>
 #include <QSqlDatabase>
 #include <QSqlError>
@@ -50,14 +51,19 @@ Transaction::~Transaction()
     m_query.exec( m_commitChanges ? "COMMIT;" : "ROLLBACK;" );
 }
 
+void Transaction::failed( const QSqlQuery &query, const QString &statement )
+{
+    m_commitChanges = false;
+    throw SQLTransactionException( QString( "Failed to store entry in database: executing SQL command '%1' failed: %2" )
+                                    .arg( statement ).arg( query.lastError().text() ),
+                                   query.lastError().text(),
+                                   query.lastError().nativeErrorCode() );
+}
+
 QVariant Transaction::exec( const QString &statement )
 {
     if ( !m_query.exec( statement ) ) {
-        m_commitChanges = false;
-        throw SQLTransactionException( QString( "Failed to store entry in database: executing SQL command '%1' failed: %2" )
-                                        .arg( statement ).arg( m_query.lastError().text() ),
-                                       m_query.lastError().text(),
-                                       m_query.lastError().nativeErrorCode() );
+        failed( m_query, statement );
     }
     if ( m_query.next() ) {
         return m_query.value( 0 );
@@ -68,18 +74,38 @@ QVariant Transaction::exec( const QString &statement )
 QVariant Transaction::insert( const QString &statement )
 {
     if ( !m_query.exec( statement ) ) {
-        m_commitChanges = false;
-        throw SQLTransactionException( QString( "Failed to store entry in database: executing SQL command '%1' failed: %2" )
-                                        .arg( statement ).arg( m_query.lastError().text() ),
-                                       m_query.lastError().text(),
-                                       m_query.lastError().nativeErrorCode() );
+        failed( m_query, statement );
     }
 
     assert( m_query.driver()->hasFeature( QSqlDriver::LastInsertId ) );
     return m_query.lastInsertId();
 }
 
-const int Database::expectedVersion = 5;
+QVariant Transaction::exec( QSqlQuery &query )
+{
+    if ( !query.exec() ) {
+        failed( query, query.lastQuery() );
+    }
+    QVariant v;
+    if ( query.next() ) {
+        v = query.value( 0 );
+    }
+    // Resets the statement so that it doesn't keep the database locked
+    query.finish();
+    return v;
+}
+
+QVariant Transaction::insert( QSqlQuery &query )
+{
+    if ( !query.exec() ) {
+        failed( query, query.lastQuery() );
+    }
+
+    assert( query.driver()->hasFeature( QSqlDriver::LastInsertId ) );
+    return query.lastInsertId();
+}
+
+const int Database::expectedVersion = 6;
 
 static const char * const schemaStatements[] = {
     "CREATE TABLE schema_downgrade (from_version INTEGER,"
@@ -129,16 +155,91 @@ static const char * const schemaStatements[] = {
     " UNIQUE(name));"
 };
 
+/* Indexes needed for looking up the variables and the backtrace of an
+ * entry, for the watch tree (which groups the entries by trace point and
+ * thread) and for removing unreferenced rows when archiving entries.
+ * Introduced with version 6.
+ */
+static const char * const indexStatements[] = {
+    "CREATE INDEX IF NOT EXISTS variable_entry_index ON variable (trace_entry_id);",
+    "CREATE INDEX IF NOT EXISTS stackframe_entry_index ON stackframe (trace_entry_id, depth);",
+    "CREATE INDEX IF NOT EXISTS trace_entry_point_index ON trace_entry (trace_point_id, traced_thread_id);",
+    "CREATE INDEX IF NOT EXISTS trace_entry_thread_index ON trace_entry (traced_thread_id);",
+    "CREATE INDEX IF NOT EXISTS trace_entry_timestamp_index ON trace_entry (timestamp);"
+};
+
+static const char * const dropIndexStatements[] = {
+    "DROP INDEX IF EXISTS variable_entry_index;",
+    "DROP INDEX IF EXISTS stackframe_entry_index;",
+    "DROP INDEX IF EXISTS trace_entry_point_index;",
+    "DROP INDEX IF EXISTS trace_entry_thread_index;",
+    "DROP INDEX IF EXISTS trace_entry_timestamp_index;"
+};
+
 static const char * const downgradeStatementsInsert[] = {
     0, // can't downgrade further than version 0
     "INSERT INTO schema_downgrade VALUES(1, 'NOT IMPLEMENTED');",
     "INSERT INTO schema_downgrade VALUES(2, 'NOT IMPLEMENTED');",
     "INSERT INTO schema_downgrade VALUES(3, 'NOT IMPLEMENTED');",
     "INSERT INTO schema_downgrade VALUES(4, 'NOT IMPLEMENTED');",
-    "INSERT INTO schema_downgrade VALUES(5, 'NOT IMPLEMENTED');"
+    "INSERT INTO schema_downgrade VALUES(5, 'NOT IMPLEMENTED');",
+    "INSERT INTO schema_downgrade VALUES(6, '"
+    "DROP INDEX IF EXISTS variable_entry_index;"
+    "DROP INDEX IF EXISTS stackframe_entry_index;"
+    "DROP INDEX IF EXISTS trace_entry_point_index;"
+    "DROP INDEX IF EXISTS trace_entry_thread_index;"
+    "DROP INDEX IF EXISTS trace_entry_timestamp_index;');"
+};
+
+/* Segment files only contain the tables which grow with every stored
+ * entry; %1 is replaced with the name the segment is attached as.
+ */
+static const char * const segmentSchemaStatements[] = {
+    "CREATE TABLE IF NOT EXISTS %1.trace_entry (id INTEGER PRIMARY KEY AUTOINCREMENT,"
+    " traced_thread_id INTEGER,"
+    " timestamp INTEGER,"
+    " trace_point_id INTEGER,"
+    " message TEXT,"
+    " stack_position INTEGER);",
+    "CREATE TABLE IF NOT EXISTS %1.variable (trace_entry_id INTEGER,"
+    " name TEXT,"
+    " value TEXT,"
+    " type INTEGER);",
+    "CREATE TABLE IF NOT EXISTS %1.stackframe (trace_entry_id INTEGER,"
+    " depth INTEGER,"
+    " module_name TEXT,"
+    " function_name TEXT,"
+    " offset INTEGER,"
+    " file_name TEXT,"
+    " line INTEGER);",
+    "CREATE INDEX IF NOT EXISTS %1.variable_entry_index ON variable (trace_entry_id);",
+    "CREATE INDEX IF NOT EXISTS %1.stackframe_entry_index ON stackframe (trace_entry_id, depth);",
+    "CREATE INDEX IF NOT EXISTS %1.trace_entry_point_index ON trace_entry (trace_point_id, traced_thread_id);",
+    "CREATE INDEX IF NOT EXISTS %1.trace_entry_thread_index ON trace_entry (traced_thread_id);",
+    "CREATE INDEX IF NOT EXISTS %1.trace_entry_timestamp_index ON trace_entry (timestamp);"
+};
 
+static const char * const segmentTables[] = {
+    "trace_entry",
+    "variable",
+    "stackframe"
 };
 
+static bool execStatements(QSqlDatabase db, const char * const statements[],
+                           unsigned numStatements, QString *errMsg)
+{
+    QSqlQuery query(db);
+    for (unsigned i = 0; i < numStatements; ++i) {
+        if (!query.exec(statements[i])) {
+            *errMsg = QObject::tr("Failed to execute '%1': %2")
+                .arg(statements[i])
+                .arg(query.lastError().text());
+            return false;
+        }
+    }
+    return true;
+}
+
 int Database::currentVersion( QSqlDatabase db, QString *errMsg )
 {
     assert( errMsg != NULL );
@@ -178,13 +279,19 @@ bool Database::checkCompatibility( QSqlDatabase db, QString *errMsg )
     return false;
 }
 
-// includes version check
+static bool upgradeToVersion6(QSqlDatabase db, QString *errMsg);
+
+/* includes version check; databases of version 5 are upgraded in place
+ * since version 6 merely added indexes.
+ */
 QSqlDatabase Database::open(const QString &fileName,
 			    QString *errMsg)
 {
     QSqlDatabase db = openAnyVersion(fileName, errMsg);
     if (!db.isValid())
 	return QSqlDatabase();
+    if (currentVersion(db, errMsg) == 5 && !upgradeToVersion6(db, errMsg))
+	return QSqlDatabase();
     if (!checkCompatibility(db, errMsg))
 	return QSqlDatabase();
     return db;
@@ -210,6 +317,12 @@ QSqlDatabase Database::create(const QString &fileName,
 	    return QSqlDatabase();
 	}
     }
+    if (!execStatements(db, indexStatements,
+                        sizeof(indexStatements) / sizeof(indexStatements[0]),
+                        errMsg)) {
+        query.exec("ROLLBACK;");
+        return QSqlDatabase();
+    }
     // statements that allow users of older versions
     // to downgrade a database created by us
     for (int v = 1; v <= expectedVersion; ++v) {
@@ -281,9 +394,14 @@ static void downgradeVersion(QSqlDatabase db, int version)
     QString sql = downgradeStatementsForVersion(db, version);
     db.transaction();
     QSqlQuery query(db);
-    if (!query.exec(sql)) {
-        db.rollback();
-        throw Qruntime_error(query.lastError().text());
+    // The driver only executes a single statement at a time
+    const QStringList statements = sql.split(';', Qt::SkipEmptyParts);
+    QStringList::ConstIterator it, end = statements.end();
+    for (it = statements.begin(); it != end; ++it) {
+        if (!query.exec(*it)) {
+            db.rollback();
+            throw Qruntime_error(query.lastError().text());
+        }
     }
     // even remove the downgrade statements to make the conversion
     // perfect. remember that they are being used to designate the
@@ -373,6 +491,25 @@ static bool upgradeToVersion5(QSqlDatabase db, QString *errMsg)
     return true;
 }
 
+static bool upgradeToVersion6(QSqlDatabase db, QString *errMsg)
+{
+    QSqlQuery query(db);
+    query.exec("BEGIN TRANSACTION;");
+    if (!execStatements(db, indexStatements,
+                        sizeof(indexStatements) / sizeof(indexStatements[0]),
+                        errMsg)) {
+        query.exec("ROLLBACK;");
+        return false;
+    }
+    if (!query.exec(downgradeStatementsInsert[6])) {
+        *errMsg = query.lastError().text();
+        query.exec("ROLLBACK;");
+        return false;
+    }
+    query.exec("COMMIT;");
+    return true;
+}
+
 static bool upgradeVersion(QSqlDatabase db, int version,
 			   QString *errMsg)
 {
@@ -382,6 +519,8 @@ static bool upgradeVersion(QSqlDatabase db, int version,
     case 4:
     return upgradeToVersion5(db, errMsg);
 	break;
+    case 5:
+	return upgradeToVersion6(db, errMsg);
     default:
 	*errMsg = QObject::tr("Automatic upgrade to version %1 is not implemented");
 	return false;
@@ -408,6 +547,20 @@ bool Database::upgrade(QSqlDatabase db, QString *errMsg)
     return true;
 }
 
+bool Database::createIndexes(QSqlDatabase db, QString *errMsg)
+{
+    return execStatements(db, indexStatements,
+                          sizeof(indexStatements) / sizeof(indexStatements[0]),
+                          errMsg);
+}
+
+bool Database::dropIndexes(QSqlDatabase db, QString *errMsg)
+{
+    return execStatements(db, dropIndexStatements,
+                          sizeof(dropIndexStatements) / sizeof(dropIndexStatements[0]),
+                          errMsg);
+}
+
 bool Database::isValidFileName(const QString &fileName,
                                QString *errMsg)
 {
@@ -425,6 +578,120 @@ bool Database::isValidFileName(const QString &fileName,
     return true;
 }
 
+// SQLite allows attaching up to ten databases by default
+const int Database::maximumSegmentCount = 8;
+
+QString Database::segmentDirectory(const QString &traceFile)
+{
+    return traceFile + ".d";
+}
+
+// The file names contain the creation time, so they sort by age
+QStringList Database::segmentFiles(const QString &traceFile)
+{
+    const QDir dir(segmentDirectory(traceFile));
+    const QStringList names = dir.entryList(QStringList() << "segment-*.trace",
+                                            QDir::Files, QDir::Name);
+    QStringList files;
+    QStringList::ConstIterator it, end = names.end();
+    for (it = names.begin(); it != end; ++it) {
+        files.append(dir.filePath(*it));
+    }
+    return files;
+}
+
+// Creates the segment tables in case the segment file is new
+bool Database::attachSegment(QSqlDatabase db, const QString &fileName,
+                             const QString &schemaName, QString *errMsg)
+{
+    QSqlQuery query(db);
+    query.prepare(QString("ATTACH DATABASE ? AS %1;").arg(schemaName));
+    query.addBindValue(fileName);
+    if (!query.exec()) {
+        *errMsg = QObject::tr("Failed to attach segment %1: %2")
+            .arg(fileName)
+            .arg(query.lastError().text());
+        return false;
+    }
+
+    for (unsigned i = 0; i < sizeof(segmentSchemaStatements) / sizeof(segmentSchemaStatements[0]); ++i) {
+        const QString statement = QString(segmentSchemaStatements[i]).arg(schemaName);
+        if (!query.exec(statement)) {
+            *errMsg = QObject::tr("Failed to execute '%1': %2")
+                .arg(statement)
+                .arg(query.lastError().text());
+            query.exec(QString("DETACH DATABASE %1;").arg(schemaName));
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Database::attachSegments(QSqlDatabase db, QString *errMsg)
+{
+    detachSegments(db);
+
+    QStringList files = segmentFiles(db.databaseName());
+    if (files.size() > maximumSegmentCount) {
+        files = files.mid(files.size() - maximumSegmentCount);
+    }
+    if (files.isEmpty()) {
+        return true;
+    }
+
+    for (int i = 0; i < files.size(); ++i) {
+        if (!attachSegment(db, files[i], QString("segment_%1").arg(i), errMsg)) {
+            detachSegments(db);
+            return false;
+        }
+    }
+
+    /* Unqualified table names are looked up in the temp schema first, so
+     * the views take the place of the (possibly empty) tables of the trace
+     * database.
+     */
+    QSqlQuery query(db);
+    for (unsigned t = 0; t < sizeof(segmentTables) / sizeof(segmentTables[0]); ++t) {
+        QString select = QString("SELECT * FROM main.%1").arg(segmentTables[t]);
+        for (int i = 0; i < files.size(); ++i) {
+            select += QString(" UNION ALL SELECT * FROM segment_%1.%2").arg(i).arg(segmentTables[t]);
+        }
+        const QString statement = QString("CREATE TEMP VIEW %1 AS %2;").arg(segmentTables[t]).arg(select);
+        if (!query.exec(statement)) {
+            *errMsg = QObject::tr("Failed to execute '%1': %2")
+                .arg(statement)
+                .arg(query.lastError().text());
+            detachSegments(db);
+            return false;
+        }
+    }
+    return true;
+}
+
+void Database::detachSegments(QSqlDatabase db)
+{
+    QSqlQuery query(db);
+    for (unsigned t = 0; t < sizeof(segmentTables) / sizeof(segmentTables[0]); ++t) {
+        query.exec(QString("DROP VIEW IF EXISTS temp.%1;").arg(segmentTables[t]));
+    }
+
+    QStringList schemaNames;
+    if (query.exec("PRAGMA database_list;")) {
+        while (query.next()) {
+            const QString name = query.value(1).toString();
+            if (name.startsWith("segment_")) {
+                schemaNames.append(name);
+            }
+        }
+    }
+    query.finish();
+
+    QStringList::ConstIterator it, end = schemaNames.end();
+    for (it = schemaNames.begin(); it != end; ++it) {
+        query.exec(QString("DETACH DATABASE %1;").arg(*it));
+    }
+}
+
 QList<StackFrame> Database::backtraceForEntry(QSqlDatabase db,
                                               unsigned int entryId)
 {
@@ -507,21 +774,31 @@ void Database::trimTo(QSqlDatabase db, size_t nMostRecent)
      * with a WHERE clause.
      */
     if ( nMostRecent == 0 ) {
+        // Segments can't be detached while a transaction is in progress
+        detachSegments( db );
+        const QStringList segments = segmentFiles( db.databaseName() );
+        QStringList::ConstIterator it, end = segments.end();
+        for ( it = segments.begin(); it != end; ++it ) {
+            if ( !QFile::remove( *it ) ) {
+                qWarning() << "Database::trimTo: failed to remove segment" << *it;
+            }
+        }
+
         Transaction transaction( db );
-        transaction.exec( "DELETE FROM trace_entry;" );
+        transaction.exec( "DELETE FROM main.trace_entry;" );
 
         // Resets all AUTOINCREMENT fields in trace_entry to zero
-        transaction.exec( "DELETE FROM sqlite_sequence WHERE name='trace_entry';" );
-
-        transaction.exec( "DELETE FROM trace_point;" );
-        transaction.exec( "DELETE FROM function_name;" );
-        transaction.exec( "DELETE FROM path_name;" );
-        transaction.exec( "DELETE FROM process;" );
-        transaction.exec( "DELETE FROM traced_thread;" );
-        transaction.exec( "DELETE FROM variable;" );
-        transaction.exec( "DELETE FROM stackframe;" );
+        transaction.exec( "DELETE FROM main.sqlite_sequence WHERE name='trace_entry';" );
+
+        transaction.exec( "DELETE FROM main.trace_point;" );
+        transaction.exec( "DELETE FROM main.function_name;" );
+        transaction.exec( "DELETE FROM main.path_name;" );
+        transaction.exec( "DELETE FROM main.process;" );
+        transaction.exec( "DELETE FROM main.traced_thread;" );
+        transaction.exec( "DELETE FROM main.variable;" );
+        transaction.exec( "DELETE FROM main.stackframe;" );
 #if 0 // cache for the user's convenenience
-        transaction.exec( "DELETE FROM trace_point_group;" );
+        transaction.exec( "DELETE FROM main.trace_point_group;" );
 #endif
         return;
     }
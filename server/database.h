@@ -132,10 +132,16 @@ public:
     QVariant exec( const QString &statement );
     QVariant insert( const QString &statement );
 
+    // For prepared queries with all values bound already
+    QVariant exec( QSqlQuery &query );
+    QVariant insert( QSqlQuery &query );
+
 private:
     Transaction( const Transaction &other );
     void operator=( const Transaction &rhs );
 
+    void failed( const QSqlQuery &query, const QString &statement );
+
     QSqlQuery m_query;
     bool m_commitChanges;
 };
@@ -157,9 +163,33 @@ public:
     static bool downgrade(QSqlDatabase db, QString *errMsg);
     static bool upgrade(QSqlDatabase db, QString *errMsg);
 
+    /* Storing many entries is faster without the indexes; they can be
+     * dropped before a bulk load and created again afterwards.
+     */
+    static bool createIndexes(QSqlDatabase db, QString *errMsg);
+    static bool dropIndexes(QSqlDatabase db, QString *errMsg);
+
     static bool isValidFileName(const QString &fileName,
                                 QString *errMsg);
 
+    /* Instead of the trace database itself, the server can store the trace
+     * entries (including their variables and backtraces) in a series of
+     * segment files kept in a directory next to the database, e.g.
+     * foo.trace.d for foo.trace. The oldest segments are deleted as a whole.
+     *
+     * attachSegments() makes the entries of all segments available to the
+     * given connection under the usual table names, by means of temporary
+     * views. Since SQLite limits the number of attached databases, only the
+     * most recent maximumSegmentCount segments are attached.
+     */
+    static const int maximumSegmentCount;
+    static QString segmentDirectory(const QString &traceFile);
+    static QStringList segmentFiles(const QString &traceFile);
+    static bool attachSegment(QSqlDatabase db, const QString &fileName,
+                              const QString &schemaName, QString *errMsg);
+    static bool attachSegments(QSqlDatabase db, QString *errMsg);
+    static void detachSegments(QSqlDatabase db);
+
     static QList<StackFrame> backtraceForEntry(QSqlDatabase db,
                                                unsigned int entryId);
     static QStringList seenGroupIds(QSqlDatabase db);
@@ -20,9 +20,13 @@
 #include "databasefeeder.h"
 
 #include "database.h"
-#include "lru_cache.h"
 
+#include <QDateTime>
+#include <QDebug>
 #include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
 #include <QSqlDatabase>
 #include <QSqlError>
 #include <QSqlQuery>
@@ -33,12 +37,196 @@
 
 using namespace std;
 
-static bool getGroupId( QSqlDatabase db, Transaction *transaction, const QString &name, unsigned int *id )
+/* SQLite limits the number of parameters per statement to 999 by default,
+ * so multi-row inserts have to be split up.
+ */
+static const int MaximumRowsPerInsert = 64;
+
+/* Prepared versions of all statements needed for storing trace entries;
+ * they are created once per DatabaseFeeder so that SQLite doesn't have to
+ * compile them again for every entry.
+ */
+class PreparedStatements
+{
+public:
+    enum Statement {
+        SelectGroupId,
+        InsertGroup,
+        SelectPathId,
+        InsertPath,
+        SelectFunctionId,
+        InsertFunction,
+        SelectProcessId,
+        InsertProcess,
+        SelectThreadId,
+        InsertThread,
+        SelectTracePointId,
+        InsertTracePoint,
+        InsertTraceEntry,
+        NumStatements
+    };
+
+    explicit PreparedStatements( QSqlDatabase db );
+    ~PreparedStatements();
+
+    QSqlQuery &query( Statement statement );
+    QSqlQuery &insertVariablesQuery( int numRows );
+    QSqlQuery &insertStackFramesQuery( int numRows );
+
+    void setEntrySchema( const QString &schemaName );
+
+private:
+    PreparedStatements( const PreparedStatements &other ); // disabled
+    void operator=( const PreparedStatements &rhs ); // disabled
+
+    QSqlQuery *prepare( const QString &statement );
+    QSqlQuery &multiRowInsertQuery( QHash<int, QSqlQuery *> &queries,
+                                    const char *table, int numColumns,
+                                    int numRows );
+
+    QSqlDatabase m_db;
+    QString m_entrySchema;
+    QSqlQuery *m_queries[NumStatements];
+    QHash<int, QSqlQuery *> m_variableInserts;
+    QHash<int, QSqlQuery *> m_stackFrameInserts;
+};
+
+static const char * const statementTexts[PreparedStatements::NumStatements] = {
+    "SELECT id FROM trace_point_group WHERE name=?;",
+    "INSERT INTO trace_point_group VALUES(NULL, ?);",
+    "SELECT id FROM path_name WHERE name=?;",
+    "INSERT INTO path_name VALUES(NULL, ?);",
+    "SELECT id FROM function_name WHERE name=?;",
+    "INSERT INTO function_name VALUES(NULL, ?);",
+    "SELECT id FROM process WHERE pid=? AND start_time=?;",
+    "INSERT INTO process VALUES(NULL, ?, ?, ?, 0);",
+    "SELECT id FROM traced_thread WHERE process_id=? AND tid=?;",
+    "INSERT INTO traced_thread VALUES(NULL, ?, ?);",
+    "SELECT id FROM trace_point WHERE type=? AND path_id=? AND line=? AND function_id=? AND group_id=?;",
+    "INSERT INTO trace_point VALUES(NULL, ?, ?, ?, ?, ?);",
+    "INSERT INTO %1.trace_entry VALUES(NULL, ?, ?, ?, ?, ?);"
+};
+
+PreparedStatements::PreparedStatements( QSqlDatabase db )
+    : m_db( db ),
+    m_entrySchema( "main" )
+{
+    for ( int i = 0; i < NumStatements; ++i ) {
+        m_queries[i] = 0;
+    }
+}
+
+PreparedStatements::~PreparedStatements()
+{
+    for ( int i = 0; i < NumStatements; ++i ) {
+        delete m_queries[i];
+    }
+    qDeleteAll( m_variableInserts );
+    qDeleteAll( m_stackFrameInserts );
+}
+
+QSqlQuery *PreparedStatements::prepare( const QString &statement )
+{
+    QSqlQuery *query = new QSqlQuery( m_db );
+    query->setForwardOnly( true );
+    if ( !query->prepare( statement ) ) {
+        const QString error = query->lastError().text();
+        delete query;
+        throw runtime_error( QString( "Failed to prepare SQL command '%1': %2" ).arg( statement ).arg( error ).toUtf8().constData() );
+    }
+    return query;
+}
+
+QSqlQuery &PreparedStatements::query( Statement statement )
+{
+    if ( !m_queries[statement] ) {
+        QString text = QString::fromLatin1( statementTexts[statement] );
+        if ( statement == InsertTraceEntry ) {
+            text = text.arg( m_entrySchema );
+        }
+        m_queries[statement] = prepare( text );
+    }
+    return *m_queries[statement];
+}
+
+QSqlQuery &PreparedStatements::multiRowInsertQuery( QHash<int, QSqlQuery *> &queries,
+                                                    const char *table, int numColumns,
+                                                    int numRows )
+{
+    QSqlQuery *&query = queries[numRows];
+    if ( !query ) {
+        QString row = "(?";
+        for ( int i = 1; i < numColumns; ++i ) {
+            row += ", ?";
+        }
+        row += ")";
+
+        QString statement = QString( "INSERT INTO %1.%2 VALUES%3" ).arg( m_entrySchema ).arg( table ).arg( row );
+        for ( int i = 1; i < numRows; ++i ) {
+            statement += ", " + row;
+        }
+        statement += ";";
+        query = prepare( statement );
+    }
+    return *query;
+}
+
+QSqlQuery &PreparedStatements::insertVariablesQuery( int numRows )
+{
+    return multiRowInsertQuery( m_variableInserts, "variable", 4, numRows );
+}
+
+QSqlQuery &PreparedStatements::insertStackFramesQuery( int numRows )
+{
+    return multiRowInsertQuery( m_stackFrameInserts, "stackframe", 7, numRows );
+}
+
+/* Trace entries, variables and backtraces are stored in the given schema,
+ * which is either the trace database itself or an attached segment. The
+ * statements using the previous schema are finalized, so that it can be
+ * detached afterwards.
+ */
+void PreparedStatements::setEntrySchema( const QString &schemaName )
+{
+    delete m_queries[InsertTraceEntry];
+    m_queries[InsertTraceEntry] = 0;
+    qDeleteAll( m_variableInserts );
+    m_variableInserts.clear();
+    qDeleteAll( m_stackFrameInserts );
+    m_stackFrameInserts.clear();
+    m_entrySchema = schemaName;
+}
+
+/* Looks up the id of a row using the given SELECT statement and inserts the
+ * row using the given INSERT statement in case it doesn't exist yet; both
+ * statements take the same values.
+ */
+static QVariant selectOrInsert( PreparedStatements *statements, Transaction *transaction,
+                                PreparedStatements::Statement selectStatement,
+                                PreparedStatements::Statement insertStatement,
+                                const QVariantList &values )
 {
-    QVariant v = transaction->exec( QString( "SELECT id FROM trace_point_group WHERE name=%1;" ).arg( Database::formatValue( db, name ) ) );
+    QSqlQuery &select = statements->query( selectStatement );
+    for ( int i = 0; i < values.size(); ++i ) {
+        select.bindValue( i, values[i] );
+    }
+    QVariant v = transaction->exec( select );
     if ( !v.isValid() ) {
-        v = transaction->insert( QString( "INSERT INTO trace_point_group VALUES(NULL, %1);" ).arg( Database::formatValue( db, name ) ) );
+        QSqlQuery &insert = statements->query( insertStatement );
+        for ( int i = 0; i < values.size(); ++i ) {
+            insert.bindValue( i, values[i] );
+        }
+        v = transaction->insert( insert );
     }
+    return v;
+}
+
+static bool getGroupId( PreparedStatements *statements, Transaction *transaction, const QString &name, unsigned int *id )
+{
+    QVariant v = selectOrInsert( statements, transaction,
+                                 PreparedStatements::SelectGroupId,
+                                 PreparedStatements::InsertGroup,
+                                 QVariantList() << name );
 
     if ( !id ) {
         return true;
@@ -49,83 +237,132 @@ static bool getGroupId( QSqlDatabase db, Transaction *transaction, const QString
     return ok;
 }
 
-class TraceKeyCache {
+/* Rough number of bytes needed for keeping a mapping in one of the caches
+ * below, including the overhead of the hash node.
+ */
+static const size_t CacheEntryOverhead = 4 * sizeof( void * );
+
+static size_t cacheCost( const QString &s )
+{
+    return sizeof( QString ) + s.size() * sizeof( QChar );
+}
+
+static size_t cacheCost( unsigned int )
+{
+    return sizeof( unsigned int );
+}
+
+template <typename T1, typename T2>
+static size_t cacheCost( const std::pair<T1, T2> &p )
+{
+    return cacheCost( p.first ) + cacheCost( p.second );
+}
+
+/* Maps values stored in the database to the ids of their rows. The caches
+ * are filled with all rows when the database is opened so that only values
+ * never seen before need to be looked up in the database.
+ */
+template <typename KeyType, typename IdType>
+class StorageCache
+{
+public:
+    StorageCache() : m_memoryUsage( 0 ) { }
+    void clear()
+    {
+        m_ids.clear();
+        m_memoryUsage = 0;
+    }
+    size_t memoryUsage() const
+    {
+        return m_memoryUsage;
+    }
+protected:
+    typedef KeyType CacheKey;
+
+    IdType* checkCache( const KeyType &key )
+    {
+        typename QHash<KeyType, IdType>::iterator it = m_ids.find( key );
+        return it != m_ids.end() ? &it.value() : 0;
+    }
+    void cache( const KeyType &key, IdType id )
+    {
+        if ( !m_ids.contains( key ) ) {
+            m_memoryUsage += cacheCost( key ) + sizeof( IdType ) + CacheEntryOverhead;
+        }
+        m_ids.insert( key, id );
+    }
+
+private:
+    QHash<KeyType, IdType> m_ids;
+    size_t m_memoryUsage;
+};
+
+class TraceKeyCache : public StorageCache<QString, unsigned int> {
 public:
-    void update( QSqlDatabase db, Transaction *transaction,
+    void load( QSqlDatabase db ) {
+        QSqlQuery q( db );
+        q.setForwardOnly( true );
+        if ( q.exec( "SELECT id, name FROM trace_point_group;" ) ) {
+            while ( q.next() ) {
+                cache( q.value( 1 ).toString(), q.value( 0 ).toUInt() );
+            }
+        }
+    }
+    void update( PreparedStatements *statements, Transaction *transaction,
          const QString &groupName,
          const QList<TraceKey> &traceKeys ) {
         QList<TraceKey>::ConstIterator it, end = traceKeys.end();
         for ( it = traceKeys.begin(); it != end; ++it ) {
-            if ( m_map.find( (*it).name ) == m_map.end() ) {
-                registerGroupName( db, transaction, (*it).name );
+            if ( !checkCache( (*it).name ) ) {
+                registerGroupName( statements, transaction, (*it).name );
             }
         }
         // in case the entry comes with a name not listed in the
         // AUT-side configuration file
-        if ( !groupName.isNull() && m_map.find( groupName ) == m_map.end() ) {
-            registerGroupName( db, transaction, groupName );
+        if ( !groupName.isNull() && !checkCache( groupName ) ) {
+            registerGroupName( statements, transaction, groupName );
         }
     }
-    void clear() {
-        m_map.clear();
-    }
-    unsigned int fetch( const QString &name ) const {
-        std::map<QString, unsigned int>::const_iterator it = m_map.find( name );
-        if ( it == m_map.end() ) {
+    unsigned int fetch( const QString &name ) {
+        unsigned int *id = checkCache( name );
+        if ( !id ) {
             throw runtime_error( QString( "Failed to find trace point group %1 in cache" ).arg( name ).toUtf8().constData() );
         }
-        return (*it).second;
+        return *id;
     }
 private:
-    void registerGroupName( QSqlDatabase db, Transaction *transaction, const QString &name )
+    void registerGroupName( PreparedStatements *statements, Transaction *transaction, const QString &name )
     {
         unsigned int id;
-        if ( !getGroupId( db, transaction, name, &id ) ) {
+        if ( !getGroupId( statements, transaction, name, &id ) ) {
             throw runtime_error( "Read non-numeric trace point group id from database - corrupt database?" );
         }
-        m_map[name] = id;
+        cache( name, id );
     }
+};
 
-    std::map<QString, unsigned int> m_map;
-} traceKeyCache;
-
-template <typename KeyType, typename IdType, int CacheSize = 10>
-class StorageCache
-{
+class PathCache : public StorageCache<QString, unsigned int> {
 public:
-    StorageCache() : m_lru( CacheSize ) { }
-    void clear()
+    void load( QSqlDatabase db )
     {
-    m_lru.clear();
-    }
-protected:
-    typedef KeyType CacheKey;
-
-    IdType* checkCache( const KeyType &key )
-    {
-    return m_lru.fetch_ptr( key );
+    QSqlQuery q( db );
+    q.setForwardOnly( true );
+    if ( q.exec( "SELECT id, name FROM path_name;" ) ) {
+        while ( q.next() ) {
+            cache( q.value( 1 ).toString(), q.value( 0 ).toUInt() );
+        }
     }
-    void cache( const KeyType &key, IdType id )
-    {
-    m_lru.insert( key, id );
     }
-
-private:
-    LRUCache<KeyType, IdType> m_lru;
-};
-
-class PathCache : public StorageCache<QString, unsigned int> {
-public:
-    unsigned int store( QSqlDatabase db, Transaction *transaction,
+    unsigned int store( PreparedStatements *statements, Transaction *transaction,
             const QString &path )
     {
     unsigned int *cachedId = checkCache( path );
     if ( cachedId )
         return *cachedId;
-    QVariant v = transaction->exec( QString( "SELECT id FROM path_name WHERE name=%1;" ).arg( Database::formatValue( db, path ) ) );
-    if ( !v.isValid() ) {
-        v = transaction->insert( QString( "INSERT INTO path_name VALUES(NULL, %1);" ).arg( Database::formatValue( db, path ) ) );
-    }
+    QVariant v = selectOrInsert( statements, transaction,
+                                 PreparedStatements::SelectPathId,
+                                 PreparedStatements::InsertPath,
+                                 QVariantList() << path );
     bool ok;
     unsigned int pathId = v.toUInt( &ok );
     if ( !ok ) {
@@ -134,20 +371,30 @@ public:
     cache( path, pathId );
     return pathId;
     }
-} pathCache;
+};
 
 class FunctionCache : public StorageCache<QString, unsigned int> {
 public:
-    unsigned int store( QSqlDatabase db, Transaction *transaction,
+    void load( QSqlDatabase db )
+    {
+    QSqlQuery q( db );
+    q.setForwardOnly( true );
+    if ( q.exec( "SELECT id, name FROM function_name;" ) ) {
+        while ( q.next() ) {
+            cache( q.value( 1 ).toString(), q.value( 0 ).toUInt() );
+        }
+    }
+    }
+    unsigned int store( PreparedStatements *statements, Transaction *transaction,
             const QString &function )
     {
     unsigned int *cachedId = checkCache( function );
     if ( cachedId )
         return *cachedId;
-    QVariant v = transaction->exec( QString( "SELECT id FROM function_name WHERE name=%1;" ).arg( Database::formatValue( db, function ) ) );
-    if ( !v.isValid() ) {
-        v = transaction->insert( QString( "INSERT INTO function_name VALUES(NULL, %1);" ).arg( Database::formatValue( db, function ) ) );
-    }
+    QVariant v = selectOrInsert( statements, transaction,
+                                 PreparedStatements::SelectFunctionId,
+                                 PreparedStatements::InsertFunction,
+                                 QVariantList() << function );
     bool ok;
     unsigned int functionId = v.toUInt( &ok );
     if ( !ok ) {
@@ -156,13 +403,24 @@ public:
     cache( function, functionId );
     return functionId;
     }
-} functionCache;
+};
 
 class ProcessCache : public StorageCache<std::pair<QString, unsigned int>,
                      unsigned int>
 {
 public:
-    unsigned int store( QSqlDatabase db, Transaction *transaction,
+    void load( QSqlDatabase db )
+    {
+    QSqlQuery q( db );
+    q.setForwardOnly( true );
+    if ( q.exec( "SELECT id, name, pid FROM process;" ) ) {
+        while ( q.next() ) {
+            cache( CacheKey( q.value( 1 ).toString(), q.value( 2 ).toUInt() ),
+                   q.value( 0 ).toUInt() );
+        }
+    }
+    }
+    unsigned int store( PreparedStatements *statements, Transaction *transaction,
             const QString &processName,
             unsigned int pid,
             const QDateTime &processStartTime )
@@ -171,9 +429,20 @@ public:
     unsigned int *cachedId = checkCache( key );
     if ( cachedId )
         return *cachedId;
-    QVariant v = transaction->exec( QString( "SELECT id FROM process WHERE pid=%1 AND start_time=%2;" ).arg( pid ).arg( Database::formatValue( db, processStartTime ) ) );
+
+    // Timestamps are stored as milliseconds since the epoch
+    const qint64 startTime = processStartTime.toMSecsSinceEpoch();
+
+    QSqlQuery &select = statements->query( PreparedStatements::SelectProcessId );
+    select.bindValue( 0, pid );
+    select.bindValue( 1, startTime );
+    QVariant v = transaction->exec( select );
     if ( !v.isValid() ) {
-        v = transaction->insert( QString( "INSERT INTO process VALUES(NULL, %1, %2, %3, 0);" ).arg( Database::formatValue( db, processName ) ).arg( pid ).arg( Database::formatValue( db, processStartTime ) ) );
+        QSqlQuery &insert = statements->query( PreparedStatements::InsertProcess );
+        insert.bindValue( 0, processName );
+        insert.bindValue( 1, pid );
+        insert.bindValue( 2, startTime );
+        v = transaction->insert( insert );
     }
     bool ok;
     unsigned int processId = v.toUInt( &ok );
@@ -183,13 +452,24 @@ public:
     cache( key, processId );
     return processId;
     }
-} processCache;
+};
 
 class ThreadCache : public StorageCache<std::pair<unsigned int, unsigned int>,
                     unsigned int>
 {
 public:
-    unsigned int store( QSqlDatabase db, Transaction *transaction,
+    void load( QSqlDatabase db )
+    {
+    QSqlQuery q( db );
+    q.setForwardOnly( true );
+    if ( q.exec( "SELECT id, process_id, tid FROM traced_thread;" ) ) {
+        while ( q.next() ) {
+            cache( CacheKey( q.value( 1 ).toUInt(), q.value( 2 ).toUInt() ),
+                   q.value( 0 ).toUInt() );
+        }
+    }
+    }
+    unsigned int store( PreparedStatements *statements, Transaction *transaction,
             unsigned int processId,
             unsigned int tid )
     {
@@ -198,10 +478,10 @@ public:
     if ( cachedId )
         return *cachedId;
 
-    QVariant v = transaction->exec( QString( "SELECT id FROM traced_thread WHERE process_id=%1 AND tid=%2;" ).arg( processId ).arg( tid ) );
-    if ( !v.isValid() ) {
-        v = transaction->insert( QString( "INSERT INTO traced_thread VALUES(NULL, %1, %2);" ).arg( processId ).arg( tid ) );
-    }
+    QVariant v = selectOrInsert( statements, transaction,
+                                 PreparedStatements::SelectThreadId,
+                                 PreparedStatements::InsertThread,
+                                 QVariantList() << processId << tid );
     bool ok;
     unsigned int threadId = v.toUInt( &ok );
     if ( !ok ) {
@@ -210,20 +490,7 @@ public:
     cache( key, threadId );
     return threadId;
     }
-} threadCache;
-
-static unsigned int storeGroup( QSqlDatabase db, Transaction *transaction,
-                const QString &groupName,
-                const QList<TraceKey> &traceKeys )
-{
-    traceKeyCache.update( db, transaction, groupName, traceKeys );
-
-    unsigned int groupId = 0;
-    if ( !groupName.isNull() ) {
-    groupId = traceKeyCache.fetch( groupName );
-    }
-    return groupId;
-}
+};
 
 // ### some portable, ready-made tuple template type would be nice
 struct TracePointTuple
@@ -234,22 +501,44 @@ struct TracePointTuple
     unsigned int functionId;
     unsigned int groupId;
 
-    bool operator<(const TracePointTuple &tp) const
+    bool operator==(const TracePointTuple &tp) const
     {
-        if ( type != tp.type ) return type < tp.type;
-        if ( pathId != tp.pathId ) return pathId < tp.pathId;
-        if ( lineno != tp.lineno ) return lineno < tp.lineno;
-        if ( functionId != tp.functionId ) return functionId < tp.functionId;
-        if ( groupId != tp.groupId ) return groupId < tp.groupId;
-        return false;
-    };
+        return type == tp.type && pathId == tp.pathId && lineno == tp.lineno &&
+               functionId == tp.functionId && groupId == tp.groupId;
+    }
 };
 
+static size_t qHash( const TracePointTuple &tp, size_t seed = 0 )
+{
+    return qHashMulti( seed, tp.type, tp.pathId, tp.lineno, tp.functionId, tp.groupId );
+}
+
+static size_t cacheCost( const TracePointTuple & )
+{
+    return sizeof( TracePointTuple );
+}
+
 class TracePointCache : public StorageCache<TracePointTuple,
                         unsigned int>
 {
 public:
-    unsigned int store( QSqlDatabase db, Transaction *transaction,
+    void load( QSqlDatabase db )
+    {
+    QSqlQuery q( db );
+    q.setForwardOnly( true );
+    if ( q.exec( "SELECT id, type, path_id, line, function_id, group_id FROM trace_point;" ) ) {
+        while ( q.next() ) {
+            CacheKey key;
+            key.type = q.value( 1 ).toUInt();
+            key.pathId = q.value( 2 ).toUInt();
+            key.lineno = q.value( 3 ).toULongLong();
+            key.functionId = q.value( 4 ).toUInt();
+            key.groupId = q.value( 5 ).toUInt();
+            cache( key, q.value( 0 ).toUInt() );
+        }
+    }
+    }
+    unsigned int store( PreparedStatements *statements, Transaction *transaction,
             unsigned int type,
             unsigned int pathId,
             unsigned long lineno,
@@ -265,10 +554,12 @@ public:
     unsigned int *cachedId = checkCache( key );
     if ( cachedId )
         return *cachedId;
-    QVariant v = transaction->exec( QString( "SELECT id FROM trace_point WHERE type=%1 AND path_id=%2 AND line=%3 AND function_id=%4 AND group_id=%5;" ).arg( type ).arg( pathId ).arg( lineno ).arg( functionId ).arg( groupId ) );
-    if ( !v.isValid() ) {
-        v = transaction->insert( QString( "INSERT INTO trace_point VALUES(NULL, %1, %2, %3, %4, %5);" ).arg( type ).arg( pathId ).arg( lineno ).arg( functionId ).arg( groupId ) );
-    }
+    QVariant v = selectOrInsert( statements, transaction,
+                                 PreparedStatements::SelectTracePointId,
+                                 PreparedStatements::InsertTracePoint,
+                                 QVariantList() << type << pathId
+                                                << qulonglong( lineno )
+                                                << functionId << groupId );
     bool ok;
     unsigned int tracepointId = v.toUInt( &ok );
     if ( !ok ) {
@@ -277,77 +568,186 @@ public:
     cache( key, tracepointId );
     return tracepointId;
     }
-} tracePointCache;
+};
+
+/* The id caches of one DatabaseFeeder. If the caches grow beyond the
+ * memory limit, they are emptied and refilled on demand.
+ */
+class StorageCaches
+{
+public:
+    static const size_t DefaultMemoryLimit = 64 * 1024 * 1024;
+
+    explicit StorageCaches( QSqlDatabase db );
+
+    void setMemoryLimit( size_t bytes );
+    void reload();
+    void enforceMemoryLimit();
+
+    TraceKeyCache traceKeys;
+    PathCache paths;
+    FunctionCache functions;
+    ProcessCache processes;
+    ThreadCache threads;
+    TracePointCache tracePoints;
+
+private:
+    StorageCaches( const StorageCaches &other ); // disabled
+    void operator=( const StorageCaches &rhs ); // disabled
+
+    void clear();
+    size_t memoryUsage() const;
+
+    QSqlDatabase m_db;
+    size_t m_memoryLimit;
+};
+
+StorageCaches::StorageCaches( QSqlDatabase db )
+    : m_db( db ),
+    m_memoryLimit( DefaultMemoryLimit )
+{
+    reload();
+}
+
+void StorageCaches::setMemoryLimit( size_t bytes )
+{
+    m_memoryLimit = bytes;
+    enforceMemoryLimit();
+}
+
+// Needs to be called whenever rows got removed from the database
+void StorageCaches::reload()
+{
+    clear();
+    traceKeys.load( m_db );
+    paths.load( m_db );
+    functions.load( m_db );
+    processes.load( m_db );
+    threads.load( m_db );
+    tracePoints.load( m_db );
+    enforceMemoryLimit();
+}
+
+void StorageCaches::enforceMemoryLimit()
+{
+    if ( memoryUsage() > m_memoryLimit ) {
+        clear();
+    }
+}
 
-static unsigned int storeTraceEntry( QSqlDatabase db, Transaction *transaction,
+void StorageCaches::clear()
+{
+    traceKeys.clear();
+    paths.clear();
+    functions.clear();
+    processes.clear();
+    threads.clear();
+    tracePoints.clear();
+}
+
+size_t StorageCaches::memoryUsage() const
+{
+    return traceKeys.memoryUsage() + paths.memoryUsage() +
+           functions.memoryUsage() + processes.memoryUsage() +
+           threads.memoryUsage() + tracePoints.memoryUsage();
+}
+
+static unsigned int storeGroup( StorageCaches *caches,
+                PreparedStatements *statements, Transaction *transaction,
+                const QString &groupName,
+                const QList<TraceKey> &traceKeys )
+{
+    caches->traceKeys.update( statements, transaction, groupName, traceKeys );
+
+    unsigned int groupId = 0;
+    if ( !groupName.isNull() ) {
+    groupId = caches->traceKeys.fetch( groupName );
+    }
+    return groupId;
+}
+
+static unsigned int storeTraceEntry( PreparedStatements *statements, Transaction *transaction,
                      unsigned int threadId,
                      const QDateTime &timestamp,
                      unsigned int pointId,
                      const QString &message,
                      unsigned long stackPosition )
 {
-    return transaction->insert( QString( "INSERT INTO trace_entry VALUES(NULL, " + QString::number( threadId )
-                                         + ", " + Database::formatValue( db, timestamp )
-                                         + ", " + QString::number( pointId )
-                                         + ", " + Database::formatValue( db, message )
-                                         + ", " + QString::number( stackPosition )
-                                         + ")" ) ).toUInt();
+    QSqlQuery &insert = statements->query( PreparedStatements::InsertTraceEntry );
+    insert.bindValue( 0, threadId );
+    insert.bindValue( 1, timestamp.toMSecsSinceEpoch() );
+    insert.bindValue( 2, pointId );
+    insert.bindValue( 3, message );
+    insert.bindValue( 4, qulonglong( stackPosition ) );
+    return transaction->insert( insert ).toUInt();
 }
 
-static void storeVariables( QSqlDatabase db, Transaction *transaction,
+static void storeVariables( PreparedStatements *statements, Transaction *transaction,
                 unsigned int traceentryId,
                 const QList<Variable> &variables )
 {
-    QList<Variable>::ConstIterator it, end = variables.end();
-    for ( it = variables.begin(); it != end; ++it ) {
-        transaction->exec( QString( "INSERT INTO variable VALUES(" + QString::number( traceentryId )
-                                    + ", " + Database::formatValue( db, it->name )
-                                    + ", " + Database::formatValue( db, it->value )
-                                    + ", " + QString::number( it->type )
-                                    + ")" ) );
+    for ( int first = 0; first < variables.size(); first += MaximumRowsPerInsert ) {
+        const int numRows = qMin( variables.size() - first, MaximumRowsPerInsert );
+        QSqlQuery &insert = statements->insertVariablesQuery( numRows );
+        int param = 0;
+        for ( int i = first; i < first + numRows; ++i ) {
+            const Variable &var = variables[i];
+            insert.bindValue( param++, traceentryId );
+            insert.bindValue( param++, var.name );
+            insert.bindValue( param++, var.value );
+            insert.bindValue( param++, int( var.type ) );
+        }
+        transaction->exec( insert );
     }
 }
 
-static void storeBacktrace( QSqlDatabase db, Transaction *transaction,
+static void storeBacktrace( PreparedStatements *statements, Transaction *transaction,
                 unsigned int traceentryId,
                 const QList<StackFrame> &backtrace )
 
 {
-    unsigned int depthCount = 0;
-    QList<StackFrame>::ConstIterator it, end = backtrace.end();
-    for ( it = backtrace.begin(); it != end; ++it, ++depthCount ) {
-        transaction->exec( QString( "INSERT INTO stackframe VALUES(" + QString::number( traceentryId )
-                                    + ", " + QString::number( depthCount )
-                                    + ", " + Database::formatValue( db, it->module )
-                                    + ", " + Database::formatValue( db, it->function )
-                                    + ", " + QString::number( it->functionOffset )
-                                    + ", " + Database::formatValue( db, it->sourceFile )
-                                    + ", " + QString::number( it->lineNumber )
-                                    + ")" ) );
+    for ( int first = 0; first < backtrace.size(); first += MaximumRowsPerInsert ) {
+        const int numRows = qMin( backtrace.size() - first, MaximumRowsPerInsert );
+        QSqlQuery &insert = statements->insertStackFramesQuery( numRows );
+        int param = 0;
+        for ( int depthCount = first; depthCount < first + numRows; ++depthCount ) {
+            const StackFrame &frame = backtrace[depthCount];
+            insert.bindValue( param++, traceentryId );
+            insert.bindValue( param++, depthCount );
+            insert.bindValue( param++, frame.module );
+            insert.bindValue( param++, frame.function );
+            insert.bindValue( param++, qulonglong( frame.functionOffset ) );
+            insert.bindValue( param++, frame.sourceFile );
+            insert.bindValue( param++, qulonglong( frame.lineNumber ) );
+        }
+        transaction->exec( insert );
     }
 }
 
-static void storeEntry( QSqlDatabase db, Transaction *transaction, const TraceEntry &e )
+static void storeEntry( StorageCaches *caches, PreparedStatements *statements,
+                        Transaction *transaction, const TraceEntry &e )
 {
-    unsigned int pathId = pathCache.store( db, transaction, e.path );
-    unsigned int functionId = functionCache.store( db, transaction, e.function );
-    unsigned int processId = processCache.store( db, transaction, e.processName,
+    unsigned int pathId = caches->paths.store( statements, transaction, e.path );
+    unsigned int functionId = caches->functions.store( statements, transaction, e.function );
+    unsigned int processId = caches->processes.store( statements, transaction, e.processName,
                          e.pid, e.processStartTime );
-    unsigned int threadId = threadCache.store( db, transaction, processId, e.tid );
-    unsigned int groupId = storeGroup( db, transaction,
+    unsigned int threadId = caches->threads.store( statements, transaction, processId, e.tid );
+    unsigned int groupId = storeGroup( caches, statements, transaction,
                        e.groupName,
                        e.traceKeys );
-    unsigned int tracepointId = tracePointCache.store( db, transaction,
+    unsigned int tracepointId = caches->tracePoints.store( statements, transaction,
                                e.type, pathId, e.lineno,
                                functionId, groupId );
-    unsigned int traceentryId = storeTraceEntry( db, transaction,
+    unsigned int traceentryId = storeTraceEntry( statements, transaction,
                          threadId,
                          e.timestamp,
                          tracepointId,
                          e.message,
                          e.stackPosition );
-    storeVariables( db, transaction, traceentryId, e.variables );
-    storeBacktrace( db, transaction, traceentryId, e.backtrace );
+    storeVariables( statements, transaction, traceentryId, e.variables );
+    storeBacktrace( statements, transaction, traceentryId, e.backtrace );
+
+    caches->enforceMemoryLimit();
 }
 
 static QString archiveFileName( const QString &archiveDirName, const QString &currentFileName )
@@ -362,7 +762,67 @@ static QString archiveFileName( const QString &archiveDirName, const QString &cu
         .arg( QFileInfo( currentFileName ).fileName() );
 }
 
-static void archiveEntries( QSqlDatabase db, unsigned short percentage, const QString &archiveDir )
+/* Makes the database with the given file name available as 'archive' on the
+ * given connection. Databases cannot be attached or detached within a
+ * transaction, so this has to outlive any Transaction using the archive.
+ */
+class AttachedArchive
+{
+public:
+    AttachedArchive( QSqlDatabase db, const QString &fileName )
+        : m_db( db )
+    {
+        QSqlQuery q( m_db );
+        q.prepare( "ATTACH DATABASE ? AS archive;" );
+        q.bindValue( 0, fileName );
+        if ( !q.exec() ) {
+            throw runtime_error( QString( "Failed to attach archive database %1: %2" ).arg( fileName ).arg( q.lastError().text() ).toUtf8().constData() );
+        }
+    }
+
+    ~AttachedArchive()
+    {
+        QSqlQuery q( m_db );
+        q.exec( "DETACH DATABASE archive;" );
+    }
+
+private:
+    AttachedArchive( const AttachedArchive &other ); // disabled
+    void operator=( const AttachedArchive &rhs ); // disabled
+
+    QSqlDatabase m_db;
+};
+
+static QString createArchiveDatabase( QSqlDatabase db, const QString &archiveDir )
+{
+    if ( !QDir().mkpath( archiveDir ) ) {
+        throw runtime_error( QString( "Failed to create archive database: creating archive directory %1 failed" ).arg( archiveDir ).toUtf8().constData() );
+    }
+
+    const QString fn = archiveFileName( archiveDir, db.databaseName() );
+    QString connName;
+    {
+        QString errorMsg;
+        QSqlDatabase archiveDB = Database::create( fn, &errorMsg );
+        if ( !archiveDB.isValid() ) {
+            throw runtime_error( QString( "Failed to create database in %1: %2" ).arg( fn ).arg( errorMsg ).toUtf8().constData() );
+        }
+        connName = archiveDB.connectionName();
+        archiveDB.close();
+    }
+    QSqlDatabase::removeDatabase( connName );
+    return fn;
+}
+
+/* Moves the oldest entries into a new database in the archive directory. The
+ * entries and all rows they refer to are copied with their ids unchanged, so
+ * everything can be copied using a few set-based statements. Afterwards,
+ * only those rows which were referenced by the archived entries are
+ * candidates for removal from the trace database; they are removed unless
+ * some remaining row still refers to them.
+ */
+static void archiveEntries( QSqlDatabase db, StorageCaches *caches,
+                            unsigned short percentage, const QString &archiveDir )
 {
     if ( percentage == 0 ) {
         return;
@@ -372,171 +832,270 @@ static void archiveEntries( QSqlDatabase db, unsigned short percentage, const QS
         percentage = 100;
     }
 
-    Transaction transaction( db );
-    qulonglong numCopy = 0;
+    qulonglong lastArchivedId = 0;
     {
-        QVariant v = transaction.exec( QString( "SELECT ROUND(COUNT(id) / 100.0 * %1) FROM trace_entry;" ).arg( percentage ) );
-        bool ok;
-        numCopy = v.toULongLong( &ok );
-        if ( !ok ) {
-            throw runtime_error( "Failed to count number of entries to archive" );
+        QSqlQuery q( db );
+        q.setForwardOnly( true );
+        if ( !q.exec( QString( "SELECT id FROM trace_entry ORDER BY id LIMIT 1 OFFSET"
+                               " (SELECT MAX(CAST(ROUND(COUNT(id) / 100.0 * %1) AS INTEGER) - 1, 0) FROM trace_entry);" ).arg( percentage ) ) ) {
+            throw runtime_error( QString( "Failed to determine entries to archive: %1" ).arg( q.lastError().text() ).toUtf8().constData() );
         }
+        if ( !q.next() ) {
+            // Nothing to archive
+            return;
+        }
+        lastArchivedId = q.value( 0 ).toULongLong();
     }
 
-    QString connName;
+    const QString archiveFile = createArchiveDatabase( db, archiveDir );
+    AttachedArchive archive( db, archiveFile );
     {
-        QSqlDatabase archiveDB;
-        {
-            if ( !QDir().mkpath( archiveDir ) ) {
-                throw runtime_error( QString( "Failed to create archive database: creating archive directory %1 failed" ).arg( archiveDir ).toUtf8().constData() );
-            }
+        Transaction transaction( db );
+
+        transaction.exec( QString( "INSERT INTO archive.trace_entry SELECT * FROM main.trace_entry WHERE id <= %1;" ).arg( lastArchivedId ) );
+        transaction.exec( QString( "INSERT INTO archive.variable SELECT * FROM main.variable WHERE trace_entry_id <= %1;" ).arg( lastArchivedId ) );
+        transaction.exec( QString( "INSERT INTO archive.stackframe SELECT * FROM main.stackframe WHERE trace_entry_id <= %1;" ).arg( lastArchivedId ) );
+        transaction.exec( "INSERT INTO archive.traced_thread SELECT * FROM main.traced_thread WHERE id IN (SELECT traced_thread_id FROM archive.trace_entry);" );
+        transaction.exec( "INSERT INTO archive.process SELECT * FROM main.process WHERE id IN (SELECT process_id FROM archive.traced_thread);" );
+        transaction.exec( "INSERT INTO archive.trace_point SELECT * FROM main.trace_point WHERE id IN (SELECT trace_point_id FROM archive.trace_entry);" );
+        transaction.exec( "INSERT INTO archive.function_name SELECT * FROM main.function_name WHERE id IN (SELECT function_id FROM archive.trace_point);" );
+        transaction.exec( "INSERT INTO archive.path_name SELECT * FROM main.path_name WHERE id IN (SELECT path_id FROM archive.trace_point);" );
+        // Groups double as the list of known trace keys, so all of them are kept
+        transaction.exec( "INSERT INTO archive.trace_point_group SELECT * FROM main.trace_point_group;" );
+
+        transaction.exec( QString( "DELETE FROM main.trace_entry WHERE id <= %1;" ).arg( lastArchivedId ) );
+        transaction.exec( QString( "DELETE FROM main.variable WHERE trace_entry_id <= %1;" ).arg( lastArchivedId ) );
+        transaction.exec( QString( "DELETE FROM main.stackframe WHERE trace_entry_id <= %1;" ).arg( lastArchivedId ) );
+
+        // The remaining entries are looked up using the trace_entry indexes
+        transaction.exec( "DELETE FROM main.trace_point WHERE id IN (SELECT id FROM archive.trace_point)"
+                          " AND NOT EXISTS (SELECT 1 FROM main.trace_entry WHERE trace_point_id = trace_point.id);" );
+        transaction.exec( "DELETE FROM main.traced_thread WHERE id IN (SELECT id FROM archive.traced_thread)"
+                          " AND NOT EXISTS (SELECT 1 FROM main.trace_entry WHERE traced_thread_id = traced_thread.id);" );
+        transaction.exec( "DELETE FROM main.process WHERE id IN (SELECT id FROM archive.process)"
+                          " AND NOT EXISTS (SELECT 1 FROM main.traced_thread WHERE process_id = process.id);" );
+
+        // There are few trace points, so scanning them is cheap
+        transaction.exec( "DELETE FROM main.function_name WHERE id IN"
+                          " (SELECT id FROM archive.function_name EXCEPT SELECT function_id FROM main.trace_point);" );
+        transaction.exec( "DELETE FROM main.path_name WHERE id IN"
+                          " (SELECT id FROM archive.path_name EXCEPT SELECT path_id FROM main.trace_point);" );
+        transaction.exec( "DELETE FROM main.trace_point_group WHERE id IN"
+                          " (SELECT id FROM archive.trace_point_group EXCEPT SELECT group_id FROM main.trace_point);" );
+
+        caches->reload();
+    }
+}
 
-            const QString fn = archiveFileName( archiveDir, db.databaseName() );
-            QString errorMsg;
-            archiveDB = Database::create( fn, &errorMsg );
-            if ( !archiveDB.isValid() ) {
-                throw runtime_error( QString( "Failed to create database in %1: %2" ).arg( fn ).arg( errorMsg ).toUtf8().constData() );
-            }
-        }
-        connName = archiveDB.connectionName();
+DatabaseFeeder::DatabaseFeeder( QSqlDatabase db )
+    : m_db( db )
+    , m_statements( new PreparedStatements( db ) )
+    , m_batchSize( 1 )
+    , m_shrinkBy( 0 )
+    , m_maximumSize( StorageConfiguration::UnlimitedTraceSize )
+    , m_maximumPageCount( 0 )
+    , m_entriesSinceSizeCheck( 0 )
+    , m_maximumSegmentSize( 0 )
+    , m_maximumSegmentDuration( 0 )
+    , m_segmentCount( 0 )
+    , m_segmentStartTime( 0 )
+{
+    assert( m_db.isValid() );
+    m_db.exec( "PRAGMA synchronous=OFF;");
 
-        {
-            QString query = QString( "SELECT"
-                            " trace_entry.id,"
-                            " process.pid,"
-                            " process.start_time,"
-                            " process.name,"
-                            " traced_thread.tid,"
-                            " trace_entry.timestamp,"
-                            " trace_point.type,"
-                            " path_name.name,"
-                            " trace_point.line,"
-                            " trace_point.group_id,"
-                            " function_name.name,"
-                            " trace_entry.message, "
-                            " trace_entry.stack_position "
-                            "FROM"
-                            " trace_entry,"
-                            " trace_point,"
-                            " path_name,"
-                            " function_name,"
-                            " process,"
-                            " traced_thread "
-                            "WHERE"
-                            " trace_entry.trace_point_id = trace_point.id "
-                            "AND"
-                            " trace_point.function_id = function_name.id "
-                            "AND"
-                            " trace_point.path_id = path_name.id "
-                            "AND"
-                            " trace_entry.traced_thread_id = traced_thread.id "
-                            "AND"
-                            " traced_thread.process_id = process.id "
-                            "ORDER BY"
-                            " trace_entry.id "
-                            "LIMIT"
-                            " %1" ).arg( numCopy );
-
-            QSqlQuery q( db );
-            q.setForwardOnly( true );
-            if ( !q.exec( query ) ) {
-                throw runtime_error( QString( "Cannot archive trace data: failed to extract entry data: %1" ).arg( q.lastError().text() ).toUtf8().constData() );
-            }
+    // Fills the id caches with the contents of the database
+    m_caches = new StorageCaches( m_db );
+}
 
-            Transaction archiveTransaction( archiveDB );
-            while ( q.next() ) {
-                qulonglong id = q.value( 0 ).toULongLong();
-
-                TraceEntry e;
-                e.pid = q.value( 1 ).toUInt();
-                e.processStartTime = QDateTime::fromMSecsSinceEpoch( q.value( 2 ).toLongLong() );
-                e.processName = q.value( 3 ).toString();
-                e.tid = q.value( 4 ).toUInt();
-                e.timestamp = QDateTime::fromMSecsSinceEpoch( q.value( 5 ).toLongLong() );
-                e.type = q.value( 6 ).toUInt();
-                e.path = q.value( 7 ).toString();
-                e.lineno = q.value( 8 ).toULongLong();
-
-                const int groupId = q.value( 9 ).toInt();
-                if ( groupId != 0 ) {
-                    QSqlQuery gq( db );
-                    gq.setForwardOnly( true );
-                    if ( gq.exec( QString( "SELECT name FROM trace_point_group WHERE id = %1" ).arg( groupId ) ) ) {
-                        if ( gq.next() ) {
-                            e.groupName = gq.value( 0 ).toString();
-                        }
-                    }
-                }
+DatabaseFeeder::~DatabaseFeeder()
+{
+    delete m_caches;
+    delete m_statements;
+}
 
-                e.function = q.value( 10 ).toString();
-                e.message = q.value( 11 ).toString();
-                e.stackPosition = q.value( 12 ).toULongLong();
-                e.backtrace = Database::backtraceForEntry( db, id );
-
-                {
-                    QSqlQuery vq( db );
-                    vq.setForwardOnly( true );
-                    if ( vq.exec( QString( "SELECT "
-                                    " name,"
-                                    " type,"
-                                    " value "
-                                    "FROM "
-                                    " variable "
-                                    "WHERE"
-                                    " trace_entry_id = %1" ).arg( id ) ) ) {
-                        while ( vq.next() ) {
-                            Variable v;
-                            v.name = vq.value( 0 ).toString();
-                            v.type = (TRACELIB_NAMESPACE_IDENT(VariableType)::Value)( vq.value( 1 ).toInt() );
-                            v.value = vq.value( 2 ).toString();
-                            e.variables.append( v );
-                        }
-                    }
-                }
-                ::storeEntry( archiveDB, &archiveTransaction, e );
-            }
+void DatabaseFeeder::setCacheMemoryLimit( size_t bytes )
+{
+    m_caches->setMemoryLimit( bytes );
+}
+
+void DatabaseFeeder::setBatchSize( unsigned int maximumEntries )
+{
+    m_batchSize = maximumEntries > 0 ? maximumEntries : 1;
+    if ( static_cast<unsigned int>( m_pendingEntries.size() ) >= m_batchSize ) {
+        flushPendingEntries();
+    }
+}
+
+bool DatabaseFeeder::hasPendingEntries() const
+{
+    return !m_pendingEntries.isEmpty();
+}
+
+void DatabaseFeeder::trimDb()
+{
+    // Pending entries would be deleted right away anyway
+    m_pendingEntries.clear();
+
+    const bool segmented = !m_segmentFile.isEmpty();
+    if ( segmented ) {
+        detachSegment();
+    }
+    Database::trimTo( m_db, 0 );
+    m_caches->reload();
+    if ( segmented ) {
+        startSegment();
+    }
+}
+
+// Name under which the segment currently written to is attached
+static const char SegmentSchema[] = "segment";
+
+static QString segmentFileName( const QString &dirName, qint64 startTime )
+{
+    return QDir( dirName ).filePath( QString( "segment-%1.trace" ).arg( startTime, 15, 10, QChar( '0' ) ) );
+}
+
+static qint64 segmentStartTime( const QString &fileName )
+{
+    return QFileInfo( fileName ).completeBaseName().mid( 8 ).toLongLong();
+}
+
+static qulonglong lastEntryId( QSqlDatabase db, const QString &schemaName )
+{
+    QSqlQuery q( db );
+    q.setForwardOnly( true );
+    if ( !q.exec( QString( "SELECT seq FROM %1.sqlite_sequence WHERE name='trace_entry';" ).arg( schemaName ) ) || !q.next() ) {
+        return 0;
+    }
+    return q.value( 0 ).toULongLong();
+}
+
+void DatabaseFeeder::setSegmentation( qulonglong maximumSize, unsigned int maximumDuration,
+                                      unsigned int segmentCount )
+{
+    flushPendingEntries();
+
+    m_maximumSegmentSize = maximumSize;
+    m_maximumSegmentDuration = maximumDuration;
+    m_segmentCount = qBound( 1u, segmentCount, static_cast<unsigned int>( Database::maximumSegmentCount ) );
+
+    if ( m_segmentFile.isEmpty() ) {
+        // Continue with the most recent segment of a previous run
+        const QStringList segments = Database::segmentFiles( m_db.databaseName() );
+        if ( segments.isEmpty() ) {
+            startSegment();
+        } else {
+            attachSegment( segments.last() );
+            removeOldSegments();
         }
     }
+}
 
-    {
-        transaction.exec( QString( "DELETE FROM trace_entry WHERE id IN (SELECT id FROM trace_entry ORDER BY id LIMIT %1);" ).arg( numCopy ) );
+void DatabaseFeeder::attachSegment( const QString &fileName )
+{
+    QString errMsg;
+    if ( !Database::attachSegment( m_db, fileName, SegmentSchema, &errMsg ) ) {
+        throw runtime_error( errMsg.toUtf8().constData() );
+    }
+    m_statements->setEntrySchema( SegmentSchema );
+    m_segmentFile = fileName;
+    m_segmentStartTime = segmentStartTime( fileName );
+}
 
-        transaction.exec( QString( "DELETE FROM trace_point WHERE id NOT IN (SELECT trace_point_id FROM trace_entry);" ) );
-        tracePointCache.clear();
+void DatabaseFeeder::detachSegment()
+{
+    m_statements->setEntrySchema( "main" );
+    m_db.exec( QString( "DETACH DATABASE %1;" ).arg( SegmentSchema ) );
+    m_segmentFile.clear();
+}
 
-        transaction.exec( QString( "DELETE FROM function_name WHERE id NOT IN (SELECT function_id FROM trace_point);" ) );
-        functionCache.clear();
+/* Entry ids continue where the previous segment (or the trace database, for
+ * the first segment) left off, so that they are unique across all segments.
+ */
+void DatabaseFeeder::startSegment()
+{
+    qulonglong lastId;
+    if ( m_segmentFile.isEmpty() ) {
+        lastId = lastEntryId( m_db, "main" );
+    } else {
+        lastId = lastEntryId( m_db, SegmentSchema );
+        detachSegment();
+    }
 
-        transaction.exec( QString( "DELETE FROM path_name WHERE id NOT IN (SELECT path_id FROM trace_point);" ) );
-        pathCache.clear();
+    const QString dirName = Database::segmentDirectory( m_db.databaseName() );
+    if ( !QDir().mkpath( dirName ) ) {
+        throw runtime_error( QString( "Failed to create segment directory %1" ).arg( dirName ).toUtf8().constData() );
+    }
 
-        transaction.exec( QString( "DELETE FROM trace_point_group WHERE id NOT IN (SELECT group_id FROM trace_point);" ) );
-        traceKeyCache.clear();
+    attachSegment( segmentFileName( dirName, QDateTime::currentMSecsSinceEpoch() ) );
+    if ( lastId > 0 ) {
+        m_db.exec( QString( "INSERT INTO %1.sqlite_sequence VALUES('trace_entry', %2);" ).arg( SegmentSchema ).arg( lastId ) );
+    }
 
-        transaction.exec( QString( "DELETE FROM traced_thread WHERE id NOT IN (SELECT traced_thread_id FROM trace_entry);" ) );
-        threadCache.clear();
+    removeOldSegments();
+}
 
-        transaction.exec( QString( "DELETE FROM process WHERE id NOT IN (SELECT process_id FROM traced_thread);" ) );
-        processCache.clear();
+/* Removing a segment fails on Windows as long as a reader has it attached;
+ * it's tried again when the next segment is started.
+ */
+void DatabaseFeeder::removeOldSegments()
+{
+    QStringList segments = Database::segmentFiles( m_db.databaseName() );
+    while ( segments.size() > static_cast<int>( m_segmentCount ) ) {
+        const QString fileName = segments.takeFirst();
+        if ( !QFile::remove( fileName ) ) {
+            qWarning() << "Failed to remove old trace segment" << fileName;
+        }
+    }
+}
 
-        transaction.exec( QString( "DELETE FROM variable WHERE trace_entry_id NOT IN (SELECT id FROM trace_entry);" ) );
-        transaction.exec( QString( "DELETE FROM stackframe WHERE trace_entry_id NOT IN (SELECT id FROM trace_entry);" ) );
+bool DatabaseFeeder::segmentIsFull() const
+{
+    if ( m_maximumSegmentSize > 0 &&
+         static_cast<qulonglong>( QFileInfo( m_segmentFile ).size() ) >= m_maximumSegmentSize ) {
+        return true;
     }
-    QSqlDatabase::removeDatabase( connName );
+    if ( m_maximumSegmentDuration > 0 &&
+         QDateTime::currentMSecsSinceEpoch() - m_segmentStartTime >= qint64( m_maximumSegmentDuration ) * 1000 ) {
+        return true;
+    }
+    return false;
 }
 
-DatabaseFeeder::DatabaseFeeder( QSqlDatabase db )
-    : m_db( db )
-    , m_shrinkBy( 0 )
-    , m_maximumSize( StorageConfiguration::UnlimitedTraceSize )
+/* Archiving starts once this percentage of the maximum database size is in
+ * use, so that storing entries rarely runs into a full database.
+ */
+static const qulonglong ArchiveWatermark = 90;
+
+// Number of stored entries after which the database size is checked again
+static const unsigned int SizeCheckInterval = 1000;
+
+static qulonglong pragmaValue( QSqlDatabase db, const char *pragma )
 {
-    assert( m_db.isValid() );
-    m_db.exec( "PRAGMA synchronous=OFF;");
+    QSqlQuery q( db );
+    q.setForwardOnly( true );
+    if ( !q.exec( QString( "PRAGMA %1;" ).arg( pragma ) ) || !q.next() ) {
+        return 0;
+    }
+    return q.value( 0 ).toULongLong();
 }
 
-void DatabaseFeeder::trimDb()
+/* Archived entries leave free pages behind which are reused for new entries,
+ * so only the pages not on the free list count.
+ */
+void DatabaseFeeder::archiveIfNearlyFull()
 {
-    Database::trimTo( m_db, 0 );
+    if ( m_maximumPageCount == 0 ) {
+        return;
+    }
+
+    const qulonglong usedPages = pragmaValue( m_db, "page_count" ) - pragmaValue( m_db, "freelist_count" );
+    if ( usedPages * 100 < m_maximumPageCount * ArchiveWatermark ) {
+        return;
+    }
+
+    archiveEntries( m_db, m_caches, m_shrinkBy, m_archiveDir );
+    archivedEntries();
 }
 
 // Definition taken from http://www.sqlite.org/c_interface.html
@@ -544,24 +1103,94 @@ void DatabaseFeeder::trimDb()
 
 void DatabaseFeeder::handleTraceEntry( const TraceEntry &e )
 {
-    try {
-        Transaction transaction( m_db );
-        ::storeEntry( m_db, &transaction, e );
-    } catch ( const SQLTransactionException &ex ) {
-        if ( ex.driverCode() == "13" ) {
-            archiveEntries( m_db, m_shrinkBy, m_archiveDir );
+    m_pendingEntries.append( e );
+    if ( static_cast<unsigned int>( m_pendingEntries.size() ) >= m_batchSize ) {
+        flushPendingEntries();
+    }
+}
+
+/* All pending entries are stored in a single transaction. If storing any of
+ * them fails, the whole batch is rolled back; in case the database is full,
+ * old entries get archived once and the complete batch is stored again.
+ * Other failures (or a database which is still full) are usually caused by
+ * single entries, so the batch is stored again one entry per transaction
+ * and only the failing entries are dropped.
+ */
+void DatabaseFeeder::flushPendingEntries()
+{
+    if ( m_pendingEntries.isEmpty() ) {
+        return;
+    }
+
+    bool archived = false;
+    while ( !m_pendingEntries.isEmpty() ) {
+        try {
+            {
+                Transaction transaction( m_db );
+                QList<TraceEntry>::ConstIterator it, end = m_pendingEntries.end();
+                for ( it = m_pendingEntries.begin(); it != end; ++it ) {
+                    ::storeEntry( m_caches, m_statements, &transaction, *it );
+                }
+            }
+            m_entriesSinceSizeCheck += m_pendingEntries.size();
+            m_pendingEntries.clear();
+        } catch ( const SQLTransactionException &ex ) {
+            // The ids cached while storing the batch were rolled back as well
+            m_caches->reload();
+
+            if ( ex.driverCode() == QString::number( SQLITE_FULL ) && !archived ) {
+                archived = true;
+                try {
+                    archiveEntries( m_db, m_caches, m_shrinkBy, m_archiveDir );
+                    archivedEntries();
+                } catch ( const runtime_error &e ) {
+                    qWarning() << e.what();
+                }
+            } else if ( m_pendingEntries.size() == 1 ) {
+                m_pendingEntries.clear();
+                throw;
+            } else {
+                storePendingEntriesSeparately();
+            }
+        }
+    }
 
+    if ( !m_segmentFile.isEmpty() ) {
+        if ( segmentIsFull() ) {
+            startSegment();
+            // Lets the GUI pick up the new segment
             archivedEntries();
+        }
+    } else if ( m_entriesSinceSizeCheck >= SizeCheckInterval ) {
+        m_entriesSinceSizeCheck = 0;
+        archiveIfNearlyFull();
+    }
+}
 
-            handleTraceEntry( e );
-        } else {
-            throw;
+void DatabaseFeeder::storePendingEntriesSeparately()
+{
+    QList<TraceEntry> entries;
+    entries.swap( m_pendingEntries );
+
+    QList<TraceEntry>::ConstIterator it, end = entries.end();
+    for ( it = entries.begin(); it != end; ++it ) {
+        try {
+            Transaction transaction( m_db );
+            ::storeEntry( m_caches, m_statements, &transaction, *it );
+        } catch ( const SQLTransactionException &ex ) {
+            m_caches->reload();
+            qWarning() << "Dropped trace entry:" << ex.what();
+            continue;
         }
+        ++m_entriesSinceSizeCheck;
     }
 }
 
 void DatabaseFeeder::handleShutdownEvent( const ProcessShutdownEvent &ev )
 {
+    // The process may only be known to the database once its entries are stored
+    flushPendingEntries();
+
     Transaction transaction( m_db );
     transaction.exec( QString( "UPDATE process SET end_time=%1 WHERE pid=%2 AND start_time=%3;" ).arg( Database::formatValue( m_db, ev.stopTime ) ).arg( ev.pid ).arg( Database::formatValue( m_db, ev.startTime ) ) );
 }
@@ -574,6 +1203,11 @@ unsigned short clamp( unsigned short v, unsigned short lowerBound, unsigned shor
 
 void DatabaseFeeder::applyStorageConfiguration( const StorageConfiguration &cfg )
 {
+    // Dropping old segments takes the place of the size limit
+    if ( !m_segmentFile.isEmpty() ) {
+        return;
+    }
+
     const unsigned short shrinkBy = clamp(cfg.shrinkBy, (unsigned short)1, (unsigned short)100 );
     if ( m_maximumSize == cfg.maximumSize &&
          m_shrinkBy == shrinkBy &&
@@ -586,6 +1220,7 @@ void DatabaseFeeder::applyStorageConfiguration( const StorageConfiguration &cfg
          * compiled with different settings.
          */
         m_db.exec( "PRAGMA max_page_count=1073741823" );
+        m_maximumPageCount = 0;
         m_maximumSize = cfg.maximumSize;
         m_shrinkBy = shrinkBy;
         m_archiveDir = cfg.archiveDir;
@@ -632,6 +1267,7 @@ void DatabaseFeeder::applyStorageConfiguration( const StorageConfiguration &cfg
 
     m_db.exec( QString( "PRAGMA max_page_count=%1" ).arg( maxPageCount ) );
 
+    m_maximumPageCount = maxPageCount;
     m_maximumSize = cfg.maximumSize;
     m_shrinkBy = shrinkBy;
     m_archiveDir = cfg.archiveDir;
@@ -22,10 +22,36 @@
 
 #include "xmlcontenthandler.h"
 
+class PreparedStatements;
+class StorageCaches;
+
 class DatabaseFeeder : public XmlParseEventsHandler
 {
 public:
     DatabaseFeeder( QSqlDatabase db );
+    ~DatabaseFeeder();
+
+    /* Entries are stored in transactions of up to maximumEntries entries;
+     * the default of one entry stores each entry right away.
+     */
+    void setBatchSize( unsigned int maximumEntries );
+    bool hasPendingEntries() const;
+    void flushPendingEntries();
+
+    /* Limits the memory used for caching the ids of paths, functions,
+     * processes, threads and trace points.
+     */
+    void setCacheMemoryLimit( size_t bytes );
+
+    /* Stores the entries in segment files (see Database::segmentFiles)
+     * instead of the trace database. A new segment is started once the
+     * current one is maximumSize bytes large or maximumDuration seconds old;
+     * a limit of zero disables the respective check. Only the most recent
+     * segmentCount segments are kept.
+     */
+    void setSegmentation( qulonglong maximumSize, unsigned int maximumDuration,
+                          unsigned int segmentCount );
+
 protected:
     virtual void handleTraceEntry( const TraceEntry & );
     virtual void applyStorageConfiguration( const StorageConfiguration & );
@@ -36,10 +62,32 @@ protected:
     // Needed for the server subclass to nuke the database
     void trimDb();
 private:
+    DatabaseFeeder( const DatabaseFeeder &other ); // disabled
+    void operator=( const DatabaseFeeder &rhs ); // disabled
+
+    void archiveIfNearlyFull();
+    void storePendingEntriesSeparately();
+    void attachSegment( const QString &fileName );
+    void detachSegment();
+    void startSegment();
+    void removeOldSegments();
+    bool segmentIsFull() const;
+
     QSqlDatabase m_db;
+    PreparedStatements *m_statements;
+    StorageCaches *m_caches;
+    QList<TraceEntry> m_pendingEntries;
+    unsigned int m_batchSize;
     unsigned short m_shrinkBy;
     unsigned long m_maximumSize;
+    qulonglong m_maximumPageCount;
+    unsigned int m_entriesSinceSizeCheck;
     QString m_archiveDir;
+    qulonglong m_maximumSegmentSize;
+    unsigned int m_maximumSegmentDuration;
+    unsigned int m_segmentCount;
+    QString m_segmentFile;
+    qint64 m_segmentStartTime;
 };
 
 #endif // TRACER_DATABASEFEEDER_H
@@ -20,6 +20,9 @@
 #include "server.h"
 
 #include "database.h"
+#ifdef Q_OS_UNIX
+#  include "sharedmemoryreader.h"
+#endif
 #include "../hooklib/tracelib_config.h"
 #include "config.h"
 
@@ -46,7 +49,7 @@ using namespace std;
 static void printUsage(const string &app)
 {
     cout << "Usage: " << app << " --help" << endl
-         << "       " << app << " [--port <port> [--guiport <port>]] <.trace-file>" << endl;
+         << "       " << app << " [--port <port> [--guiport <port>]] [--socket <path>] [--shm <name> [--shmslots <count>] [--shmslotsize <KB>]] [--batchsize <entries> [--batchdelay <ms>]] [--cachelimit <MB>] [--segmentsize <MB>] [--segmentduration <minutes>] [--segments <count>] [--symbolcache <file>] <.trace-file>" << endl;
 }
 
 #ifdef Q_OS_WIN32
@@ -91,11 +94,48 @@ int main( int argc, char **argv )
                                   "port", QString::number(TRACELIB_DEFAULT_PORT));
     QCommandLineOption guiportOption(QStringList() << "g" << "guiport", "Listening Port for the trace gui to connect to.",
                                      "guiport", QString::number(TRACELIB_DEFAULT_PORT + 1));
+    QCommandLineOption socketOption(QStringList() << "socket", "Also listen on this Unix domain socket for the trace library to connect to (a path starting with @ names a socket in the abstract namespace).",
+                                    "path");
+#ifdef Q_OS_UNIX
+    QCommandLineOption shmOption(QStringList() << "shm", "Also read trace entries from the POSIX shared memory segment with this name, which is created if necessary.",
+                                 "name");
+    QCommandLineOption shmSlotsOption(QStringList() << "shmslots", "Number of processes which can write into the shared memory segment at the same time.",
+                                      "count", QString::number(SharedMemoryReader::DefaultSlotCount));
+    QCommandLineOption shmSlotSizeOption(QStringList() << "shmslotsize", "Size in kilobytes of the ring buffer of each process writing into the shared memory segment.",
+                                         "KB", QString::number(SharedMemoryReader::DefaultSlotSize / 1024));
+#endif
+    QCommandLineOption batchSizeOption(QStringList() << "b" << "batchsize", "Maximum number of trace entries to store in one database transaction.",
+                                       "entries", QString::number(1));
+    QCommandLineOption batchDelayOption(QStringList() << "d" << "batchdelay", "Maximum time in milliseconds a received trace entry is kept before it is stored.",
+                                        "ms", QString::number(100));
+    QCommandLineOption cacheLimitOption(QStringList() << "c" << "cachelimit", "Maximum memory in megabytes used for caching database ids.",
+                                        "MB", QString::number(64));
+    QCommandLineOption segmentSizeOption(QStringList() << "s" << "segmentsize", "Store the trace entries in segment files of at most this many megabytes.",
+                                         "MB", QString::number(0));
+    QCommandLineOption segmentDurationOption(QStringList() << "t" << "segmentduration", "Store the trace entries in segment files covering at most this many minutes.",
+                                             "minutes", QString::number(0));
+    QCommandLineOption segmentCountOption(QStringList() << "n" << "segments", QString("Number of segment files to keep (at most %1).").arg(Database::maximumSegmentCount),
+                                          "count", QString::number(Database::maximumSegmentCount));
+    QCommandLineOption symbolCacheOption(QStringList() << "symbolcache", "File for caching the symbols resolved for backtraces sent as addresses (default: <.trace_file>.symbols).",
+                                         "file");
     opt.addHelpOption();
     opt.addVersionOption();
     opt.setApplicationDescription("Listens for trace library connections to store trace entries into a database");
     opt.addOption(portOption);
     opt.addOption(guiportOption);
+    opt.addOption(socketOption);
+#ifdef Q_OS_UNIX
+    opt.addOption(shmOption);
+    opt.addOption(shmSlotsOption);
+    opt.addOption(shmSlotSizeOption);
+#endif
+    opt.addOption(batchSizeOption);
+    opt.addOption(batchDelayOption);
+    opt.addOption(cacheLimitOption);
+    opt.addOption(segmentSizeOption);
+    opt.addOption(segmentDurationOption);
+    opt.addOption(segmentCountOption);
+    opt.addOption(symbolCacheOption);
     opt.addPositionalArgument(".trace_file", "Trace database to store the trace entries into");
     opt.process(app);
 
@@ -128,6 +168,66 @@ int main( int argc, char **argv )
 	cout << "Trace port and GUI port have to be different." << endl;
 	return Error::CommandLineArgs;
     }
+    const unsigned int batchSize = opt.value(batchSizeOption).toUInt(&ok);
+    if (!ok || batchSize == 0) {
+        cout << "Invalid batch size '"
+             << opt.value(batchSizeOption).toLocal8Bit().constData()
+             << "' given." << endl;
+        return Error::CommandLineArgs;
+    }
+    const unsigned int batchDelay = opt.value(batchDelayOption).toUInt(&ok);
+    if (!ok) {
+        cout << "Invalid batch delay '"
+             << opt.value(batchDelayOption).toLocal8Bit().constData()
+             << "' given." << endl;
+        return Error::CommandLineArgs;
+    }
+    const unsigned int cacheLimit = opt.value(cacheLimitOption).toUInt(&ok);
+    if (!ok) {
+        cout << "Invalid cache limit '"
+             << opt.value(cacheLimitOption).toLocal8Bit().constData()
+             << "' given." << endl;
+        return Error::CommandLineArgs;
+    }
+
+#ifdef Q_OS_UNIX
+    const unsigned int shmSlots = opt.value(shmSlotsOption).toUInt(&ok);
+    if (!ok || shmSlots == 0) {
+        cout << "Invalid shared memory slot count '"
+             << opt.value(shmSlotsOption).toLocal8Bit().constData()
+             << "' given." << endl;
+        return Error::CommandLineArgs;
+    }
+    const unsigned int shmSlotSize = opt.value(shmSlotSizeOption).toUInt(&ok);
+    if (!ok || shmSlotSize == 0) {
+        cout << "Invalid shared memory slot size '"
+             << opt.value(shmSlotSizeOption).toLocal8Bit().constData()
+             << "' given." << endl;
+        return Error::CommandLineArgs;
+    }
+#endif
+
+    const unsigned int segmentSize = opt.value(segmentSizeOption).toUInt(&ok);
+    if (!ok) {
+        cout << "Invalid segment size '"
+             << opt.value(segmentSizeOption).toLocal8Bit().constData()
+             << "' given." << endl;
+        return Error::CommandLineArgs;
+    }
+    const unsigned int segmentDuration = opt.value(segmentDurationOption).toUInt(&ok);
+    if (!ok) {
+        cout << "Invalid segment duration '"
+             << opt.value(segmentDurationOption).toLocal8Bit().constData()
+             << "' given." << endl;
+        return Error::CommandLineArgs;
+    }
+    const unsigned int segmentCount = opt.value(segmentCountOption).toUInt(&ok);
+    if (!ok || segmentCount == 0 || segmentCount > unsigned(Database::maximumSegmentCount)) {
+        cout << "Invalid segment count '"
+             << opt.value(segmentCountOption).toLocal8Bit().constData()
+             << "' given." << endl;
+        return Error::CommandLineArgs;
+    }
 
     QSqlDatabase database;
     if (QFile::exists(traceFile)) {
@@ -142,7 +242,37 @@ int main( int argc, char **argv )
         return Error::Database;
     }
 
-    Server server(traceFile, database, port, guiport);
+    Server server(traceFile, database, port, guiport, opt.value(symbolCacheOption));
+    server.setBatchLimits(batchSize, batchDelay);
+    if (opt.isSet(socketOption)) {
+        if (!server.listenOnLocalSocket(opt.value(socketOption), &errMsg)) {
+            cout << "Failed to listen on socket '"
+                 << opt.value(socketOption).toLocal8Bit().constData()
+                 << "': " << errMsg.toLocal8Bit().constData() << endl;
+            return Error::CommandLineArgs;
+        }
+    }
+#ifdef Q_OS_UNIX
+    if (opt.isSet(shmOption)) {
+        if (!server.readSharedMemory(opt.value(shmOption), shmSlots,
+                                     quint64(shmSlotSize) * 1024, &errMsg)) {
+            cout << "Failed to set up shared memory segment '"
+                 << opt.value(shmOption).toLocal8Bit().constData()
+                 << "': " << errMsg.toLocal8Bit().constData() << endl;
+            return Error::CommandLineArgs;
+        }
+    }
+#endif
+    server.setCacheMemoryLimit(size_t(cacheLimit) * 1024 * 1024);
+    if (segmentSize > 0 || segmentDuration > 0) {
+        try {
+            server.setSegmentation(qulonglong(segmentSize) * 1024 * 1024,
+                                   segmentDuration * 60, segmentCount);
+        } catch (const std::exception &e) {
+            cout << "Failed to set up trace segments: " << e.what() << endl;
+            return Error::Database;
+        }
+    }
 
     return app.exec();
 }
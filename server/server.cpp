@@ -21,6 +21,10 @@
 
 #include "database.h"
 #include "datagramtypes.h"
+#ifdef Q_OS_UNIX
+#  include "sharedmemoryreader.h"
+#endif
+#include "../hooklib/binaryformat.h"
 
 #include <QDataStream>
 #include <QDir>
@@ -47,55 +51,114 @@ void ClientSocket::handleIncomingData()
     emit dataReceived( data );
 }
 
-NetworkingThread::NetworkingThread( qintptr  socketDescriptor, QObject *parent )
+LocalClientSocket::LocalClientSocket( QObject *parent )
+    : QLocalSocket( parent )
+{
+    connect( this, SIGNAL( readyRead() ),
+             this, SLOT( handleIncomingData() ) );
+}
+
+void LocalClientSocket::handleIncomingData()
+{
+    const QByteArray data = readAll();
+    assert( !data.isEmpty() );
+    emit dataReceived( data );
+}
+
+NetworkingThread::NetworkingThread( qintptr  socketDescriptor, ConnectionType type, QObject *parent )
     : QThread( parent ),
     m_socketDescriptor( socketDescriptor ),
-    m_clientSocket( 0 )
+    m_type( type )
 {
 }
 
 void NetworkingThread::run()
 {
-    m_clientSocket = new ClientSocket;
-    m_clientSocket->setSocketDescriptor( m_socketDescriptor );
-    connect( m_clientSocket, SIGNAL( dataReceived( const QByteArray & ) ),
+    QIODevice *clientSocket;
+    if ( m_type == LocalConnection ) {
+        LocalClientSocket *socket = new LocalClientSocket;
+        socket->setSocketDescriptor( m_socketDescriptor );
+        clientSocket = socket;
+    } else {
+        ClientSocket *socket = new ClientSocket;
+        socket->setSocketDescriptor( m_socketDescriptor );
+        clientSocket = socket;
+    }
+    connect( clientSocket, SIGNAL( dataReceived( const QByteArray & ) ),
              this, SIGNAL( dataReceived( const QByteArray & ) ),
              Qt::QueuedConnection );
-    connect( m_clientSocket, SIGNAL( disconnected() ),
+    connect( clientSocket, SIGNAL( disconnected() ),
              this, SLOT( quit() ),
              Qt::QueuedConnection  );
     exec();
-    delete m_clientSocket;
+    delete clientSocket;
 }
 
-ServerSocket::ServerSocket( Server *server )
-    : QTcpServer( server ),
-    m_server( server )
+static void startNetworkingThread( qintptr socketDescriptor,
+                                   NetworkingThread::ConnectionType type,
+                                   QObject *parent, Server *server )
 {
+    NetworkingThread *thread = new NetworkingThread( socketDescriptor, type, parent );
+    QObject::connect( thread, SIGNAL( dataReceived( const QByteArray & ) ),
+                      server, SLOT( handleIncomingData( const QByteArray & ) ) );
+    QObject::connect( thread, SIGNAL( finished() ),
+                      server, SLOT( connectionClosed() ) );
+    QObject::connect( thread, SIGNAL( finished() ),
+                      thread, SLOT( deleteLater() ) );
+    thread->start();
 }
 
-ServerSocket::~ServerSocket()
+/* The threads are children of the server socket which accepted their
+ * connections; threads whose connection was closed already deleted
+ * themselves, so the children are the threads which may still run.
+ */
+static void stopNetworkingThreads( QObject *serverSocket )
 {
-    QList<NetworkingThread *>::Iterator it, end = m_networkingThreads.end();
-    for ( it = m_networkingThreads.begin(); it != end; ++it ) {
+    const QList<NetworkingThread *> threads =
+        serverSocket->findChildren<NetworkingThread *>( QString(), Qt::FindDirectChildrenOnly );
+
+    QList<NetworkingThread *>::ConstIterator it, end = threads.end();
+    for ( it = threads.begin(); it != end; ++it ) {
         ( *it )->quit();
     }
 
-    for ( it = m_networkingThreads.begin(); it != end; ++it ) {
+    for ( it = threads.begin(); it != end; ++it ) {
         ( *it )->wait();
     }
 }
 
+ServerSocket::ServerSocket( Server *server )
+    : QTcpServer( server ),
+    m_server( server )
+{
+}
+
+ServerSocket::~ServerSocket()
+{
+    stopNetworkingThreads( this );
+}
+
 void ServerSocket::incomingConnection( qintptr  socketDescriptor )
 {
-    NetworkingThread *thread = new NetworkingThread( socketDescriptor,
-                                                     this );
-    m_networkingThreads.push_back( thread );
-    connect( thread, SIGNAL( dataReceived( const QByteArray & ) ),
-             m_server, SLOT( handleIncomingData( const QByteArray & ) ) );
-    connect( thread, SIGNAL( finished() ),
-             thread, SLOT( deleteLater() ) );
-    thread->start();
+    startNetworkingThread( socketDescriptor, NetworkingThread::TcpConnection,
+                           this, m_server );
+}
+
+LocalServerSocket::LocalServerSocket( Server *server )
+    : QLocalServer( server ),
+    m_server( server )
+{
+}
+
+LocalServerSocket::~LocalServerSocket()
+{
+    stopNetworkingThreads( this );
+}
+
+void LocalServerSocket::incomingConnection( quintptr socketDescriptor )
+{
+    startNetworkingThread( socketDescriptor, NetworkingThread::LocalConnection,
+                           this, m_server );
 }
 
 GUIConnection::GUIConnection( Server *server, QTcpSocket *sock )
@@ -160,18 +223,101 @@ void GUIConnection::handleDisconnect()
     delete this;
 }
 
+ConnectionDecoder::ConnectionDecoder( XmlParseEventsHandler *handler, Symbolizer *symbolizer )
+    : m_handler( handler ),
+    m_symbolizer( symbolizer ),
+    m_xmlHandler( 0 ),
+    m_binaryHandler( 0 ),
+    m_failed( false )
+{
+}
+
+ConnectionDecoder::~ConnectionDecoder()
+{
+    delete m_xmlHandler;
+    delete m_binaryHandler;
+}
+
+void ConnectionDecoder::addData( const QByteArray &data )
+{
+    // Once the stream got out of sync, the rest of it is meaningless
+    if ( m_failed ) {
+        return;
+    }
+
+    try {
+        if ( !m_xmlHandler && !m_binaryHandler ) {
+            if ( data.at( 0 ) == TRACELIB_NAMESPACE_IDENT(BinaryFormat)::Magic[0] ) {
+                m_binaryHandler = new BinaryContentHandler( m_handler, m_symbolizer );
+            } else {
+                m_xmlHandler = new XmlContentHandler( m_handler );
+                m_xmlHandler->addData( "<toplevel_trace_element>" );
+            }
+        }
+
+        if ( m_binaryHandler ) {
+            m_binaryHandler->addData( data );
+            m_binaryHandler->continueParsing();
+        } else {
+            m_xmlHandler->addData( data );
+            m_xmlHandler->continueParsing();
+        }
+    } catch ( const XmlParseException & ) {
+        m_failed = true;
+        throw;
+    } catch ( const BinaryParseException & ) {
+        m_failed = true;
+        throw;
+    }
+}
+
+bool ConnectionDecoder::isWaitingForSymbols() const
+{
+    return m_binaryHandler && !m_failed && m_binaryHandler->isWaitingForSymbols();
+}
+
+void ConnectionDecoder::resume()
+{
+    if ( !isWaitingForSymbols() ) {
+        return;
+    }
+    try {
+        m_binaryHandler->continueParsing();
+    } catch ( const BinaryParseException & ) {
+        m_failed = true;
+        throw;
+    }
+}
+
+void ConnectionDecoder::finish()
+{
+    if ( !isWaitingForSymbols() ) {
+        return;
+    }
+    m_binaryHandler->stopWaitingForSymbols();
+    resume();
+}
+
 Server::Server( const QString &traceFile,
                 QSqlDatabase database,
                 unsigned short port, unsigned short guiPort,
+                const QString &symbolCacheFile,
                 QObject *parent )
     : QObject( parent ),
       DatabaseFeeder( database ),
+      m_batchTimer( 0 ),
       m_tcpServer( 0 ),
-      m_xmlHandler( this )
+      m_localServer( 0 ),
+      m_sharedMemoryReader( 0 ),
+      m_symbolizer( 0 )
 {
     QFileInfo fi( traceFile );
     m_traceFile = QDir::toNativeSeparators( fi.canonicalFilePath() );
 
+    m_symbolizer = new Symbolizer( symbolCacheFile.isEmpty() ? traceFile + QLatin1String( ".symbols" )
+                                                             : symbolCacheFile );
+    connect( m_symbolizer, SIGNAL( framesResolved() ), SLOT( resumeDecoding() ) );
+
     m_tcpServer = new ServerSocket( this );
     //connect( m_tcpServer, SIGNAL( newConnection() ), SLOT( m_tcpServer.incomingConnection() ) );
     int a = m_tcpServer->listen( QHostAddress::LocalHost, port );
@@ -180,7 +326,93 @@ Server::Server( const QString &traceFile,
     connect( m_guiServer, SIGNAL( newConnection() ), SLOT( handleNewGUIConnection() ) );
     a = m_guiServer->listen( QHostAddress::LocalHost, guiPort );
 
-    m_xmlHandler.addData( "<toplevel_trace_element>" );
+    m_batchTimer = new QTimer( this );
+    m_batchTimer->setSingleShot( true );
+    connect( m_batchTimer, SIGNAL( timeout() ), SLOT( storePendingEntries() ) );
+}
+
+Server::~Server()
+{
+#ifdef Q_OS_UNIX
+    delete m_sharedMemoryReader;
+#endif
+
+    // Entries still waiting for the symbolizer are stored unresolved
+    QList<ConnectionDecoder *> decoders = m_decoders.values() + m_streamDecoders.values() + m_closedDecoders;
+    QList<ConnectionDecoder *>::ConstIterator it, end = decoders.end();
+    for ( it = decoders.begin(); it != end; ++it ) {
+        try {
+            ( *it )->finish();
+        } catch ( const runtime_error &e ) {
+            qWarning() << e.what();
+        }
+        delete *it;
+    }
+    storePendingEntries();
+    delete m_symbolizer;
+}
+
+void Server::setBatchLimits( unsigned int maximumEntries, unsigned int maximumDelay )
+{
+    m_batchTimer->setInterval( maximumDelay );
+    setBatchSize( maximumEntries );
+}
+
+bool Server::listenOnLocalSocket( const QString &path, QString *errorMessage )
+{
+    delete m_localServer;
+    m_localServer = new LocalServerSocket( this );
+
+    QString name = path;
+    if ( path.startsWith( QLatin1Char( '@' ) ) ) {
+#if defined(Q_OS_LINUX) && QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+        m_localServer->setSocketOptions( QLocalServer::AbstractNamespaceOption );
+        name = path.mid( 1 );
+#else
+        *errorMessage = QObject::tr( "Sockets in the abstract namespace are not supported on this platform" );
+        return false;
+#endif
+    } else {
+        // A socket file left behind by a server which didn't shut down cleanly
+        QLocalServer::removeServer( path );
+    }
+
+    if ( !m_localServer->listen( name ) ) {
+        *errorMessage = m_localServer->errorString();
+        return false;
+    }
+    return true;
+}
+
+#ifdef Q_OS_UNIX
+bool Server::readSharedMemory( const QString &name, unsigned int slotCount, quint64 slotSize,
+                               QString *errorMessage )
+{
+    delete m_sharedMemoryReader;
+    m_sharedMemoryReader = new SharedMemoryReader( this );
+    if ( !m_sharedMemoryReader->attach( name, slotCount, slotSize, errorMessage ) ) {
+        delete m_sharedMemoryReader;
+        m_sharedMemoryReader = 0;
+        return false;
+    }
+
+    connect( m_sharedMemoryReader, SIGNAL( dataReceived( quint64, const QByteArray & ) ),
+             SLOT( handleSharedMemoryData( quint64, const QByteArray & ) ) );
+    connect( m_sharedMemoryReader, SIGNAL( streamClosed( quint64 ) ),
+             SLOT( sharedMemoryStreamClosed( quint64 ) ) );
+    m_sharedMemoryReader->start();
+    return true;
+}
+#endif
+
+void Server::storePendingEntries()
+{
+    m_batchTimer->stop();
+    try {
+        flushPendingEntries();
+    } catch ( const runtime_error &e ) {
+        qWarning() << e.what();
+    }
 }
 
 // duplicated in gui/mainwindow.cpp
@@ -222,6 +454,9 @@ QByteArray serializeGUIClientData( ServerDatagramType type, const T &v ) {
 void Server::handleTraceEntry( const TraceEntry &entry )
 {
     DatabaseFeeder::handleTraceEntry( entry );
+    if ( hasPendingEntries() && !m_batchTimer->isActive() ) {
+        m_batchTimer->start();
+    }
 
     QByteArray serializedEntry = serializeGUIClientData( TraceEntryDatagram, entry );
 
@@ -247,11 +482,69 @@ void Server::handleShutdownEvent( const ProcessShutdownEvent &ev )
     emit processShutdown( ev );
 }
 
-void Server::handleIncomingData( const QByteArray &xmlData )
+// Each networking thread delivers the data of exactly one connection
+void Server::handleIncomingData( const QByteArray &data )
+{
+    decode( m_decoders[sender()], data );
+}
+
+void Server::connectionClosed()
 {
+    closeDecoder( m_decoders.take( sender() ) );
+}
+
+// Each stream read from shared memory is decoded like a connection
+void Server::handleSharedMemoryData( quint64 stream, const QByteArray &data )
+{
+    decode( m_streamDecoders[stream], data );
+}
+
+void Server::sharedMemoryStreamClosed( quint64 stream )
+{
+    closeDecoder( m_streamDecoders.take( stream ) );
+}
+
+// The entries of a closed connection may still wait for the symbolizer
+void Server::closeDecoder( ConnectionDecoder *decoder )
+{
+    if ( decoder && decoder->isWaitingForSymbols() ) {
+        m_closedDecoders.append( decoder );
+        return;
+    }
+    delete decoder;
+}
+
+void Server::resumeDecoding()
+{
+    QList<ConnectionDecoder *> decoders = m_decoders.values() + m_streamDecoders.values() + m_closedDecoders;
+    QList<ConnectionDecoder *>::ConstIterator it, end = decoders.end();
+    for ( it = decoders.begin(); it != end; ++it ) {
+        try {
+            ( *it )->resume();
+        } catch ( const runtime_error &e ) {
+            qWarning() << e.what();
+        }
+    }
+
+    QList<ConnectionDecoder *>::Iterator closedIt = m_closedDecoders.begin();
+    while ( closedIt != m_closedDecoders.end() ) {
+        if ( ( *closedIt )->isWaitingForSymbols() ) {
+            ++closedIt;
+        } else {
+            delete *closedIt;
+            closedIt = m_closedDecoders.erase( closedIt );
+        }
+    }
+}
+
+void Server::decode( ConnectionDecoder *&decoder, const QByteArray &data )
+{
+    if ( !decoder ) {
+        decoder = new ConnectionDecoder( this, m_symbolizer );
+    }
+
     try {
-        m_xmlHandler.addData( xmlData );
-        m_xmlHandler.continueParsing();
+        decoder->addData( data );
     } catch ( const runtime_error &e ) {
         qWarning() << e.what();
     }
@@ -21,17 +21,25 @@
 #define TRACE_SERVER_H
 
 #include <QByteArray>
+#include <QHash>
 #include <QList>
+#include <QLocalServer>
+#include <QLocalSocket>
 #include <QObject>
 #include <QSqlDatabase>
 #include <QTcpServer>
 #include <QTcpSocket>
 #include <QThread>
+#include <QTimer>
 #include <QXmlStreamReader>
 
 #include "database.h"
 #include "xmlcontenthandler.h"
+#include "binarycontenthandler.h"
 #include "databasefeeder.h"
+#include "symbolizer.h"
+
+class SharedMemoryReader;
 
 class ClientSocket : public QTcpSocket
 {
@@ -46,11 +54,29 @@ private slots:
     void handleIncomingData();
 };
 
+class LocalClientSocket : public QLocalSocket
+{
+    Q_OBJECT
+public:
+    LocalClientSocket( QObject *parent = 0 );
+
+signals:
+    void dataReceived( const QByteArray &data );
+
+private slots:
+    void handleIncomingData();
+};
+
 class NetworkingThread : public QThread
 {
     Q_OBJECT
 public:
-    NetworkingThread( qintptr  socketDescriptor, QObject *parent = 0 );
+    enum ConnectionType {
+        TcpConnection,
+        LocalConnection
+    };
+
+    NetworkingThread( qintptr  socketDescriptor, ConnectionType type, QObject *parent = 0 );
 
 signals:
     void dataReceived( const QByteArray &data );
@@ -60,7 +86,7 @@ protected:
 
 private:
     qintptr  m_socketDescriptor;
-    ClientSocket *m_clientSocket;
+    ConnectionType m_type;
 };
 
 class Server;
@@ -76,7 +102,22 @@ protected:
 
 private:
     Server *m_server;
-    QList<NetworkingThread *> m_networkingThreads;
+};
+
+/* Accepts connections of trace libraries on the same host (via Unix domain
+ * sockets); each is handled by a NetworkingThread, like TCP connections.
+ */
+class LocalServerSocket : public QLocalServer
+{
+public:
+    LocalServerSocket( Server *server );
+    ~LocalServerSocket();
+
+protected:
+    virtual void incomingConnection( quintptr socketDescriptor );
+
+private:
+    Server *m_server;
 };
 
 class Server;
@@ -102,13 +143,72 @@ private:
     QTcpSocket *m_sock;
 };
 
+/* Decodes the data received over a single connection. Clients send either
+ * XML or the binary trace format; the format is determined by the first
+ * bytes of the stream (binary streams start with a magic header).
+ */
+class ConnectionDecoder
+{
+public:
+    ConnectionDecoder( XmlParseEventsHandler *handler, Symbolizer *symbolizer );
+    ~ConnectionDecoder();
+
+    void addData( const QByteArray &data );
+
+    /* Binary streams wait for the symbolizer to resolve backtraces (see
+     * BinaryContentHandler::continueParsing()); resume() continues
+     * decoding after it resolved some, finish() decodes the received data
+     * without waiting.
+     */
+    bool isWaitingForSymbols() const;
+    void resume();
+    void finish();
+
+private:
+    ConnectionDecoder( const ConnectionDecoder &other ); // disabled
+    void operator=( const ConnectionDecoder &rhs ); // disabled
+
+    XmlParseEventsHandler *m_handler;
+    Symbolizer *m_symbolizer;
+    XmlContentHandler *m_xmlHandler;
+    BinaryContentHandler *m_binaryHandler;
+    bool m_failed;
+};
+
 class Server : public QObject, public DatabaseFeeder
 {
     Q_OBJECT
 public:
+    /* Backtraces sent as plain addresses are resolved using (and cached
+     * in) the given symbol cache file; by default, the file is stored next
+     * to the trace file.
+     */
     Server( const QString &traceFile,
             QSqlDatabase database, unsigned short port, unsigned short guiPort,
+            const QString &symbolCacheFile = QString(),
             QObject *parent = 0 );
+    ~Server();
+
+    /* Stores the received entries in batches of up to maximumEntries
+     * entries; pending entries are stored at the latest maximumDelay
+     * milliseconds after the first of them was received.
+     */
+    void setBatchLimits( unsigned int maximumEntries, unsigned int maximumDelay );
+
+    /* Also accepts trace library connections on the Unix domain socket with
+     * the given path (which starts with '@' for the abstract namespace);
+     * returns false and sets errorMessage on failure.
+     */
+    bool listenOnLocalSocket( const QString &path, QString *errorMessage );
+
+#ifdef Q_OS_UNIX
+    /* Also reads the trace entries which trace libraries write into the
+     * POSIX shared memory segment with the given name (see
+     * SharedMemoryReader); returns false and sets errorMessage on failure.
+     */
+    bool readSharedMemory( const QString &name, unsigned int slotCount, quint64 slotSize,
+                           QString *errorMessage );
+#endif
 
 public slots:
     void handleIncomingData(const QByteArray &data);
@@ -121,16 +221,29 @@ private slots:
     void handleNewGUIConnection();
     void nukeDatabase();
     void guiDisconnected( GUIConnection *c );
+    void connectionClosed();
+    void handleSharedMemoryData( quint64 stream, const QByteArray &data );
+    void sharedMemoryStreamClosed( quint64 stream );
+    void storePendingEntries();
+    void resumeDecoding();
 
 private:
     void handleDatagram( const QByteArray &datagram );
     void handleTraceEntry( const TraceEntry &e );
     void handleShutdownEvent( const ProcessShutdownEvent &ev );
     void archivedEntries();
+    void decode( ConnectionDecoder *&decoder, const QByteArray &data );
+    void closeDecoder( ConnectionDecoder *decoder );
 
+    QTimer *m_batchTimer;
     QTcpServer *m_guiServer;
     ServerSocket *m_tcpServer;
-    XmlContentHandler m_xmlHandler;
+    LocalServerSocket *m_localServer;
+    QHash<QObject *, ConnectionDecoder *> m_decoders;
+    SharedMemoryReader *m_sharedMemoryReader;
+    QHash<quint64, ConnectionDecoder *> m_streamDecoders;
+    QList<ConnectionDecoder *> m_closedDecoders; // waiting for the symbolizer
+    Symbolizer *m_symbolizer;
     bool m_receivedData;
     QString m_traceFile;
     QList<GUIConnection *> m_guiConnections;
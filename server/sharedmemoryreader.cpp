@@ -0,0 +1,403 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sharedmemoryreader.h"
+
+#include "../hooklib/sharedmemoryformat.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef Q_OS_LINUX
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+#endif
+
+using namespace TRACELIB_NAMESPACE_IDENT(SharedMemoryFormat);
+
+// How often the owners of the slots are checked for having died
+static const unsigned int OwnerCheckInterval = 1000; // milliseconds
+
+#ifndef Q_OS_LINUX
+// Without futexes, the reader polls for new data
+static const unsigned int PollInterval = 10; // milliseconds
+#endif
+
+static bool isAlive( unsigned int pid )
+{
+    return kill( static_cast<pid_t>( pid ), 0 ) == 0 || errno != ESRCH;
+}
+
+static bool isValidHeader( const Header *header, unsigned int slotCount, quint64 slotSize )
+{
+    return memcmp( header->magic, Magic, sizeof( Magic ) ) == 0 &&
+           header->version == Version &&
+           header->headerSize == HeaderSize &&
+           header->slotCount == slotCount &&
+           header->slotSize == slotSize;
+}
+
+SharedMemoryReader::SharedMemoryReader( QObject *parent )
+    : QThread( parent ),
+    m_segment( 0 ),
+    m_segmentSize( 0 ),
+    m_slotCount( 0 ),
+    m_slotSize( 0 ),
+    m_nextStreamId( 1 ),
+    m_stopRequested( 0 )
+{
+}
+
+SharedMemoryReader::~SharedMemoryReader()
+{
+    stop();
+    wait();
+    detach();
+}
+
+bool SharedMemoryReader::attach( const QString &name, unsigned int slotCount, quint64 slotSize,
+                                 QString *errorMessage )
+{
+    detach();
+
+    m_name = QFile::encodeName( name.startsWith( QLatin1Char( '/' ) ) ? name : QLatin1Char( '/' ) + name );
+    const quint64 size = segmentSize( slotCount, slotSize );
+
+    // Only processes of the same user may write trace entries
+    int fd = shm_open( m_name.constData(), O_RDWR | O_CREAT, 0600 );
+    struct stat st;
+    if ( fd == -1 || fstat( fd, &st ) != 0 ) {
+        *errorMessage = QString::fromLocal8Bit( strerror( errno ) );
+        if ( fd != -1 ) {
+            ::close( fd );
+        }
+        return false;
+    }
+
+    bool takeOver = false;
+    if ( static_cast<quint64>( st.st_size ) == size ) {
+        void *mapping = mmap( 0, static_cast<size_t>( size ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+        if ( mapping != MAP_FAILED ) {
+            Header *header = static_cast<Header *>( mapping );
+            if ( isValidHeader( header, slotCount, slotSize ) ) {
+                const unsigned int serverPid = load( &header->serverPid );
+                if ( serverPid != 0 && serverPid != static_cast<unsigned int>( getpid() ) && isAlive( serverPid ) ) {
+                    *errorMessage = QObject::tr( "The segment is in use by the trace server with process id %1" ).arg( serverPid );
+                    munmap( mapping, static_cast<size_t>( size ) );
+                    ::close( fd );
+                    return false;
+                }
+                m_segment = static_cast<char *>( mapping );
+                takeOver = true;
+            } else {
+                munmap( mapping, static_cast<size_t>( size ) );
+            }
+        }
+    }
+
+    if ( !takeOver && st.st_size != 0 ) {
+        /* Tell the processes still writing into the old segment to open the
+         * new one, then replace it.
+         */
+        if ( static_cast<quint64>( st.st_size ) >= HeaderSize ) {
+            void *mapping = mmap( 0, HeaderSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+            if ( mapping != MAP_FAILED ) {
+                Header *header = static_cast<Header *>( mapping );
+                if ( memcmp( header->magic, Magic, sizeof( Magic ) ) == 0 ) {
+                    store( &header->flags, static_cast<unsigned short>( header->flags | Closed ) );
+                }
+                munmap( mapping, HeaderSize );
+            }
+        }
+        ::close( fd );
+        shm_unlink( m_name.constData() );
+        fd = shm_open( m_name.constData(), O_RDWR | O_CREAT | O_EXCL, 0600 );
+        if ( fd == -1 ) {
+            *errorMessage = QString::fromLocal8Bit( strerror( errno ) );
+            return false;
+        }
+    }
+
+    if ( !takeOver ) {
+        /* Allocate the memory right away; running out of memory while
+         * writing to a sparse mapping would kill the writer with SIGBUS.
+         */
+        int result = ftruncate( fd, static_cast<off_t>( size ) );
+#ifdef Q_OS_LINUX
+        if ( result == 0 ) {
+            result = posix_fallocate( fd, 0, static_cast<off_t>( size ) );
+            errno = result;
+        }
+#endif
+        void *mapping = MAP_FAILED;
+        if ( result == 0 ) {
+            mapping = mmap( 0, static_cast<size_t>( size ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+        }
+        if ( mapping == MAP_FAILED ) {
+            *errorMessage = QString::fromLocal8Bit( strerror( errno ) );
+            ::close( fd );
+            shm_unlink( m_name.constData() );
+            return false;
+        }
+        m_segment = static_cast<char *>( mapping );
+
+        // Writers check the magic first, so it is stored last
+        Header *header = reinterpret_cast<Header *>( m_segment );
+        header->version = Version;
+        header->headerSize = HeaderSize;
+        header->slotCount = slotCount;
+        header->slotSize = slotSize;
+        fullFence();
+        memcpy( header->magic, Magic, sizeof( Magic ) );
+    }
+    ::close( fd ); // the mapping stays valid
+
+    m_segmentSize = size;
+    m_slotCount = slotCount;
+    m_slotSize = slotSize;
+    m_streams.fill( 0, slotCount );
+
+    // Writers restart their streams once they notice the new server
+    Header *header = reinterpret_cast<Header *>( m_segment );
+    store( &header->serverWaiting, 0u );
+    store( &header->serverPid, static_cast<unsigned int>( getpid() ) );
+    fetchAdd( &header->serverGeneration, 1u );
+    return true;
+}
+
+/* The segment is kept, so that the trace libraries can keep writing into it
+ * until the ring buffers are full and a server started later on continues
+ * where this one stopped.
+ */
+void SharedMemoryReader::detach()
+{
+    if ( !m_segment ) {
+        return;
+    }
+    Header *header = reinterpret_cast<Header *>( m_segment );
+    compareAndSwap( &header->serverPid, static_cast<unsigned int>( getpid() ), 0u );
+    munmap( m_segment, static_cast<size_t>( m_segmentSize ) );
+    m_segment = 0;
+    m_streams.clear();
+}
+
+void SharedMemoryReader::stop()
+{
+    m_stopRequested.storeRelease( 1 );
+    if ( m_segment ) {
+        wakeUp();
+    }
+}
+
+void SharedMemoryReader::run()
+{
+    if ( !m_segment ) {
+        return;
+    }
+
+    QElapsedTimer ownerCheckTimer;
+    ownerCheckTimer.start();
+    while ( !m_stopRequested.loadAcquire() ) {
+        bool readData = false;
+        for ( unsigned int slot = 0; slot < m_slotCount; ++slot ) {
+            if ( readSlot( slot ) ) {
+                readData = true;
+            }
+        }
+
+        if ( ownerCheckTimer.elapsed() >= OwnerCheckInterval ) {
+            checkOwners();
+            ownerCheckTimer.restart();
+        }
+
+        if ( !readData ) {
+            waitForData( OwnerCheckInterval );
+        }
+    }
+}
+
+void SharedMemoryReader::copyFromData( unsigned int slot, quint64 position, char *data, size_t size ) const
+{
+    const char *slotStart = slotData( m_segment, m_slotCount, m_slotSize, slot );
+    const size_t offset = static_cast<size_t>( position % m_slotSize );
+    const size_t firstPart = offset + size <= m_slotSize ? size : static_cast<size_t>( m_slotSize - offset );
+    memcpy( data, slotStart + offset, firstPart );
+    if ( firstPart < size ) {
+        memcpy( data + firstPart, slotStart, size - firstPart );
+    }
+}
+
+/* Consumes all records published in the given slot and frees it if its
+ * owner released it; returns whether there were any records.
+ */
+bool SharedMemoryReader::readSlot( unsigned int slot )
+{
+    SlotHeader *slotHdr = slotHeader( m_segment, slot );
+    if ( load( &slotHdr->ownerPid ) == 0 ) {
+        return false;
+    }
+
+    // The owner sets the flag after publishing its last record
+    const bool released = load( &slotHdr->released ) != 0;
+    const uint64_t writePosition = load( &slotHdr->writePosition );
+    uint64_t readPosition = slotHdr->readPosition;
+    const bool hadRecords = readPosition != writePosition;
+
+    if ( writePosition - readPosition > m_slotSize ) {
+        qWarning() << "Discarding corrupt data in slot" << slot << "of shared memory segment" << m_name;
+        readPosition = writePosition;
+        closeStream( slot );
+    }
+
+    QByteArray data;
+    while ( readPosition < writePosition ) {
+        RecordHeader record;
+        copyFromData( slot, readPosition, reinterpret_cast<char *>( &record ), RecordHeaderSize );
+        if ( writePosition - readPosition < RecordHeaderSize + static_cast<uint64_t>( record.length ) ) {
+            qWarning() << "Discarding corrupt data in slot" << slot << "of shared memory segment" << m_name;
+            readPosition = writePosition;
+            if ( !data.isEmpty() ) {
+                emit dataReceived( m_streams[slot], data );
+                data.clear();
+            }
+            closeStream( slot );
+            break;
+        }
+
+        if ( record.flags & StreamStart ) {
+            if ( !data.isEmpty() ) {
+                emit dataReceived( m_streams[slot], data );
+                data.clear();
+            }
+            closeStream( slot );
+            m_streams[slot] = m_nextStreamId++;
+        } else if ( m_streams[slot] == 0 && ( record.flags & SyncPoint ) ) {
+            m_streams[slot] = m_nextStreamId++;
+        }
+
+        // Records preceding the first decodable one are skipped
+        if ( m_streams[slot] != 0 && record.length > 0 ) {
+            const int oldSize = data.size();
+            data.resize( oldSize + static_cast<int>( record.length ) );
+            copyFromData( slot, readPosition + RecordHeaderSize, data.data() + oldSize, record.length );
+        }
+        readPosition += RecordHeaderSize + record.length;
+    }
+
+    if ( !data.isEmpty() ) {
+        emit dataReceived( m_streams[slot], data );
+    }
+    store( &slotHdr->readPosition, readPosition );
+
+    if ( released ) {
+        freeSlot( slot );
+    }
+    return hadRecords;
+}
+
+void SharedMemoryReader::freeSlot( unsigned int slot )
+{
+    closeStream( slot );
+
+    SlotHeader *slotHdr = slotHeader( m_segment, slot );
+    store( &slotHdr->writePosition, static_cast<uint64_t>( 0 ) );
+    store( &slotHdr->readPosition, static_cast<uint64_t>( 0 ) );
+    store( &slotHdr->released, 0u );
+    store( &slotHdr->ownerPid, 0u );
+}
+
+void SharedMemoryReader::closeStream( unsigned int slot )
+{
+    if ( m_streams[slot] != 0 ) {
+        emit streamClosed( m_streams[slot] );
+        m_streams[slot] = 0;
+    }
+}
+
+/* The slots of processes which died without releasing them are freed after
+ * consuming what they wrote before.
+ */
+void SharedMemoryReader::checkOwners()
+{
+    for ( unsigned int slot = 0; slot < m_slotCount; ++slot ) {
+        SlotHeader *slotHdr = slotHeader( m_segment, slot );
+        const unsigned int ownerPid = load( &slotHdr->ownerPid );
+        if ( ownerPid != 0 && !isAlive( ownerPid ) ) {
+            readSlot( slot );
+            freeSlot( slot );
+        }
+    }
+}
+
+bool SharedMemoryReader::hasData() const
+{
+    for ( unsigned int slot = 0; slot < m_slotCount; ++slot ) {
+        const SlotHeader *slotHdr = slotHeader( m_segment, slot );
+        if ( load( &slotHdr->ownerPid ) != 0 &&
+             ( load( &slotHdr->writePosition ) != slotHdr->readPosition || load( &slotHdr->released ) ) ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Writers only wake the reader if serverWaiting is set; the fence orders
+ * setting it before checking the slots again, and the futex wait returns
+ * right away if a writer changed wakeupSequence since it was read.
+ */
+void SharedMemoryReader::waitForData( unsigned int timeout )
+{
+    Header *header = reinterpret_cast<Header *>( m_segment );
+    const unsigned int sequence = load( &header->wakeupSequence );
+    store( &header->serverWaiting, 1u );
+    fullFence();
+    if ( !hasData() && !m_stopRequested.loadAcquire() ) {
+#ifdef Q_OS_LINUX
+        struct timespec ts;
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = ( timeout % 1000 ) * 1000000;
+        syscall( SYS_futex, &header->wakeupSequence, FUTEX_WAIT, sequence, &ts, 0, 0 );
+#else
+        Q_UNUSED( sequence );
+        Q_UNUSED( timeout );
+        msleep( PollInterval );
+#endif
+    }
+    store( &header->serverWaiting, 0u );
+}
+
+void SharedMemoryReader::wakeUp()
+{
+    Header *header = reinterpret_cast<Header *>( m_segment );
+    fetchAdd( &header->wakeupSequence, 1u );
+#ifdef Q_OS_LINUX
+    syscall( SYS_futex, &header->wakeupSequence, FUTEX_WAKE, INT_MAX, 0, 0, 0 );
+#endif
+}
@@ -0,0 +1,85 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_SHAREDMEMORYREADER_H
+#define TRACE_SHAREDMEMORYREADER_H
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QString>
+#include <QThread>
+#include <QVector>
+
+/* Reads the trace entries which trace libraries on the same host write into
+ * a POSIX shared memory segment (see hooklib/sharedmemoryformat.h). The
+ * entries of each stream are delivered with a stream id of their own, like
+ * the data of a connection; a stream is closed once the process which wrote
+ * it restarted it, released its slot or died.
+ *
+ * An existing segment of the same size (e.g. left behind by a server which
+ * crashed) is taken over, including the entries which were written into it
+ * meanwhile; other segments of the same name are replaced.
+ */
+class SharedMemoryReader : public QThread
+{
+    Q_OBJECT
+public:
+    static const unsigned int DefaultSlotCount = 32;
+    static const unsigned int DefaultSlotSize = 1024 * 1024; // bytes
+
+    SharedMemoryReader( QObject *parent = 0 );
+    ~SharedMemoryReader();
+
+    /* Creates or takes over the segment with the given name; returns false
+     * and sets errorMessage on failure.
+     */
+    bool attach( const QString &name, unsigned int slotCount, quint64 slotSize,
+                 QString *errorMessage );
+
+    void stop();
+
+signals:
+    void dataReceived( quint64 stream, const QByteArray &data );
+    void streamClosed( quint64 stream );
+
+protected:
+    virtual void run();
+
+private:
+    bool readSlot( unsigned int slot );
+    void freeSlot( unsigned int slot );
+    void closeStream( unsigned int slot );
+    void checkOwners();
+    bool hasData() const;
+    void waitForData( unsigned int timeout );
+    void wakeUp();
+    void copyFromData( unsigned int slot, quint64 position, char *data, size_t size ) const;
+    void detach();
+
+    QByteArray m_name;
+    char *m_segment;
+    quint64 m_segmentSize;
+    unsigned int m_slotCount;
+    quint64 m_slotSize;
+    QVector<quint64> m_streams; // current stream of each slot, 0 if none
+    quint64 m_nextStreamId;
+    QAtomicInt m_stopRequested;
+};
+
+#endif // !defined(TRACE_SHAREDMEMORYREADER_H)
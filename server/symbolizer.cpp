@@ -0,0 +1,342 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "symbolizer.h"
+
+#include <QDebug>
+#include <QFileInfo>
+#include <QMap>
+#include <QMutex>
+#include <QProcess>
+#include <QStringList>
+#include <QTextStream>
+#include <QThread>
+#include <QWaitCondition>
+
+// Upper limit for a single addr2line run
+static const int Addr2LineTimeout = 30000;
+
+static QString addressString( quint64 address )
+{
+    return QString::fromLatin1( "[0x%1]" ).arg( address, 0, 16 );
+}
+
+static StackFrame unresolvedFrame( const ModuleDescription *module, quint64 offset )
+{
+    StackFrame frame;
+    if ( module ) {
+        frame.module = module->fileName;
+    }
+    frame.function = addressString( offset );
+    frame.functionOffset = 0;
+    frame.lineNumber = 0;
+    return frame;
+}
+
+/* Prefers separate debug files installed under /usr/lib/debug/.build-id
+ * since the modules themselves are usually stripped.
+ */
+static QString debugFileName( const ModuleDescription &module )
+{
+    if ( module.buildId.size() > 2 ) {
+        const QString fileName = QString::fromLatin1( "/usr/lib/debug/.build-id/%1/%2.debug" )
+                                     .arg( module.buildId.left( 2 ) )
+                                     .arg( module.buildId.mid( 2 ) );
+        if ( QFileInfo( fileName ).isFile() ) {
+            return fileName;
+        }
+    }
+    return module.fileName;
+}
+
+/* The addresses of one module to be looked up by a single addr2line run.
+ * The module is copied since the decoder which knows it may be gone by the
+ * time the lookup finished.
+ */
+struct Lookup
+{
+    Lookup() : succeeded( false ) { }
+
+    ModuleDescription module;
+    QList<quint64> offsets;
+    QList<StackFrame> frames;
+    bool succeeded;
+};
+
+/* addr2line prints two lines per address: the function name followed by
+ * the source location as "file:line", with "??" for unknown values.
+ */
+static void runAddr2Line( Lookup *lookup )
+{
+    QStringList args;
+    args << QString::fromLatin1( "-C" ) << QString::fromLatin1( "-f" )
+         << QString::fromLatin1( "-e" ) << debugFileName( lookup->module );
+    QList<quint64>::ConstIterator it, end = lookup->offsets.end();
+    for ( it = lookup->offsets.begin(); it != end; ++it ) {
+        args << QString::fromLatin1( "0x%1" ).arg( *it, 0, 16 );
+    }
+
+    QProcess addr2line;
+    addr2line.start( QString::fromLatin1( "addr2line" ), args );
+    QStringList output;
+    if ( addr2line.waitForFinished( Addr2LineTimeout ) && addr2line.exitCode() == 0 ) {
+        output = QString::fromLocal8Bit( addr2line.readAllStandardOutput() ).split( QLatin1Char( '\n' ) );
+    } else {
+        qWarning() << "Failed to resolve addresses in" << lookup->module.fileName << ":" << addr2line.errorString();
+    }
+    lookup->succeeded = output.size() >= 2 * lookup->offsets.size();
+
+    for ( int i = 0; i < lookup->offsets.size(); ++i ) {
+        StackFrame frame = unresolvedFrame( &lookup->module, lookup->offsets[i] + 1 );
+        if ( output.size() < 2 * i + 2 ) {
+            lookup->frames.append( frame );
+            continue;
+        }
+
+        const QString function = output[2 * i];
+        if ( function != QLatin1String( "??" ) ) {
+            frame.function = function;
+        }
+        QString location = output[2 * i + 1];
+        const int discriminatorPos = location.indexOf( QLatin1String( " (discriminator" ) );
+        if ( discriminatorPos != -1 ) {
+            location.truncate( discriminatorPos );
+        }
+        const int colonPos = location.lastIndexOf( QLatin1Char( ':' ) );
+        if ( colonPos != -1 && !location.startsWith( QLatin1String( "??" ) ) ) {
+            frame.sourceFile = location.left( colonPos );
+            frame.lineNumber = location.mid( colonPos + 1 ).toUInt();
+        }
+        lookup->frames.append( frame );
+    }
+}
+
+/* Runs the queued lookups one after another and hands the results to the
+ * symbolizer in the thread it lives in.
+ */
+class LookupThread : public QThread
+{
+public:
+    explicit LookupThread( Symbolizer *symbolizer );
+
+    void addLookup( const Lookup &lookup );
+    QList<Lookup> takeResults();
+
+    // Discards the lookups which didn't start yet
+    void stop();
+
+protected:
+    virtual void run();
+
+private:
+    Symbolizer *m_symbolizer;
+    QMutex m_mutex;
+    QWaitCondition m_lookupAdded;
+    QList<Lookup> m_lookups;
+    QList<Lookup> m_results;
+    bool m_stopRequested;
+};
+
+LookupThread::LookupThread( Symbolizer *symbolizer )
+    : m_symbolizer( symbolizer ),
+    m_stopRequested( false )
+{
+}
+
+void LookupThread::addLookup( const Lookup &lookup )
+{
+    QMutexLocker locker( &m_mutex );
+    m_lookups.append( lookup );
+    m_lookupAdded.wakeOne();
+}
+
+QList<Lookup> LookupThread::takeResults()
+{
+    QMutexLocker locker( &m_mutex );
+    QList<Lookup> results;
+    results.swap( m_results );
+    return results;
+}
+
+void LookupThread::stop()
+{
+    QMutexLocker locker( &m_mutex );
+    m_stopRequested = true;
+    m_lookupAdded.wakeOne();
+}
+
+void LookupThread::run()
+{
+    QMutexLocker locker( &m_mutex );
+    while ( true ) {
+        while ( m_lookups.isEmpty() && !m_stopRequested ) {
+            m_lookupAdded.wait( &m_mutex );
+        }
+        if ( m_stopRequested ) {
+            return;
+        }
+
+        Lookup lookup = m_lookups.takeFirst();
+        locker.unlock();
+        runAddr2Line( &lookup );
+        locker.relock();
+
+        m_results.append( lookup );
+        QMetaObject::invokeMethod( m_symbolizer, "storeLookupResults", Qt::QueuedConnection );
+    }
+}
+
+Symbolizer::Symbolizer( const QString &cacheFileName, QObject *parent )
+    : QObject( parent ),
+    m_cacheFile( cacheFileName ),
+    m_lookupThread( 0 )
+{
+    if ( !cacheFileName.isEmpty() ) {
+        loadCache();
+        if ( !m_cacheFile.open( QIODevice::WriteOnly | QIODevice::Append | QIODevice::Text ) ) {
+            qWarning() << "Failed to open symbol cache" << cacheFileName << ":" << m_cacheFile.errorString();
+        }
+    }
+
+    m_lookupThread = new LookupThread( this );
+    m_lookupThread->start();
+}
+
+// Waits for a running addr2line, which is bounded by Addr2LineTimeout
+Symbolizer::~Symbolizer()
+{
+    m_lookupThread->stop();
+    m_lookupThread->wait();
+    delete m_lookupThread;
+}
+
+/* Each line of the cache file describes one frame; the fields (cache key,
+ * module, function, source file and line number) are separated by tabs.
+ */
+void Symbolizer::loadCache()
+{
+    QFile f( m_cacheFile.fileName() );
+    if ( !f.open( QIODevice::ReadOnly | QIODevice::Text ) ) {
+        return;
+    }
+
+    QTextStream stream( &f );
+    while ( !stream.atEnd() ) {
+        const QStringList fields = stream.readLine().split( QLatin1Char( '\t' ) );
+        if ( fields.size() != 5 ) {
+            continue;
+        }
+        StackFrame frame;
+        frame.module = fields[1];
+        frame.function = fields[2];
+        frame.functionOffset = 0;
+        frame.sourceFile = fields[3];
+        frame.lineNumber = fields[4].toUInt();
+        m_frames.insert( fields[0], frame );
+    }
+}
+
+void Symbolizer::storeFrame( const QString &key, const StackFrame &frame )
+{
+    m_frames.insert( key, frame );
+    if ( m_cacheFile.isOpen() ) {
+        QTextStream stream( &m_cacheFile );
+        stream << key << '\t' << frame.module << '\t' << frame.function << '\t'
+               << frame.sourceFile << '\t' << frame.lineNumber << '\n';
+    }
+}
+
+// Build ids identify a module even if the file was replaced meanwhile
+QString Symbolizer::cacheKey( const ModuleDescription *module, quint64 offset )
+{
+    const QString moduleKey = module->buildId.isEmpty() ? module->fileName : module->buildId;
+    return moduleKey + QLatin1Char( ':' ) + QString::number( offset, 16 );
+}
+
+bool Symbolizer::resolve( const QList<Address> &addresses, QList<StackFrame> *frames )
+{
+    // Return addresses point behind the call, so look up the call itself
+    QList<quint64> lookupOffsets;
+    QMap<const ModuleDescription *, QList<quint64> > missingOffsets;
+    bool resolved = true;
+    QList<Address>::ConstIterator it, end = addresses.end();
+    for ( it = addresses.begin(); it != end; ++it ) {
+        const quint64 offset = it->second > 0 ? it->second - 1 : 0;
+        lookupOffsets.append( offset );
+        if ( !it->first ) {
+            continue;
+        }
+        const QString key = cacheKey( it->first, offset );
+        if ( m_frames.contains( key ) ) {
+            continue;
+        }
+        resolved = false;
+        if ( !m_pendingKeys.contains( key ) ) {
+            m_pendingKeys.insert( key );
+            missingOffsets[it->first].append( offset );
+        }
+    }
+
+    QMap<const ModuleDescription *, QList<quint64> >::ConstIterator missingIt, missingEnd = missingOffsets.constEnd();
+    for ( missingIt = missingOffsets.constBegin(); missingIt != missingEnd; ++missingIt ) {
+        Lookup lookup;
+        lookup.module = *missingIt.key();
+        lookup.offsets = missingIt.value();
+        m_lookupThread->addLookup( lookup );
+    }
+
+    for ( int i = 0; i < addresses.size(); ++i ) {
+        const ModuleDescription *module = addresses[i].first;
+        if ( !module ) {
+            frames->append( unresolvedFrame( module, addresses[i].second ) );
+            continue;
+        }
+        frames->append( m_frames.value( cacheKey( module, lookupOffsets[i] ),
+                                        unresolvedFrame( module, addresses[i].second ) ) );
+    }
+    return resolved;
+}
+
+// One call may take the results of several lookups
+void Symbolizer::storeLookupResults()
+{
+    const QList<Lookup> results = m_lookupThread->takeResults();
+    if ( results.isEmpty() ) {
+        return;
+    }
+
+    QList<Lookup>::ConstIterator it, end = results.end();
+    for ( it = results.begin(); it != end; ++it ) {
+        for ( int i = 0; i < it->offsets.size(); ++i ) {
+            const QString key = cacheKey( &it->module, it->offsets[i] );
+            m_pendingKeys.remove( key );
+            if ( it->succeeded ) {
+                storeFrame( key, it->frames[i] );
+            } else {
+                // Don't run addr2line over and over again, but don't persist the failure either
+                m_frames.insert( key, it->frames[i] );
+            }
+        }
+    }
+    if ( m_cacheFile.isOpen() ) {
+        m_cacheFile.flush();
+    }
+
+    emit framesResolved();
+}
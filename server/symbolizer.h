@@ -0,0 +1,95 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACER_SYMBOLIZER_H
+#define TRACER_SYMBOLIZER_H
+
+#include "database.h"
+
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QPair>
+#include <QSet>
+#include <QString>
+
+/* A module (executable or shared library) of a traced process, as announced
+ * in the ModuleRecord of the binary trace format.
+ */
+struct ModuleDescription
+{
+    ModuleDescription() : base( 0 ) { }
+
+    QString fileName;
+    QString buildId;
+    quint64 base;
+};
+
+class LookupThread;
+
+/* Resolves the addresses of backtraces which the traced processes did not
+ * symbolize themselves. Addresses are resolved with addr2line (preferring
+ * separate debug files found via the build id) in one run per module and
+ * backtrace, and the results are cached for the lifetime of the server.
+ * If a cache file is given, the resolved frames are also stored there so
+ * that they survive restarts of the server.
+ *
+ * addr2line runs in a background thread, so that the server keeps handling
+ * other connections meanwhile; framesResolved() is emitted whenever it
+ * looked up some addresses.
+ */
+class Symbolizer : public QObject
+{
+    Q_OBJECT
+public:
+    typedef QPair<const ModuleDescription *, quint64> Address;
+
+    Symbolizer( const QString &cacheFileName = QString(), QObject *parent = 0 );
+    ~Symbolizer();
+
+    /* Resolves the given addresses; the module is null for addresses
+     * which are not part of any known module. Returns false if some of
+     * the addresses are still being looked up; their frames only show the
+     * address then.
+     */
+    bool resolve( const QList<Address> &addresses, QList<StackFrame> *frames );
+
+signals:
+    void framesResolved();
+
+private slots:
+    void storeLookupResults();
+
+private:
+    Symbolizer( const Symbolizer &other ); // disabled
+    void operator=( const Symbolizer &rhs ); // disabled
+
+    static QString cacheKey( const ModuleDescription *module, quint64 offset );
+
+    void loadCache();
+    void storeFrame( const QString &key, const StackFrame &frame );
+
+    QHash<QString, StackFrame> m_frames;
+    QSet<QString> m_pendingKeys;
+    QFile m_cacheFile;
+    LookupThread *m_lookupThread;
+};
+
+#endif // !defined(TRACER_SYMBOLIZER_H)
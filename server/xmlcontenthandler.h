@@ -59,6 +59,7 @@ private:
 class XmlParseEventsHandler
 {
     friend class XmlContentHandler;
+    friend class BinaryContentHandler;
 protected:
     virtual void handleTraceEntry( const TraceEntry& ) = 0;
     virtual void applyStorageConfiguration( const StorageConfiguration & ) = 0;
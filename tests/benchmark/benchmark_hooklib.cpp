@@ -0,0 +1,520 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Measures the cost of visiting trace points, both in time and in heap
+ * allocations per call, for various configurations and numbers of threads.
+ * The results are written to stdout as one JSON object per line, e.g.
+ *
+ *   {"benchmark": "visit_message", "serializer": "xml", "output": "file",
+ *    "threads": 4, "iterations": 100000, "ns_per_call": 812.4,
+ *    "calls_per_second": 4923661, "allocations_per_call": 9.00,
+ *    "version": "3.1.1"}
+ *
+ * ns_per_call is the average time a single thread spent per call, so lock
+ * contention shows up as a growing value with more threads. Allocations
+ * include those made by helper threads (e.g. the asynchronous writer) while
+ * the benchmark is running.
+ */
+
+#include "config.h"
+#include "tracelib.h"
+#include "tracelib_config.h"
+#include "atomic.h"
+#include "configuration.h"
+#include "output.h"
+#include "trace.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static volatile TRACELIB_NAMESPACE_IDENT(AtomicWord) g_allocationCount = 0;
+
+#if __cplusplus >= 201103L
+#  define BENCHMARK_THROWS_BAD_ALLOC
+#  define BENCHMARK_THROWS_NOTHING noexcept
+#else
+#  define BENCHMARK_THROWS_BAD_ALLOC throw( std::bad_alloc )
+#  define BENCHMARK_THROWS_NOTHING throw()
+#endif
+
+static void *countedAllocation( size_t size )
+{
+    TRACELIB_NAMESPACE_IDENT(atomicFetchAdd)( &g_allocationCount, 1 );
+    void *p = malloc( size > 0 ? size : 1 );
+    if ( !p ) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new( size_t size ) BENCHMARK_THROWS_BAD_ALLOC
+{
+    return countedAllocation( size );
+}
+
+void *operator new[]( size_t size ) BENCHMARK_THROWS_BAD_ALLOC
+{
+    return countedAllocation( size );
+}
+
+void operator delete( void *p ) BENCHMARK_THROWS_NOTHING
+{
+    free( p );
+}
+
+void operator delete[]( void *p ) BENCHMARK_THROWS_NOTHING
+{
+    free( p );
+}
+
+TRACELIB_NAMESPACE_BEGIN
+
+typedef void (*BenchmarkBody)( unsigned long iterations );
+
+static void benchmarkVisit( unsigned long iterations )
+{
+    for ( unsigned long i = 0; i < iterations; ++i ) {
+        TRACELIB_TRACE
+    }
+}
+
+static void benchmarkVisitWithMessage( unsigned long iterations )
+{
+    for ( unsigned long i = 0; i < iterations; ++i ) {
+        TRACELIB_TRACE_MSG( "iteration " << i )
+    }
+}
+
+static void benchmarkWatchOne( unsigned long iterations )
+{
+    for ( unsigned long i = 0; i < iterations; ++i ) {
+        TRACELIB_WATCH( TRACELIB_VAR( i ) )
+    }
+}
+
+static void benchmarkWatchFive( unsigned long iterations )
+{
+    const int number = 42;
+    const double ratio = 0.5;
+    const bool flag = true;
+    const string text = "some text";
+    for ( unsigned long i = 0; i < iterations; ++i ) {
+        TRACELIB_WATCH( TRACELIB_VAR( i ) << TRACELIB_VAR( number ) << TRACELIB_VAR( ratio )
+                        << TRACELIB_VAR( flag ) << TRACELIB_VAR( text ) )
+    }
+}
+
+static void benchmarkWatchTwenty( unsigned long iterations )
+{
+    const int n0 = 0, n1 = 1, n2 = 2, n3 = 3, n4 = 4;
+    const double d0 = 0.0, d1 = 0.1, d2 = 0.2, d3 = 0.3, d4 = 0.4;
+    const bool b0 = false, b1 = true, b2 = false, b3 = true;
+    const string s0 = "zero", s1 = "one", s2 = "two", s3 = "three", s4 = "four";
+    for ( unsigned long i = 0; i < iterations; ++i ) {
+        TRACELIB_WATCH( TRACELIB_VAR( i )
+                        << TRACELIB_VAR( n0 ) << TRACELIB_VAR( n1 ) << TRACELIB_VAR( n2 ) << TRACELIB_VAR( n3 ) << TRACELIB_VAR( n4 )
+                        << TRACELIB_VAR( d0 ) << TRACELIB_VAR( d1 ) << TRACELIB_VAR( d2 ) << TRACELIB_VAR( d3 ) << TRACELIB_VAR( d4 )
+                        << TRACELIB_VAR( b0 ) << TRACELIB_VAR( b1 ) << TRACELIB_VAR( b2 ) << TRACELIB_VAR( b3 )
+                        << TRACELIB_VAR( s0 ) << TRACELIB_VAR( s1 ) << TRACELIB_VAR( s2 ) << TRACELIB_VAR( s3 ) << TRACELIB_VAR( s4 ) )
+    }
+}
+
+// Measures the trace library without the cost of any I/O
+class DiscardingOutput : public Output
+{
+public:
+    virtual void write( const vector<char> & ) { }
+};
+
+enum OutputType {
+    DiscardOutput,
+    FileOutputType,
+    MappedFileOutputType,
+    TcpOutput
+};
+
+static const char *outputName( OutputType type )
+{
+    switch ( type ) {
+        case DiscardOutput: return "discard";
+        case FileOutputType: return "file";
+        case MappedFileOutputType: return "mmap";
+        case TcpOutput: return "tcp";
+    }
+    return 0;
+}
+
+static const char AllTracePoints[] = "";
+static const char NoTracePoints[] =
+    "<tracepointset><pathfilter matchingmode=\"strict\">no-such-file.cpp</pathfilter></tracepointset>";
+static const char TracePointsWithVariables[] =
+    "<tracepointset variables=\"yes\"><pathfilter matchingmode=\"wildcard\">*</pathfilter></tracepointset>";
+static const char TracePointsWithBacktraces[] =
+    "<tracepointset backtraces=\"yes\"><pathfilter matchingmode=\"wildcard\">*</pathfilter></tracepointset>";
+static const char TracePointsWithDeferredBacktraces[] =
+    "<tracepointset backtraces=\"deferred\"><pathfilter matchingmode=\"wildcard\">*</pathfilter></tracepointset>";
+
+struct Scenario
+{
+    string name;
+    BenchmarkBody body;
+    string serializer;
+    OutputType output;
+    string tracePointSets;
+    unsigned int iterationDivisor;
+    string writer; // synchronous if empty
+};
+
+static vector<Scenario> scenarios()
+{
+    vector<Scenario> result;
+
+    Scenario inactive = { "advancevisit_inactive", benchmarkVisit, "plaintext", DiscardOutput, NoTracePoints, 1 };
+    result.push_back( inactive );
+    Scenario visit = { "visit", benchmarkVisit, "plaintext", DiscardOutput, AllTracePoints, 1 };
+    result.push_back( visit );
+    Scenario watch1 = { "watch_1", benchmarkWatchOne, "plaintext", DiscardOutput, TracePointsWithVariables, 1 };
+    result.push_back( watch1 );
+    Scenario watch5 = { "watch_5", benchmarkWatchFive, "plaintext", DiscardOutput, TracePointsWithVariables, 1 };
+    result.push_back( watch5 );
+    Scenario watch20 = { "watch_20", benchmarkWatchTwenty, "plaintext", DiscardOutput, TracePointsWithVariables, 4 };
+    result.push_back( watch20 );
+    Scenario backtrace = { "backtrace", benchmarkVisit, "plaintext", DiscardOutput, TracePointsWithBacktraces, 20 };
+    result.push_back( backtrace );
+    // Symbols are resolved by the writer thread, so this measures capturing the return addresses
+    Scenario deferredBacktrace = { "backtrace_deferred", benchmarkVisit, "plaintext", DiscardOutput,
+                                   TracePointsWithDeferredBacktraces, 20, "asynchronous" };
+    result.push_back( deferredBacktrace );
+
+    static const char * const serializers[] = { "plaintext", "xml", "binary" };
+    static const OutputType outputs[] = { DiscardOutput, FileOutputType, MappedFileOutputType, TcpOutput };
+    for ( size_t s = 0; s < sizeof( serializers ) / sizeof( serializers[0] ); ++s ) {
+        for ( size_t o = 0; o < sizeof( outputs ) / sizeof( outputs[0] ); ++o ) {
+            Scenario message = { "visit_message", benchmarkVisitWithMessage, serializers[s], outputs[o], AllTracePoints,
+                                 outputs[o] == DiscardOutput ? 1u : 4u };
+            result.push_back( message );
+        }
+    }
+
+    Scenario flightRecorder = { "visit_message_flightrecorder", benchmarkVisitWithMessage, "plaintext", DiscardOutput,
+                                AllTracePoints, 1, "flightrecorder" };
+    result.push_back( flightRecorder );
+
+    // The flight recorder doesn't keep variables, so this measures capturing them
+    Scenario watchCapture = { "watch_5_flightrecorder", benchmarkWatchFive, "plaintext", DiscardOutput,
+                              TracePointsWithVariables, 1, "flightrecorder" };
+    result.push_back( watchCapture );
+    return result;
+}
+
+/* Accepts any number of connections on a local port and discards all data
+ * received, standing in for the trace daemon.
+ */
+static int g_tcpSinkSocket = -1;
+
+static void *tcpSinkProc( void * )
+{
+    const int listenSocket = g_tcpSinkSocket;
+
+    vector<pollfd> fds( 1 );
+    fds[0].fd = listenSocket;
+    fds[0].events = POLLIN;
+
+    char buf[65536];
+    while ( true ) {
+        if ( poll( &fds[0], fds.size(), -1 ) < 0 ) {
+            continue;
+        }
+        for ( size_t i = fds.size(); i-- > 1; ) {
+            if ( fds[i].revents == 0 ) {
+                continue;
+            }
+            if ( read( fds[i].fd, buf, sizeof( buf ) ) <= 0 ) {
+                close( fds[i].fd );
+                fds.erase( fds.begin() + i );
+            }
+        }
+        if ( fds[0].revents & POLLIN ) {
+            const int fd = accept( listenSocket, NULL, NULL );
+            if ( fd >= 0 ) {
+                pollfd p;
+                p.fd = fd;
+                p.events = POLLIN;
+                p.revents = 0;
+                fds.push_back( p );
+            }
+        }
+    }
+    return NULL;
+}
+
+static unsigned short startTcpSink()
+{
+    const int listenSocket = socket( AF_INET, SOCK_STREAM, 0 );
+
+    sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    addr.sin_port = 0;
+    socklen_t addrLen = sizeof( addr );
+    if ( bind( listenSocket, (const sockaddr *)&addr, sizeof( addr ) ) != 0 ||
+         listen( listenSocket, 16 ) != 0 ||
+         getsockname( listenSocket, (sockaddr *)&addr, &addrLen ) != 0 ) {
+        perror( "benchmark_hooklib: failed to set up TCP sink" );
+        return 0;
+    }
+
+    g_tcpSinkSocket = listenSocket;
+    pthread_t thread;
+    pthread_create( &thread, NULL, tcpSinkProc, NULL );
+    pthread_detach( thread );
+    return ntohs( addr.sin_port );
+}
+
+static string configurationMarkup( const Scenario &scenario, const string &dataFileName,
+                                   unsigned short tcpPort )
+{
+    ostringstream str;
+    str << "<tracelibConfiguration><process><name>" << Configuration::currentProcessName() << "</name>";
+    switch ( scenario.output ) {
+        case DiscardOutput:
+            // Replaced after loading the configuration
+            str << "<output type=\"stdout\"/>";
+            break;
+        case FileOutputType:
+            str << "<output type=\"file\"><option name=\"filename\">" << dataFileName << "</option></output>";
+            break;
+        case MappedFileOutputType:
+            str << "<output type=\"mmap\"><option name=\"filename\">" << dataFileName << "</option></output>";
+            break;
+        case TcpOutput:
+            str << "<output type=\"tcp\"><option name=\"host\">127.0.0.1</option>"
+                << "<option name=\"port\">" << tcpPort << "</option></output>";
+            break;
+    }
+    if ( !scenario.writer.empty() ) {
+        str << "<writer type=\"" << scenario.writer << "\"/>";
+    }
+    str << "<serializer type=\"" << scenario.serializer << "\"/>"
+        << scenario.tracePointSets
+        << "</process></tracelibConfiguration>";
+    return str.str();
+}
+
+static uint64_t monotonicNanoseconds()
+{
+    timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return uint64_t( ts.tv_sec ) * 1000000000ULL + ts.tv_nsec;
+}
+
+struct Worker
+{
+    BenchmarkBody body;
+    unsigned long iterations;
+    volatile AtomicWord *startFlag;
+    pthread_t thread;
+};
+
+static void *workerProc( void *arg )
+{
+    Worker *worker = static_cast<Worker *>( arg );
+    while ( !atomicLoad( worker->startFlag ) ) {
+        sched_yield();
+    }
+    worker->body( worker->iterations );
+    return NULL;
+}
+
+static void runScenario( const Scenario &scenario, unsigned int numThreads,
+                         unsigned long iterations )
+{
+    iterations = iterations / scenario.iterationDivisor;
+    if ( iterations == 0 ) {
+        iterations = 1;
+    }
+
+    volatile AtomicWord startFlag = 0;
+    vector<Worker> workers( numThreads );
+    for ( unsigned int i = 0; i < numThreads; ++i ) {
+        workers[i].body = scenario.body;
+        workers[i].iterations = iterations;
+        workers[i].startFlag = &startFlag;
+        pthread_create( &workers[i].thread, NULL, workerProc, &workers[i] );
+    }
+
+    const AtomicWord allocationsBefore = atomicLoad( &g_allocationCount );
+    const uint64_t startTime = monotonicNanoseconds();
+    atomicStore( &startFlag, 1 );
+    for ( unsigned int i = 0; i < numThreads; ++i ) {
+        pthread_join( workers[i].thread, NULL );
+    }
+    const uint64_t elapsed = monotonicNanoseconds() - startTime;
+    const AtomicWord allocations = atomicLoad( &g_allocationCount ) - allocationsBefore;
+
+    const double totalCalls = double( iterations ) * numThreads;
+    ostringstream str;
+    str.setf( ios::fixed );
+    str.precision( 2 );
+    str << "{\"benchmark\": \"" << scenario.name << "\", "
+        << "\"serializer\": \"" << scenario.serializer << "\", "
+        << "\"output\": \"" << outputName( scenario.output ) << "\", "
+        << "\"threads\": " << numThreads << ", "
+        << "\"iterations\": " << iterations << ", "
+        << "\"ns_per_call\": " << double( elapsed ) / iterations << ", "
+        << "\"calls_per_second\": " << ( elapsed > 0 ? totalCalls * 1e9 / elapsed : 0.0 ) << ", "
+        << "\"allocations_per_call\": " << allocations / totalCalls << ", "
+        << "\"version\": \"" << TRACELIB_VERSION_STR << "\"}";
+    cout << str.str() << endl;
+}
+
+static void printUsage( const char *app )
+{
+    cerr << "Usage: " << app << " [--threads <maximum>] [--iterations <per thread>] [--filter <benchmark name>]" << endl;
+}
+
+static int runBenchmarks( int argc, char **argv )
+{
+    long numCpus = sysconf( _SC_NPROCESSORS_ONLN );
+    unsigned int maxThreads = numCpus > 0 ? static_cast<unsigned int>( numCpus ) : 1;
+    unsigned long iterations = 100000;
+    string filter;
+    for ( int i = 1; i < argc; ++i ) {
+        const string arg = argv[i];
+        if ( arg == "--threads" && i + 1 < argc ) {
+            maxThreads = strtoul( argv[++i], NULL, 10 );
+        } else if ( arg == "--iterations" && i + 1 < argc ) {
+            iterations = strtoul( argv[++i], NULL, 10 );
+        } else if ( arg == "--filter" && i + 1 < argc ) {
+            filter = argv[++i];
+        } else {
+            printUsage( argv[0] );
+            return 1;
+        }
+    }
+    if ( maxThreads == 0 || iterations == 0 ) {
+        printUsage( argv[0] );
+        return 1;
+    }
+
+    vector<unsigned int> threadCounts;
+    for ( unsigned int n = 1; n < maxThreads; n *= 2 ) {
+        threadCounts.push_back( n );
+    }
+    threadCounts.push_back( maxThreads );
+
+    char tempDirTemplate[] = "/tmp/benchmark_hooklib.XXXXXX";
+    const char *tempDir = mkdtemp( tempDirTemplate );
+    if ( !tempDir ) {
+        perror( "benchmark_hooklib: failed to create temporary directory" );
+        return 1;
+    }
+    const unsigned short tcpPort = startTcpSink();
+
+    vector<Scenario> selectedScenarios;
+    const vector<Scenario> allScenarios = scenarios();
+    for ( size_t i = 0; i < allScenarios.size(); ++i ) {
+        const Scenario &scenario = allScenarios[i];
+        if ( !filter.empty() && scenario.name.find( filter ) == string::npos ) {
+            continue;
+        }
+        if ( scenario.output == TcpOutput && tcpPort == 0 ) {
+            continue;
+        }
+        selectedScenarios.push_back( scenario );
+    }
+
+    /* All configuration files are written before the first Trace starts
+     * watching the directory; otherwise the modification notifications for
+     * a freshly written file would make its Trace reload the configuration
+     * (and replace the discarding output) while the benchmark is running.
+     */
+    vector<string> cfgFileNames;
+    vector<string> tempFiles;
+    for ( size_t i = 0; i < selectedScenarios.size(); ++i ) {
+        ostringstream prefix;
+        prefix << tempDir << "/scenario" << i;
+        const string cfgFileName = prefix.str() + ".xml";
+        const string dataFileName = prefix.str() + ".trace";
+        {
+            ofstream cfgFile( cfgFileName.c_str() );
+            cfgFile << configurationMarkup( selectedScenarios[i], dataFileName, tcpPort );
+        }
+        cfgFileNames.push_back( cfgFileName );
+        tempFiles.push_back( cfgFileName );
+        tempFiles.push_back( dataFileName );
+    }
+
+    // Every scenario gets its own Trace
+    vector<Trace *> traces;
+    for ( size_t i = 0; i < selectedScenarios.size(); ++i ) {
+        const Scenario &scenario = selectedScenarios[i];
+        setenv( "TRACELIB_CONFIG_FILE", cfgFileNames[i].c_str(), 1 );
+
+        Trace *trace = new Trace;
+        traces.push_back( trace );
+        if ( scenario.output == DiscardOutput ) {
+            trace->setOutput( new DiscardingOutput );
+        }
+        setActiveTrace( trace );
+
+        // Configures the trace points and connects the output
+        scenario.body( 100 );
+
+        for ( size_t t = 0; t < threadCounts.size(); ++t ) {
+            runScenario( scenario, threadCounts[t], iterations );
+        }
+    }
+
+    setActiveTrace( 0 );
+    deleteRange( traces.begin(), traces.end() );
+    for ( size_t i = 0; i < tempFiles.size(); ++i ) {
+        unlink( tempFiles[i].c_str() );
+    }
+    rmdir( tempDir );
+    return 0;
+}
+
+TRACELIB_NAMESPACE_END
+
+int main( int argc, char **argv )
+{
+    return TRACELIB_NAMESPACE_IDENT(runBenchmarks)( argc, argv );
+}
+
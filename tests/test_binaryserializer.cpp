@@ -0,0 +1,421 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Feeds the output of the BinarySerializer of the hooklib into the
+ * BinaryContentHandler of the server and compares what arrives with what
+ * was written.
+ */
+
+#include "tracelib.h"
+#include "backtrace.h"
+#include "binaryformat.h"
+#include "configuration.h"
+#include "serializer.h"
+#include "trace.h"
+#include "variabledumping.h"
+
+#include "../server/binarycontenthandler.h"
+
+#include <string.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+int g_failureCount = 0;
+int g_verificationCount = 0;
+
+template <typename T>
+static void verify( const char *what, T expected, T actual )
+{
+    if ( !( expected == actual ) ) {
+        cout << "FAIL: " << what << "; expected '" << boolalpha << expected << "', got '" << boolalpha << actual << "'" << endl;
+        ++g_failureCount;
+    }
+    ++g_verificationCount;
+}
+
+static void verify( const char *what, const char *expected, const QString &actual )
+{
+    verify( what, string( expected ), actual.toStdString() );
+}
+
+// Collects everything the content handler decoded
+class RecordingHandler : public XmlParseEventsHandler
+{
+public:
+    RecordingHandler() : storageConfigurations( 0 ) { }
+
+    QList<TraceEntry> entries;
+    QList<ProcessShutdownEvent> shutdownEvents;
+    StorageConfiguration storageConfiguration;
+    int storageConfigurations;
+
+protected:
+    virtual void handleTraceEntry( const TraceEntry &e ) {
+        entries.append( e );
+    }
+
+    virtual void applyStorageConfiguration( const StorageConfiguration &cfg ) {
+        storageConfiguration = cfg;
+        ++storageConfigurations;
+    }
+
+    virtual void handleShutdownEvent( const ProcessShutdownEvent &ev ) {
+        shutdownEvents.append( ev );
+    }
+};
+
+static QByteArray toByteArray( const vector<char> &data )
+{
+    return QByteArray( data.empty() ? 0 : &data[0], static_cast<int>( data.size() ) );
+}
+
+static bool startsWithStreamHeader( const vector<char> &data )
+{
+    return data.size() >= TRACELIB_NAMESPACE_IDENT(BinaryFormat)::HeaderSize &&
+           memcmp( &data[0], TRACELIB_NAMESPACE_IDENT(BinaryFormat)::Magic,
+                   TRACELIB_NAMESPACE_IDENT(BinaryFormat)::MagicSize ) == 0;
+}
+
+// Returns whether the data was decoded without a BinaryParseException
+static bool parse( BinaryContentHandler &contentHandler, const vector<char> &data )
+{
+    try {
+        contentHandler.addData( toByteArray( data ) );
+        contentHandler.continueParsing();
+    } catch ( const BinaryParseException &e ) {
+        cout << "Parse error: " << e.what() << endl;
+        return false;
+    }
+    return true;
+}
+
+TRACELIB_NAMESPACE_BEGIN
+
+static TracePoint firstTracePoint( TracePointType::Log, "/src/first.cpp", 17, "void first()", "FirstGroup" );
+static TracePoint secondTracePoint( TracePointType::Error, "/src/second.cpp", 42, "int second(int)", 0 );
+
+static void testRoundTrip()
+{
+    TraceKey key;
+    key.name = "Network";
+    key.enabled = true;
+    TraceEntry::process.availableTraceKeys.clear();
+    TraceEntry::process.availableTraceKeys.push_back( key );
+
+    StorageConfiguration cfg;
+    cfg.maximumTraceSize = 1000;
+    cfg.shrinkPercentage = 20;
+    cfg.archiveDirectoryName = "/tmp/archive";
+
+    BinarySerializer serializer;
+    serializer.setStorageConfiguration( cfg );
+    serializer.setWriteBacktraceAddresses( true );
+
+    RecordingHandler handler;
+    BinaryContentHandler contentHandler( &handler );
+
+    const int number = -5;
+    const string text = "some text";
+    VariableSnapshot variables;
+    variables << makeVariable( "number", number ) << makeVariable( "text", text );
+
+    TraceEntry first( &firstTracePoint, "hello world", 11, 1234567, 4096 );
+    first.variables = &variables;
+    const vector<char> firstData = serializer.serialize( first );
+    verify( "first serialized entry starts the stream", true, startsWithStreamHeader( firstData ) );
+
+    TraceEntry second( &secondTracePoint, 0, 12, 1234568, 2048 );
+    TraceEntry third( &firstTracePoint, "again", 11, 1234569, 4096 );
+
+    // The module records are written along with the first address backtrace
+    BacktraceGenerator generator;
+    third.backtrace = new Backtrace( generator.capture( 0 ) );
+    const size_t backtraceDepth = third.backtrace->addresses().size();
+
+    vector<char> data = firstData;
+    vector<char> secondData = serializer.serialize( second );
+    data.insert( data.end(), secondData.begin(), secondData.end() );
+    vector<char> thirdData = serializer.serialize( third );
+    data.insert( data.end(), thirdData.begin(), thirdData.end() );
+    vector<char> shutdownData = serializer.serialize( ProcessShutdownEvent() );
+    data.insert( data.end(), shutdownData.begin(), shutdownData.end() );
+
+    verify( "round trip parses", true, parse( contentHandler, data ) );
+    verify( "round trip entry count", 3, static_cast<int>( handler.entries.size() ) );
+    verify( "round trip storage configuration count", 1, handler.storageConfigurations );
+    verify( "round trip maximum size", 1000ul, handler.storageConfiguration.maximumSize );
+    verify( "round trip shrink percentage", (unsigned short)20, handler.storageConfiguration.shrinkBy );
+    verify( "round trip archive directory", "/tmp/archive", handler.storageConfiguration.archiveDir );
+    if ( handler.entries.size() != 3 ) {
+        return;
+    }
+
+    const ::TraceEntry &e1 = handler.entries[0];
+    verify( "first entry pid", static_cast<unsigned int>( TraceEntry::process.id ), e1.pid );
+    verify( "first entry process start time",
+            static_cast<qint64>( TraceEntry::process.startTime ),
+            e1.processStartTime.toMSecsSinceEpoch() );
+    verify( "first entry process name", Configuration::currentProcessName().c_str(), e1.processName );
+    verify( "first entry trace key count", 1, static_cast<int>( e1.traceKeys.size() ) );
+    if ( e1.traceKeys.size() == 1 ) {
+        verify( "first entry trace key name", "Network", e1.traceKeys[0].name );
+        verify( "first entry trace key enabled", true, e1.traceKeys[0].enabled );
+    }
+    verify( "first entry tid", 11u, e1.tid );
+    verify( "first entry timestamp", static_cast<qint64>( 1234567 ), e1.timestamp.toMSecsSinceEpoch() );
+    verify( "first entry stack position", 4096ul, e1.stackPosition );
+    verify( "first entry type", static_cast<unsigned int>( TracePointType::Log ), e1.type );
+    verify( "first entry path", "/src/first.cpp", e1.path );
+    verify( "first entry line", 17ul, e1.lineno );
+    verify( "first entry function", "void first()", e1.function );
+    verify( "first entry group", "FirstGroup", e1.groupName );
+    verify( "first entry message", "hello world", e1.message );
+    verify( "first entry variable count", 2, static_cast<int>( e1.variables.size() ) );
+    if ( e1.variables.size() == 2 ) {
+        verify( "first variable name", "number", e1.variables[0].name );
+        verify( "first variable type", VariableType::Number, e1.variables[0].type );
+        verify( "first variable value", "-5", e1.variables[0].value );
+        verify( "second variable name", "text", e1.variables[1].name );
+        verify( "second variable type", VariableType::String, e1.variables[1].type );
+        verify( "second variable value", "some text", e1.variables[1].value );
+    }
+    verify( "first entry backtrace", 0, static_cast<int>( e1.backtrace.size() ) );
+
+    const ::TraceEntry &e2 = handler.entries[1];
+    verify( "second entry type", static_cast<unsigned int>( TracePointType::Error ), e2.type );
+    verify( "second entry path", "/src/second.cpp", e2.path );
+    verify( "second entry line", 42ul, e2.lineno );
+    verify( "second entry group", "", e2.groupName );
+    verify( "second entry message", "", e2.message );
+    verify( "second entry variable count", 0, static_cast<int>( e2.variables.size() ) );
+
+    const ::TraceEntry &e3 = handler.entries[2];
+    verify( "third entry path", "/src/first.cpp", e3.path );
+    verify( "third entry message", "again", e3.message );
+    verify( "third entry backtrace depth", static_cast<int>( backtraceDepth ), static_cast<int>( e3.backtrace.size() ) );
+    bool framesHaveModule = false;
+    bool framesAreAddresses = true;
+    for ( int i = 0; i < e3.backtrace.size(); ++i ) {
+        framesHaveModule = framesHaveModule || !e3.backtrace[i].module.isEmpty();
+        framesAreAddresses = framesAreAddresses && e3.backtrace[i].function.startsWith( "[0x" );
+    }
+    verify( "third entry backtrace refers to modules", true, framesHaveModule );
+    verify( "third entry backtrace holds addresses", true, framesAreAddresses );
+
+    verify( "shutdown event count", 1, static_cast<int>( handler.shutdownEvents.size() ) );
+    if ( handler.shutdownEvents.size() == 1 ) {
+        verify( "shutdown event pid", static_cast<unsigned int>( TraceEntry::process.id ), handler.shutdownEvents[0].pid );
+        verify( "shutdown event name", Configuration::currentProcessName().c_str(), handler.shutdownEvents[0].name );
+    }
+
+    TraceEntry::process.availableTraceKeys.clear();
+}
+
+/* After a restart, the stream has to be decodable on its own, e.g. by the
+ * content handler of a new connection.
+ */
+static void testRestartStream()
+{
+    BinarySerializer serializer;
+
+    RecordingHandler handler;
+    BinaryContentHandler contentHandler( &handler );
+    TraceEntry first( &firstTracePoint, "first", 1, 1000, 0 );
+    verify( "restart: first stream parses", true, parse( contentHandler, serializer.serialize( first ) ) );
+
+    TraceEntry second( &firstTracePoint, "second", 1, 1001, 0 );
+    const vector<char> continued = serializer.serialize( second );
+    verify( "restart: continued stream has no header", false, startsWithStreamHeader( continued ) );
+
+    serializer.restartStream();
+    TraceEntry third( &secondTracePoint, "third", 1, 1002, 0 );
+    const vector<char> restarted = serializer.serialize( third );
+    verify( "restart: restarted stream has a header", true, startsWithStreamHeader( restarted ) );
+
+    RecordingHandler newHandler;
+    BinaryContentHandler newContentHandler( &newHandler );
+    verify( "restart: restarted stream parses", true, parse( newContentHandler, restarted ) );
+    verify( "restart: entry count", 1, static_cast<int>( newHandler.entries.size() ) );
+    if ( newHandler.entries.size() == 1 ) {
+        verify( "restart: entry path", "/src/second.cpp", newHandler.entries[0].path );
+        verify( "restart: entry message", "third", newHandler.entries[0].message );
+        verify( "restart: entry pid", static_cast<unsigned int>( TraceEntry::process.id ), newHandler.entries[0].pid );
+    }
+}
+
+/* The ids are assigned anew after data was dropped, so the receiver has to
+ * replace the definitions it got before.
+ */
+static void testDataDropped()
+{
+    BinarySerializer serializer;
+    RecordingHandler handler;
+    BinaryContentHandler contentHandler( &handler );
+
+    TraceEntry first( &firstTracePoint, "first", 1, 1000, 0 );
+    TraceEntry second( &secondTracePoint, "second", 1, 1001, 0 );
+    verify( "dropped: first entry parses", true, parse( contentHandler, serializer.serialize( first ) ) );
+    verify( "dropped: second entry parses", true, parse( contentHandler, serializer.serialize( second ) ) );
+
+    // Gets lost on the way to the receiver
+    serializer.serialize( first );
+    serializer.dataDropped();
+
+    // The second trace point now gets the id which the first one had
+    TraceEntry third( &secondTracePoint, "third", 1, 1002, 0 );
+    const vector<char> afterDrop = serializer.serialize( third );
+    verify( "dropped: no new stream header", false, startsWithStreamHeader( afterDrop ) );
+    verify( "dropped: entry after drop parses", true, parse( contentHandler, afterDrop ) );
+
+    TraceEntry fourth( &firstTracePoint, "fourth", 1, 1003, 0 );
+    verify( "dropped: fourth entry parses", true, parse( contentHandler, serializer.serialize( fourth ) ) );
+
+    verify( "dropped: entry count", 4, static_cast<int>( handler.entries.size() ) );
+    verify( "dropped: process record repeated", 2, handler.storageConfigurations );
+    if ( handler.entries.size() == 4 ) {
+        verify( "dropped: third entry path", "/src/second.cpp", handler.entries[2].path );
+        verify( "dropped: third entry line", 42ul, handler.entries[2].lineno );
+        verify( "dropped: third entry message", "third", handler.entries[2].message );
+        verify( "dropped: fourth entry path", "/src/first.cpp", handler.entries[3].path );
+        verify( "dropped: fourth entry group", "FirstGroup", handler.entries[3].groupName );
+        verify( "dropped: fourth entry message", "fourth", handler.entries[3].message );
+    }
+}
+
+/* Entries which were serialized for a broken stream can be sent over a new
+ * one after what resumeStream() yields, since the ids are kept.
+ */
+static void testResumeStream()
+{
+    BinarySerializer serializer;
+    serializer.setWriteBacktraceAddresses( true );
+
+    RecordingHandler handler;
+    BinaryContentHandler contentHandler( &handler );
+    TraceEntry first( &firstTracePoint, "first", 1, 1000, 0 );
+    BacktraceGenerator generator;
+    first.backtrace = new Backtrace( generator.capture( 0 ) );
+    verify( "resume: first entry parses", true, parse( contentHandler, serializer.serialize( first ) ) );
+
+    // Queued, but not sent before the stream broke
+    TraceEntry second( &secondTracePoint, "second", 1, 1001, 0 );
+    TraceEntry third( &firstTracePoint, "third", 1, 1002, 0 );
+    third.backtrace = new Backtrace( generator.capture( 0 ) );
+    vector<char> queued = serializer.serialize( second );
+    const vector<char> thirdData = serializer.serialize( third );
+    queued.insert( queued.end(), thirdData.begin(), thirdData.end() );
+
+    vector<char> resumed = serializer.resumeStream();
+    verify( "resume: resumed stream has a header", true, startsWithStreamHeader( resumed ) );
+    resumed.insert( resumed.end(), queued.begin(), queued.end() );
+
+    RecordingHandler newHandler;
+    BinaryContentHandler newContentHandler( &newHandler );
+    verify( "resume: resumed stream parses", true, parse( newContentHandler, resumed ) );
+
+    // The serializer goes on with the same ids
+    TraceEntry fourth( &secondTracePoint, "fourth", 1, 1003, 0 );
+    const vector<char> fourthData = serializer.serialize( fourth );
+    verify( "resume: no header after resuming", false, startsWithStreamHeader( fourthData ) );
+    verify( "resume: entry after resuming parses", true, parse( newContentHandler, fourthData ) );
+
+    verify( "resume: entry count", 3, static_cast<int>( newHandler.entries.size() ) );
+    verify( "resume: process record count", 1, newHandler.storageConfigurations );
+    if ( newHandler.entries.size() == 3 ) {
+        verify( "resume: second entry path", "/src/second.cpp", newHandler.entries[0].path );
+        verify( "resume: second entry message", "second", newHandler.entries[0].message );
+        verify( "resume: third entry path", "/src/first.cpp", newHandler.entries[1].path );
+        verify( "resume: third entry group", "FirstGroup", newHandler.entries[1].groupName );
+        verify( "resume: third entry backtrace depth",
+                static_cast<int>( third.backtrace->addresses().size() ),
+                static_cast<int>( newHandler.entries[1].backtrace.size() ) );
+        verify( "resume: fourth entry path", "/src/second.cpp", newHandler.entries[2].path );
+    }
+}
+
+// Network reads may split records at any byte
+static void testSplitRecords()
+{
+    BinarySerializer serializer;
+    vector<char> data;
+    for ( int i = 0; i < 10; ++i ) {
+        TraceEntry entry( i % 2 ? &firstTracePoint : &secondTracePoint, "split", 1, 1000 + i, 0 );
+        const vector<char> entryData = serializer.serialize( entry );
+        data.insert( data.end(), entryData.begin(), entryData.end() );
+    }
+
+    RecordingHandler handler;
+    BinaryContentHandler contentHandler( &handler );
+    bool parsed = true;
+    for ( size_t i = 0; i < data.size() && parsed; ++i ) {
+        parsed = parse( contentHandler, vector<char>( 1, data[i] ) );
+    }
+    verify( "split: all bytes parse", true, parsed );
+    verify( "split: entry count", 10, static_cast<int>( handler.entries.size() ) );
+    if ( handler.entries.size() == 10 ) {
+        verify( "split: last entry timestamp", static_cast<qint64>( 1009 ), handler.entries[9].timestamp.toMSecsSinceEpoch() );
+        verify( "split: last entry path", "/src/first.cpp", handler.entries[9].path );
+    }
+}
+
+static void testInvalidData()
+{
+    BinarySerializer serializer;
+    RecordingHandler handler;
+    BinaryContentHandler contentHandler( &handler );
+    TraceEntry first( &firstTracePoint, "first", 1, 1000, 0 );
+    verify( "invalid: first entry parses", true, parse( contentHandler, serializer.serialize( first ) ) );
+
+    /* Shorten the record (and its length field accordingly) so that the
+     * message string ends beyond the record.
+     */
+    TraceEntry second( &firstTracePoint, "second", 1, 1001, 0 );
+    vector<char> truncated = serializer.serialize( second );
+    truncated.resize( truncated.size() - 3 );
+    const unsigned int recordSize = static_cast<unsigned int>( truncated.size() - 4 );
+    for ( int i = 0; i < 4; ++i ) {
+        truncated[i] = static_cast<char>( ( recordSize >> ( 8 * i ) ) & 0xff );
+    }
+    verify( "invalid: truncated record is rejected", false, parse( contentHandler, truncated ) );
+    verify( "invalid: entry count", 1, static_cast<int>( handler.entries.size() ) );
+
+    RecordingHandler otherHandler;
+    BinaryContentHandler headerlessContentHandler( &otherHandler );
+    BinarySerializer otherSerializer;
+    otherSerializer.serialize( first ); // the stream header gets lost
+    verify( "invalid: stream without header is rejected", false,
+            parse( headerlessContentHandler, otherSerializer.serialize( second ) ) );
+}
+
+TRACELIB_NAMESPACE_END
+
+int main()
+{
+    TRACELIB_NAMESPACE_IDENT(testRoundTrip)();
+    TRACELIB_NAMESPACE_IDENT(testRestartStream)();
+    TRACELIB_NAMESPACE_IDENT(testDataDropped)();
+    TRACELIB_NAMESPACE_IDENT(testResumeStream)();
+    TRACELIB_NAMESPACE_IDENT(testSplitRecords)();
+    TRACELIB_NAMESPACE_IDENT(testInvalidData)();
+    cout << g_verificationCount << " verifications; " << g_failureCount << " failures found." << endl;
+    return g_failureCount;
+}
@@ -199,6 +199,7 @@ static void testCommunication()
     Log error_log( &log_output, &log_output );
     std::string quick_fox = "The quick brown fox jumps over the lazy dog";
     NetworkOutput *net = new NetworkOutput( &error_log, "127.0.0.1", TRACELIB_DEFAULT_PORT );
+    net->setReconnectDelay( 100, 400 );
     verify( "Initial NetworkOutput::canWrite()",
             false,
             net->canWrite() );
@@ -208,16 +209,28 @@ static void testCommunication()
             true,
             net->canWrite() );
 
+    // data written while the server is unreachable is sent after reconnecting
+    net->write( std::vector<char>( quick_fox.begin(), quick_fox.end() ) );
     sleep( 2 );
-    verify( "Connect Error NetworkOutput::canWrite()",
-            false,
+    verify( "Reconnecting NetworkOutput::canWrite()",
+            true,
             net->canWrite() );
 
-    delete net;
-
     std::string output, expected;
     pthread_t server_thread;
     pthread_create( &server_thread, NULL, fakeServerProc, &output );
+    sleep( 1 );
+
+    delete net;
+    sleep( 1 );
+    pthread_detach( server_thread );
+
+    verify( "testCommunication server received data queued while reconnecting",
+            quick_fox,
+            output );
+
+    output = "";
+    pthread_create( &server_thread, NULL, fakeServerProc, &output );
     usleep( 100000 );
 
     net = new NetworkOutput( &error_log, "127.0.0.1", TRACELIB_DEFAULT_PORT );
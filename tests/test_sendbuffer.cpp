@@ -0,0 +1,309 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tracelib.h"
+#include "sendbuffer.h"
+
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+int g_failureCount = 0;
+int g_verificationCount = 0;
+
+template <typename T>
+static void verify( const char *what, T expected, T actual )
+{
+    if ( !( expected == actual ) ) {
+        cout << "FAIL: " << what << "; expected '" << boolalpha << expected << "', got '" << boolalpha << actual << "'" << endl;
+        ++g_failureCount;
+    }
+    ++g_verificationCount;
+}
+
+TRACELIB_NAMESPACE_BEGIN
+
+static const size_t ChunkSize = SendBuffer::ChunkSize;
+
+// Each entry gets a character of its own, so misplaced bytes show up
+static string entry( char c, size_t size )
+{
+    return string( size, c );
+}
+
+static void append( SendBuffer &buf, const string &data )
+{
+    buf.append( data.data(), data.size() );
+}
+
+// Yields the queued data like the consumer sees it, without consuming it
+static string contents( const SendBuffer &buf )
+{
+    SendBuffer::Region regions[16];
+    const size_t numRegions = buf.peek( regions, 16 );
+    string s;
+    for ( size_t i = 0; i < numRegions; ++i ) {
+        s.append( regions[i].data, regions[i].size );
+    }
+    return s;
+}
+
+static void endPeek( SendBuffer &buf )
+{
+    buf.consume( 0 );
+}
+
+static void testAppendAndConsume()
+{
+    SendBuffer buf;
+    verify( "new buffer is empty", true, buf.isEmpty() );
+
+    const string a = entry( 'a', 100 );
+    const string b = entry( 'b', 2 * ChunkSize ); // larger than a chunk
+    const string c = entry( 'c', 10 );
+    verify( "append to empty buffer", true, buf.append( a.data(), a.size() ) );
+    verify( "append to non-empty buffer", false, buf.append( b.data(), b.size() ) );
+    append( buf, c );
+    verify( "size after append", a.size() + b.size() + c.size(), buf.size() );
+    verify( "entries after append", (size_t)3, buf.entryCount() );
+    verify( "contents after append", a + b + c, contents( buf ) );
+    endPeek( buf );
+
+    verify( "consume part of first entry", false, buf.consume( 50 ) );
+    verify( "entries after partial consume", (size_t)3, buf.entryCount() );
+    verify( "contents after partial consume", a.substr( 50 ) + b + c, contents( buf ) );
+    endPeek( buf );
+
+    verify( "consume up to last entry", false, buf.consume( 50 + b.size() ) );
+    verify( "entries before last consume", (size_t)1, buf.entryCount() );
+    verify( "consume everything", true, buf.consume( c.size() ) );
+    verify( "entries after consuming everything", (size_t)0, buf.entryCount() );
+    verify( "empty after consuming everything", true, buf.isEmpty() );
+}
+
+static void testStraddlingEntries()
+{
+    SendBuffer buf;
+    const string a = entry( 'a', ChunkSize - 10 );
+    const string b = entry( 'b', 100 ); // starts in the first chunk, ends in the second
+    const string c = entry( 'c', 50 );
+    append( buf, a );
+    append( buf, b );
+    append( buf, c );
+
+    SendBuffer::Region regions[4];
+    verify( "straddling entry spans two regions", (size_t)2, buf.peek( regions, 4 ) );
+    verify( "first region is a full chunk", ChunkSize, regions[0].size );
+    endPeek( buf );
+    verify( "contents with straddling entry", a + b + c, contents( buf ) );
+    endPeek( buf );
+
+    verify( "drop first entry", (size_t)1, buf.dropOldest( a.size() ) );
+    verify( "contents after dropping first entry", b + c, contents( buf ) );
+    endPeek( buf );
+
+    verify( "drop straddling entry", (size_t)1, buf.dropOldest( 1 ) );
+    verify( "contents after dropping straddling entry", c, contents( buf ) );
+    endPeek( buf );
+    verify( "size after dropping", c.size(), buf.size() );
+}
+
+/* The remainder of a partially sent entry is moved behind the dropped
+ * entries, here from the first chunk into the second one.
+ */
+static void testDropOldestKeepsStartedEntry()
+{
+    SendBuffer buf;
+    const string a = entry( 'a', ChunkSize - 20 );
+    const string b = entry( 'b', 100 ); // straddles the chunk boundary
+    const string c = entry( 'c', 100 );
+    const string d = entry( 'd', 50 );
+    append( buf, a );
+    append( buf, b );
+    append( buf, c );
+    append( buf, d );
+
+    buf.consume( a.size() - 50 );
+    verify( "drop entries behind started entry", (size_t)2, buf.dropOldest( 150 ) );
+    verify( "started entry survives dropping", a.substr( a.size() - 50 ) + d, contents( buf ) );
+    endPeek( buf );
+    verify( "entries after dropping", (size_t)2, buf.entryCount() );
+    verify( "size after dropping", (size_t)100, buf.size() );
+
+    // The moved remainder is still known to be the started entry
+    verify( "drop started entry", (size_t)1, buf.dropStartedEntry() );
+    verify( "contents after dropping started entry", d, contents( buf ) );
+    endPeek( buf );
+    verify( "no started entry left", (size_t)0, buf.dropStartedEntry() );
+    verify( "untouched entry stays", d, contents( buf ) );
+    endPeek( buf );
+}
+
+static void testRefuseDrop()
+{
+    SendBuffer buf;
+    const string a = entry( 'a', 100 );
+    const string b = entry( 'b', 100 );
+    append( buf, a );
+    append( buf, b );
+
+    verify( "cannot free more than queued", (size_t)0, buf.dropOldest( 1000 ) );
+    verify( "contents after refused drop", a + b, contents( buf ) );
+
+    // The consumer is still writing the regions it peeked at
+    verify( "no drop while writing", (size_t)0, buf.dropOldest( 10 ) );
+    endPeek( buf );
+    verify( "drop after writing", (size_t)1, buf.dropOldest( 10 ) );
+    verify( "contents after drop", b, contents( buf ) );
+    endPeek( buf );
+
+    // A partially sent entry is never dropped, only the entries behind it
+    buf.consume( 10 );
+    verify( "no drop of partly sent entry", (size_t)0, buf.dropOldest( 10 ) );
+    verify( "partly sent entry remains", b.substr( 10 ), contents( buf ) );
+    endPeek( buf );
+
+    // Nothing to drop unless the first entry was sent partially
+    SendBuffer other;
+    append( other, a );
+    verify( "no started entry to drop", (size_t)0, other.dropStartedEntry() );
+    verify( "contents without started entry", a, contents( other ) );
+    endPeek( other );
+}
+
+// A drained buffer keeps its last chunk for the next data
+static void testChunkReuse()
+{
+    SendBuffer buf;
+    append( buf, entry( 'a', ChunkSize ) );
+    SendBuffer::Region regions[2];
+    buf.peek( regions, 2 );
+    const void *firstChunk = regions[0].data;
+    verify( "drain full chunk", true, buf.consume( ChunkSize ) );
+
+    append( buf, entry( 'b', 10 ) );
+    buf.peek( regions, 2 );
+    verify( "full chunk is reused", firstChunk, static_cast<const void *>( regions[0].data ) );
+    verify( "drain partially filled chunk", true, buf.consume( 10 ) );
+
+    append( buf, entry( 'c', 10 ) );
+    buf.peek( regions, 2 );
+    verify( "partially filled chunk is reused", firstChunk, static_cast<const void *>( regions[0].data ) );
+    verify( "reused chunk holds new data", entry( 'c', 10 ), string( regions[0].data, regions[0].size ) );
+    endPeek( buf );
+
+    buf.clear();
+    verify( "empty after clear", true, buf.isEmpty() );
+    append( buf, entry( 'd', 10 ) );
+    buf.peek( regions, 2 );
+    verify( "chunk is reused after clear", firstChunk, static_cast<const void *>( regions[0].data ) );
+    endPeek( buf );
+}
+
+/* Marks are set when the data dropped, so marked entries which weren't sent
+ * once the stream broke are dropped while entries queued later stay.
+ */
+static void testDropMarkedEntries()
+{
+    SendBuffer buf;
+    const string a = entry( 'a', 100 );
+    const string b = entry( 'b', 100 );
+    const string c = entry( 'c', 100 );
+    const string d = entry( 'd', 100 );
+    append( buf, a );
+    append( buf, b );
+    append( buf, c );
+    buf.markEntries();
+    append( buf, d );
+
+    buf.consume( a.size() + 10 );
+    verify( "drop started entry before marked ones", (size_t)1, buf.dropStartedEntry() );
+    verify( "drop remaining marked entries", (size_t)1, buf.dropMarkedEntries() );
+    verify( "unmarked entry stays", d, contents( buf ) );
+    endPeek( buf );
+    verify( "marks are gone after dropping", (size_t)0, buf.dropMarkedEntries() );
+
+    // Marked entries which were sent completely don't count anymore
+    append( buf, a );
+    buf.markEntries();
+    verify( "consume all marked entries", false, buf.consume( d.size() + a.size() - 1 ) );
+    verify( "consume rest of marked entries", true, buf.consume( 1 ) );
+    append( buf, b );
+    verify( "nothing marked after consuming", (size_t)0, buf.dropMarkedEntries() );
+    verify( "entry after consumed marks stays", b, contents( buf ) );
+    endPeek( buf );
+
+    append( buf, c );
+    buf.markEntries();
+    buf.clear();
+    append( buf, d );
+    verify( "nothing marked after clear", (size_t)0, buf.dropMarkedEntries() );
+    verify( "entry after clear stays", d, contents( buf ) );
+    endPeek( buf );
+}
+
+static void testPrepend()
+{
+    SendBuffer buf;
+    const string a = entry( 'a', ChunkSize - 10 );
+    const string b = entry( 'b', 100 ); // straddles the chunk boundary
+    const string p = entry( 'p', 50 );
+    const string c = entry( 'c', 10 );
+    append( buf, a );
+    append( buf, b );
+    buf.prepend( p.data(), p.size() );
+    verify( "prepended data comes first", p + a + b, contents( buf ) );
+    endPeek( buf );
+    verify( "prepended data is an entry", (size_t)3, buf.entryCount() );
+    verify( "size after prepend", p.size() + a.size() + b.size(), buf.size() );
+
+    // The prepended chunk doesn't take appended data
+    append( buf, c );
+    verify( "appended data goes last", p + a + b + c, contents( buf ) );
+    endPeek( buf );
+
+    verify( "drop prepended entry", (size_t)1, buf.dropOldest( 1 ) );
+    verify( "contents after dropping prepended entry", a + b + c, contents( buf ) );
+    endPeek( buf );
+
+    SendBuffer empty;
+    empty.prepend( p.data(), p.size() );
+    verify( "prepend to empty buffer", p, contents( empty ) );
+    endPeek( empty );
+    verify( "drain prepended entry", true, empty.consume( p.size() ) );
+    append( empty, c );
+    verify( "append after draining prepended entry", c, contents( empty ) );
+    endPeek( empty );
+}
+
+TRACELIB_NAMESPACE_END
+
+int main()
+{
+    TRACELIB_NAMESPACE_IDENT(testAppendAndConsume)();
+    TRACELIB_NAMESPACE_IDENT(testStraddlingEntries)();
+    TRACELIB_NAMESPACE_IDENT(testDropOldestKeepsStartedEntry)();
+    TRACELIB_NAMESPACE_IDENT(testRefuseDrop)();
+    TRACELIB_NAMESPACE_IDENT(testChunkReuse)();
+    TRACELIB_NAMESPACE_IDENT(testDropMarkedEntries)();
+    TRACELIB_NAMESPACE_IDENT(testPrepend)();
+    cout << g_verificationCount << " verifications; " << g_failureCount << " failures found." << endl;
+    return g_failureCount;
+}
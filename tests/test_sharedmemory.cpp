@@ -0,0 +1,560 @@
+/* tracetool - a framework for tracing the execution of C++ programs
+ * Copyright 2010-2016 froglogic GmbH
+ *
+ * This file is part of tracetool.
+ *
+ * tracetool is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * tracetool is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tracetool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tracelib.h"
+#include "log.h"
+#include "output.h"
+#include "sharedmemoryformat.h"
+#include "../server/sharedmemoryreader.h"
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QString>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace TRACELIB_NAMESPACE_IDENT(SharedMemoryFormat);
+
+int g_failureCount = 0;
+int g_verificationCount = 0;
+
+template <typename T>
+static void verify( const char *what, T expected, T actual )
+{
+    if ( !( expected == actual ) ) {
+        cout << "FAIL: " << what << "; expected '" << boolalpha << expected << "', got '" << boolalpha << actual << "'" << endl;
+        ++g_failureCount;
+    }
+    ++g_verificationCount;
+}
+
+// The reader delivers data asynchronously, so the tests poll for it
+static const int Timeout = 5000; // milliseconds
+
+/* Collects the data which the reader thread delivers, per stream and in
+ * the order in which the streams started.
+ */
+class Receiver
+{
+public:
+    explicit Receiver( SharedMemoryReader *reader )
+    {
+        QObject::connect( reader, &SharedMemoryReader::dataReceived,
+                          [this]( quint64 stream, const QByteArray &data ) {
+                              QMutexLocker locker( &m_mutex );
+                              if ( !m_data.contains( stream ) ) {
+                                  m_streams.append( stream );
+                              }
+                              m_data[stream].append( data );
+                          } );
+        QObject::connect( reader, &SharedMemoryReader::streamClosed,
+                          [this]( quint64 stream ) {
+                              QMutexLocker locker( &m_mutex );
+                              m_closedStreams.append( stream );
+                          } );
+    }
+
+    string data() const
+    {
+        QMutexLocker locker( &m_mutex );
+        QByteArray data;
+        for ( int i = 0; i < m_streams.size(); ++i ) {
+            data.append( m_data.value( m_streams[i] ) );
+        }
+        return string( data.constData(), static_cast<size_t>( data.size() ) );
+    }
+
+    int streamCount() const
+    {
+        QMutexLocker locker( &m_mutex );
+        return static_cast<int>( m_streams.size() );
+    }
+
+    int closedStreamCount() const
+    {
+        QMutexLocker locker( &m_mutex );
+        return static_cast<int>( m_closedStreams.size() );
+    }
+
+    string waitForData( size_t size ) const
+    {
+        QElapsedTimer timer;
+        timer.start();
+        while ( data().size() < size && timer.elapsed() < Timeout ) {
+            QThread::msleep( 1 );
+        }
+        return data();
+    }
+
+private:
+    mutable QMutex m_mutex;
+    QList<quint64> m_streams;
+    QHash<quint64, QByteArray> m_data;
+    QList<quint64> m_closedStreams;
+};
+
+// Maps the segment created by the reader to look at its headers
+class Segment
+{
+public:
+    explicit Segment( const string &name )
+        : m_mapping( MAP_FAILED ),
+        m_size( 0 )
+    {
+        const int fd = shm_open( name.c_str(), O_RDWR, 0 );
+        struct stat st;
+        if ( fd != -1 && fstat( fd, &st ) == 0 ) {
+            m_size = static_cast<size_t>( st.st_size );
+            m_mapping = mmap( 0, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+        }
+        if ( fd != -1 ) {
+            close( fd );
+        }
+    }
+
+    ~Segment()
+    {
+        if ( m_mapping != MAP_FAILED ) {
+            munmap( m_mapping, m_size );
+        }
+    }
+
+    bool isValid() const { return m_mapping != MAP_FAILED; }
+
+    Header *header() { return static_cast<Header *>( m_mapping ); }
+    SlotHeader *slot( unsigned int n ) { return slotHeader( static_cast<char *>( m_mapping ), n ); }
+
+    // The reader stores the read position after delivering the data
+    bool waitUntilRead( unsigned int n )
+    {
+        QElapsedTimer timer;
+        timer.start();
+        while ( load( &slot( n )->readPosition ) != load( &slot( n )->writePosition ) ) {
+            if ( timer.elapsed() >= Timeout ) {
+                return false;
+            }
+            QThread::msleep( 1 );
+        }
+        return true;
+    }
+
+private:
+    void *m_mapping;
+    size_t m_size;
+};
+
+static TRACELIB_NAMESPACE_IDENT(NullLogOutput) g_logOutput;
+static TRACELIB_NAMESPACE_IDENT(Log) g_log( &g_logOutput, &g_logOutput );
+
+static string segmentName( const char *test )
+{
+    ostringstream str;
+    str << "/tracetool-test-" << getpid() << "-" << test;
+    return str.str();
+}
+
+static bool attach( SharedMemoryReader &reader, const string &name, quint64 slotSize )
+{
+    QString errorMessage;
+    if ( !reader.attach( QString::fromLatin1( name.c_str() ), 4, slotSize, &errorMessage ) ) {
+        cout << "Failed to attach to " << name << ": " << errorMessage.toStdString() << endl;
+        return false;
+    }
+    return true;
+}
+
+static vector<char> entry( const string &s )
+{
+    return vector<char>( s.begin(), s.end() );
+}
+
+static string numberedEntry( int n, size_t size )
+{
+    ostringstream str;
+    str << n << ":";
+    string s = str.str();
+    s.resize( size, static_cast<char>( 'a' + n % 26 ) );
+    return s;
+}
+
+TRACELIB_NAMESPACE_BEGIN
+
+// Reopens the output once it cannot write anymore, like the trace does
+static void write( SharedMemoryOutput &output, const string &data )
+{
+    if ( !output.canWrite() && !output.open() ) {
+        return;
+    }
+    output.write( entry( data ) );
+}
+
+static void testOrdering()
+{
+    const string name = segmentName( "ordering" );
+    SharedMemoryReader reader;
+    if ( !attach( reader, name, 4096 ) ) {
+        ++g_failureCount;
+        return;
+    }
+    Receiver receiver( &reader );
+    reader.start();
+
+    SharedMemoryOutput output( &g_log, name );
+    string expected;
+    for ( int i = 0; i < 100; ++i ) {
+        const string s = numberedEntry( i, 10 + i % 7 );
+        write( output, s );
+        expected += s;
+    }
+    verify( "ordering: entries arrive in order", expected, receiver.waitForData( expected.size() ) );
+    verify( "ordering: one stream", 1, receiver.streamCount() );
+    verify( "ordering: nothing dropped", 0ul, output.takeDroppedEntryCount() );
+
+    reader.stop();
+    reader.wait();
+    shm_unlink( name.c_str() );
+}
+
+/* Records of varying sizes wrap around the end of a small slot many times,
+ * with headers and data split at the boundary.
+ */
+static void testWrapAround()
+{
+    const string name = segmentName( "wraparound" );
+    const quint64 slotSize = 256;
+    SharedMemoryReader reader;
+    if ( !attach( reader, name, slotSize ) ) {
+        ++g_failureCount;
+        return;
+    }
+    Receiver receiver( &reader );
+    reader.start();
+
+    SharedMemoryOutput output( &g_log, name );
+    string expected;
+    for ( int i = 0; i < 200; ++i ) {
+        const string s = numberedEntry( i, 5 + ( i * 7 ) % 61 );
+        write( output, s );
+        expected += s;
+        // Keep the slot from overflowing
+        receiver.waitForData( expected.size() );
+    }
+    verify( "wrap-around: entries arrive in order", expected, receiver.data() );
+    verify( "wrap-around: one stream", 1, receiver.streamCount() );
+    verify( "wrap-around: nothing dropped", 0ul, output.takeDroppedEntryCount() );
+
+    Segment segment( name );
+    verify( "wrap-around: segment mapped", true, segment.isValid() );
+    if ( segment.isValid() ) {
+        verify( "wrap-around: slot wrapped several times", true,
+                load( &segment.slot( 0 )->writePosition ) > 10 * slotSize );
+        verify( "wrap-around: everything read", true, segment.waitUntilRead( 0 ) );
+    }
+
+    reader.stop();
+    reader.wait();
+    shm_unlink( name.c_str() );
+}
+
+/* Entries which don't fit into the slot are dropped; they are reported
+ * once the reader drained the slot to half its size.
+ */
+static void testDroppedEntries()
+{
+    const string name = segmentName( "dropped" );
+    const quint64 slotSize = 256;
+    SharedMemoryReader reader;
+    if ( !attach( reader, name, slotSize ) ) {
+        ++g_failureCount;
+        return;
+    }
+    Receiver receiver( &reader );
+    Segment segment( name );
+    verify( "dropped: segment mapped", true, segment.isValid() );
+    if ( !segment.isValid() ) {
+        return;
+    }
+
+    SharedMemoryOutput output( &g_log, name );
+    const size_t entrySize = 50;
+    const int fittingEntries = static_cast<int>( slotSize / ( RecordHeaderSize + entrySize ) );
+    string expected;
+    for ( int i = 0; i < 20; ++i ) {
+        const string s = numberedEntry( i, entrySize );
+        write( output, s );
+        if ( i < fittingEntries ) {
+            expected += s;
+        }
+    }
+    verify( "dropped: data was dropped", true, output.droppedData() );
+    verify( "dropped: flag is reset", false, output.droppedData() );
+    verify( "dropped: no report while the slot is full", 0ul, output.takeDroppedEntryCount() );
+
+    reader.start();
+    verify( "dropped: fitting entries arrive", expected, receiver.waitForData( expected.size() ) );
+    verify( "dropped: slot is drained", true, segment.waitUntilRead( 0 ) );
+    verify( "dropped: report once drained", static_cast<unsigned long>( 20 - fittingEntries ), output.takeDroppedEntryCount() );
+    verify( "dropped: reported just once", 0ul, output.takeDroppedEntryCount() );
+
+    write( output, string( slotSize, 'x' ) );
+    verify( "dropped: oversized entry is dropped", true, output.droppedData() );
+    verify( "dropped: oversized entry is reported", 1ul, output.takeDroppedEntryCount() );
+
+    const string last = numberedEntry( 99, entrySize );
+    write( output, last );
+    expected += last;
+    verify( "dropped: writing continues", expected, receiver.waitForData( expected.size() ) );
+    verify( "dropped: one stream", 1, receiver.streamCount() );
+
+    reader.stop();
+    reader.wait();
+    shm_unlink( name.c_str() );
+}
+
+/* A slot is claimed when opening the output, records are published by
+ * advancing the write position and the slot is freed by the reader once
+ * the output released it.
+ */
+static void testClaimPublishRelease()
+{
+    const string name = segmentName( "claim" );
+    SharedMemoryReader reader;
+    if ( !attach( reader, name, 4096 ) ) {
+        ++g_failureCount;
+        return;
+    }
+    Receiver receiver( &reader );
+    Segment segment( name );
+    verify( "claim: segment mapped", true, segment.isValid() );
+    if ( !segment.isValid() ) {
+        return;
+    }
+    const unsigned int pid = static_cast<unsigned int>( getpid() );
+    verify( "claim: slot is free", 0u, load( &segment.slot( 0 )->ownerPid ) );
+
+    SharedMemoryOutput *output = new SharedMemoryOutput( &g_log, name );
+    verify( "claim: open", true, output->open() );
+    verify( "claim: slot is owned", pid, load( &segment.slot( 0 )->ownerPid ) );
+    verify( "claim: generation is bumped", 1u, load( &segment.slot( 0 )->generation ) );
+    verify( "claim: other slots stay free", 0u, load( &segment.slot( 1 )->ownerPid ) );
+
+    const string s = "hello";
+    output->write( entry( s ) );
+    verify( "publish: write position", static_cast<uint64_t>( RecordHeaderSize + s.size() ),
+            load( &segment.slot( 0 )->writePosition ) );
+    verify( "publish: nothing read yet", static_cast<uint64_t>( 0 ), load( &segment.slot( 0 )->readPosition ) );
+
+    reader.start();
+    verify( "publish: data arrives", s, receiver.waitForData( s.size() ) );
+
+    delete output;
+    QElapsedTimer timer;
+    timer.start();
+    while ( load( &segment.slot( 0 )->ownerPid ) != 0 && timer.elapsed() < Timeout ) {
+        QThread::msleep( 1 );
+    }
+    verify( "release: slot is freed", 0u, load( &segment.slot( 0 )->ownerPid ) );
+    verify( "release: positions are reset", static_cast<uint64_t>( 0 ), load( &segment.slot( 0 )->writePosition ) );
+    verify( "release: flag is reset", 0u, load( &segment.slot( 0 )->released ) );
+    verify( "release: stream is closed", 1, receiver.closedStreamCount() );
+
+    reader.stop();
+    reader.wait();
+    shm_unlink( name.c_str() );
+}
+
+/* An output whose slot was freed and claimed again (which bumps the slot
+ * generation) must neither write into nor release that slot anymore.
+ */
+static void testSlotTakeover()
+{
+    const string name = segmentName( "slottakeover" );
+    SharedMemoryReader reader;
+    if ( !attach( reader, name, 4096 ) ) {
+        ++g_failureCount;
+        return;
+    }
+    Receiver receiver( &reader );
+    Segment segment( name );
+    verify( "slot takeover: segment mapped", true, segment.isValid() );
+    if ( !segment.isValid() ) {
+        return;
+    }
+
+    SharedMemoryOutput first( &g_log, name );
+    write( first, "lost" );
+
+    // Free the slot like the reader does for processes it considers dead
+    SlotHeader *slot = segment.slot( 0 );
+    store( &slot->writePosition, static_cast<uint64_t>( 0 ) );
+    store( &slot->readPosition, static_cast<uint64_t>( 0 ) );
+    store( &slot->ownerPid, 0u );
+
+    SharedMemoryOutput second( &g_log, name );
+    write( second, "second" );
+    verify( "slot takeover: slot is claimed again", 2u, load( &slot->generation ) );
+    verify( "slot takeover: old owner stops writing", false, first.canWrite() );
+
+    write( first, "first" );
+    verify( "slot takeover: old owner claims another slot", static_cast<unsigned int>( getpid() ),
+            load( &segment.slot( 1 )->ownerPid ) );
+    verify( "slot takeover: slot is not released", 0u, load( &slot->released ) );
+    verify( "slot takeover: new owner keeps writing", true, second.canWrite() );
+
+    // Slots are read in order
+    reader.start();
+    const string expected = "secondfirst";
+    verify( "slot takeover: data of both outputs", expected, receiver.waitForData( expected.size() ) );
+    verify( "slot takeover: two streams", 2, receiver.streamCount() );
+
+    reader.stop();
+    reader.wait();
+    shm_unlink( name.c_str() );
+}
+
+/* A reader started later takes over the segment (bumping the server
+ * generation) including what was written while no reader was running; the
+ * output restarts its stream for the new reader.
+ */
+static void testServerTakeover()
+{
+    const string name = segmentName( "servertakeover" );
+    SharedMemoryOutput output( &g_log, name );
+
+    SharedMemoryReader *firstReader = new SharedMemoryReader;
+    if ( !attach( *firstReader, name, 4096 ) ) {
+        delete firstReader;
+        ++g_failureCount;
+        return;
+    }
+    Receiver firstReceiver( firstReader );
+    firstReader->start();
+    write( output, "1" );
+    verify( "server takeover: first reader gets data", string( "1" ), firstReceiver.waitForData( 1 ) );
+    delete firstReader;
+
+    Segment segment( name );
+    verify( "server takeover: segment is kept", true, segment.isValid() );
+    if ( !segment.isValid() ) {
+        return;
+    }
+    verify( "server takeover: no server", 0u, load( &segment.header()->serverPid ) );
+    const unsigned int generation = load( &segment.slot( 0 )->generation );
+
+    verify( "server takeover: stream restarts without server", false, output.canWrite() );
+    write( output, "2" );
+    verify( "server takeover: slot is kept", generation, load( &segment.slot( 0 )->generation ) );
+
+    SharedMemoryReader secondReader;
+    if ( !attach( secondReader, name, 4096 ) ) {
+        ++g_failureCount;
+        return;
+    }
+    verify( "server takeover: server generation is bumped", 2u, load( &segment.header()->serverGeneration ) );
+    verify( "server takeover: server pid", static_cast<unsigned int>( getpid() ), load( &segment.header()->serverPid ) );
+    Receiver secondReceiver( &secondReader );
+    secondReader.start();
+    verify( "server takeover: queued data arrives", string( "2" ), secondReceiver.waitForData( 1 ) );
+
+    verify( "server takeover: stream restarts for new server", false, output.canWrite() );
+    write( output, "3" );
+    verify( "server takeover: data after restart", string( "23" ), secondReceiver.waitForData( 2 ) );
+    verify( "server takeover: restarted stream", 2, secondReceiver.streamCount() );
+    verify( "server takeover: previous stream is closed", 1, secondReceiver.closedStreamCount() );
+
+    secondReader.stop();
+    secondReader.wait();
+    shm_unlink( name.c_str() );
+}
+
+/* Writers only wake the reader (by changing wakeupSequence and, on Linux,
+ * a futex wake) while it is waiting for data.
+ */
+static void testWakeup()
+{
+    const string name = segmentName( "wakeup" );
+    SharedMemoryReader reader;
+    if ( !attach( reader, name, 4096 ) ) {
+        ++g_failureCount;
+        return;
+    }
+    Receiver receiver( &reader );
+    Segment segment( name );
+    verify( "wakeup: segment mapped", true, segment.isValid() );
+    if ( !segment.isValid() ) {
+        return;
+    }
+    Header *header = segment.header();
+
+    SharedMemoryOutput output( &g_log, name );
+    unsigned int sequence = load( &header->wakeupSequence );
+    write( output, "a" );
+    verify( "wakeup: no wakeup while reader is not waiting", sequence, load( &header->wakeupSequence ) );
+
+    reader.start();
+    verify( "wakeup: data arrives", string( "a" ), receiver.waitForData( 1 ) );
+
+    QElapsedTimer timer;
+    timer.start();
+    while ( !load( &header->serverWaiting ) && timer.elapsed() < Timeout ) {
+        QThread::msleep( 1 );
+    }
+    verify( "wakeup: reader waits for data", 1u, load( &header->serverWaiting ) );
+
+    sequence = load( &header->wakeupSequence );
+    timer.restart();
+    write( output, "b" );
+    verify( "wakeup: writer wakes the reader", sequence + 1, load( &header->wakeupSequence ) );
+    verify( "wakeup: data arrives after wakeup", string( "ab" ), receiver.waitForData( 2 ) );
+#ifdef __linux__
+    // Without the futex wake, the reader would wait for its timeout
+    verify( "wakeup: reader wakes up right away", true, timer.elapsed() < 500 );
+#endif
+
+    reader.stop();
+    reader.wait();
+    shm_unlink( name.c_str() );
+}
+
+TRACELIB_NAMESPACE_END
+
+int main()
+{
+    TRACELIB_NAMESPACE_IDENT(testOrdering)();
+    TRACELIB_NAMESPACE_IDENT(testWrapAround)();
+    TRACELIB_NAMESPACE_IDENT(testDroppedEntries)();
+    TRACELIB_NAMESPACE_IDENT(testClaimPublishRelease)();
+    TRACELIB_NAMESPACE_IDENT(testSlotTakeover)();
+    TRACELIB_NAMESPACE_IDENT(testServerTakeover)();
+    TRACELIB_NAMESPACE_IDENT(testWakeup)();
+    cout << g_verificationCount << " verifications; " << g_failureCount << " failures found." << endl;
+    return g_failureCount;
+}
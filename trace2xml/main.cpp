@@ -234,7 +234,7 @@ int main(int argc, char **argv)
     QString traceFile = opt.positionalArguments().at(0);
     QString errMsg;
     QSqlDatabase db = Database::open(traceFile, &errMsg);
-    if (!db.isValid()) {
+    if (!db.isValid() || !Database::attachSegments(db, &errMsg)) {
         fprintf(stderr, "Open error: %s\n", qPrintable(errMsg));
         return Error::Open;
     }
@@ -37,9 +37,13 @@ namespace Error
     const int Transformation = 4;
 }
 
+// Number of entries stored per transaction
+static const unsigned int BatchSize = 1000;
+
 static bool fromXml( QSqlDatabase &db, QFile &input, QString *errMsg )
 {
     DatabaseFeeder feeder( db );
+    feeder.setBatchSize( BatchSize );
     XmlContentHandler xmlparser(&feeder );
     xmlparser.addData( "<toplevel_trace_element>" );
     while( !input.atEnd() ) {
@@ -47,13 +51,19 @@ static bool fromXml( QSqlDatabase &db, QFile &input, QString *errMsg )
             xmlparser.addData( input.read( 1 << 16 ) );
             xmlparser.continueParsing();
         } catch( const SQLTransactionException &ex ) {
-            *errMsg = "Database error: " + QString::fromLatin1( ex.what() ) + ", driver message: " + ex.driverMessage() + "(" + QString::number(ex.driverCode()) + ")";
+            *errMsg = "Database error: " + QString::fromLatin1( ex.what() ) + ", driver message: " + ex.driverMessage() + "(" + ex.driverCode() + ")";
             return false;
         } catch( const XmlParseException &ex ) {
             *errMsg = "XML error: " + QString::fromLatin1( ex.what() ) + ", driver message: " + ex.parserMessage() + "(" + QString::number(ex.parserCode()) + ")";
             return false;
         }
     }
+    try {
+        feeder.flushPendingEntries();
+    } catch( const SQLTransactionException &ex ) {
+        *errMsg = "Database error: " + QString::fromLatin1( ex.what() ) + ", driver message: " + ex.driverMessage() + "(" + ex.driverCode() + ")";
+        return false;
+    }
     return true;
 }
 
@@ -64,10 +74,12 @@ int main( int argc, char **argv )
 
     QCommandLineParser opt;
     QCommandLineOption inputOption(QStringList() << "i" << "input", "XML input file to read from, if not specified reads from stdin", "file");
+    QCommandLineOption deferIndexesOption("defer-indexes", "Drop the database indexes while converting and create them afterwards; faster for large inputs");
     opt.setApplicationDescription("Converts xml files into trace databases.");
     opt.addHelpOption();
     opt.addVersionOption();
     opt.addOption(inputOption);
+    opt.addOption(deferIndexesOption);
     opt.addPositionalArgument(".trace-file", "Trace database output file to write into (.trace suffix will be appended if missing).");
     opt.process(a);
 
@@ -105,10 +117,26 @@ int main( int argc, char **argv )
         }
     }
 
+    const bool deferIndexes = opt.isSet( deferIndexesOption );
+    if (deferIndexes && !Database::dropIndexes( db, &errMsg )) {
+        fprintf( stderr, "Failed to drop indexes of %s: %s\n", qPrintable( traceFile ), qPrintable( errMsg ));
+        return Error::Open;
+    }
+
     if (!fromXml( db, input, &errMsg )) {
         fprintf( stderr, "Transformation error: %s\n", qPrintable( errMsg ));
+        // Don't leave a database without indexes behind
+        QString indexErrMsg;
+        if (deferIndexes && !Database::createIndexes( db, &indexErrMsg )) {
+            fprintf( stderr, "Failed to create indexes of %s: %s\n", qPrintable( traceFile ), qPrintable( indexErrMsg ));
+        }
         return Error::Transformation;
     }
     input.close();
+
+    if (deferIndexes && !Database::createIndexes( db, &errMsg )) {
+        fprintf( stderr, "Failed to create indexes of %s: %s\n", qPrintable( traceFile ), qPrintable( errMsg ));
+        return Error::Transformation;
+    }
     return Error::None;
 }